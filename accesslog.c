@@ -0,0 +1,259 @@
+#include "accesslog.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "http.h"
+
+#define ACCESSLOG_ESCAPED (4 * ACCESSLOG_TARGET)   // A target with every byte escaped.
+
+typedef struct accesslog_ring {
+    // The indices only grow, the producer and the consumer keep them on separate cache lines.
+    _Alignas(64) _Atomic uint64_t head;    // Next record to be taken, advanced by the writer.
+    _Alignas(64) _Atomic uint64_t tail;    // Next free slot, advanced by the loop.
+    _Alignas(64) accesslog_record_t records[ACCESSLOG_RING];
+} accesslog_ring_t;
+
+static accesslog_ring_t* accesslog_rings = NULL;
+static unsigned accesslog_ring_count = 0;
+static char* accesslog_path = NULL;
+static char* accesslog_old_path = NULL;
+static size_t accesslog_max_size = 0;
+static int accesslog_fd = -1;
+static size_t accesslog_size = 0;
+
+static _Atomic uint64_t accesslog_written = 0;
+static _Atomic uint64_t accesslog_dropped = 0;
+static _Atomic uint64_t accesslog_rotations = 0;
+static _Atomic uint64_t accesslog_write_errors = 0;
+static _Atomic uint64_t accesslog_passes = 0;   // Over all the rings, by the writer.
+
+static uint64_t accesslog_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static int accesslog_open() {
+    accesslog_fd = open(accesslog_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (accesslog_fd == -1)
+        return ACCESSLOG_ERR;
+
+    struct stat st;
+    accesslog_size = fstat(accesslog_fd, &st) == 0 ? st.st_size : 0;
+    return ACCESSLOG_OK;
+}
+
+static void accesslog_rotate() {
+    fsync(accesslog_fd);
+    close(accesslog_fd);
+    rename(accesslog_path, accesslog_old_path);
+    atomic_fetch_add_explicit(&accesslog_rotations, 1, memory_order_relaxed);
+    if (accesslog_open() != ACCESSLOG_OK)
+        accesslog_fd = -1;
+}
+
+static void accesslog_flush(const char* batch, size_t size) {
+    if (accesslog_fd == -1 && accesslog_open() != ACCESSLOG_OK) {
+        atomic_fetch_add_explicit(&accesslog_write_errors, 1, memory_order_relaxed);
+        return;
+    }
+
+    while (size > 0) {
+        ssize_t ret = write(accesslog_fd, batch, size);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret == -1) {
+            // The rest of the batch is lost, the file is opened again for the next one,
+            // eg. after the disk has been freed or the file removed.
+            atomic_fetch_add_explicit(&accesslog_write_errors, 1, memory_order_relaxed);
+            close(accesslog_fd);
+            accesslog_fd = -1;
+            return;
+        }
+        batch += ret;
+        size -= ret;
+        accesslog_size += ret;
+    }
+
+    if (accesslog_max_size > 0 && accesslog_size >= accesslog_max_size)
+        accesslog_rotate();
+}
+
+// Copies target into out, which has room for ACCESSLOG_ESCAPED bytes. Bytes, which are not printable,
+// '"' and '\\' are written as \xHH, so that a target cannot break the quoted field or forge a line.
+static void accesslog_escape(const char* target, char* out) {
+    static const char digits[] = "0123456789abcdef";
+    for (const unsigned char* c = (const unsigned char*)target; *c != '\0'; ++c) {
+        if (*c < 0x20 || *c >= 0x7f || *c == '"' || *c == '\\') {
+            *out++ = '\\';
+            *out++ = 'x';
+            *out++ = digits[*c >> 4];
+            *out++ = digits[*c & 0xf];
+        }
+        else
+            *out++ = *c;
+    }
+    *out = '\0';
+}
+
+// Formats a record as a line: client time "method target" status bytes duration_us
+static int accesslog_format(const accesslog_record_t* record, char* out, size_t out_size) {
+    char client[INET6_ADDRSTRLEN] = "-";
+    if (record->family == AF_INET || record->family == AF_INET6)
+        inet_ntop(record->family, record->family == AF_INET ? record->addr + 12 : record->addr, client, sizeof(client));
+
+    time_t seconds = record->time_ns / 1000000000;
+    struct tm tm;
+    char time[32];
+    gmtime_r(&seconds, &tm);
+    strftime(time, sizeof(time), "%Y-%m-%dT%H:%M:%S", &tm);
+
+    const char* method = record->method == M_GET ? "GET" : record->method == M_HEAD ? "HEAD" : "-";
+    char target[ACCESSLOG_ESCAPED] = "-";
+    if (record->target[0] != '\0')
+        accesslog_escape(record->target, target);
+    return snprintf(out, out_size, "%s %s.%03uZ \"%s %s\" %u %llu %llu\n",
+                    client, time, (unsigned)(record->time_ns / 1000000 % 1000), method, target,
+                    record->status, (unsigned long long)record->bytes,
+                    (unsigned long long)(record->duration_ns / 1000));
+}
+
+static void* accesslog_loop(void* arg) {
+    struct timespec interval = {
+        .tv_sec = ACCESSLOG_FLUSH_MS / 1000,
+        .tv_nsec = (ACCESSLOG_FLUSH_MS % 1000) * 1000000
+    };
+    char* batch = malloc(ACCESSLOG_BATCH);
+    uint64_t synced = accesslog_now();
+    bool unsynced = false;
+
+    for (;;) {
+        size_t batch_size = 0;
+        for (unsigned i = 0; i < accesslog_ring_count; ++i) {
+            accesslog_ring_t* ring = &accesslog_rings[i];
+            uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+            uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+            for (; head != tail; ++head) {
+                const accesslog_record_t* record = &ring->records[head & (ACCESSLOG_RING - 1)];
+                char line[ACCESSLOG_ESCAPED + 256];
+                int line_size = accesslog_format(record, line, sizeof(line));
+                if (line_size < 0)
+                    continue;
+                if ((size_t)line_size >= sizeof(line))
+                    line_size = sizeof(line) - 1;
+
+                if (batch_size + line_size > ACCESSLOG_BATCH) {
+                    accesslog_flush(batch, batch_size);
+                    batch_size = 0;
+                }
+                memcpy(batch + batch_size, line, line_size);
+                batch_size += line_size;
+                atomic_fetch_add_explicit(&accesslog_written, 1, memory_order_relaxed);
+            }
+            // The slots are handed back to the loop only after they have been read.
+            atomic_store_explicit(&ring->head, head, memory_order_release);
+        }
+
+        if (batch_size > 0) {
+            accesslog_flush(batch, batch_size);
+            unsynced = true;
+        }
+
+        uint64_t now = accesslog_now();
+        if (unsynced && now - synced >= (uint64_t)ACCESSLOG_FSYNC_MS * 1000000) {
+            if (accesslog_fd != -1)
+                fdatasync(accesslog_fd);
+            synced = now;
+            unsynced = false;
+        }
+        atomic_fetch_add_explicit(&accesslog_passes, 1, memory_order_release);
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+int accesslog_start(const char* path, size_t max_size, unsigned rings) {
+    size_t path_len = strlen(path);
+    accesslog_path = strdup(path);
+    accesslog_old_path = malloc(path_len + 3);
+    if (!accesslog_path || !accesslog_old_path)
+        return ACCESSLOG_ERR;
+    memcpy(accesslog_old_path, path, path_len);
+    memcpy(accesslog_old_path + path_len, ".1", 3);
+    accesslog_max_size = max_size;
+
+    if (accesslog_open() != ACCESSLOG_OK)
+        return ACCESSLOG_ERR;
+
+    accesslog_rings = aligned_alloc(_Alignof(accesslog_ring_t), rings * sizeof(accesslog_ring_t));
+    if (!accesslog_rings)
+        return ACCESSLOG_ERR;
+    for (unsigned i = 0; i < rings; ++i) {
+        atomic_init(&accesslog_rings[i].head, 0);
+        atomic_init(&accesslog_rings[i].tail, 0);
+    }
+    accesslog_ring_count = rings;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, accesslog_loop, NULL) != 0)
+        return ACCESSLOG_ERR;
+    pthread_detach(thread);
+    return ACCESSLOG_OK;
+}
+
+void accesslog_drain() {
+    if (!accesslog_enabled())
+        return;
+
+    // The second pass from now has started after the call, it writes every record pushed before.
+    // Written records survive the process, in the page cache.
+    struct timespec interval = {.tv_sec = 0, .tv_nsec = 1000000};
+    uint64_t passes = atomic_load_explicit(&accesslog_passes, memory_order_acquire);
+    while (atomic_load_explicit(&accesslog_passes, memory_order_acquire) < passes + 2)
+        nanosleep(&interval, NULL);
+}
+
+bool accesslog_enabled() {
+    return accesslog_ring_count > 0;
+}
+
+void accesslog_set_addr(accesslog_record_t* record, const struct sockaddr* addr) {
+    memset(record->addr, 0, 16);
+    record->family = addr->sa_family;
+    if (addr->sa_family == AF_INET6)
+        memcpy(record->addr, &((const struct sockaddr_in6*)addr)->sin6_addr, 16);
+    else if (addr->sa_family == AF_INET)
+        memcpy(record->addr + 12, &((const struct sockaddr_in*)addr)->sin_addr, 4);
+}
+
+int accesslog_push(unsigned ring_index, const accesslog_record_t* record) {
+    accesslog_ring_t* ring = &accesslog_rings[ring_index];
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail - head == ACCESSLOG_RING) {
+        atomic_fetch_add_explicit(&accesslog_dropped, 1, memory_order_relaxed);
+        return ACCESSLOG_FULL;
+    }
+
+    ring->records[tail & (ACCESSLOG_RING - 1)] = *record;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return ACCESSLOG_OK;
+}
+
+void accesslog_stats(accesslog_stats_t* out_stats) {
+    out_stats->written = atomic_load(&accesslog_written);
+    out_stats->dropped = atomic_load(&accesslog_dropped);
+    out_stats->rotations = atomic_load(&accesslog_rotations);
+    out_stats->write_errors = atomic_load(&accesslog_write_errors);
+}
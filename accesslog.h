@@ -0,0 +1,63 @@
+#ifndef ACCESSLOG_H
+#define ACCESSLOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+// Asynchronous access log.
+// Every event loop pushes fixed-size records into a ring of its own, which has a single
+// producer and a single consumer, so neither side takes a lock. A writer thread formats them,
+// writes them in batches, syncs the file periodically and rotates it, once it grows too big.
+// A record, for which the ring has no room, is dropped and counted, the loop never waits.
+
+// Return codes //
+#define ACCESSLOG_ERR  -1
+#define ACCESSLOG_OK    0
+#define ACCESSLOG_FULL  1   // The ring has no room, the record is dropped.
+
+#define ACCESSLOG_RING      8192   // Records per ring, a power of 2.
+#define ACCESSLOG_TARGET    112    // Longer targets are truncated.
+#define ACCESSLOG_BATCH     (64 * 1024)
+#define ACCESSLOG_FLUSH_MS  50     // Rings are emptied this often.
+#define ACCESSLOG_FSYNC_MS  1000
+
+#define ACCESSLOG_DEFAULT_MAX_SIZE (64 * 1024 * 1024)
+
+typedef struct accesslog_record {
+    uint64_t time_ns;        // Realtime, when the response was finished.
+    uint64_t duration_ns;    // From the arrival of the request.
+    uint64_t bytes;          // Of the response sent, head included.
+    uint16_t family;         // AF_INET or AF_INET6, the address is not logged for others.
+    uint16_t status;
+    uint8_t method;          // M_* from http.h
+    uint8_t addr[16];
+    char target[ACCESSLOG_TARGET];   // NUL-terminated, empty if the request was not parsed.
+} accesslog_record_t;
+
+typedef struct accesslog_stats {
+    uint64_t written;
+    uint64_t dropped;        // For lack of room in a ring.
+    uint64_t rotations;
+    uint64_t write_errors;
+} accesslog_stats_t;
+
+// Starts logging to path with rings producers. When the file reaches max_size bytes,
+// it is renamed to path.1, replacing the previous one; 0 means no rotation.
+int accesslog_start(const char* path, size_t max_size, unsigned rings);
+
+bool accesslog_enabled();
+
+// Waits until the records pushed so far are written, eg. before the process exits.
+void accesslog_drain();
+
+// Fills the address fields of record from addr.
+void accesslog_set_addr(accesslog_record_t* record, const struct sockaddr* addr);
+
+// Pushes a record into the ring, which only the calling thread may push into.
+int accesslog_push(unsigned ring, const accesslog_record_t* record);
+
+void accesslog_stats(accesslog_stats_t* out_stats);
+
+#endif /* ACCESSLOG_H */
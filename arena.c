@@ -0,0 +1,60 @@
+#include "arena.h"
+#include "bufpool.h"
+
+#define ARENA_HEADER_SIZE ((sizeof(arena_block_t) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+static arena_block_t* arena_block(int class) {
+    arena_block_t* block = (arena_block_t*)bufpool_get(class);
+    if (!block)
+        return NULL;
+
+    block->next = NULL;
+    block->class = class;
+    block->size = bufpool_size(class);
+    return block;
+}
+
+int arena_init(arena_t* arena) {
+    arena->blocks = arena_block(BUFPOOL_HEADER);
+    arena->used = ARENA_HEADER_SIZE;
+    return arena->blocks ? ARENA_OK : ARENA_ERR;
+}
+
+void* arena_alloc(arena_t* arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    if (arena->used + size > arena->blocks->size) {
+        int class = ARENA_HEADER_SIZE + size <= bufpool_size(BUFPOOL_HEADER) ? BUFPOOL_HEADER : BUFPOOL_BODY;
+        if (ARENA_HEADER_SIZE + size > bufpool_size(class))
+            return NULL;
+
+        arena_block_t* block = arena_block(class);
+        if (!block)
+            return NULL;
+        block->next = arena->blocks;
+        arena->blocks = block;
+        arena->used = ARENA_HEADER_SIZE;
+    }
+
+    void* allocated = (char*)arena->blocks + arena->used;
+    arena->used += size;
+    return allocated;
+}
+
+void arena_reset(arena_t* arena) {
+    while (arena->blocks->next) {
+        arena_block_t* block = arena->blocks;
+        arena->blocks = block->next;
+        bufpool_put(block->class, (char*)block);
+    }
+    arena->used = ARENA_HEADER_SIZE;
+}
+
+void arena_destroy(arena_t* arena) {
+    if (!arena->blocks)
+        return;
+
+    arena_reset(arena);
+    bufpool_put(arena->blocks->class, (char*)arena->blocks);
+    arena->blocks = NULL;
+}
@@ -0,0 +1,38 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// Bump-pointer allocator for request-scoped data.
+// Each connection owns one, it is reset after every response.
+// Blocks come from the buffer pool, a request needing more than the first one
+// gets another, which is given back on reset.
+
+#define ARENA_ALIGN 16
+
+// Return codes //
+#define ARENA_ERR -1
+#define ARENA_OK   0
+
+typedef struct arena_block {
+    struct arena_block* next;
+    int class;                 // Buffer pool class of the block
+    size_t size;
+} arena_block_t;
+
+typedef struct arena {
+    arena_block_t* blocks;     // The current block, followed by the earlier ones.
+    size_t used;               // In the current block, including its header.
+} arena_t;
+
+int arena_init(arena_t* arena);
+
+// Returns NULL if size exceeds the biggest buffer of the pool, or the pool is exhausted.
+void* arena_alloc(arena_t* arena, size_t size);
+
+// Frees everything allocated since the arena was initialized, keeping the first block.
+void arena_reset(arena_t* arena);
+
+void arena_destroy(arena_t* arena);
+
+#endif /* ARENA_H */
@@ -0,0 +1,135 @@
+#include "balance.h"
+
+#include <netinet/in.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+
+#define BALANCE_GOLDEN 0x9E3779B97F4A7C15ULL
+
+// Latency of a server, as a moving average.
+// The updates are not atomic as a whole, a lost sample does not matter.
+typedef struct balance_server {
+    _Atomic uint64_t key;       // ip and port, see balance_key, 0 marks an empty slot.
+    _Atomic uint64_t latency_ns;
+} balance_server_t;
+
+static int balance_current = BALANCE_FIRST;
+static balance_server_t balance_servers[BALANCE_SERVERS];
+
+static __thread uint32_t balance_turn = 0;
+static __thread uint64_t balance_random = 0;
+
+// splitmix64 finalizer
+static uint64_t balance_mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static uint64_t balance_key(uint32_t ip, uint16_t port) {
+    return ((uint64_t)ip << 16 | port) + 1;
+}
+
+// Returns the slot of the server, or NULL if it is not tracked. create claims an empty slot for it.
+static balance_server_t* balance_find(uint64_t key, bool create) {
+    uint64_t home = balance_mix(key);
+    for (int i = 0; i < BALANCE_PROBES; ++i) {
+        balance_server_t* server = &balance_servers[(home + i) % BALANCE_SERVERS];
+        uint64_t seen = atomic_load_explicit(&server->key, memory_order_acquire);
+        if (seen == key)
+            return server;
+        if (seen == 0) {
+            if (!create)
+                return NULL;
+            if (atomic_compare_exchange_strong(&server->key, &seen, key) || seen == key)
+                return server;
+        }
+    }
+    return NULL;
+}
+
+static uint64_t balance_latency(const cos_replica_t* replica) {
+    balance_server_t* server = balance_find(balance_key(replica->ip, replica->port), false);
+    // Servers never observed are tried first.
+    return server ? atomic_load_explicit(&server->latency_ns, memory_order_relaxed) : 0;
+}
+
+static uint64_t balance_next_random() {
+    if (balance_random == 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        balance_random = balance_mix((uint64_t)(uintptr_t)&balance_random ^ now.tv_nsec) | 1;
+    }
+    // xorshift64
+    balance_random ^= balance_random << 13;
+    balance_random ^= balance_random >> 7;
+    balance_random ^= balance_random << 17;
+    return balance_random;
+}
+
+void balance_init(int mode) {
+    balance_current = mode;
+    memset(balance_servers, 0, sizeof(balance_servers));
+}
+
+int balance_mode() {
+    return balance_current;
+}
+
+uint32_t balance_pick(const cos_replica_t* replicas, uint32_t count, const struct sockaddr* addr) {
+    if (count <= 1)
+        return 0;
+
+    switch (balance_current) {
+    case BALANCE_ROUND_ROBIN:
+        return balance_turn++ % count;
+    case BALANCE_LATENCY: {
+        uint64_t random = balance_next_random();
+        uint32_t a = random % count;
+        uint32_t b = (a + 1 + (random >> 32) % (count - 1)) % count;
+        return balance_latency(&replicas[b]) < balance_latency(&replicas[a]) ? b : a;
+    }
+    case BALANCE_CLIENT_HASH: {
+        uint64_t client = 0;
+        if (addr->sa_family == AF_INET6) {
+            uint64_t halves[2];
+            memcpy(halves, &((const struct sockaddr_in6*)addr)->sin6_addr, 16);
+            client = balance_mix(halves[0]) ^ halves[1];
+        }
+        else if (addr->sa_family == AF_INET) {
+            client = ((const struct sockaddr_in*)addr)->sin_addr.s_addr;
+        }
+
+        uint32_t best = 0;
+        uint64_t best_score = 0;
+        for (uint32_t i = 0; i < count; ++i) {
+            uint64_t score = balance_mix(client ^ balance_key(replicas[i].ip, replicas[i].port) * BALANCE_GOLDEN);
+            if (i == 0 || score > best_score) {
+                best = i;
+                best_score = score;
+            }
+        }
+        return best;
+    }
+    default: /* BALANCE_FIRST */
+        return 0;
+    }
+}
+
+void balance_observe(uint32_t ip, uint16_t port, uint64_t latency_ns) {
+    if (balance_current != BALANCE_LATENCY)
+        return;
+
+    balance_server_t* server = balance_find(balance_key(ip, port), true);
+    if (!server)
+        return;
+
+    // Weight 1/8 for the new sample, the first one is taken as is.
+    uint64_t average = atomic_load_explicit(&server->latency_ns, memory_order_relaxed);
+    average = average == 0 ? latency_ns : average - average / 8 + latency_ns / 8;
+    atomic_store_explicit(&server->latency_ns, average > 0 ? average : 1, memory_order_relaxed);
+}
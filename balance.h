@@ -0,0 +1,33 @@
+#ifndef BALANCE_H
+#define BALANCE_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include "co_servers.h"
+
+// Choice among the replicas of a resource listed more than once in the corelated servers file.
+// The specification wants the first one. Other modes spread the clients over all of them.
+
+// Modes //
+#define BALANCE_FIRST       0   // The first replica in the file.
+#define BALANCE_ROUND_ROBIN 1   // The replicas in turns, counted by every thread separately.
+#define BALANCE_LATENCY     2   // The faster of two random replicas (power of two choices).
+#define BALANCE_CLIENT_HASH 3   // The replica chosen by rendezvous hashing of the client's address,
+                                // so that a client keeps its replica, while others are added or removed.
+
+#define BALANCE_SERVERS    1024            // Servers, whose latency is tracked.
+#define BALANCE_PROBES     8
+#define BALANCE_FAILURE_NS 1000000000ULL   // Latency counted for a failed request.
+
+void balance_init(int mode);
+
+int balance_mode();
+
+// Returns the index of the replica, among count of them, for the client with the address addr.
+uint32_t balance_pick(const cos_replica_t* replicas, uint32_t count, const struct sockaddr* addr);
+
+// Records the latency of a response from ip:port. Only proxied requests are observed,
+// without them the latency mode picks randomly.
+void balance_observe(uint32_t ip, uint16_t port, uint64_t latency_ns);
+
+#endif /* BALANCE_H */
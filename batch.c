@@ -0,0 +1,361 @@
+#include "batch.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include "balance.h"
+#include "bundle.h"
+#include "co_servers.h"
+#include "fcache.h"
+#include "file.h"
+#include "http.h"
+#include "scan.h"
+
+// Statuses of the items, which are not answered yet //
+#define ITEM_PENDING 0   // Not looked up.
+#define ITEM_MISSING 1   // Not in the root, the corelated servers are asked.
+
+// The rendered 302 of a corelated server is its status line and its Location header, see render_found.
+#define FOUND_LOCATION "HTTP/1.1 302 Found\r\nLocation: "
+#define FOUND_END      "\r\n\r\n"
+
+typedef struct batch_item {
+    char* target;
+    size_t target_size;
+    int status;
+    const char* data;
+    size_t data_size;
+    fcache_entry_t* entry;     // Held while data is sent from the cache.
+    uint8_t header[BATCH_HEADER];
+} batch_item_t;
+
+struct batch {
+    batch_item_t* items;
+    unsigned count;
+    size_t bytes;              // Of the files' data, against BATCH_MAX_BYTES.
+    bundle_t* bundle;          // Held while the data is sent from the bundle.
+
+    // The body: the header, the target and the data of every item, the empty ones left out.
+    struct iovec* parts;
+    size_t part_count;
+    size_t size;
+    size_t cursor;             // Part, at which the last gather or copy has started,
+    size_t cursor_offset;      // and its offset in the body.
+};
+
+bool batch_requested(const char* target) {
+    return strncmp(target, BATCH_PREFIX, sizeof(BATCH_PREFIX) - 1) == 0;
+}
+
+int batch_parse(const char* target, arena_t* arena, batch_t** out_batch) {
+    const char* list = target + sizeof(BATCH_PREFIX) - 1;
+    size_t list_size = strlen(list);
+    if (list_size == 0)
+        return BATCH_BAD_REQ;
+
+    unsigned count = 1;
+    for (const char* comma = list; (comma = scan_find(comma, list + list_size - comma, ',')) != NULL; ++comma) {
+        if (++count > BATCH_MAX_ITEMS)
+            return BATCH_BAD_REQ;
+    }
+
+    // The targets are cut out of a copy, the request's one is logged whole.
+    batch_t* batch = arena_alloc(arena, sizeof(batch_t));
+    batch_item_t* items = arena_alloc(arena, count * sizeof(batch_item_t));
+    char* copy = arena_alloc(arena, list_size + 1);
+    if (!batch || !items || !copy)
+        return BATCH_ERR;
+    memcpy(copy, list, list_size + 1);
+    memset(batch, 0, sizeof(batch_t));
+    memset(items, 0, count * sizeof(batch_item_t));
+    batch->items = items;
+    batch->count = count;
+
+    char* next = copy;
+    for (unsigned i = 0; i < count; ++i) {
+        batch_item_t* item = &items[i];
+        char* comma = strchr(next, ',');
+        if (comma)
+            *comma = '\0';
+        item->target = next;
+        item->target_size = comma ? (size_t)(comma - next) : strlen(next);
+        if (comma)
+            next = comma + 1;
+
+        if (item->target_size > UINT16_MAX)
+            return BATCH_BAD_REQ;
+        // Checked as the request's own target would be.
+        if (item->target_size == 0 || item->target[0] != '/'
+            || scan_span(item->target, item->target_size, &scan_target) != item->target_size)
+            item->status = C_BAD_REQUEST;
+    }
+
+    *out_batch = batch;
+    return BATCH_OK;
+}
+
+// Takes size bytes of data for the item, unless the batch would grow too big.
+static bool batch_admit(batch_t* batch, batch_item_t* item, size_t size) {
+    if (size > BATCH_MAX_FILE || batch->bytes + size > BATCH_MAX_BYTES) {
+        item->status = BATCH_TOO_LARGE;
+        return false;
+    }
+    batch->bytes += size;
+    item->data_size = size;
+    return true;
+}
+
+// Reads the file, which the cache has bypassed, whole into arena.
+static void batch_read_file(batch_t* batch, batch_item_t* item, const char* filesystem, arena_t* arena) {
+    int fd;
+    int ret = take_file(filesystem, item->target, arena, &fd);
+    if (ret != FILE_OK) {
+        item->status = ret == FILE_NOT_FOUND ? ITEM_MISSING : ret == FILE_REACHOUT ? C_NOT_FOUND : C_INTERNAL_ERROR;
+        return;
+    }
+
+    size_t size;
+    if (take_filesize(fd, &size) != FILE_OK) {
+        close(fd);
+        item->status = C_INTERNAL_ERROR;
+        return;
+    }
+    if (!batch_admit(batch, item, size)) {
+        close(fd);
+        return;
+    }
+
+    char* data = arena_alloc(arena, size > 0 ? size : 1);
+    size_t got = 0;
+    while (data && got < size) {
+        ssize_t ret = read(fd, data + got, size - got);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+        got += ret;
+    }
+    close(fd);
+
+    // The file may have shrunk since its size was taken.
+    if (!data || got < size) {
+        batch->bytes -= size;
+        item->data_size = 0;
+        item->status = C_INTERNAL_ERROR;
+        return;
+    }
+    item->data = data;
+    item->status = C_OK;
+}
+
+void batch_read(batch_t* batch, const char* filesystem, arena_t* arena) {
+    for (unsigned i = 0; i < batch->count; ++i) {
+        batch_item_t* item = &batch->items[i];
+        if (item->status != ITEM_PENDING)
+            continue;
+
+        int ret = fcache_get(filesystem, item->target, arena, &item->entry);
+        if (ret == FCACHE_HIT) {
+            if (batch_admit(batch, item, fcache_size(item->entry))) {
+                item->data = fcache_data(item->entry);
+                item->status = C_OK;
+            }
+            else {
+                fcache_release(item->entry);
+                item->entry = NULL;
+            }
+        }
+        else if (ret == FCACHE_BYPASS)
+            batch_read_file(batch, item, filesystem, arena);
+        else if (ret == FCACHE_NOT_FOUND)
+            item->status = ITEM_MISSING;
+        else if (ret == FCACHE_REACHOUT)
+            item->status = C_NOT_FOUND;
+        else
+            item->status = C_INTERNAL_ERROR;
+    }
+}
+
+void batch_read_bundle(batch_t* batch, arena_t* arena) {
+    batch->bundle = bundle_acquire();
+    for (unsigned i = 0; i < batch->count; ++i) {
+        batch_item_t* item = &batch->items[i];
+        if (item->status != ITEM_PENDING)
+            continue;
+
+        // Looked up as the root filesystem would resolve the target, which is framed as it is.
+        char* path;
+        int ret = take_normal_path(item->target, arena, &path);
+        if (ret != FILE_OK) {
+            item->status = ret == FILE_REACHOUT ? C_NOT_FOUND : C_INTERNAL_ERROR;
+            continue;
+        }
+
+        const char* data;
+        fs_meta_t meta;
+        ret = bundle_lookup(batch->bundle, path, &data, &meta);
+        if (ret == BUNDLE_FOUND) {
+            if (batch_admit(batch, item, meta.size)) {
+                item->data = data;
+                item->status = C_OK;
+            }
+        }
+        else if (ret == BUNDLE_NOT_FOUND)
+            item->status = ITEM_MISSING;
+        else
+            item->status = C_INTERNAL_ERROR;
+    }
+}
+
+// Answers the missing item by the table, with the response rendered for the file's replica.
+static void batch_locate(const cos_table_t* table, batch_item_t* item, const struct sockaddr* addr, arena_t* arena) {
+    const char* res;
+    size_t res_size;
+    int ret;
+    if (balance_mode() != BALANCE_FIRST) {
+        const cos_replica_t* replicas;
+        uint32_t count;
+        ret = cos_search_replicas(table, item->target, &replicas, &count);
+        if (ret == COS_FOUND) {
+            const cos_replica_t* replica = &replicas[balance_pick(replicas, count, addr)];
+            res = table->strings + replica->response_off;
+            res_size = replica->response_size;
+        }
+    }
+    else
+        ret = cos_search(table, item->target, &res, &res_size);
+
+    if (ret == COS_NOT_FOUND) {
+        item->status = C_NOT_FOUND;
+        return;
+    }
+    size_t prefix_size = sizeof(FOUND_LOCATION) - 1;
+    size_t suffix_size = sizeof(FOUND_END) - 1;
+    if (ret != COS_FOUND || res_size < prefix_size + suffix_size || memcmp(res, FOUND_LOCATION, prefix_size) != 0) {
+        item->status = C_INTERNAL_ERROR;
+        return;
+    }
+
+    // The table is kept only until cos_read_end.
+    size_t location_size = res_size - prefix_size - suffix_size;
+    char* location = arena_alloc(arena, location_size > 0 ? location_size : 1);
+    if (!location) {
+        item->status = C_INTERNAL_ERROR;
+        return;
+    }
+    memcpy(location, res + prefix_size, location_size);
+    item->data = location;
+    item->data_size = location_size;
+    item->status = C_FOUND;
+}
+
+void batch_redirect(batch_t* batch, const struct sockaddr* addr, arena_t* arena) {
+    const cos_table_t* table = NULL;
+    for (unsigned i = 0; i < batch->count; ++i) {
+        batch_item_t* item = &batch->items[i];
+        if (item->status != ITEM_MISSING)
+            continue;
+
+        if (!table && !(table = cos_read_begin())) {
+            item->status = C_INTERNAL_ERROR;
+            continue;
+        }
+        batch_locate(table, item, addr, arena);
+    }
+    if (table)
+        cos_read_end();
+}
+
+static void batch_put16(uint8_t* out, uint16_t value) {
+    out[0] = value >> 8;
+    out[1] = value;
+}
+
+static void batch_put32(uint8_t* out, uint32_t value) {
+    out[0] = value >> 24;
+    out[1] = value >> 16;
+    out[2] = value >> 8;
+    out[3] = value;
+}
+
+int batch_finish(batch_t* batch, arena_t* arena) {
+    batch->parts = arena_alloc(arena, 3 * batch->count * sizeof(struct iovec));
+    if (!batch->parts)
+        return BATCH_ERR;
+
+    for (unsigned i = 0; i < batch->count; ++i) {
+        batch_item_t* item = &batch->items[i];
+        // Those never looked up have been missing, without the corelated servers asked.
+        if (item->status == ITEM_PENDING || item->status == ITEM_MISSING)
+            item->status = C_NOT_FOUND;
+
+        batch_put16(item->header, item->status);
+        batch_put16(item->header + 2, item->target_size);
+        batch_put32(item->header + 4, item->data_size);
+
+        batch->parts[batch->part_count].iov_base = item->header;
+        batch->parts[batch->part_count++].iov_len = BATCH_HEADER;
+        if (item->target_size > 0) {
+            batch->parts[batch->part_count].iov_base = item->target;
+            batch->parts[batch->part_count++].iov_len = item->target_size;
+        }
+        if (item->data_size > 0) {
+            batch->parts[batch->part_count].iov_base = (char*)item->data;
+            batch->parts[batch->part_count++].iov_len = item->data_size;
+        }
+        batch->size += BATCH_HEADER + item->target_size + item->data_size;
+    }
+    return BATCH_OK;
+}
+
+size_t batch_size(const batch_t* batch) {
+    return batch->size;
+}
+
+// Moves the cursor to the part holding offset.
+static void batch_seek(batch_t* batch, size_t offset) {
+    if (offset < batch->cursor_offset) {
+        batch->cursor = 0;
+        batch->cursor_offset = 0;
+    }
+    while (batch->cursor < batch->part_count && batch->cursor_offset + batch->parts[batch->cursor].iov_len <= offset)
+        batch->cursor_offset += batch->parts[batch->cursor++].iov_len;
+}
+
+int batch_gather(batch_t* batch, size_t offset, struct iovec* iov, int max) {
+    batch_seek(batch, offset);
+    size_t skip = offset - batch->cursor_offset;
+    int count = 0;
+    for (size_t i = batch->cursor; i < batch->part_count && count < max; ++i) {
+        iov[count].iov_base = (char*)batch->parts[i].iov_base + skip;
+        iov[count++].iov_len = batch->parts[i].iov_len - skip;
+        skip = 0;
+    }
+    return count;
+}
+
+void batch_copy(batch_t* batch, size_t offset, char* dst, size_t size) {
+    batch_seek(batch, offset);
+    size_t skip = offset - batch->cursor_offset;
+    for (size_t i = batch->cursor; i < batch->part_count && size > 0; ++i) {
+        size_t copied = batch->parts[i].iov_len - skip < size ? batch->parts[i].iov_len - skip : size;
+        memcpy(dst, (char*)batch->parts[i].iov_base + skip, copied);
+        dst += copied;
+        size -= copied;
+        skip = 0;
+    }
+}
+
+void batch_release(batch_t* batch) {
+    for (unsigned i = 0; i < batch->count; ++i) {
+        if (batch->items[i].entry) {
+            fcache_release(batch->items[i].entry);
+            batch->items[i].entry = NULL;
+        }
+    }
+    if (batch->bundle) {
+        bundle_release(batch->bundle);
+        batch->bundle = NULL;
+    }
+}
@@ -0,0 +1,79 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "arena.h"
+
+// Batch fetches: one request names many small files of the root and gets them all in one response,
+// instead of a round trip for each.
+//
+//     GET /_batch?/a.txt,/dir/b.txt HTTP/1.1
+//
+// The targets follow BATCH_PREFIX, separated by commas. The response is a 200 of BATCH_CONTENT_TYPE,
+// whose body is a frame for every target, in their order. A frame is a header of BATCH_HEADER bytes
+// in network byte order: the status (16 bits), the length of the target (16 bits) and the length
+// of the data (32 bits), followed by the target and the data. The statuses are:
+//   200 - the data is the contents of the file,
+//   302 - the file is on a corelated server, the data is the URL of its Location,
+//   400 - the target is malformed,
+//   404 - there is no such file,
+//   413 - the file is bigger than BATCH_MAX_FILE, or it would make the batch bigger than BATCH_MAX_BYTES,
+//   500 - the file could not be read.
+// The last four have no data. The files are held in the cache, or in the bundle, and sent from there
+// with the frames between them by vectored writes.
+
+// Return codes //
+#define BATCH_ERR     -1
+#define BATCH_OK       0
+#define BATCH_BAD_REQ  1
+
+#define BATCH_PREFIX       "/_batch?"
+#define BATCH_CONTENT_TYPE "application/x-serwer-batch"
+#define BATCH_HEADER       8
+#define BATCH_MAX_ITEMS    1024
+#define BATCH_MAX_FILE     (256 * 1024)
+#define BATCH_MAX_BYTES    (8 * 1048576)   // Of the files' data in one batch.
+#define BATCH_IOV          64              // Parts of the body written at once.
+
+#define BATCH_TOO_LARGE 413
+
+typedef struct batch batch_t;
+
+// Whether the request target asks for a batch.
+bool batch_requested(const char* target);
+
+// Parses the targets of the batch asked for by the request target, in arena.
+// Returns BATCH_BAD_REQ if there are none, more than BATCH_MAX_ITEMS, or one is too long to be framed.
+int batch_parse(const char* target, arena_t* arena, batch_t** out_batch);
+
+// Looks up the files in the root filesystem, holding those found in the cache and reading the others
+// into arena. Blocks on the disk.
+void batch_read(batch_t* batch, const char* filesystem, arena_t* arena);
+
+// Looks up the files in the bundle, which is held by the batch. Temporary data is allocated in arena.
+void batch_read_bundle(batch_t* batch, arena_t* arena);
+
+// Redirects the files missing from the root to the corelated servers, picking the replica for
+// the client at addr. Has to be called on the threads, which read the corelated servers' table.
+void batch_redirect(batch_t* batch, const struct sockaddr* addr, arena_t* arena);
+
+// Frames the files looked up, after which the body can be sent.
+int batch_finish(batch_t* batch, arena_t* arena);
+
+// Bytes of the framed body.
+size_t batch_size(const batch_t* batch);
+
+// Fills at most max vectors with the body from offset on. Returns how many are filled.
+// Offsets are expected to grow, going back costs a scan from the start.
+int batch_gather(batch_t* batch, size_t offset, struct iovec* iov, int max);
+
+// Copies size bytes of the body from offset on to dst.
+void batch_copy(batch_t* batch, size_t offset, char* dst, size_t size);
+
+// Drops the files held.
+void batch_release(batch_t* batch);
+
+#endif /* BATCH_H */
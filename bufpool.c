@@ -0,0 +1,195 @@
+#include "bufpool.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// A free buffer holds the link to the next one.
+typedef struct bufpool_free {
+    struct bufpool_free* next;
+} bufpool_free_t;
+
+typedef struct bufpool_class {
+    size_t buffer_size;
+    size_t cache_max;          // Length limit of the threads' free lists.
+
+    pthread_mutex_t mutex;     // Guards the fields below.
+    bufpool_free_t* free_list;
+    size_t max_buffers;
+
+    _Atomic uint64_t buffers;
+    _Atomic uint64_t in_use;
+    _Atomic uint64_t peak_in_use;
+    _Atomic uint64_t slabs;
+    _Atomic uint64_t huge_slabs;
+    _Atomic uint64_t local_gets;
+    _Atomic uint64_t shared_gets;
+    _Atomic uint64_t exhausted;
+} bufpool_class_t;
+
+typedef struct bufpool_cache {
+    char* buffers[BUFPOOL_CACHE_MAX];
+    size_t count;
+} bufpool_cache_t;
+
+static bufpool_class_t bufpool_classes[BUFPOOL_CLASSES];
+static bool bufpool_hugepages = false;
+static __thread bufpool_cache_t bufpool_caches[BUFPOOL_CLASSES];
+
+// Maps a new slab and puts its buffers on the shared free list.
+// Called with the class' mutex held.
+static int bufpool_grow(bufpool_class_t* pool) {
+    size_t slab_size = BUFPOOL_SLAB_SIZE;
+    if (slab_size < pool->buffer_size)
+        slab_size = pool->buffer_size;
+    size_t count = slab_size / pool->buffer_size;
+
+    uint64_t buffers = atomic_load_explicit(&pool->buffers, memory_order_relaxed);
+    if (buffers + count > pool->max_buffers)
+        count = pool->max_buffers - buffers;
+    if (count == 0)
+        return BUFPOOL_ERR;
+    slab_size = count * pool->buffer_size;
+
+    char* slab = MAP_FAILED;
+    bool huge = false;
+    if (bufpool_hugepages && slab_size % (2 * 1048576) == 0) {
+        slab = mmap(NULL, slab_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        huge = slab != MAP_FAILED;
+    }
+    if (slab == MAP_FAILED) {
+        slab = mmap(NULL, slab_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (slab == MAP_FAILED)
+            return BUFPOOL_ERR;
+        if (bufpool_hugepages)
+            madvise(slab, slab_size, MADV_HUGEPAGE);  // Transparent huge pages, if enabled.
+    }
+
+    for (size_t i = count; i > 0; --i) {
+        bufpool_free_t* buffer = (bufpool_free_t*)(slab + (i - 1) * pool->buffer_size);
+        buffer->next = pool->free_list;
+        pool->free_list = buffer;
+    }
+
+    atomic_fetch_add_explicit(&pool->buffers, count, memory_order_relaxed);
+    atomic_fetch_add_explicit(&pool->slabs, 1, memory_order_relaxed);
+    if (huge)
+        atomic_fetch_add_explicit(&pool->huge_slabs, 1, memory_order_relaxed);
+    return BUFPOOL_OK;
+}
+
+int bufpool_init(size_t header_size, size_t body_size, size_t max_size, bool hugepages) {
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t sizes[BUFPOOL_CLASSES] = {header_size, body_size};
+
+    bufpool_hugepages = hugepages;
+    for (int class = 0; class < BUFPOOL_CLASSES; ++class) {
+        bufpool_class_t* pool = &bufpool_classes[class];
+        memset(pool, 0, sizeof(bufpool_class_t));
+
+        pool->buffer_size = (sizes[class] + page_size - 1) / page_size * page_size;
+        if (pool->buffer_size == 0)
+            return BUFPOOL_ERR;
+        pool->max_buffers = max_size / pool->buffer_size;
+        if (pool->max_buffers == 0)
+            pool->max_buffers = 1;
+
+        pool->cache_max = BUFPOOL_CACHE_BYTES / pool->buffer_size;
+        if (pool->cache_max == 0)
+            pool->cache_max = 1;
+        if (pool->cache_max > BUFPOOL_CACHE_MAX)
+            pool->cache_max = BUFPOOL_CACHE_MAX;
+
+        if (pthread_mutex_init(&pool->mutex, NULL) != 0)
+            return BUFPOOL_ERR;
+    }
+    return BUFPOOL_OK;
+}
+
+char* bufpool_get(int class) {
+    bufpool_class_t* pool = &bufpool_classes[class];
+    bufpool_cache_t* cache = &bufpool_caches[class];
+
+    if (cache->count > 0) {
+        atomic_fetch_add_explicit(&pool->local_gets, 1, memory_order_relaxed);
+    }
+    else {
+        // Refill half of the local free list at once, or take a single buffer of a class, which cannot grow.
+        pthread_mutex_lock(&pool->mutex);
+        size_t batch = (pool->cache_max + 1) / 2;
+        if (atomic_load_explicit(&pool->buffers, memory_order_relaxed) >= pool->max_buffers)
+            batch = 1;
+        while (cache->count < batch) {
+            if (!pool->free_list && bufpool_grow(pool) != BUFPOOL_OK)
+                break;
+            bufpool_free_t* buffer = pool->free_list;
+            pool->free_list = buffer->next;
+            cache->buffers[cache->count++] = (char*)buffer;
+        }
+        pthread_mutex_unlock(&pool->mutex);
+
+        if (cache->count == 0) {
+            atomic_fetch_add_explicit(&pool->exhausted, 1, memory_order_relaxed);
+            return NULL;
+        }
+        atomic_fetch_add_explicit(&pool->shared_gets, 1, memory_order_relaxed);
+    }
+
+    uint64_t in_use = atomic_fetch_add_explicit(&pool->in_use, 1, memory_order_relaxed) + 1;
+    uint64_t peak = atomic_load_explicit(&pool->peak_in_use, memory_order_relaxed);
+    while (in_use > peak
+           && !atomic_compare_exchange_weak_explicit(&pool->peak_in_use, &peak, in_use,
+                                                     memory_order_relaxed, memory_order_relaxed));
+
+    return cache->buffers[--cache->count];
+}
+
+void bufpool_put(int class, char* buffer) {
+    if (!buffer)
+        return;
+
+    bufpool_class_t* pool = &bufpool_classes[class];
+    bufpool_cache_t* cache = &bufpool_caches[class];
+    atomic_fetch_sub_explicit(&pool->in_use, 1, memory_order_relaxed);
+
+    // A class, which cannot grow, keeps its free buffers shared, where the other threads waiting for one find them.
+    bool full = atomic_load_explicit(&pool->buffers, memory_order_relaxed) >= pool->max_buffers;
+    if (full || cache->count == pool->cache_max) {
+        // Give half of the local free list back, or all of it.
+        pthread_mutex_lock(&pool->mutex);
+        size_t keep = full ? 0 : pool->cache_max / 2;
+        if (full) {
+            ((bufpool_free_t*)buffer)->next = pool->free_list;
+            pool->free_list = (bufpool_free_t*)buffer;
+        }
+        while (cache->count > keep) {
+            bufpool_free_t* returned = (bufpool_free_t*)cache->buffers[--cache->count];
+            returned->next = pool->free_list;
+            pool->free_list = returned;
+        }
+        pthread_mutex_unlock(&pool->mutex);
+        if (full)
+            return;
+    }
+    cache->buffers[cache->count++] = buffer;
+}
+
+size_t bufpool_size(int class) {
+    return bufpool_classes[class].buffer_size;
+}
+
+void bufpool_stats(int class, bufpool_stats_t* out_stats) {
+    bufpool_class_t* pool = &bufpool_classes[class];
+
+    out_stats->buffer_size = pool->buffer_size;
+    out_stats->buffers = atomic_load(&pool->buffers);
+    out_stats->in_use = atomic_load(&pool->in_use);
+    out_stats->peak_in_use = atomic_load(&pool->peak_in_use);
+    out_stats->slabs = atomic_load(&pool->slabs);
+    out_stats->huge_slabs = atomic_load(&pool->huge_slabs);
+    out_stats->local_gets = atomic_load(&pool->local_gets);
+    out_stats->shared_gets = atomic_load(&pool->shared_gets);
+    out_stats->exhausted = atomic_load(&pool->exhausted);
+}
@@ -0,0 +1,52 @@
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Pool of fixed-size, page-aligned I/O buffers.
+// Buffers are carved from mmap-ed slabs (hugepage-backed on request) and never returned
+// to the system, so steady-state serving does no malloc/free.
+// Every thread keeps a small free list of its own, refilled from the shared one in batches.
+
+// Buffer classes //
+#define BUFPOOL_HEADER  0   // Requests' headers
+#define BUFPOOL_BODY    1   // Chunks of files' contents
+#define BUFPOOL_CLASSES 2
+
+#define BUFPOOL_SLAB_SIZE   (4 * 1048576)   // Multiple of the huge page size.
+#define BUFPOOL_DEFAULT_MAX_SIZE (256 * 1048576) // Per class, buffers above it are not given out.
+#define BUFPOOL_CACHE_BYTES (4 * 1048576)   // Per thread and class, kept in the local free list.
+#define BUFPOOL_CACHE_MAX   32
+
+// Return codes //
+#define BUFPOOL_ERR -1
+#define BUFPOOL_OK   0
+
+typedef struct bufpool_stats {
+    size_t buffer_size;
+    uint64_t buffers;      // Carved from slabs so far.
+    uint64_t in_use;
+    uint64_t peak_in_use;
+    uint64_t slabs;
+    uint64_t huge_slabs;   // Slabs backed by explicit huge pages.
+    uint64_t local_gets;   // Served from the thread's free list.
+    uint64_t shared_gets;  // Served after a refill from the shared free list.
+    uint64_t exhausted;    // Failed, because the class reached its most bytes.
+} bufpool_stats_t;
+
+// Sizes are rounded up to the page size. Every class grows up to max_size bytes, at least to a buffer.
+// With hugepages, slabs are mapped from huge pages when the system has them reserved.
+int bufpool_init(size_t header_size, size_t body_size, size_t max_size, bool hugepages);
+
+// Returns NULL when the class is exhausted.
+char* bufpool_get(int class);
+void bufpool_put(int class, char* buffer);
+
+// Size of buffers of the class.
+size_t bufpool_size(int class);
+
+void bufpool_stats(int class, bufpool_stats_t* out_stats);
+
+#endif /* BUFPOOL_H */
@@ -0,0 +1,391 @@
+#define _XOPEN_SOURCE 700  // nftw
+
+#include "bundle.h"
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <libgen.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BUNDLE_ALIGN(x, to) (((x) + (to) - 1) & ~(uint64_t)((to) - 1))
+
+struct bundle {
+    const char* image;
+    size_t image_size;
+    const bundle_header_t* header;
+    const bundle_entry_t* entries;
+    const char* names;
+    uint64_t refs;             // Guarded by bundle_mutex. The current bundle holds one too.
+};
+
+static pthread_mutex_t bundle_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bundle_t* bundle_current = NULL;
+static char* bundle_path = NULL;
+
+static _Atomic uint64_t bundle_reloads = 0;
+static _Atomic uint64_t bundle_reload_errors = 0;
+
+///// Packing /////
+typedef struct bundle_file {
+    char* name;                // Relative to the root, starting with '/'.
+    size_t name_len;
+    uint64_t size;
+    struct timespec mtime;
+} bundle_file_t;
+
+// Collected by the nftw callback.
+static bundle_file_t* bundle_files = NULL;
+static size_t bundle_file_count = 0;
+static size_t bundle_file_capacity = 0;
+static size_t bundle_root_len = 0;
+
+static int bundle_collect(const char* path, const struct stat* st, int type, struct FTW* ftw) {
+    (void)ftw;
+    if (type != FTW_F || !S_ISREG(st->st_mode))
+        return 0;
+
+    if (bundle_file_count == bundle_file_capacity) {
+        size_t capacity = bundle_file_capacity ? 2 * bundle_file_capacity : 1024;
+        bundle_file_t* files = realloc(bundle_files, capacity * sizeof(bundle_file_t));
+        if (!files)
+            return -1;
+        bundle_files = files;
+        bundle_file_capacity = capacity;
+    }
+
+    bundle_file_t* file = &bundle_files[bundle_file_count];
+    file->name = strdup(path + bundle_root_len);
+    if (!file->name)
+        return -1;
+    file->name_len = strlen(file->name);
+    file->size = st->st_size;
+    file->mtime = st->st_mtim;
+    bundle_file_count++;
+    return 0;
+}
+
+static int bundle_file_compare(const void* a, const void* b) {
+    const bundle_file_t* file_a = a;
+    const bundle_file_t* file_b = b;
+    return strcmp(file_a->name, file_b->name);
+}
+
+// Copies size bytes of the file at path to out.
+static int bundle_copy(const char* path, uint64_t size, FILE* out) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return BUNDLE_INTERNAL_ERR;
+
+    char buffer[65536];
+    while (size > 0) {
+        ssize_t ret = read(fd, buffer, size < sizeof(buffer) ? size : sizeof(buffer));
+        if (ret <= 0 || fwrite(buffer, 1, ret, out) != (size_t)ret) {
+            // The file has shrunk or cannot be read.
+            close(fd);
+            return BUNDLE_INTERNAL_ERR;
+        }
+        size -= ret;
+    }
+    close(fd);
+    return BUNDLE_FOUND;
+}
+
+static int bundle_write(const char* root, FILE* out) {
+    bundle_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BUNDLE_MAGIC, sizeof(header.magic));
+    header.version = BUNDLE_VERSION;
+    header.count = bundle_file_count;
+    header.entries_off = BUNDLE_ALIGN(sizeof(bundle_header_t), 8);
+    header.names_off = header.entries_off + bundle_file_count * sizeof(bundle_entry_t);
+    for (size_t i = 0; i < bundle_file_count; ++i)
+        header.names_size += bundle_files[i].name_len;
+    header.data_off = BUNDLE_ALIGN(header.names_off + header.names_size, BUNDLE_PAGE);
+
+    static const char padding[BUNDLE_PAGE] = {0};
+    if (fwrite(&header, sizeof(header), 1, out) != 1
+        || fwrite(padding, 1, header.entries_off - sizeof(header), out) != header.entries_off - sizeof(header))
+        return BUNDLE_INTERNAL_ERR;
+
+    uint64_t name_off = 0;
+    uint64_t data_off = header.data_off;
+    for (size_t i = 0; i < bundle_file_count; ++i) {
+        bundle_entry_t entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.name_off = name_off;
+        entry.name_len = bundle_files[i].name_len;
+        entry.mtime_sec = bundle_files[i].mtime.tv_sec;
+        entry.mtime_nsec = bundle_files[i].mtime.tv_nsec;
+        entry.data_off = data_off;
+        entry.size = bundle_files[i].size;
+        if (fwrite(&entry, sizeof(entry), 1, out) != 1)
+            return BUNDLE_INTERNAL_ERR;
+        name_off += entry.name_len;
+        data_off = BUNDLE_ALIGN(data_off + entry.size, BUNDLE_PAGE);
+    }
+
+    for (size_t i = 0; i < bundle_file_count; ++i)
+        if (fwrite(bundle_files[i].name, 1, bundle_files[i].name_len, out) != bundle_files[i].name_len)
+            return BUNDLE_INTERNAL_ERR;
+    uint64_t names_end = header.names_off + header.names_size;
+    if (fwrite(padding, 1, header.data_off - names_end, out) != header.data_off - names_end)
+        return BUNDLE_INTERNAL_ERR;
+
+    size_t root_len = strlen(root);
+    for (size_t i = 0; i < bundle_file_count; ++i) {
+        char path[root_len + bundle_files[i].name_len + 1];
+        memcpy(path, root, root_len);
+        memcpy(path + root_len, bundle_files[i].name, bundle_files[i].name_len + 1);
+
+        uint64_t size = bundle_files[i].size;
+        uint64_t pad = BUNDLE_ALIGN(size, BUNDLE_PAGE) - size;
+        if (bundle_copy(path, size, out) != BUNDLE_FOUND || fwrite(padding, 1, pad, out) != pad)
+            return BUNDLE_INTERNAL_ERR;
+    }
+
+    // The size is known only now.
+    header.image_size = data_off;
+    if (fseek(out, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, out) != 1)
+        return BUNDLE_INTERNAL_ERR;
+    return BUNDLE_FOUND;
+}
+
+int bundle_pack(const char* root, const char* outpath) {
+    // Paths in the bundle start with the '/' following root.
+    bundle_root_len = strlen(root);
+    while (bundle_root_len > 1 && root[bundle_root_len - 1] == '/')
+        bundle_root_len--;
+    char trimmed[bundle_root_len + 1];
+    memcpy(trimmed, root, bundle_root_len);
+    trimmed[bundle_root_len] = '\0';
+
+    int ret = nftw(trimmed, bundle_collect, 64, FTW_PHYS) == 0 ? BUNDLE_FOUND : BUNDLE_INTERNAL_ERR;
+    if (ret == BUNDLE_FOUND)
+        qsort(bundle_files, bundle_file_count, sizeof(bundle_file_t), bundle_file_compare);
+
+    // Written next to outpath first, so that the server never maps a partial bundle.
+    size_t tmppath_size = strlen(outpath) + 5;
+    char tmppath[tmppath_size];
+    snprintf(tmppath, tmppath_size, "%s.tmp", outpath);
+
+    FILE* out = ret == BUNDLE_FOUND ? fopen(tmppath, "w") : NULL;
+    if (out) {
+        bool written = bundle_write(trimmed, out) == BUNDLE_FOUND;
+        if (fflush(out) != 0 || fsync(fileno(out)) != 0)
+            written = false;
+        if (fclose(out) != 0)
+            written = false;
+        if (!written || rename(tmppath, outpath) != 0) {
+            unlink(tmppath);
+            ret = BUNDLE_INTERNAL_ERR;
+        }
+    }
+    else {
+        ret = BUNDLE_INTERNAL_ERR;
+    }
+
+    for (size_t i = 0; i < bundle_file_count; ++i)
+        free(bundle_files[i].name);
+    free(bundle_files);
+    bundle_files = NULL;
+    bundle_file_count = bundle_file_capacity = 0;
+    return ret;
+}
+
+///// Loading /////
+static void bundle_unmap(bundle_t* bundle) {
+    munmap((void*)bundle->image, bundle->image_size);
+    free(bundle);
+}
+
+static int bundle_open(const char* path, bundle_t** out_bundle) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return BUNDLE_INTERNAL_ERR;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(bundle_header_t)) {
+        close(fd);
+        return BUNDLE_INTERNAL_ERR;
+    }
+    void* image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED)
+        return BUNDLE_INTERNAL_ERR;
+
+    const bundle_header_t* header = image;
+    bundle_t* bundle = malloc(sizeof(bundle_t));
+    if (!bundle
+        || memcmp(header->magic, BUNDLE_MAGIC, sizeof(header->magic)) != 0
+        || header->version != BUNDLE_VERSION || header->image_size != (uint64_t)st.st_size
+        || header->entries_off + (uint64_t)header->count * sizeof(bundle_entry_t) > header->names_off
+        || header->names_off + header->names_size > header->data_off
+        || header->data_off > header->image_size) {
+        free(bundle);
+        munmap(image, st.st_size);
+        return BUNDLE_INTERNAL_ERR;
+    }
+
+    bundle->image = image;
+    bundle->image_size = st.st_size;
+    bundle->header = header;
+    bundle->entries = (const bundle_entry_t*)((const char*)image + header->entries_off);
+    bundle->names = (const char*)image + header->names_off;
+    bundle->refs = 1;
+    *out_bundle = bundle;
+    return BUNDLE_FOUND;
+}
+
+static void bundle_reload() {
+    bundle_t* bundle;
+    if (bundle_open(bundle_path, &bundle) != BUNDLE_FOUND) {
+        // The old bundle is served until the file can be read again.
+        atomic_fetch_add_explicit(&bundle_reload_errors, 1, memory_order_relaxed);
+        fprintf(stderr, "Cannot reload the bundle %s\n", bundle_path);
+        return;
+    }
+
+    pthread_mutex_lock(&bundle_mutex);
+    bundle_t* old = bundle_current;
+    bundle_current = bundle;
+    pthread_mutex_unlock(&bundle_mutex);
+
+    bundle_release(old);
+    atomic_fetch_add_explicit(&bundle_reloads, 1, memory_order_relaxed);
+}
+
+static void* bundle_watch_loop(void* arg) {
+    (void)arg;
+
+    // The directory is watched, so that replacing the file by a rename is noticed. Writes are not,
+    // a file being written to path is not complete yet, see bundle.h.
+    char path_copy[strlen(bundle_path) + 1];
+    strcpy(path_copy, bundle_path);
+    char name_copy[strlen(bundle_path) + 1];
+    strcpy(name_copy, bundle_path);
+    const char* directory = dirname(path_copy);
+    const char* name = basename(name_copy);
+
+    int inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd == -1 || inotify_add_watch(inotify_fd, directory, IN_MOVED_TO) == -1) {
+        fprintf(stderr, "Cannot watch %s, the bundle will not be reloaded\n", bundle_path);
+        return NULL;
+    }
+
+    struct pollfd fds = {.fd = inotify_fd, .events = POLLIN};
+    bool pending = false;
+    for (;;) {
+        int ret = poll(&fds, 1, pending ? BUNDLE_RELOAD_DELAY_MS : -1);
+        if (ret == -1)
+            continue;
+        if (ret == 0) {
+            // No more changes within the delay.
+            pending = false;
+            bundle_reload();
+            continue;
+        }
+
+        char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        ssize_t events_size = read(inotify_fd, events, sizeof(events));
+        for (char* ptr = events; events_size > 0 && ptr < events + events_size;) {
+            struct inotify_event* event = (struct inotify_event*)ptr;
+            if (event->mask & IN_Q_OVERFLOW || (event->len > 0 && strcmp(event->name, name) == 0))
+                pending = true;
+            ptr += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    return NULL;
+}
+
+int bundle_start(const char* path) {
+    bundle_path = strdup(path);
+    if (!bundle_path || bundle_open(path, &bundle_current) != BUNDLE_FOUND)
+        return BUNDLE_INTERNAL_ERR;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, bundle_watch_loop, NULL) != 0)
+        return BUNDLE_INTERNAL_ERR;
+    pthread_detach(thread);
+    return BUNDLE_FOUND;
+}
+
+bool bundle_enabled() {
+    return bundle_current != NULL;
+}
+
+bundle_t* bundle_acquire() {
+    pthread_mutex_lock(&bundle_mutex);
+    bundle_t* bundle = bundle_current;
+    bundle->refs++;
+    pthread_mutex_unlock(&bundle_mutex);
+    return bundle;
+}
+
+void bundle_release(bundle_t* bundle) {
+    pthread_mutex_lock(&bundle_mutex);
+    bool last = --bundle->refs == 0;
+    pthread_mutex_unlock(&bundle_mutex);
+    if (last)
+        bundle_unmap(bundle);
+}
+
+///// Searching /////
+int bundle_lookup(const bundle_t* bundle, const char* target, const char** out_data, fs_meta_t* out_meta) {
+    const bundle_header_t* header = bundle->header;
+    size_t target_len = strlen(target);
+
+    // Bisection over the entries, ordered as strcmp orders the names.
+    size_t low = 0;
+    size_t high = header->count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        const bundle_entry_t* entry = &bundle->entries[middle];
+        if (entry->name_off + entry->name_len > header->names_size)
+            return BUNDLE_INTERNAL_ERR;
+
+        size_t common = entry->name_len < target_len ? entry->name_len : target_len;
+        int order = memcmp(bundle->names + entry->name_off, target, common);
+        if (order == 0)
+            order = entry->name_len < target_len ? -1 : entry->name_len > target_len ? 1 : 0;
+
+        if (order < 0) {
+            low = middle + 1;
+        }
+        else if (order > 0) {
+            high = middle;
+        }
+        else {
+            // A bundle could claim anything.
+            if (entry->data_off < header->data_off || entry->data_off + entry->size > bundle->image_size)
+                return BUNDLE_INTERNAL_ERR;
+            *out_data = bundle->image + entry->data_off;
+            out_meta->regular = true;
+            out_meta->size = entry->size;
+            out_meta->mtime.tv_sec = entry->mtime_sec;
+            out_meta->mtime.tv_nsec = entry->mtime_nsec;
+            return BUNDLE_FOUND;
+        }
+    }
+    return BUNDLE_NOT_FOUND;
+}
+
+void bundle_stats(bundle_stats_t* out_stats) {
+    memset(out_stats, 0, sizeof(bundle_stats_t));
+    pthread_mutex_lock(&bundle_mutex);
+    if (bundle_current) {
+        out_stats->files = bundle_current->header->count;
+        out_stats->bytes = bundle_current->image_size;
+    }
+    pthread_mutex_unlock(&bundle_mutex);
+    out_stats->reloads = atomic_load(&bundle_reloads);
+    out_stats->reload_errors = atomic_load(&bundle_reload_errors);
+}
@@ -0,0 +1,81 @@
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "fs_index.h"
+
+// Document root packed into a single read-only file, which is mmap-ed and served from memory.
+//
+// Layout: header, entries, names, data.
+// Entries are sorted by the path of their file, which starts with '/', and are searched by bisection.
+// Every file's data starts at a page boundary. Only regular files are packed.
+//
+// The bundle is reloaded, when its file is replaced, and swapped for the old one atomically.
+// A response holds a reference to the bundle it is sent from, so the old one is unmapped
+// only after its last response is sent.
+//
+// The file has to be replaced atomically, by renaming a new one over it, as bundle_pack does. Only renames
+// are noticed. The mapping is shared with the file, so a bundle rewritten in place would change under
+// the responses being sent, and one truncated would fault the server.
+
+// Return codes //
+#define BUNDLE_INTERNAL_ERR -1
+#define BUNDLE_FOUND         0
+#define BUNDLE_NOT_FOUND     1
+
+#define BUNDLE_MAGIC   "SRWBNDL"
+#define BUNDLE_VERSION 1
+#define BUNDLE_PAGE    4096
+#define BUNDLE_RELOAD_DELAY_MS 100   // Changes of the file are coalesced for this long before reloading.
+
+typedef struct bundle_header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint64_t entries_off;   // bundle_entry_t[count]
+    uint64_t names_off;
+    uint64_t names_size;
+    uint64_t data_off;
+    uint64_t image_size;
+} bundle_header_t;
+
+typedef struct bundle_entry {
+    uint64_t name_off;      // In the name area, not NUL-terminated.
+    uint32_t name_len;
+    uint32_t mtime_nsec;
+    int64_t  mtime_sec;
+    uint64_t data_off;      // From the beginning of the image.
+    uint64_t size;
+} bundle_entry_t;
+
+typedef struct bundle bundle_t;
+
+typedef struct bundle_stats {
+    uint64_t files;         // In the current bundle.
+    uint64_t bytes;         // Of the current bundle.
+    uint64_t reloads;
+    uint64_t reload_errors;
+} bundle_stats_t;
+
+// Packs the regular files under root into a bundle in outpath, which is replaced atomically.
+int bundle_pack(const char* root, const char* outpath);
+
+// Maps the bundle in path and starts the thread reloading it, when a file is renamed to path.
+// Has to be called at most once.
+int bundle_start(const char* path);
+
+bool bundle_enabled();
+
+// Takes a reference to the current bundle, to be dropped by bundle_release.
+bundle_t* bundle_acquire();
+void bundle_release(bundle_t* bundle);
+
+// Looks up target, a path starting with '/'. On BUNDLE_FOUND *out_data points to its contents,
+// valid while the bundle is held.
+int bundle_lookup(const bundle_t* bundle, const char* target, const char** out_data, fs_meta_t* out_meta);
+
+void bundle_stats(bundle_stats_t* out_stats);
+
+#endif /* BUNDLE_H */
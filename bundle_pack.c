@@ -0,0 +1,17 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "bundle.h"
+
+// Packs a document root into the bundle served by serwer --bundle.
+int main(int argc, char* argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s root_directory output_file\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (bundle_pack(argv[1], argv[2]) != BUNDLE_FOUND) {
+        fprintf(stderr, "%s: cannot pack %s into %s\n", argv[0], argv[1], argv[2]);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -1,78 +1,889 @@
 #include "co_servers.h"
+#include "http.h"
 
-int search_corelated_servers(const char* lookfilepath, const char* lookfor, char** out_address) {
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define COS_GOLDEN 0x9E3779B97F4A7C15ULL
+#define COS_MAX_DISPLACEMENT 0x1000000  // Tries for a single bucket before the seed is changed.
+#define COS_MAX_SEEDS 16
+#define COS_RELOAD_DELAY_MS 100       // Changes of the file are coalesced for this long before reloading.
+#define COS_ALIGN(x) (((x) + 7) & ~(uint64_t)7)
+
+///// Hashing /////
+// FNV-1a
+static uint64_t cos_hash(const char* str, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= (unsigned char)str[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// splitmix64 finalizer
+static uint64_t cos_mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static uint32_t cos_bucket(uint64_t hash, uint32_t seed, uint32_t buckets) {
+    return (cos_mix(hash + seed) >> 32) % buckets;
+}
+
+static uint32_t cos_place(uint64_t hash, uint32_t seed, uint32_t displacement, uint32_t count) {
+    return cos_mix(hash + seed + (displacement + 1) * COS_GOLDEN) % count;
+}
+
+// Whether size bytes from off lie within the first limit bytes, without the sum overflowing.
+static bool cos_fits(uint64_t off, uint64_t size, uint64_t limit) {
+    return off <= limit && size <= limit - off;
+}
+
+// The record has to be checked to hold the resource, see cos_find.
+static const char* cos_record_resource(const char* strings, const cos_record_t* record) {
+    // The resource ends right before the closing "\r\n\r\n".
+    return strings + record->response_off + record->response_size - 4 - record->resource_len;
+}
+
+///// Building /////
+typedef struct cos_build {
+    cos_header_t header;
+
+    cos_record_t* records;
+    uint64_t* hashes;
+    size_t records_capacity;
+
+    char* strings;
+    size_t strings_capacity;
+
+    uint32_t* seen;          // Open addressing set of record indices + 1, 0 marks an empty slot.
+    size_t seen_capacity;    // Power of 2.
+
+    // Every entry, in the order of the file, until grouped by cos_build_group.
+    cos_replica_t* replicas;
+    uint32_t* replica_owner; // Index of the record of every replica.
+    size_t replicas_capacity;
+
+    int32_t* displace;
+} cos_build_t;
+
+static void cos_build_free(cos_build_t* build) {
+    free(build->records);
+    free(build->hashes);
+    free(build->strings);
+    free(build->seen);
+    free(build->replicas);
+    free(build->replica_owner);
+    free(build->displace);
+}
+
+// Returns the slot of seen in which the resource is, or the empty slot where it should be put.
+static uint32_t* cos_build_seen(cos_build_t* build, uint64_t hash, const char* resource, size_t resource_len) {
+    size_t mask = build->seen_capacity - 1;
+    size_t i = hash & mask;
+
+    while (build->seen[i] != 0) {
+        uint32_t index = build->seen[i] - 1;
+        cos_record_t* record = &build->records[index];
+        if (build->hashes[index] == hash && record->resource_len == resource_len
+            && memcmp(cos_record_resource(build->strings, record), resource, resource_len) == 0)
+            return &build->seen[i];
+
+        i = (i + 1) & mask;
+    }
+    return &build->seen[i];
+}
+
+static int cos_build_reserve(cos_build_t* build, size_t response_size) {
+    size_t count = build->header.count;
+
+    if (count == build->records_capacity) {
+        size_t capacity = build->records_capacity ? 2 * build->records_capacity : 64;
+        cos_record_t* records = realloc(build->records, capacity * sizeof(cos_record_t));
+        if (!records)
+            return COS_INTERNAL_ERR;
+        build->records = records;
+
+        uint64_t* hashes = realloc(build->hashes, capacity * sizeof(uint64_t));
+        if (!hashes)
+            return COS_INTERNAL_ERR;
+        build->hashes = hashes;
+        build->records_capacity = capacity;
+    }
+
+    // Keep the load factor of seen under 1/2.
+    if (2 * (count + 1) > build->seen_capacity) {
+        size_t capacity = build->seen_capacity ? 2 * build->seen_capacity : 128;
+        uint32_t* old_seen = build->seen;
+        size_t old_capacity = build->seen_capacity;
+
+        build->seen = calloc(capacity, sizeof(uint32_t));
+        if (!build->seen) {
+            build->seen = old_seen;
+            return COS_INTERNAL_ERR;
+        }
+        build->seen_capacity = capacity;
+
+        for (size_t i = 0; i < old_capacity; ++i) {
+            if (old_seen[i] == 0)
+                continue;
+            uint32_t index = old_seen[i] - 1;
+            cos_record_t* record = &build->records[index];
+            *cos_build_seen(build, build->hashes[index],
+                            cos_record_resource(build->strings, record), record->resource_len) = old_seen[i];
+        }
+        free(old_seen);
+    }
+
+    if (build->header.replica_count == build->replicas_capacity) {
+        size_t capacity = build->replicas_capacity ? 2 * build->replicas_capacity : 64;
+        cos_replica_t* replicas = realloc(build->replicas, capacity * sizeof(cos_replica_t));
+        if (!replicas)
+            return COS_INTERNAL_ERR;
+        build->replicas = replicas;
+
+        uint32_t* owners = realloc(build->replica_owner, capacity * sizeof(uint32_t));
+        if (!owners)
+            return COS_INTERNAL_ERR;
+        build->replica_owner = owners;
+        build->replicas_capacity = capacity;
+    }
+
+    if (build->header.strings_size + response_size > build->strings_capacity) {
+        size_t capacity = build->strings_capacity ? build->strings_capacity : 4096;
+        while (build->header.strings_size + response_size > capacity)
+            capacity *= 2;
+
+        char* strings = realloc(build->strings, capacity);
+        if (!strings)
+            return COS_INTERNAL_ERR;
+        build->strings = strings;
+        build->strings_capacity = capacity;
+    }
+
+    return COS_FOUND;
+}
+
+// line is in the form "resource TAB ip TAB port", without the trailing newline.
+// Returns COS_NOT_FOUND if it is not.
+static int cos_build_add(cos_build_t* build, char* line) {
+    char* ip = strchr(line, '\t');
+    if (!ip)
+        return COS_NOT_FOUND;
+    *ip = '\0';
+    ++ip;
+
+    char* port = strchr(ip, '\t');
+    if (!port)
+        return COS_NOT_FOUND;
+    *port = '\0';
+    ++port;
+
+    cos_record_t record;
+    memset(&record, 0, sizeof(record));
+
+    if (inet_pton(AF_INET, ip, &record.ip) != 1)
+        return COS_NOT_FOUND;
+
+    char* port_end;
+    unsigned long port_number = strtoul(port, &port_end, 10);
+    if (port_end == port || *port_end != '\0' || port_number > 65535)
+        return COS_NOT_FOUND;
+    record.port = (uint16_t)port_number;
+
+    size_t resource_len = strlen(line);
+    if (resource_len > UINT32_MAX / 2)
+        return COS_NOT_FOUND;
+    record.resource_len = resource_len;
+    uint64_t hash = cos_hash(line, resource_len);
+
+    // The first occurrence of a resource makes its record, every one is its replica.
+    uint32_t owner = 0;
+    if (build->seen_capacity > 0)
+        owner = *cos_build_seen(build, hash, line, resource_len);
+    bool duplicate = owner != 0;
+    if (duplicate)
+        owner--;
+
+    if ((!duplicate && build->header.count >= INT32_MAX) || build->header.replica_count >= UINT32_MAX)
+        return COS_INTERNAL_ERR;
+
+    // render_found expects "ip:port"
+    *(port - 1) = ':';
+    char* response;
+    size_t response_size;
+    if (render_found(line, ip, &response, &response_size) != SEND_OK)
+        return COS_INTERNAL_ERR;
+
+    if (cos_build_reserve(build, response_size) != COS_FOUND) {
+        free(response);
+        return COS_INTERNAL_ERR;
+    }
+
+    record.response_off = build->header.strings_size;
+    record.response_size = response_size;
+    memcpy(build->strings + build->header.strings_size, response, response_size);
+    build->header.strings_size += response_size;
+    free(response);
+
+    if (!duplicate) {
+        owner = build->header.count++;
+        build->records[owner] = record;
+        build->hashes[owner] = hash;
+        *cos_build_seen(build, hash, line, resource_len) = owner + 1;
+    }
+
+    cos_replica_t* replica = &build->replicas[build->header.replica_count];
+    memset(replica, 0, sizeof(cos_replica_t));
+    replica->response_off = record.response_off;
+    replica->response_size = record.response_size;
+    replica->ip = record.ip;
+    replica->port = record.port;
+    build->replica_owner[build->header.replica_count++] = owner;
+    return COS_FOUND;
+}
+
+// Groups the replicas by their records, keeping the order of the file.
+static int cos_build_group(cos_build_t* build) {
+    uint32_t count = build->header.count;
+    size_t replica_count = build->header.replica_count;
+    cos_replica_t* grouped = malloc((replica_count > 0 ? replica_count : 1) * sizeof(cos_replica_t));
+    if (!grouped)
+        return COS_INTERNAL_ERR;
+
+    for (size_t r = 0; r < replica_count; ++r)
+        build->records[build->replica_owner[r]].replica_count++;
+    uint32_t first = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        build->records[i].replica_first = first;
+        first += build->records[i].replica_count;
+        build->records[i].replica_count = 0;
+    }
+    for (size_t r = 0; r < replica_count; ++r) {
+        cos_record_t* record = &build->records[build->replica_owner[r]];
+        grouped[record->replica_first + record->replica_count++] = build->replicas[r];
+    }
+
+    free(build->replicas);
+    build->replicas = grouped;
+    build->replicas_capacity = replica_count;
+    return COS_FOUND;
+}
+
+static int cos_build_read(cos_build_t* build, FILE* lookfile) {
+    char* line = NULL;
+    size_t line_size = 0;
+    ssize_t line_len;
+    size_t line_number = 0;
+    while ((line_len = getline(&line, &line_size, lookfile)) != -1) {
+        ++line_number;
+        if (line_len > 0 && line[line_len - 1] == '\n')
+            line[--line_len] = '\0';
+        if (line_len > 0 && line[line_len - 1] == '\r')
+            line[--line_len] = '\0';
+        if (line_len == 0)
+            continue;
+
+        // A malformed line is skipped, the others are still served.
+        int ret = cos_build_add(build, line);
+        if (ret == COS_NOT_FOUND)
+            fprintf(stderr, "Skipping malformed line %zu of the corelated servers\n", line_number);
+        else if (ret != COS_FOUND) {
+            free(line);
+            return COS_INTERNAL_ERR;
+        }
+    }
+    free(line);
+
+    if (ferror(lookfile))
+        return COS_INTERNAL_ERR;
+    return COS_FOUND;
+}
+
+// Tries to find the displacements for the given seed.
+// slot_of has to hold count elements, on success it maps records to their slots.
+static int cos_build_displace(cos_build_t* build, uint32_t seed, uint32_t* slot_of) {
+    uint32_t count = build->header.count;
+    uint32_t buckets = build->header.buckets;
+    int ret = COS_INTERNAL_ERR;
+
+    uint32_t* bucket_start = calloc((size_t)buckets + 1, sizeof(uint32_t));
+    uint32_t* bucket_fill = malloc((size_t)buckets * sizeof(uint32_t));
+    uint32_t* members = malloc((size_t)count * sizeof(uint32_t));
+    uint32_t* order = malloc((size_t)buckets * sizeof(uint32_t));
+    uint8_t* used = calloc(count, 1);
+    uint32_t* size_start = NULL;
+    uint32_t* slots = NULL;
+    if (!bucket_start || !bucket_fill || !members || !order || !used)
+        goto out;
+
+    // Group the records by buckets.
+    for (uint32_t i = 0; i < count; ++i)
+        ++bucket_start[cos_bucket(build->hashes[i], seed, buckets) + 1];
+
+    uint32_t max_size = 0;
+    for (uint32_t b = 0; b < buckets; ++b) {
+        if (bucket_start[b + 1] > max_size)
+            max_size = bucket_start[b + 1];
+        bucket_start[b + 1] += bucket_start[b];
+    }
+    memcpy(bucket_fill, bucket_start, (size_t)buckets * sizeof(uint32_t));
+    for (uint32_t i = 0; i < count; ++i)
+        members[bucket_fill[cos_bucket(build->hashes[i], seed, buckets)]++] = i;
+
+    // Biggest buckets are placed first, while most of the slots are free.
+    size_start = calloc((size_t)max_size + 2, sizeof(uint32_t));
+    slots = malloc((size_t)max_size * sizeof(uint32_t));
+    if (!size_start || !slots)
+        goto out;
+    for (uint32_t b = 0; b < buckets; ++b)
+        ++size_start[max_size - (bucket_start[b + 1] - bucket_start[b]) + 1];
+    for (uint32_t s = 0; s <= max_size; ++s)
+        size_start[s + 1] += size_start[s];
+    for (uint32_t b = 0; b < buckets; ++b)
+        order[size_start[max_size - (bucket_start[b + 1] - bucket_start[b])]++] = b;
+
+    ret = COS_FOUND;
+    uint32_t free_slot = 0;
+    for (uint32_t o = 0; o < buckets && ret == COS_FOUND; ++o) {
+        uint32_t b = order[o];
+        uint32_t first = bucket_start[b];
+        uint32_t size = bucket_start[b + 1] - first;
+
+        if (size == 0) {
+            build->displace[b] = 0;
+        }
+        else if (size == 1) {
+            // Single records take the remaining slots directly.
+            while (used[free_slot])
+                ++free_slot;
+            used[free_slot] = 1;
+            slot_of[members[first]] = free_slot;
+            build->displace[b] = -(int32_t)free_slot - 1;
+        }
+        else {
+            uint32_t d;
+            for (d = 0; d < COS_MAX_DISPLACEMENT; ++d) {
+                bool fits = true;
+                for (uint32_t k = 0; k < size && fits; ++k) {
+                    slots[k] = cos_place(build->hashes[members[first + k]], seed, d, count);
+                    if (used[slots[k]])
+                        fits = false;
+                    for (uint32_t j = 0; j < k && fits; ++j)
+                        if (slots[j] == slots[k])
+                            fits = false;
+                }
+                if (fits)
+                    break;
+            }
+            if (d == COS_MAX_DISPLACEMENT) {
+                ret = COS_INTERNAL_ERR;
+                break;
+            }
+
+            for (uint32_t k = 0; k < size; ++k) {
+                used[slots[k]] = 1;
+                slot_of[members[first + k]] = slots[k];
+            }
+            build->displace[b] = d;
+        }
+    }
+
+out:
+    free(bucket_start);
+    free(bucket_fill);
+    free(members);
+    free(order);
+    free(used);
+    free(size_start);
+    free(slots);
+    return ret;
+}
+
+// Builds the perfect hash and reorders the records into their slots.
+static int cos_build_hash(cos_build_t* build) {
+    uint32_t count = build->header.count;
+    build->header.buckets = count / 2 + 1;
+    build->displace = malloc((size_t)build->header.buckets * sizeof(int32_t));
+    if (!build->displace)
+        return COS_INTERNAL_ERR;
+
+    if (count == 0) {
+        build->displace[0] = 0;
+        return COS_FOUND;
+    }
+
+    uint32_t* slot_of = malloc((size_t)count * sizeof(uint32_t));
+    cos_record_t* placed = malloc((size_t)count * sizeof(cos_record_t));
+    if (!slot_of || !placed) {
+        free(slot_of);
+        free(placed);
+        return COS_INTERNAL_ERR;
+    }
+
+    uint32_t seed;
+    for (seed = 0; seed < COS_MAX_SEEDS; ++seed)
+        if (cos_build_displace(build, seed, slot_of) == COS_FOUND)
+            break;
+    if (seed == COS_MAX_SEEDS) {
+        free(slot_of);
+        free(placed);
+        return COS_INTERNAL_ERR;
+    }
+    build->header.seed = seed;
+
+    for (uint32_t i = 0; i < count; ++i)
+        placed[slot_of[i]] = build->records[i];
+    free(slot_of);
+    free(build->records);
+    build->records = placed;
+    build->records_capacity = count;
+    return COS_FOUND;
+}
+
+static void cos_build_layout(cos_build_t* build) {
+    cos_header_t* header = &build->header;
+    memcpy(header->magic, COS_MAGIC, sizeof(header->magic));
+    header->version = COS_VERSION;
+    header->displace_off = COS_ALIGN(sizeof(cos_header_t));
+    header->records_off = COS_ALIGN(header->displace_off + (uint64_t)header->buckets * sizeof(int32_t));
+    header->replicas_off = header->records_off + (uint64_t)header->count * sizeof(cos_record_t);
+    header->strings_off = header->replicas_off + header->replica_count * sizeof(cos_replica_t);
+    header->image_size = header->strings_off + header->strings_size;
+}
+
+static int cos_build(FILE* lookfile, cos_build_t* build) {
+    memset(build, 0, sizeof(cos_build_t));
+    if (cos_build_read(build, lookfile) != COS_FOUND || cos_build_group(build) != COS_FOUND
+        || cos_build_hash(build) != COS_FOUND) {
+        cos_build_free(build);
+        return COS_INTERNAL_ERR;
+    }
+    cos_build_layout(build);
+    return COS_FOUND;
+}
+
+///// Loading /////
+// Points the table at image, checking whether the header is consistent with its size.
+static int cos_table_view(cos_table_t* table, const char* image, size_t image_size) {
+    if (image_size < sizeof(cos_header_t))
+        return COS_INTERNAL_ERR;
+
+    const cos_header_t* header = (const cos_header_t*)image;
+    if (memcmp(header->magic, COS_MAGIC, sizeof(header->magic)) != 0 || header->version != COS_VERSION)
+        return COS_INTERNAL_ERR;
+    if (header->image_size != image_size || header->buckets == 0
+        || header->replica_count > image_size / sizeof(cos_replica_t)
+        || !cos_fits(header->displace_off, (uint64_t)header->buckets * sizeof(int32_t), header->records_off)
+        || !cos_fits(header->records_off, (uint64_t)header->count * sizeof(cos_record_t), header->replicas_off)
+        || !cos_fits(header->replicas_off, header->replica_count * sizeof(cos_replica_t), header->strings_off)
+        || !cos_fits(header->strings_off, header->strings_size, image_size))
+        return COS_INTERNAL_ERR;
+
+    table->image = image;
+    table->image_size = image_size;
+    table->header = header;
+    table->displace = (const int32_t*)(image + header->displace_off);
+    table->records = (const cos_record_t*)(image + header->records_off);
+    table->replicas = (const cos_replica_t*)(image + header->replicas_off);
+    table->strings = image + header->strings_off;
+    return COS_FOUND;
+}
+
+// Reads the image into memory, a mapping would change under the readers (or fault) if the file
+// was rewritten in place. An image torn by such a rewrite fails the header's checks, or the lookups' ones.
+static int cos_load_compiled(int fd, cos_table_t* table) {
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0)
+        return COS_INTERNAL_ERR;
+
+    size_t image_size = file_stat.st_size;
+    char* image = malloc(image_size > 0 ? image_size : 1);
+    if (!image)
+        return COS_INTERNAL_ERR;
+    size_t read_size = 0;
+    while (read_size < image_size) {
+        ssize_t ret = pread(fd, image + read_size, image_size - read_size, read_size);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+        read_size += ret;
+    }
+
+    if (read_size != image_size || cos_table_view(table, image, image_size) != COS_FOUND) {
+        free(image);
+        return COS_INTERNAL_ERR;
+    }
+    return COS_FOUND;
+}
+
+static int cos_load_text(FILE* lookfile, cos_table_t* table) {
+    cos_build_t build;
+    if (cos_build(lookfile, &build) != COS_FOUND)
+        return COS_INTERNAL_ERR;
+
+    char* image = malloc(build.header.image_size);
+    if (!image) {
+        cos_build_free(&build);
+        return COS_INTERNAL_ERR;
+    }
+    memset(image, 0, build.header.strings_off);
+    memcpy(image, &build.header, sizeof(cos_header_t));
+    memcpy(image + build.header.displace_off, build.displace, (size_t)build.header.buckets * sizeof(int32_t));
+    memcpy(image + build.header.records_off, build.records, (size_t)build.header.count * sizeof(cos_record_t));
+    memcpy(image + build.header.replicas_off, build.replicas, build.header.replica_count * sizeof(cos_replica_t));
+    memcpy(image + build.header.strings_off, build.strings, build.header.strings_size);
+    cos_build_free(&build);
+
+    if (cos_table_view(table, image, build.header.image_size) != COS_FOUND) {
+        free(image);
+        return COS_INTERNAL_ERR;
+    }
+    return COS_FOUND;
+}
+
+int cos_load(const char* lookfilepath, cos_table_t** out_table) {
     FILE* lookfile = fopen(lookfilepath, "r");
     if (!lookfile)
         return COS_INTERNAL_ERR;
-    
-    // lookfor + tab + XXX.XXX.XXX.XXX + tab + 65535 + '\n'
-    size_t buffer_size = strlen(lookfor) + 1 + 15 + 1 + 5 + 1;
-    if (buffer_size > __INT32_MAX__) {
+
+    cos_table_t* table = malloc(sizeof(cos_table_t));
+    if (!table) {
         fclose(lookfile);
         return COS_INTERNAL_ERR;
     }
 
-    char* buffer = malloc(buffer_size + 1);
-    if (!buffer) {
-        fclose(lookfile);
+    char magic[sizeof(((cos_header_t*)NULL)->magic)];
+    size_t magic_size = fread(magic, 1, sizeof(magic), lookfile);
+
+    int ret;
+    if (magic_size == sizeof(magic) && memcmp(magic, COS_MAGIC, sizeof(magic)) == 0) {
+        ret = cos_load_compiled(fileno(lookfile), table);
+    }
+    else {
+        rewind(lookfile);
+        ret = cos_load_text(lookfile, table);
+    }
+    fclose(lookfile);
+
+    if (ret != COS_FOUND) {
+        free(table);
+        return COS_INTERNAL_ERR;
+    }
+    *out_table = table;
+    return COS_FOUND;
+}
+
+int cos_compile(const char* lookfilepath, const char* outpath) {
+    FILE* lookfile = fopen(lookfilepath, "r");
+    if (!lookfile)
+        return COS_INTERNAL_ERR;
+
+    cos_build_t build;
+    int ret = cos_build(lookfile, &build);
+    fclose(lookfile);
+    if (ret != COS_FOUND)
+        return COS_INTERNAL_ERR;
+
+    // Written next to outpath first, so that readers never see a partial image.
+    size_t tmppath_size = strlen(outpath) + 5;
+    char tmppath[tmppath_size];
+    snprintf(tmppath, tmppath_size, "%s.tmp", outpath);
+
+    FILE* outfile = fopen(tmppath, "w");
+    if (!outfile) {
+        cos_build_free(&build);
+        return COS_INTERNAL_ERR;
+    }
+
+    static const char padding[8] = {0};
+    cos_header_t* header = &build.header;
+    uint64_t displace_end = header->displace_off + (uint64_t)header->buckets * sizeof(int32_t);
+    bool written =
+        fwrite(header, sizeof(cos_header_t), 1, outfile) == 1
+        && fwrite(padding, 1, header->displace_off - sizeof(cos_header_t), outfile) == header->displace_off - sizeof(cos_header_t)
+        && fwrite(build.displace, sizeof(int32_t), header->buckets, outfile) == header->buckets
+        && fwrite(padding, 1, header->records_off - displace_end, outfile) == header->records_off - displace_end
+        && fwrite(build.records, sizeof(cos_record_t), header->count, outfile) == header->count
+        && fwrite(build.replicas, sizeof(cos_replica_t), header->replica_count, outfile) == header->replica_count
+        && fwrite(build.strings, 1, header->strings_size, outfile) == header->strings_size;
+    cos_build_free(&build);
+
+    if (fflush(outfile) != 0 || fsync(fileno(outfile)) != 0)
+        written = false;
+    if (fclose(outfile) != 0)
+        written = false;
+
+    if (!written || rename(tmppath, outpath) != 0) {
+        unlink(tmppath);
         return COS_INTERNAL_ERR;
     }
+    return COS_FOUND;
+}
+
+///// Searching /////
+// Returns the record of the resource lookfor, or NULL if there is none.
+static const cos_record_t* cos_find(const cos_table_t* table, const char* lookfor) {
+    const cos_header_t* header = table->header;
+    if (header->count == 0)
+        return NULL;
 
     size_t lookfor_len = strlen(lookfor);
-    char look_for[lookfor_len + 2];
-    if (strcpy(look_for, lookfor) == NULL) {
-        fclose(lookfile);
-        free(buffer);
+    uint64_t hash = cos_hash(lookfor, lookfor_len);
+
+    int32_t d = table->displace[cos_bucket(hash, header->seed, header->buckets)];
+    uint32_t slot = d < 0 ? (uint32_t)(-(d + 1)) : cos_place(hash, header->seed, d, header->count);
+    if (slot >= header->count)
+        return NULL;
+
+    // Resources outside of the index also land in some slot.
+    // A compiled file could claim anything, the resource has to lie within its response.
+    const cos_record_t* record = &table->records[slot];
+    if (record->resource_len != lookfor_len
+        || (uint64_t)record->resource_len + 4 > record->response_size
+        || !cos_fits(record->response_off, record->response_size, header->strings_size)
+        || memcmp(cos_record_resource(table->strings, record), lookfor, lookfor_len) != 0)
+        return NULL;
+    return record;
+}
+
+int cos_search(const cos_table_t* table, const char* lookfor, const char** out_response, size_t* out_response_size) {
+    const cos_record_t* record = cos_find(table, lookfor);
+    if (!record)
+        return COS_NOT_FOUND;
+
+    *out_response = table->strings + record->response_off;
+    *out_response_size = record->response_size;
+    return COS_FOUND;
+}
+
+int cos_search_server(const cos_table_t* table, const char* lookfor, uint32_t* out_ip, uint16_t* out_port) {
+    const cos_record_t* record = cos_find(table, lookfor);
+    if (!record)
+        return COS_NOT_FOUND;
+
+    *out_ip = record->ip;
+    *out_port = record->port;
+    return COS_FOUND;
+}
+
+int cos_search_replicas(const cos_table_t* table, const char* lookfor, const cos_replica_t** out_replicas, uint32_t* out_count) {
+    const cos_record_t* record = cos_find(table, lookfor);
+    if (!record)
+        return COS_NOT_FOUND;
+
+    // A compiled file could claim anything.
+    const cos_header_t* header = table->header;
+    if (record->replica_count == 0 || (uint64_t)record->replica_first + record->replica_count > header->replica_count)
         return COS_INTERNAL_ERR;
+    const cos_replica_t* replicas = table->replicas + record->replica_first;
+    for (uint32_t i = 0; i < record->replica_count; ++i)
+        if (!cos_fits(replicas[i].response_off, replicas[i].response_size, header->strings_size))
+            return COS_INTERNAL_ERR;
+
+    *out_replicas = replicas;
+    *out_count = record->replica_count;
+    return COS_FOUND;
+}
+
+void cos_free(cos_table_t* table) {
+    if (!table)
+        return;
+
+    free((void*)table->image);
+    free(table);
+}
+
+///// Reloading /////
+static _Atomic(cos_table_t*) cos_current = NULL;
+
+// Epoch of every registered reader, 0 when it is outside of a read section.
+static _Atomic uint64_t cos_epoch = 1;
+static _Atomic uint64_t cos_reader_epochs[COS_MAX_READERS];
+static _Atomic size_t cos_readers = 0;
+static __thread _Atomic uint64_t* cos_reader = NULL;
+
+static pthread_t cos_watcher;
+static int cos_stop_pipe[2] = {-1, -1};
+static char* cos_watched_path = NULL;
+
+const cos_table_t* cos_read_begin() {
+    if (!cos_reader) {
+        size_t slot = atomic_fetch_add(&cos_readers, 1);
+        if (slot >= COS_MAX_READERS)
+            return NULL;
+        cos_reader = &cos_reader_epochs[slot];
     }
-    look_for[lookfor_len] = '\t';
-    look_for[lookfor_len + 1] = '\0';
 
-    while (fgets(buffer, buffer_size + 1, lookfile) != NULL) {
-        char* ret = strstr(buffer, look_for);
-        
-        if (buffer == ret) {
-            fclose(lookfile);
+    // The epoch has to be visible before the pointer is read,
+    // so that the writer waits for this reader if it got the old table.
+    atomic_store(cos_reader, atomic_load(&cos_epoch));
+    return atomic_load(&cos_current);
+}
 
-            char* ip = strchr(buffer, '\t');
-            if (!ip) {
-                free(buffer);
-                return COS_INTERNAL_ERR;
-            }
-            ++ip;
+void cos_read_end() {
+    atomic_store(cos_reader, 0);
+}
 
-            char* ip_end = strchr(ip, '\t');
-            if (!ip_end) {
-                free(buffer);
-                return COS_INTERNAL_ERR;
-            }
-            *ip_end = ':';
+// Replaces the current table and frees the previous one once no reader can be using it.
+static void cos_publish(cos_table_t* table) {
+    cos_table_t* old = atomic_exchange(&cos_current, table);
+    uint64_t epoch = atomic_fetch_add(&cos_epoch, 1);
 
-            ip_end = strchr(ip_end, '\n');
-            if (!ip_end) {
-                free(buffer);
-                return COS_INTERNAL_ERR;
-            }
-            *ip_end = '\0';
+    // Readers, which entered in epoch or before, might hold old.
+    size_t readers = atomic_load(&cos_readers);
+    if (readers > COS_MAX_READERS)
+        readers = COS_MAX_READERS;
+    for (size_t i = 0; i < readers; ++i) {
+        for (;;) {
+            uint64_t reader_epoch = atomic_load(&cos_reader_epochs[i]);
+            if (reader_epoch == 0 || reader_epoch > epoch)
+                break;
 
-            size_t out_size = ip_end - ip;
-            *out_address = malloc(out_size + 1);
-            if (!*out_address) {
-                free(buffer);
-                return COS_INTERNAL_ERR;
-            }
+            struct timespec pause = {0, 1000000};
+            nanosleep(&pause, NULL);
+        }
+    }
+
+    cos_free(old);
+}
+
+static void cos_reload(const char* lookfilepath) {
+    cos_table_t* table;
+    if (cos_load(lookfilepath, &table) != COS_FOUND) {
+        // The old table is kept until the file can be read again.
+        fprintf(stderr, "Cannot reload corelated servers from %s\n", lookfilepath);
+        return;
+    }
+    cos_publish(table);
+}
 
-            if (strcpy(*out_address, ip) == NULL) {
-                free(*out_address);
-                free(buffer);
-                return COS_INTERNAL_ERR;
+static void* cos_watch_loop(void* arg) {
+    (void)arg;
+
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    int signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+
+    // The directory is watched, so that replacing the file by a rename is noticed too.
+    char path_copy[strlen(cos_watched_path) + 1];
+    strcpy(path_copy, cos_watched_path);
+    char name_copy[strlen(cos_watched_path) + 1];
+    strcpy(name_copy, cos_watched_path);
+    const char* directory = dirname(path_copy);
+    const char* name = basename(name_copy);
+
+    int inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd != -1
+        && inotify_add_watch(inotify_fd, directory, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) == -1) {
+        close(inotify_fd);
+        inotify_fd = -1;
+    }
+
+    struct pollfd fds[3];
+    fds[0].fd = cos_stop_pipe[0];
+    fds[0].events = POLLIN;
+    fds[1].fd = signal_fd;
+    fds[1].events = POLLIN;
+    fds[2].fd = inotify_fd;
+    fds[2].events = POLLIN;
+
+    bool pending = false;
+    for (;;) {
+        int ret = poll(fds, 3, pending ? COS_RELOAD_DELAY_MS : -1);
+        if (ret == -1)
+            continue;
+        if (ret == 0) {
+            // No more changes within the delay.
+            pending = false;
+            cos_reload(cos_watched_path);
+            continue;
+        }
+
+        if (fds[0].revents & POLLIN)
+            break;
+
+        if (fds[1].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            if (read(signal_fd, &info, sizeof(info)) == sizeof(info))
+                pending = true;
+        }
+
+        if (fds[2].revents & POLLIN) {
+            char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+            ssize_t events_size = read(inotify_fd, events, sizeof(events));
+
+            for (char* ptr = events; events_size > 0 && ptr < events + events_size;) {
+                struct inotify_event* event = (struct inotify_event*)ptr;
+                if (event->mask & IN_Q_OVERFLOW
+                    || (event->len > 0 && strcmp(event->name, name) == 0))
+                    pending = true;
+                ptr += sizeof(struct inotify_event) + event->len;
             }
-            free(buffer);
-            return COS_FOUND;
         }
     }
 
-    fclose(lookfile);
-    free(buffer);
-    return COS_NOT_FOUND;
+    if (signal_fd != -1)
+        close(signal_fd);
+    if (inotify_fd != -1)
+        close(inotify_fd);
+    return NULL;
+}
+
+int cos_watch(const char* lookfilepath, cos_table_t* table) {
+    atomic_store(&cos_current, table);
+
+    cos_watched_path = strdup(lookfilepath);
+    if (!cos_watched_path)
+        return COS_INTERNAL_ERR;
+
+    // SIGHUP is received only through the signalfd of the watching thread.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    if (pthread_sigmask(SIG_BLOCK, &signals, NULL) != 0)
+        return COS_INTERNAL_ERR;
+
+    if (pipe(cos_stop_pipe) != 0)
+        return COS_INTERNAL_ERR;
+
+    if (pthread_create(&cos_watcher, NULL, cos_watch_loop, NULL) != 0) {
+        close(cos_stop_pipe[0]);
+        close(cos_stop_pipe[1]);
+        cos_stop_pipe[0] = cos_stop_pipe[1] = -1;
+        return COS_INTERNAL_ERR;
+    }
+    return COS_FOUND;
+}
+
+void cos_unwatch() {
+    if (cos_stop_pipe[1] != -1) {
+        if (write(cos_stop_pipe[1], "", 1) == 1)
+            pthread_join(cos_watcher, NULL);
+        close(cos_stop_pipe[0]);
+        close(cos_stop_pipe[1]);
+        cos_stop_pipe[0] = cos_stop_pipe[1] = -1;
+    }
+
+    free(cos_watched_path);
+    cos_watched_path = NULL;
+    cos_free(atomic_exchange(&cos_current, NULL));
 }
@@ -1,6 +1,8 @@
 #ifndef CO_SERVERS_H
 #define CO_SERVERS_H
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,6 +11,114 @@
 #define COS_FOUND 0
 #define COS_NOT_FOUND 1
 
-int search_corelated_servers(const char* lookfilepath, const char* lookfor, char** out_address);
+///// Compiled index /////
+// The corelated servers file is compiled into a single image,
+// which is either built in memory or read from a file made by cos_compile.
+//
+// Layout: header, displacements, records, replicas, strings.
+// Resources are placed by a minimal perfect hash (hash and displace):
+// the resource's bucket holds a displacement d. When d >= 0, the record is
+// in slot mix(hash + seed + (d + 1) * COS_GOLDEN) % count, otherwise in slot -d - 1.
+// The string area holds the rendered "302 Found" response of every record,
+// the resource is the tail of its Location header.
+// Every entry of the file is a replica, those of a resource are consecutive, in the order of the file.
+// The record of a resource describes its first entry.
 
-#endif /* CO_SERVERS_H */
\ No newline at end of file
+#define COS_MAGIC   "COSIDX1"
+#define COS_VERSION 2
+
+typedef struct cos_header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t count;        // Number of distinct resources, equal to the number of records.
+    uint32_t buckets;      // Number of displacements.
+    uint32_t seed;
+    uint64_t displace_off; // int32_t[buckets]
+    uint64_t records_off;  // cos_record_t[count]
+    uint64_t replicas_off; // cos_replica_t[replica_count]
+    uint64_t replica_count;
+    uint64_t strings_off;
+    uint64_t strings_size;
+    uint64_t image_size;
+} cos_header_t;
+
+typedef struct cos_record {
+    uint64_t response_off;  // Offset of the response in the string area.
+    uint32_t response_size;
+    uint32_t resource_len;
+    uint32_t ip;            // IPv4 address in network byte order.
+    uint16_t port;
+    uint16_t reserved;
+    uint32_t replica_first;
+    uint32_t replica_count;
+} cos_record_t;
+
+// An entry of a resource listed in the file, possibly one of several.
+typedef struct cos_replica {
+    uint64_t response_off;
+    uint32_t response_size;
+    uint32_t ip;
+    uint16_t port;
+    uint16_t reserved[3];
+} cos_replica_t;
+
+// Index of the corelated servers file.
+// Lookups by cos_search give the first occurrence of every resource, all are kept as its replicas.
+typedef struct cos_table {
+    const char* image;
+    size_t image_size;
+
+    const cos_header_t* header;
+    const int32_t* displace;
+    const cos_record_t* records;
+    const cos_replica_t* replicas;
+    const char* strings;
+} cos_table_t;
+
+// Reads the corelated servers file in lookfilepath into a newly allocated *out_table.
+// The file is either in the text form "resource TAB ip TAB port" or compiled by cos_compile,
+// in which case its image is read as it is, and checked against its header.
+// Malformed lines of the text form are reported to stderr and skipped, a CR before the newline is ignored.
+int cos_load(const char* lookfilepath, cos_table_t** out_table);
+
+// Compiles the text corelated servers file in lookfilepath into outpath.
+// outpath is replaced atomically.
+int cos_compile(const char* lookfilepath, const char* outpath);
+
+// Looks for the resource lookfor in table.
+// On COS_FOUND *out_response points to the complete redirect response, owned by the table.
+int cos_search(const cos_table_t* table, const char* lookfor, const char** out_response, size_t* out_response_size);
+
+// Looks for the resource lookfor in table.
+// On COS_FOUND *out_ip (in network byte order) and *out_port are the server holding it.
+int cos_search_server(const cos_table_t* table, const char* lookfor, uint32_t* out_ip, uint16_t* out_port);
+
+// Looks for the resource lookfor in table.
+// On COS_FOUND *out_replicas are its *out_count entries, owned by the table.
+// The response of a replica is at table->strings + response_off.
+int cos_search_replicas(const cos_table_t* table, const char* lookfor, const cos_replica_t** out_replicas, uint32_t* out_count);
+
+void cos_free(cos_table_t* table);
+
+///// Reloading /////
+// The current table is published with an atomic pointer swap.
+// Readers never lock, a replaced table is freed only after every reader,
+// which could have seen it, has left its read section (epoch based reclamation).
+
+#define COS_MAX_READERS 256
+
+// Publishes table as the current one and starts a thread reloading it
+// from lookfilepath on SIGHUP, or whenever the file is replaced or rewritten.
+// Has to be called before any other thread is created, as it blocks SIGHUP.
+// A file caught in the middle of a rewrite is refused, the current table is kept until the next change.
+int cos_watch(const char* lookfilepath, cos_table_t* table);
+
+// Stops the reloading thread and frees the current table.
+void cos_unwatch();
+
+// Enters a read section and returns the current table, valid until cos_read_end.
+// Returns NULL if there are more than COS_MAX_READERS reading threads.
+const cos_table_t* cos_read_begin();
+void cos_read_end();
+
+#endif /* CO_SERVERS_H */
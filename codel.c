@@ -0,0 +1,73 @@
+#include "codel.h"
+
+#include <math.h>
+
+static uint64_t codel_control_law(const codel_t* codel, uint64_t t) {
+    return t + codel->interval_ns / sqrt(codel->count);
+}
+
+void codel_init(codel_t* codel, uint64_t target_ms, uint64_t interval_ms) {
+    codel->target_ns = target_ms * 1000000;
+    codel->interval_ns = interval_ms * 1000000;
+    codel->above = false;
+    codel->observed = 0;
+    codel->first_above = 0;
+    codel->dropping = false;
+    codel->drop_next = 0;
+    codel->count = 0;
+    codel->last_count = 0;
+}
+
+void codel_observe(codel_t* codel, uint64_t delay_ns, uint64_t now) {
+    if (codel->target_ns == 0)
+        return;
+
+    codel->observed = now;
+    if (delay_ns < codel->target_ns) {
+        codel->above = false;
+        codel->first_above = 0;
+        return;
+    }
+
+    codel->above = true;
+    if (codel->first_above == 0)
+        codel->first_above = now + codel->interval_ns;
+}
+
+bool codel_shed(codel_t* codel, uint64_t now) {
+    if (codel->target_ns == 0)
+        return false;
+
+    if (codel->above && now - codel->observed >= codel->interval_ns) {
+        codel->above = false;
+        codel->first_above = 0;
+    }
+    bool ok_to_drop = codel->above && codel->first_above != 0 && now >= codel->first_above;
+
+    if (codel->dropping) {
+        if (!ok_to_drop) {
+            codel->dropping = false;
+            return false;
+        }
+        if (now < codel->drop_next)
+            return false;
+
+        codel->count++;
+        codel->drop_next = codel_control_law(codel, codel->drop_next);
+        return true;
+    }
+
+    if (!ok_to_drop)
+        return false;
+
+    // Dropping resumed soon after it stopped starts from near the rate it had.
+    codel->dropping = true;
+    uint32_t delta = codel->count - codel->last_count;
+    if (delta > 1 && now - codel->drop_next < 16 * codel->interval_ns)
+        codel->count = delta;
+    else
+        codel->count = 1;
+    codel->last_count = codel->count;
+    codel->drop_next = codel_control_law(codel, now);
+    return true;
+}
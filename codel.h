@@ -0,0 +1,36 @@
+#ifndef CODEL_H
+#define CODEL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Admission control by queueing delay, after CoDel (RFC 8289).
+// The delay of every served request is observed. Once it has stayed above target
+// for a whole interval, new requests are shed, at a rate growing with the square root
+// of the number shed, until the delay falls below target again.
+// Nothing observed for an interval counts as an empty queue, as all the requests may have been shed.
+// Not thread-safe, every event loop keeps its own.
+
+typedef struct codel {
+    uint64_t target_ns;
+    uint64_t interval_ns;
+
+    bool above;               // The last delay observed was above target.
+    uint64_t observed;        // When the last delay was observed.
+    uint64_t first_above;     // When the delay will have been above target for an interval, 0 if it is not.
+    bool dropping;
+    uint64_t drop_next;
+    uint32_t count;           // Requests shed in this dropping state.
+    uint32_t last_count;
+} codel_t;
+
+// A target of 0 disables shedding.
+void codel_init(codel_t* codel, uint64_t target_ms, uint64_t interval_ms);
+
+// Observes the queueing delay of a request, now being monotonic time in nanoseconds.
+void codel_observe(codel_t* codel, uint64_t delay_ns, uint64_t now);
+
+// Tells whether the request arriving now should be shed.
+bool codel_shed(codel_t* codel, uint64_t now);
+
+#endif /* CODEL_H */
@@ -0,0 +1,326 @@
+#include "config.h"
+#include "accesslog.h"
+#include "balance.h"
+#include "bufpool.h"
+#include "fcache.h"
+#include "hotset.h"
+#include "iopool.h"
+#include "server.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Options without a short form
+#define OPT_HUGEPAGES       256
+#define OPT_CACHE_SIZE      257
+#define OPT_CACHE_MAX_FILE  258
+#define OPT_IO_THREADS      259
+#define OPT_IO_QUEUE        260
+#define OPT_IO_TIMEOUT      261
+#define OPT_METRICS         262
+#define OPT_QUANTUM         263
+#define OPT_SMALL_RESPONSE  264
+#define OPT_CONNS_PER_IP    265
+#define OPT_REQUESTS_PER_IP 266
+#define OPT_BYTES_PER_IP    267
+#define OPT_CODEL_TARGET    268
+#define OPT_CODEL_INTERVAL  269
+#define OPT_ACCESS_LOG      270
+#define OPT_ACCESS_LOG_SIZE 271
+#define OPT_PROXY           272
+#define OPT_COS_BALANCE     273
+#define OPT_BUNDLE          274
+#define OPT_UNIX            275
+#define OPT_NO_TCP          276
+#define OPT_BACKLOG         277
+#define OPT_DEFER_ACCEPT    278
+#define OPT_FASTOPEN        279
+#define OPT_HANDOFF         280
+#define OPT_DRAIN_TIMEOUT   281
+#define OPT_HOTSET          282
+#define OPT_WARM_RATE       283
+#define OPT_WARM_SOCKET     284
+#define OPT_PREFETCH        285
+#define OPT_BUFFER_POOL     286
+
+static const struct option long_options[] = {
+    {"hugepages", no_argument, NULL, OPT_HUGEPAGES},
+    {"buffer-pool", required_argument, NULL, OPT_BUFFER_POOL},
+    {"bundle", no_argument, NULL, OPT_BUNDLE},
+    {"workers", required_argument, NULL, 'w'},
+    {"unix", required_argument, NULL, OPT_UNIX},
+    {"no-tcp", no_argument, NULL, OPT_NO_TCP},
+    {"backlog", required_argument, NULL, OPT_BACKLOG},
+    {"defer-accept", required_argument, NULL, OPT_DEFER_ACCEPT},
+    {"fastopen", required_argument, NULL, OPT_FASTOPEN},
+    {"handoff", required_argument, NULL, OPT_HANDOFF},
+    {"drain-timeout", required_argument, NULL, OPT_DRAIN_TIMEOUT},
+    {"hotset", required_argument, NULL, OPT_HOTSET},
+    {"warm-rate", required_argument, NULL, OPT_WARM_RATE},
+    {"warm-socket", required_argument, NULL, OPT_WARM_SOCKET},
+    {"prefetch", no_argument, NULL, OPT_PREFETCH},
+    {"cache-size", required_argument, NULL, OPT_CACHE_SIZE},
+    {"cache-max-file", required_argument, NULL, OPT_CACHE_MAX_FILE},
+    {"io-threads", required_argument, NULL, OPT_IO_THREADS},
+    {"io-queue", required_argument, NULL, OPT_IO_QUEUE},
+    {"io-timeout", required_argument, NULL, OPT_IO_TIMEOUT},
+    {"metrics", required_argument, NULL, OPT_METRICS},
+    {"proxy", no_argument, NULL, OPT_PROXY},
+    {"cos-balance", required_argument, NULL, OPT_COS_BALANCE},
+    {"access-log", required_argument, NULL, OPT_ACCESS_LOG},
+    {"access-log-size", required_argument, NULL, OPT_ACCESS_LOG_SIZE},
+    {"quantum", required_argument, NULL, OPT_QUANTUM},
+    {"small-response", required_argument, NULL, OPT_SMALL_RESPONSE},
+    {"codel-target", required_argument, NULL, OPT_CODEL_TARGET},
+    {"codel-interval", required_argument, NULL, OPT_CODEL_INTERVAL},
+    {"max-conns-per-ip", required_argument, NULL, OPT_CONNS_PER_IP},
+    {"requests-per-ip", required_argument, NULL, OPT_REQUESTS_PER_IP},
+    {"bytes-per-ip", required_argument, NULL, OPT_BYTES_PER_IP},
+    {NULL, 0, NULL, 0}
+};
+
+void print_usage(const char* program) {
+    fprintf(stderr, "Usage: %s [options] server's_filesystem_root corelated_servers [port_number]\n", program);
+    fprintf(stderr,
+        "Options:\n"
+        "  --hugepages             back I/O buffers with huge pages\n"
+        "  --buffer-pool BYTES     let the request buffers and the file chunks take up to BYTES each;\n"
+        "                          streamed files wait for a chunk beyond (default: %d)\n"
+        "  --bundle                serve filesystem, a bundle packed by bundle_pack, instead of a directory\n"
+        "  -w, --workers N         serve connections with N event loops (default: one per CPU)\n"
+        "  --unix PATH             listen also on the Unix domain socket PATH, up to %d times\n"
+        "  --no-tcp                do not listen on the port, only on the Unix domain sockets\n"
+        "  --backlog N             let N connections wait to be accepted (default: %d)\n"
+        "  --defer-accept S        accept TCP connections once their request comes, waiting up to S seconds,\n"
+        "                          0 disables (default: 0)\n"
+        "  --fastopen N            accept TCP Fast Open, with up to N requests pending, 0 disables (default: 0)\n"
+        "  --handoff PATH          take over the listening sockets and the cache from the process serving\n"
+        "                          on the control socket PATH, then serve it for the next one\n"
+        "  --drain-timeout MS      after handing off, let the connections finish for up to MS (default: %d)\n"
+        "  --hotset FILE           keep the files requested most in FILE and warm them on startup\n"
+        "  --warm-rate BYTES       warm at most BYTES of files per second, 0 means no limit (default: %d)\n"
+        "  --warm-socket PATH      warm the files, whose targets are written to the control socket PATH\n"
+        "  --prefetch              warm the files referred to by the HTML pages served, before they are requested\n"
+        "  --cache-size BYTES      cache up to BYTES of file contents, 0 disables (default: %d)\n"
+        "  --cache-max-file BYTES  do not cache files bigger than BYTES (default: %d)\n"
+        "  --io-threads N          run blocking file operations on N threads (default: %d)\n"
+        "  --io-queue N            queue at most N file operations, answer 503 beyond (default: %d)\n"
+        "  --io-timeout MS         answer 503 when a file operation waits longer than MS, 0 disables (default: 0)\n"
+        "  --metrics FILE          write the counters to FILE every second\n"
+        "  --proxy                 fetch files of the corelated servers, instead of redirecting to them\n"
+        "  --cos-balance MODE      choose among the corelated servers of a file by MODE: first,\n"
+        "                          round-robin, latency or client-hash (default: first)\n"
+        "  --access-log FILE       log the requests to FILE\n"
+        "  --access-log-size BYTES rotate the access log to FILE.1 at BYTES, 0 disables (default: %d)\n"
+        "  --quantum BYTES         let a connection send BYTES in its turn (default: %d)\n"
+        "  --small-response BYTES  serve responses up to BYTES before bigger ones, 0 disables (default: %d)\n"
+        "  --codel-target MS       shed requests with 503 while they wait longer than MS, 0 disables (default: 0)\n"
+        "  --codel-interval MS     start shedding after the wait has exceeded the target for MS (default: %d)\n"
+        "  --max-conns-per-ip N    refuse a client's connections beyond N with 503\n"
+        "  --requests-per-ip N     answer a client's requests beyond N per second with 429\n"
+        "  --bytes-per-ip BYTES    send at most BYTES per second to a client\n",
+        BUFPOOL_DEFAULT_MAX_SIZE, CONFIG_MAX_UNIX, CONFIG_DEFAULT_BACKLOG, SERVER_DEFAULT_DRAIN_TIMEOUT, HOTSET_DEFAULT_WARM_RATE, FCACHE_DEFAULT_CAPACITY, FCACHE_DEFAULT_MAX_FILE, IOPOOL_DEFAULT_THREADS, IOPOOL_DEFAULT_DEPTH, ACCESSLOG_DEFAULT_MAX_SIZE,
+        SERVER_DEFAULT_QUANTUM, SERVER_DEFAULT_SMALL_RESPONSE, SERVER_DEFAULT_CODEL_INTERVAL);
+}
+
+// Parses a non-negative decimal number, returns false if arg is not one.
+static bool parse_size(const char* arg, size_t* out) {
+    char* end;
+    if (*arg < '0' || *arg > '9')
+        return false;
+    unsigned long long value = strtoull(arg, &end, 10);
+    if (*end != '\0')
+        return false;
+    *out = value;
+    return true;
+}
+
+int parse_config(int argc, char* argv[], config_t* out) {
+    out->hugepages = false;
+    out->buffer_pool = BUFPOOL_DEFAULT_MAX_SIZE;
+    out->bundle = false;
+    out->port = DEFAULT_HTTP_PORT;
+    out->tcp = true;
+    out->unix_count = 0;
+    out->backlog = CONFIG_DEFAULT_BACKLOG;
+    out->defer_accept = 0;
+    out->fastopen = 0;
+    out->handoff = NULL;
+    out->drain_timeout = SERVER_DEFAULT_DRAIN_TIMEOUT;
+    out->hotset = NULL;
+    out->warm_rate = HOTSET_DEFAULT_WARM_RATE;
+    out->warm_socket = NULL;
+    out->prefetch = false;
+    out->workers = 0;
+    out->cache_size = FCACHE_DEFAULT_CAPACITY;
+    out->cache_max_file = FCACHE_DEFAULT_MAX_FILE;
+    out->io_threads = IOPOOL_DEFAULT_THREADS;
+    out->io_queue = IOPOOL_DEFAULT_DEPTH;
+    out->io_timeout = 0;
+    out->metrics = NULL;
+    out->proxy = false;
+    out->cos_balance = BALANCE_FIRST;
+    out->access_log = NULL;
+    out->access_log_size = ACCESSLOG_DEFAULT_MAX_SIZE;
+    out->quantum = SERVER_DEFAULT_QUANTUM;
+    out->small_response = SERVER_DEFAULT_SMALL_RESPONSE;
+    out->codel_target = 0;
+    out->codel_interval = SERVER_DEFAULT_CODEL_INTERVAL;
+    out->max_conns_per_ip = 0;
+    out->requests_per_ip = 0;
+    out->bytes_per_ip = 0;
+
+    size_t value;
+    int option;
+    while ((option = getopt_long(argc, argv, "w:", long_options, NULL)) != -1) {
+        switch (option) {
+        case OPT_HUGEPAGES:
+            out->hugepages = true;
+            break;
+        case OPT_BUFFER_POOL:
+            if (!parse_size(optarg, &out->buffer_pool))
+                return CONFIG_ERR;
+            break;
+        case 'w':
+            if (!parse_size(optarg, &value) || value > CONFIG_MAX_WORKERS)
+                return CONFIG_ERR;
+            out->workers = value;
+            break;
+        case OPT_CACHE_SIZE:
+            if (!parse_size(optarg, &out->cache_size))
+                return CONFIG_ERR;
+            break;
+        case OPT_CACHE_MAX_FILE:
+            if (!parse_size(optarg, &out->cache_max_file))
+                return CONFIG_ERR;
+            break;
+        case OPT_IO_THREADS:
+            if (!parse_size(optarg, &value) || value == 0 || value > CONFIG_MAX_IO_THREADS)
+                return CONFIG_ERR;
+            out->io_threads = value;
+            break;
+        case OPT_IO_QUEUE:
+            if (!parse_size(optarg, &out->io_queue) || out->io_queue == 0)
+                return CONFIG_ERR;
+            break;
+        case OPT_IO_TIMEOUT:
+            if (!parse_size(optarg, &out->io_timeout))
+                return CONFIG_ERR;
+            break;
+        case OPT_METRICS:
+            out->metrics = optarg;
+            break;
+        case OPT_UNIX:
+            if (out->unix_count == CONFIG_MAX_UNIX)
+                return CONFIG_ERR;
+            out->unix_paths[out->unix_count++] = optarg;
+            break;
+        case OPT_NO_TCP:
+            out->tcp = false;
+            break;
+        case OPT_BACKLOG:
+            if (!parse_size(optarg, &out->backlog) || out->backlog == 0 || out->backlog > INT32_MAX)
+                return CONFIG_ERR;
+            break;
+        case OPT_DEFER_ACCEPT:
+            if (!parse_size(optarg, &out->defer_accept) || out->defer_accept > INT32_MAX)
+                return CONFIG_ERR;
+            break;
+        case OPT_FASTOPEN:
+            if (!parse_size(optarg, &out->fastopen) || out->fastopen > INT32_MAX)
+                return CONFIG_ERR;
+            break;
+        case OPT_HANDOFF:
+            out->handoff = optarg;
+            break;
+        case OPT_DRAIN_TIMEOUT:
+            if (!parse_size(optarg, &out->drain_timeout))
+                return CONFIG_ERR;
+            break;
+        case OPT_HOTSET:
+            out->hotset = optarg;
+            break;
+        case OPT_WARM_RATE:
+            if (!parse_size(optarg, &out->warm_rate))
+                return CONFIG_ERR;
+            break;
+        case OPT_WARM_SOCKET:
+            out->warm_socket = optarg;
+            break;
+        case OPT_PREFETCH:
+            out->prefetch = true;
+            break;
+        case OPT_BUNDLE:
+            out->bundle = true;
+            break;
+        case OPT_PROXY:
+            out->proxy = true;
+            break;
+        case OPT_COS_BALANCE:
+            if (strcmp(optarg, "first") == 0)
+                out->cos_balance = BALANCE_FIRST;
+            else if (strcmp(optarg, "round-robin") == 0)
+                out->cos_balance = BALANCE_ROUND_ROBIN;
+            else if (strcmp(optarg, "latency") == 0)
+                out->cos_balance = BALANCE_LATENCY;
+            else if (strcmp(optarg, "client-hash") == 0)
+                out->cos_balance = BALANCE_CLIENT_HASH;
+            else
+                return CONFIG_ERR;
+            break;
+        case OPT_ACCESS_LOG:
+            out->access_log = optarg;
+            break;
+        case OPT_ACCESS_LOG_SIZE:
+            if (!parse_size(optarg, &out->access_log_size))
+                return CONFIG_ERR;
+            break;
+        case OPT_QUANTUM:
+            if (!parse_size(optarg, &out->quantum) || out->quantum == 0)
+                return CONFIG_ERR;
+            break;
+        case OPT_SMALL_RESPONSE:
+            if (!parse_size(optarg, &out->small_response))
+                return CONFIG_ERR;
+            break;
+        case OPT_CODEL_TARGET:
+            if (!parse_size(optarg, &out->codel_target))
+                return CONFIG_ERR;
+            break;
+        case OPT_CODEL_INTERVAL:
+            if (!parse_size(optarg, &out->codel_interval) || out->codel_interval == 0)
+                return CONFIG_ERR;
+            break;
+        case OPT_CONNS_PER_IP:
+            if (!parse_size(optarg, &out->max_conns_per_ip) || out->max_conns_per_ip > UINT32_MAX)
+                return CONFIG_ERR;
+            break;
+        case OPT_REQUESTS_PER_IP:
+            if (!parse_size(optarg, &out->requests_per_ip))
+                return CONFIG_ERR;
+            break;
+        case OPT_BYTES_PER_IP:
+            if (!parse_size(optarg, &out->bytes_per_ip))
+                return CONFIG_ERR;
+            break;
+        default:
+            return CONFIG_ERR;
+        }
+    }
+
+    int positional = argc - optind;
+    if (positional < 2 || positional > 3)
+        return CONFIG_ERR;
+    // The server has to listen somewhere.
+    if (!out->tcp && out->unix_count == 0)
+        return CONFIG_ERR;
+
+    out->filesystem = argv[optind];
+    out->corelated_servers = argv[optind + 1];
+    if (positional == 3)
+        out->port = (uint16_t)atoi(argv[optind + 2]);
+
+    return CONFIG_OK;
+}
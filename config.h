@@ -0,0 +1,69 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define DEFAULT_HTTP_PORT 8080
+#define CONFIG_DEFAULT_BACKLOG 511   // Capped by the kernel, at net.core.somaxconn.
+#define CONFIG_MAX_WORKERS 128   // Below the limit of threads reading the corelated servers.
+#define CONFIG_MAX_IO_THREADS 1024
+#define CONFIG_MAX_UNIX 8           // Unix domain sockets listened on.
+
+// Return codes //
+#define CONFIG_ERR -1
+#define CONFIG_OK   0
+
+// Settings of the server, taken from the command line.
+typedef struct server_config {
+    const char* filesystem;         // Root directory of served files, or their bundle.
+    const char* corelated_servers;  // Text or compiled corelated servers file.
+    uint16_t port;
+    bool tcp;                       // Listen on the port, false if only on Unix domain sockets.
+    const char* unix_paths[CONFIG_MAX_UNIX];   // Unix domain sockets listened on, besides the port.
+    unsigned unix_count;
+    size_t backlog;                 // Connections waiting to be accepted, per listening socket.
+    size_t defer_accept;            // Seconds a TCP connection can wait for its request before it is accepted, 0 disables.
+    size_t fastopen;                // TCP Fast Open requests pending at once, 0 disables.
+    const char* handoff;            // Control socket, over which the listening sockets are handed to a new process, NULL if none.
+    size_t drain_timeout;           // Milliseconds the connections can take to finish, after the handoff.
+    const char* hotset;             // Manifest of the files requested most, warmed on startup, NULL if none.
+    size_t warm_rate;               // Bytes per second the files are warmed at, 0 means no limit.
+    const char* warm_socket;        // Control socket, on which files to warm are accepted, NULL if none.
+    bool prefetch;                  // Warm the files referred to by the HTML pages served.
+
+    bool bundle;                    // The filesystem is a bundle file, see bundle.h.
+    bool hugepages;                 // Back the buffer pool with huge pages.
+    size_t buffer_pool;             // Bytes of the buffers of each class, see bufpool.h.
+    unsigned workers;               // Event loops serving connections, 0 means one per CPU.
+    size_t cache_size;              // Bytes of file contents kept in memory, 0 disables the cache.
+    size_t cache_max_file;          // Bigger files are read from the disk on every request.
+
+    unsigned io_threads;            // Threads running blocking file operations.
+    size_t io_queue;                // File operations queued or running at once, beyond them 503 is sent.
+    size_t io_timeout;              // Milliseconds a file operation can wait in the queue, 0 means no limit.
+    const char* metrics;            // File the counters are written to, NULL if none.
+    int cos_balance;                // Choice among the replicas of a corelated resource, BALANCE_* from balance.h.
+    bool proxy;                     // Fetch files of the corelated servers instead of redirecting to them.
+    const char* access_log;         // File the requests are logged to, NULL if none.
+    size_t access_log_size;         // Bytes, at which the access log is rotated, 0 disables.
+
+    size_t quantum;                 // Bytes a connection can send in its turn.
+    size_t small_response;          // Responses up to this size are served before bigger ones.
+    size_t codel_target;            // Milliseconds of queueing delay, above which requests are shed, 0 disables.
+    size_t codel_interval;          // Milliseconds the delay has to stay above the target, before shedding starts.
+
+    // Limits per client address, 0 means no limit.
+    size_t max_conns_per_ip;
+    size_t requests_per_ip;         // Per second.
+    size_t bytes_per_ip;            // Per second.
+} config_t;
+
+// Reads argv into out, filling unspecified settings with defaults.
+// The command line is: [options] filesystem corelated_servers [port]
+int parse_config(int argc, char* argv[], config_t* out);
+
+void print_usage(const char* program);
+
+#endif /* CONFIG_H */
@@ -0,0 +1,17 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "co_servers.h"
+
+// Compiles a corelated servers file into the image mmap-ed by serwer.
+int main(int argc, char* argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s corelated_servers output_file\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (cos_compile(argv[1], argv[2]) != COS_FOUND) {
+        fprintf(stderr, "%s: cannot compile %s into %s\n", argv[0], argv[1], argv[2]);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
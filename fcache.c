@@ -0,0 +1,514 @@
+#include "fcache.h"
+#include "file.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FCACHE_BUCKETS 16384   // Power of 2.
+#define FCACHE_EXPORT_MAGIC "SRWCACH1"
+
+// Entry states //
+#define FCACHE_FILLING 0
+#define FCACHE_READY   1
+#define FCACHE_FAILED  2
+
+struct fcache_entry {
+    struct fcache_entry* hash_next;
+    struct fcache_entry* lru_prev;    // More recently used
+    struct fcache_entry* lru_next;
+    uint64_t hash;
+
+    int state;
+    int result;          // FCACHE_* return code of a failed fill.
+    bool linked;         // Whether the entry can still be found, otherwise it is freed with its last reference.
+    size_t refs;
+    fcache_waiter_t* waiters;
+
+    char* data;
+    size_t size;
+    struct timespec mtime;
+
+    size_t path_len;
+    char path[];
+};
+
+// Everything below is guarded by fcache_mutex.
+static pthread_mutex_t fcache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fcache_filled = PTHREAD_COND_INITIALIZER;
+static fcache_entry_t* fcache_buckets[FCACHE_BUCKETS];
+static fcache_entry_t* fcache_lru_head = NULL;
+static fcache_entry_t* fcache_lru_tail = NULL;
+static size_t fcache_capacity = 0;
+static size_t fcache_max_file = 0;
+static fcache_stats_t fcache_counters;
+
+static uint64_t fcache_hash(const char* path, size_t path_len) {
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < path_len; ++i) {
+        hash ^= (unsigned char)path[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static fcache_entry_t* fcache_find(const char* path, size_t path_len, uint64_t hash) {
+    fcache_entry_t* entry = fcache_buckets[hash & (FCACHE_BUCKETS - 1)];
+    while (entry != NULL) {
+        if (entry->hash == hash && entry->path_len == path_len && memcmp(entry->path, path, path_len) == 0)
+            return entry;
+        entry = entry->hash_next;
+    }
+    return NULL;
+}
+
+static void fcache_free(fcache_entry_t* entry) {
+    free(entry->data);
+    free(entry);
+}
+
+static void fcache_lru_remove(fcache_entry_t* entry) {
+    if (entry->lru_prev)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        fcache_lru_head = entry->lru_next;
+    if (entry->lru_next)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        fcache_lru_tail = entry->lru_prev;
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void fcache_lru_push(fcache_entry_t* entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = fcache_lru_head;
+    if (fcache_lru_head)
+        fcache_lru_head->lru_prev = entry;
+    else
+        fcache_lru_tail = entry;
+    fcache_lru_head = entry;
+}
+
+// Makes the entry unreachable, it is freed once nobody holds it.
+static void fcache_unlink(fcache_entry_t* entry) {
+    if (!entry->linked)
+        return;
+
+    fcache_entry_t** link = &fcache_buckets[entry->hash & (FCACHE_BUCKETS - 1)];
+    while (*link != entry)
+        link = &(*link)->hash_next;
+    *link = entry->hash_next;
+    entry->linked = false;
+
+    if (entry->state == FCACHE_READY) {
+        fcache_lru_remove(entry);
+        fcache_counters.entries--;
+        fcache_counters.bytes -= entry->size;
+    }
+    if (entry->refs == 0)
+        fcache_free(entry);
+}
+
+// Whether entry holds the current contents of the file described by meta.
+static bool fcache_fresh(const fcache_entry_t* entry, const fs_meta_t* meta) {
+    return entry->size == (size_t)meta->size
+        && entry->mtime.tv_sec == meta->mtime.tv_sec && entry->mtime.tv_nsec == meta->mtime.tv_nsec;
+}
+
+static void fcache_evict() {
+    while (fcache_counters.bytes > fcache_capacity && fcache_lru_tail) {
+        fcache_unlink(fcache_lru_tail);
+        fcache_counters.evictions++;
+    }
+}
+
+// Reads the file into entry, without holding the lock.
+static int fcache_fill(const char* filesystem, char* filename, arena_t* arena, fcache_entry_t* entry) {
+    int fd;
+    int ret = take_file(filesystem, filename, arena, &fd);
+    if (ret == FILE_NOT_FOUND)
+        return FCACHE_NOT_FOUND;
+    if (ret == FILE_REACHOUT)
+        return FCACHE_REACHOUT;
+    if (ret != FILE_OK)
+        return FCACHE_INTERNAL_ERR;
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0) {
+        close(fd);
+        return FCACHE_INTERNAL_ERR;
+    }
+    if ((size_t)file_stat.st_size > fcache_max_file) {
+        close(fd);
+        return FCACHE_BYPASS;
+    }
+
+    char* data = malloc(file_stat.st_size > 0 ? file_stat.st_size : 1);
+    if (!data) {
+        close(fd);
+        return FCACHE_INTERNAL_ERR;
+    }
+
+    // A file growing meanwhile is cut at the size it had, the entry is replaced on the next lookup.
+    size_t has_read;
+    ret = take_filecontent_chunk(fd, file_stat.st_size, &data, &has_read);
+    close(fd);
+    if (ret == FILE_INTERNAL_ERR) {
+        free(data);
+        return FCACHE_INTERNAL_ERR;
+    }
+
+    entry->data = data;
+    entry->size = has_read;
+    entry->mtime = file_stat.st_mtim;
+    return FCACHE_HIT;
+}
+
+int fcache_init(size_t capacity, size_t max_file) {
+    fcache_capacity = capacity;
+    fcache_max_file = capacity > 0 ? max_file : 0;
+    if (fcache_max_file > fcache_capacity)
+        fcache_max_file = fcache_capacity;
+    return FCACHE_HIT;
+}
+
+int fcache_get(const char* filesystem, char* filename, arena_t* arena, fcache_entry_t** out_entry) {
+    fs_meta_t meta;
+    int ret = take_file_meta(filesystem, filename, arena, &meta);
+    if (ret == FILE_NOT_FOUND)
+        return FCACHE_NOT_FOUND;
+    if (ret == FILE_REACHOUT)
+        return FCACHE_REACHOUT;
+    if (ret != FILE_OK)
+        return FCACHE_INTERNAL_ERR;
+    if (!meta.regular)
+        return FCACHE_NOT_FOUND;
+
+    if (fcache_capacity == 0 || (size_t)meta.size > fcache_max_file) {
+        pthread_mutex_lock(&fcache_mutex);
+        fcache_counters.bypassed++;
+        pthread_mutex_unlock(&fcache_mutex);
+        return FCACHE_BYPASS;
+    }
+
+    size_t path_len = strlen(filename);
+    uint64_t hash = fcache_hash(filename, path_len);
+
+    pthread_mutex_lock(&fcache_mutex);
+    fcache_entry_t* entry = fcache_find(filename, path_len, hash);
+    if (entry && entry->state == FCACHE_READY && !fcache_fresh(entry, &meta)) {
+        fcache_unlink(entry);
+        fcache_counters.stale++;
+        entry = NULL;
+    }
+
+    if (entry) {
+        entry->refs++;
+        if (entry->state == FCACHE_FILLING) {
+            fcache_counters.coalesced++;
+            while (entry->state == FCACHE_FILLING)
+                pthread_cond_wait(&fcache_filled, &fcache_mutex);
+        }
+        else {
+            fcache_counters.hits++;
+            fcache_lru_remove(entry);
+            fcache_lru_push(entry);
+        }
+
+        ret = entry->state == FCACHE_READY ? FCACHE_HIT : entry->result;
+        pthread_mutex_unlock(&fcache_mutex);
+
+        if (ret != FCACHE_HIT) {
+            fcache_release(entry);
+            return ret;
+        }
+        *out_entry = entry;
+        return FCACHE_HIT;
+    }
+
+    // This lookup reads the file, later ones for the same file wait for it.
+    entry = calloc(1, sizeof(fcache_entry_t) + path_len + 1);
+    if (!entry) {
+        pthread_mutex_unlock(&fcache_mutex);
+        return FCACHE_INTERNAL_ERR;
+    }
+    entry->hash = hash;
+    entry->state = FCACHE_FILLING;
+    entry->linked = true;
+    entry->refs = 1;
+    entry->path_len = path_len;
+    memcpy(entry->path, filename, path_len + 1);
+
+    fcache_entry_t** bucket = &fcache_buckets[hash & (FCACHE_BUCKETS - 1)];
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    fcache_counters.misses++;
+    pthread_mutex_unlock(&fcache_mutex);
+
+    ret = fcache_fill(filesystem, filename, arena, entry);
+
+    pthread_mutex_lock(&fcache_mutex);
+    fcache_waiter_t* waiters = entry->waiters;
+    entry->waiters = NULL;
+    if (ret == FCACHE_HIT) {
+        entry->state = FCACHE_READY;
+        fcache_lru_push(entry);
+        fcache_counters.entries++;
+        fcache_counters.bytes += entry->size;
+    }
+    else {
+        entry->state = FCACHE_FAILED;
+        entry->result = ret;
+        fcache_unlink(entry);
+    }
+    for (fcache_waiter_t* waiter = waiters; waiter != NULL; waiter = waiter->next) {
+        waiter->result = ret;
+        if (ret == FCACHE_HIT) {
+            waiter->entry = entry;
+        }
+        else {
+            waiter->entry = NULL;
+            entry->refs--;   // This lookup still holds the entry.
+        }
+    }
+    if (ret == FCACHE_HIT)
+        fcache_evict();
+    pthread_cond_broadcast(&fcache_filled);
+    pthread_mutex_unlock(&fcache_mutex);
+
+    while (waiters != NULL) {
+        fcache_waiter_t* waiter = waiters;
+        waiters = waiter->next;
+        waiter->wake(waiter);
+    }
+
+    if (ret != FCACHE_HIT) {
+        fcache_release(entry);
+        return ret;
+    }
+    *out_entry = entry;
+    return FCACHE_HIT;
+}
+
+int fcache_try_get(const char* filename, fcache_waiter_t* waiter, fcache_entry_t** out_entry) {
+    fs_meta_t meta;
+    int ret = take_file_meta_indexed(filename, &meta);
+    if (ret == FILE_NOT_FOUND)
+        return FCACHE_NOT_FOUND;
+    if (ret == FILE_REACHOUT)
+        return FCACHE_REACHOUT;
+    if (ret != FILE_OK)
+        return FCACHE_WOULD_BLOCK;
+    if (!meta.regular)
+        return FCACHE_NOT_FOUND;
+    if (fcache_capacity == 0 || (size_t)meta.size > fcache_max_file) {
+        pthread_mutex_lock(&fcache_mutex);
+        fcache_counters.bypassed++;
+        pthread_mutex_unlock(&fcache_mutex);
+        return FCACHE_BYPASS;
+    }
+
+    size_t path_len = strlen(filename);
+    uint64_t hash = fcache_hash(filename, path_len);
+
+    pthread_mutex_lock(&fcache_mutex);
+    fcache_entry_t* entry = fcache_find(filename, path_len, hash);
+    if (!entry || (entry->state == FCACHE_READY && !fcache_fresh(entry, &meta))) {
+        pthread_mutex_unlock(&fcache_mutex);
+        return FCACHE_WOULD_BLOCK;
+    }
+
+    entry->refs++;
+    if (entry->state == FCACHE_FILLING) {
+        fcache_counters.coalesced++;
+        waiter->next = entry->waiters;
+        entry->waiters = waiter;
+        pthread_mutex_unlock(&fcache_mutex);
+        return FCACHE_PENDING;
+    }
+
+    fcache_counters.hits++;
+    fcache_lru_remove(entry);
+    fcache_lru_push(entry);
+    pthread_mutex_unlock(&fcache_mutex);
+
+    *out_entry = entry;
+    return FCACHE_HIT;
+}
+
+int fcache_warm(const char* filesystem, char* filename, arena_t* arena, size_t* out_size) {
+    fcache_entry_t* entry;
+    int ret = fcache_get(filesystem, filename, arena, &entry);
+    if (ret == FCACHE_HIT) {
+        *out_size = entry->size;
+        fcache_release(entry);
+        return FCACHE_HIT;
+    }
+    if (ret != FCACHE_BYPASS)
+        return ret;
+
+    int fd;
+    ret = take_file(filesystem, filename, arena, &fd);
+    if (ret == FILE_NOT_FOUND)
+        return FCACHE_NOT_FOUND;
+    if (ret == FILE_REACHOUT)
+        return FCACHE_REACHOUT;
+    if (ret != FILE_OK)
+        return FCACHE_INTERNAL_ERR;
+    if (take_filesize(fd, out_size) != FILE_OK) {
+        close(fd);
+        return FCACHE_INTERNAL_ERR;
+    }
+    posix_fadvise(fd, 0, *out_size, POSIX_FADV_WILLNEED);
+    close(fd);
+    return FCACHE_BYPASS;
+}
+
+void fcache_release(fcache_entry_t* entry) {
+    pthread_mutex_lock(&fcache_mutex);
+    if (--entry->refs == 0 && !entry->linked)
+        fcache_free(entry);
+    pthread_mutex_unlock(&fcache_mutex);
+}
+
+const char* fcache_data(const fcache_entry_t* entry) {
+    return entry->data;
+}
+
+size_t fcache_size(const fcache_entry_t* entry) {
+    return entry->size;
+}
+
+void fcache_stats(fcache_stats_t* out_stats) {
+    pthread_mutex_lock(&fcache_mutex);
+    *out_stats = fcache_counters;
+    pthread_mutex_unlock(&fcache_mutex);
+}
+
+// Record of a file in an export, followed by its path and its contents.
+typedef struct fcache_record {
+    uint64_t path_len;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+} fcache_record_t;
+
+static int fcache_write(int fd, const void* data, size_t size) {
+    while (size > 0) {
+        ssize_t ret = write(fd, data, size);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return FCACHE_INTERNAL_ERR;
+        data = (const char*)data + ret;
+        size -= ret;
+    }
+    return FCACHE_HIT;
+}
+
+int fcache_export(int fd) {
+    // The entries are held, so that they are written without the lock.
+    pthread_mutex_lock(&fcache_mutex);
+    size_t count = fcache_counters.entries;
+    fcache_entry_t** entries = malloc((count > 0 ? count : 1) * sizeof(fcache_entry_t*));
+    if (!entries) {
+        pthread_mutex_unlock(&fcache_mutex);
+        return FCACHE_INTERNAL_ERR;
+    }
+    count = 0;
+    for (fcache_entry_t* entry = fcache_lru_tail; entry != NULL; entry = entry->lru_prev) {
+        entry->refs++;
+        entries[count++] = entry;
+    }
+    pthread_mutex_unlock(&fcache_mutex);
+
+    int ret = fcache_write(fd, FCACHE_EXPORT_MAGIC, 8);
+    for (size_t i = 0; i < count; ++i) {
+        fcache_entry_t* entry = entries[i];
+        fcache_record_t record = {
+            .path_len = entry->path_len,
+            .size = entry->size,
+            .mtime_sec = entry->mtime.tv_sec,
+            .mtime_nsec = entry->mtime.tv_nsec
+        };
+        if (ret == FCACHE_HIT)
+            ret = fcache_write(fd, &record, sizeof(record));
+        if (ret == FCACHE_HIT)
+            ret = fcache_write(fd, entry->path, entry->path_len);
+        if (ret == FCACHE_HIT)
+            ret = fcache_write(fd, entry->data, entry->size);
+        fcache_release(entry);
+    }
+    free(entries);
+    return ret;
+}
+
+int fcache_import(const char* data, size_t size) {
+    if (size < 8 || memcmp(data, FCACHE_EXPORT_MAGIC, 8) != 0)
+        return FCACHE_INTERNAL_ERR;
+    if (fcache_capacity == 0)
+        return FCACHE_HIT;
+    size_t offset = 8;
+
+    while (offset < size) {
+        fcache_record_t record;
+        if (size - offset < sizeof(record))
+            return FCACHE_INTERNAL_ERR;
+        memcpy(&record, data + offset, sizeof(record));
+        offset += sizeof(record);
+        if (record.path_len > size - offset || record.size > size - offset - record.path_len)
+            return FCACHE_INTERNAL_ERR;
+        const char* path = data + offset;
+        const char* contents = path + record.path_len;
+        offset += record.path_len + record.size;
+        if (record.size > fcache_max_file)
+            continue;
+
+        fcache_entry_t* entry = calloc(1, sizeof(fcache_entry_t) + record.path_len + 1);
+        char* copy = malloc(record.size > 0 ? record.size : 1);
+        if (!entry || !copy) {
+            free(entry);
+            free(copy);
+            return FCACHE_INTERNAL_ERR;
+        }
+        memcpy(copy, contents, record.size);
+        entry->hash = fcache_hash(path, record.path_len);
+        entry->state = FCACHE_READY;
+        entry->linked = true;
+        entry->data = copy;
+        entry->size = record.size;
+        entry->mtime.tv_sec = record.mtime_sec;
+        entry->mtime.tv_nsec = record.mtime_nsec;
+        entry->path_len = record.path_len;
+        memcpy(entry->path, path, record.path_len);
+
+        // The more recently used files come later, they push the older ones out.
+        // A file cached already is kept.
+        pthread_mutex_lock(&fcache_mutex);
+        if (fcache_find(entry->path, entry->path_len, entry->hash)) {
+            pthread_mutex_unlock(&fcache_mutex);
+            fcache_free(entry);
+            continue;
+        }
+        fcache_entry_t** bucket = &fcache_buckets[entry->hash & (FCACHE_BUCKETS - 1)];
+        entry->hash_next = *bucket;
+        *bucket = entry;
+        fcache_lru_push(entry);
+        fcache_counters.entries++;
+        fcache_counters.bytes += entry->size;
+        fcache_evict();
+        pthread_mutex_unlock(&fcache_mutex);
+    }
+    return FCACHE_HIT;
+}
+
+void fcache_destroy() {
+    pthread_mutex_lock(&fcache_mutex);
+    while (fcache_lru_tail)
+        fcache_unlink(fcache_lru_tail);
+    pthread_mutex_unlock(&fcache_mutex);
+}
@@ -0,0 +1,85 @@
+#ifndef FCACHE_H
+#define FCACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "arena.h"
+
+// Cache of the contents of small files.
+// Concurrent misses of one file are coalesced (single flight): the first request
+// reads the file, the others wait for it and share the same copy.
+// Entries are checked against the file's size and modification time on every lookup,
+// the least recently used ones are evicted above the capacity.
+
+// Return codes //
+#define FCACHE_INTERNAL_ERR -1
+#define FCACHE_HIT           0
+#define FCACHE_NOT_FOUND     1
+#define FCACHE_REACHOUT      2
+#define FCACHE_BYPASS        3   // The file is not cached, eg. it is too big. The caller should read it itself.
+#define FCACHE_WOULD_BLOCK   4   // Answering needs the disk, fcache_get has to be called where blocking is fine.
+#define FCACHE_PENDING       5   // Another lookup is reading the file, the waiter is woken when it is done.
+
+#define FCACHE_DEFAULT_CAPACITY (256 * 1048576)
+#define FCACHE_DEFAULT_MAX_FILE (16 * 1048576)
+
+typedef struct fcache_entry fcache_entry_t;
+
+// A lookup waiting for a file read by another one, see fcache_try_get.
+typedef struct fcache_waiter {
+    struct fcache_waiter* next;
+    void (*wake)(struct fcache_waiter* waiter);  // Called by the reading thread, with no lock held.
+    int result;                                  // FCACHE_HIT or the result of the failed read.
+    fcache_entry_t* entry;                       // Held on FCACHE_HIT, until released.
+} fcache_waiter_t;
+
+typedef struct fcache_stats {
+    uint64_t hits;
+    uint64_t misses;       // Lookups which have read the file.
+    uint64_t coalesced;    // Lookups which have waited for another one reading the file.
+    uint64_t stale;        // Entries replaced, because the file has changed.
+    uint64_t evictions;
+    uint64_t bypassed;
+    uint64_t entries;
+    uint64_t bytes;
+} fcache_stats_t;
+
+// A capacity of 0 disables the cache, every lookup is bypassed.
+int fcache_init(size_t capacity, size_t max_file);
+
+// Looks up the file named filename, treating the directory supplied in filesystem as root.
+// On FCACHE_HIT *out_entry holds the contents until it is released.
+// Temporary data is allocated in arena.
+int fcache_get(const char* filesystem, char* filename, arena_t* arena, fcache_entry_t** out_entry);
+void fcache_release(fcache_entry_t* entry);
+
+// Warms the file for the requests to come: caches it, or if it is bypassed, asks the kernel
+// to read it ahead into the page cache. Returns FCACHE_HIT or FCACHE_BYPASS respectively,
+// with the file's size in *out_size, or the failure of fcache_get.
+int fcache_warm(const char* filesystem, char* filename, arena_t* arena, size_t* out_size);
+
+// Like fcache_get, but never blocks: answers only from the cache and the root index.
+// Returns FCACHE_WOULD_BLOCK when fcache_get is needed, or FCACHE_PENDING when
+// the file is being read, then waiter is woken with the result later.
+int fcache_try_get(const char* filename, fcache_waiter_t* waiter, fcache_entry_t** out_entry);
+
+const char* fcache_data(const fcache_entry_t* entry);
+size_t fcache_size(const fcache_entry_t* entry);
+
+void fcache_stats(fcache_stats_t* out_stats);
+
+// Writes the cached files to fd, from the least recently used one, for another process to import them.
+// Lookups go on meanwhile, the files cached in the meantime may be left out.
+int fcache_export(int fd);
+
+// Caches the files exported into data, up to the capacity. They are checked against the disk
+// on their lookups as any other entry. Returns FCACHE_INTERNAL_ERR if data is malformed,
+// the files before the malformed one are kept.
+int fcache_import(const char* data, size_t size);
+
+// Frees every entry, none can be held.
+void fcache_destroy();
+
+#endif /* FCACHE_H */
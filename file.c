@@ -1,5 +1,7 @@
 #include "file.h"
 
+#include <unistd.h>
+
 int is_file(const char* filepath) {
     struct stat file_stat;
     stat(filepath, &file_stat);
@@ -38,61 +40,132 @@ static bool verify_file_contained_in_root(const char* filename) {
     return true;
 }
 
-int take_file(const char* filesystem, char* filename, FILE** out_fptr) {
-    // Verify if filename doesn't try to get outside the root directory
-    if (!verify_file_contained_in_root(filename))
-        return FILE_REACHOUT;
-    
+int take_normal_path(const char* filename, arena_t* arena, char** out_path) {
+    char* path = arena_alloc(arena, strlen(filename) + 2);
+    if (!path) return FILE_INTERNAL_ERR;
+
+    size_t size = 0;
+    bool directory = false;  // Whether the last segment names a directory, like "", . or .. do.
+    const char* segment = filename;
+    while (*segment != '\0') {
+        while (*segment == '/')
+            ++segment;
+        const char* end = strchr(segment, '/');
+        size_t segment_len = end ? (size_t)(end - segment) : strlen(segment);
+
+        directory = segment_len == 0 || (segment[0] == '.' && (segment_len == 1 || (segment_len == 2 && segment[1] == '.')));
+        if (segment_len == 2 && segment[0] == '.' && segment[1] == '.') {
+            if (size == 0) return FILE_REACHOUT;
+            while (path[--size] != '/');
+        }
+        else if (!directory) {
+            path[size++] = '/';
+            memcpy(path + size, segment, segment_len);
+            size += segment_len;
+        }
+        segment += segment_len;
+    }
+
+    if (size == 0 || directory)
+        path[size++] = '/';
+    path[size] = '\0';
+    *out_path = path;
+    return FILE_OK;
+}
+
+// Writes filesystem + filename into *out_concat, allocated in arena.
+static int concat_path(const char* filesystem, const char* filename, arena_t* arena, char** out_concat) {
     size_t filesystem_len = strlen(filesystem);
     size_t filename_len = strlen(filename);
     size_t concat_len = filesystem_len + filename_len;
 
-    char* concat = malloc(concat_len + 1);
+    char* concat = arena_alloc(arena, concat_len + 1);
     if (!concat) return FILE_INTERNAL_ERR;
 
-    if (strcpy(concat, filesystem) == NULL) {
-        free(concat);
-        return FILE_INTERNAL_ERR;
-    }
-    if (strcpy(concat + filesystem_len, filename) == NULL) {
-        free(concat);
-        return FILE_INTERNAL_ERR;
-    }
+    memcpy(concat, filesystem, filesystem_len);
+    memcpy(concat + filesystem_len, filename, filename_len + 1);
 
-    if (is_file(concat) == FILE_NOT_FOUND) {
-        free(concat);
+    *out_concat = concat;
+    return FILE_OK;
+}
+
+int take_file_meta(const char* filesystem, const char* filename, arena_t* arena, fs_meta_t* out_meta) {
+    // Verify if filename doesn't try to get outside the root directory
+    if (!verify_file_contained_in_root(filename))
+        return FILE_REACHOUT;
+
+    int ret = fs_index_lookup(filename, out_meta);
+    if (ret == FS_INDEX_FOUND)
+        return FILE_OK;
+    if (ret == FS_INDEX_NOT_FOUND)
         return FILE_NOT_FOUND;
-    }
-    
-    *out_fptr = fopen(concat, "r");
-    free(concat);
 
-    if (!*out_fptr)
+    // The index cannot tell, the file has to be checked on the disk.
+    char* concat;
+    if (concat_path(filesystem, filename, arena, &concat) != FILE_OK)
         return FILE_INTERNAL_ERR;
+
+    struct stat file_stat;
+    if (stat(concat, &file_stat) != 0)
+        return FILE_NOT_FOUND;
+
+    out_meta->regular = S_ISREG(file_stat.st_mode);
+    out_meta->size = file_stat.st_size;
+    out_meta->mtime = file_stat.st_mtim;
     return FILE_OK;
 }
 
-int take_filesize(FILE* fptr, size_t* out_filesize) {
-    if (fseek (fptr, 0, SEEK_END) != 0)
+int take_file_meta_indexed(const char* filename, fs_meta_t* out_meta) {
+    if (!verify_file_contained_in_root(filename))
+        return FILE_REACHOUT;
+
+    int ret = fs_index_lookup(filename, out_meta);
+    if (ret == FS_INDEX_FOUND)
+        return FILE_OK;
+    if (ret == FS_INDEX_NOT_FOUND)
+        return FILE_NOT_FOUND;
+    return FILE_WOULD_BLOCK;
+}
+
+int take_file(const char* filesystem, char* filename, arena_t* arena, int* out_fd) {
+    fs_meta_t meta;
+    int ret = take_file_meta(filesystem, filename, arena, &meta);
+    if (ret != FILE_OK)
+        return ret;
+    if (!meta.regular)
+        return FILE_NOT_FOUND;
+
+    char* concat;
+    if (concat_path(filesystem, filename, arena, &concat) != FILE_OK)
         return FILE_INTERNAL_ERR;
 
-    if ((*out_filesize = ftell(fptr)) < 0)
+    // A plain descriptor, unlike a FILE, needs no allocation.
+    *out_fd = open(concat, O_RDONLY | O_CLOEXEC);
+
+    if (*out_fd == -1)
         return FILE_INTERNAL_ERR;
+    return FILE_OK;
+}
 
-    if (fseek(fptr, 0, SEEK_SET) != 0)
+int take_filesize(int fd, size_t* out_filesize) {
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0)
         return FILE_INTERNAL_ERR;
-    
+
+    *out_filesize = file_stat.st_size;
     return FILE_OK;
 }
 
-int take_filecontent_chunk(FILE* fptr, size_t chunk_size, char** out_content, size_t* out_hasread) {
-    *out_hasread = fread(*out_content, 1, chunk_size, fptr);
-    if (*out_hasread != chunk_size) {
-        if (feof(fptr) != 0)
+int take_filecontent_chunk(int fd, size_t chunk_size, char** out_content, size_t* out_hasread) {
+    *out_hasread = 0;
+    while (*out_hasread < chunk_size) {
+        ssize_t ret = read(fd, *out_content + *out_hasread, chunk_size - *out_hasread);
+        if (ret == 0)
             return FILE_EOF;
-        else
+        if (ret == -1)
             return FILE_INTERNAL_ERR;
+        *out_hasread += ret;
     }
-    
+
     return FILE_OK;
 }
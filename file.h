@@ -2,11 +2,14 @@
 #define FILE_H
 
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "arena.h"
+#include "fs_index.h"
 
 // Return codes //
 #define FILE_INTERNAL_ERR -1
@@ -14,21 +17,39 @@
 #define FILE_NOT_FOUND     1
 #define FILE_REACHOUT      2
 #define FILE_EOF           3
+#define FILE_WOULD_BLOCK   4   // Answering needs a system call, which can block.
 
 // Checks whether a file in filepath exists and is a file.
 int is_file(const char* filepath);
 
-// Opens a file named filename into out_fptr ion a readonly mode,
+// Writes the metadata of a file named filename to out_meta,
 // treating the directory supplied in filesystem as root.
-int take_file(const char* filesystem, char* filename, FILE** out_fptr);
+// Answered from the root index when it is started, otherwise the file is stat-ed.
+// Returns FILE_REACHOUT if filename points outside the root.
+// Temporary data is allocated in arena.
+int take_file_meta(const char* filesystem, const char* filename, arena_t* arena, fs_meta_t* out_meta);
 
-// Writes size of file fptr to out_filesize.
-// fptr should be open in read mode.
-int take_filesize(FILE* fptr, size_t* out_filesize);
+// Like take_file_meta, but only answers from the root index, without any system call.
+// Returns FILE_WOULD_BLOCK if the index cannot tell.
+int take_file_meta_indexed(const char* filename, fs_meta_t* out_meta);
 
-// Writes contents of file fptr to out_content.
-// fptr should be open in read mode.
+// Writes filename into *out_path, allocated in arena, with the . and .. segments and repeated slashes
+// collapsed, as the filesystem would resolve them. A trailing slash is kept.
+// Returns FILE_REACHOUT if filename points outside the root.
+int take_normal_path(const char* filename, arena_t* arena, char** out_path);
+
+// Opens a file named filename into out_fd in a readonly mode,
+// treating the directory supplied in filesystem as root.
+// Temporary data is allocated in arena.
+int take_file(const char* filesystem, char* filename, arena_t* arena, int* out_fd);
+
+// Writes size of file fd to out_filesize.
+// fd should be open in read mode.
+int take_filesize(int fd, size_t* out_filesize);
+
+// Writes contents of file fd to out_content.
+// fd should be open in read mode.
 // *out_content should have enough space to contain chunk_size bytes.
-int take_filecontent_chunk(FILE* fptr, size_t chunk_size, char** out_content, size_t* out_hasread);
+int take_filecontent_chunk(int fd, size_t chunk_size, char** out_content, size_t* out_hasread);
 
 #endif /* FILE_H */
\ No newline at end of file
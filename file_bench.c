@@ -0,0 +1,445 @@
+#define _GNU_SOURCE  // splice
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "arena.h"
+#include "bufpool.h"
+#include "file.h"
+#include "instrument.h"
+
+// Compares the ways of sending the body of a file: the server's own, chunks read by
+// take_filecontent_chunk into a body buffer and written, against pread, mmap, sendfile and splice.
+// Files of a range of sizes are created in the directory given. Each is requested over and over,
+// opened by take_file like the server does, and its body is sent over a loopback TCP connection
+// to a thread, which drains it.
+// Every run is made with the page cache hot, and cold: the pages of the file are dropped before
+// each request, which takes a directory on a disk, not on tmpfs.
+// The throughput is of the whole run, the CPU time is of the sending thread, the system calls
+// are counted per request by the linker's wrappers, see instrument.h.
+
+// Return codes //
+#define BENCH_ERR -1
+#define BENCH_OK   0
+
+#define BENCH_DEFAULT_CHUNK (1048576)             // The server's body buffer, BODY_CHUNK_SIZE.
+#define BENCH_BYTES         (256 * 1048576)       // Sent per run, unless the requests are given.
+#define BENCH_MIN_REQUESTS  16
+#define BENCH_MAX_REQUESTS  20000
+#define BENCH_MAX_SIZES     16
+#define BENCH_PIPE_CHUNK    (64 * 1024)           // Spliced at once, the default pipe size.
+#define BENCH_DRAIN         (1048576)
+
+#define BENCH_HOT  1
+#define BENCH_COLD 2
+
+typedef struct bench {
+    const char* dir;
+    arena_t arena;
+    char* chunk;               // Body buffer of the chunked reads.
+    size_t chunk_size;
+    int pipe[2];               // Of the splices.
+    int sock;                  // Sending end of the connection.
+} bench_t;
+
+typedef struct bench_strategy {
+    const char* name;
+    int (*send)(bench_t* bench, int fd, size_t size);
+} bench_strategy_t;
+
+typedef struct bench_drain {
+    int sock;
+    uint64_t bytes;
+} bench_drain_t;
+
+static const struct option long_options[] = {
+    {"sizes",    required_argument, NULL, 's'},
+    {"requests", required_argument, NULL, 'n'},
+    {"chunk",    required_argument, NULL, 'c'},
+    {"cold",     no_argument,       NULL, 'C'},
+    {"hot",      no_argument,       NULL, 'H'},
+    {NULL, 0, NULL, 0}
+};
+
+static void usage(const char* name) {
+    fprintf(stderr,
+            "Usage: %s [options] directory\n"
+            "Options:\n"
+            "  -s, --sizes LIST      send files of the comma separated sizes in bytes\n"
+            "                        (default: 4096,65536,1048576,16777216)\n"
+            "  -n, --requests N      request each file N times per run (default: %d MiB per run,\n"
+            "                        between %d and %d requests)\n"
+            "  -c, --chunk BYTES     read the chunks and the preads of BYTES (default: %d)\n"
+            "  --hot                 only run with the page cache hot\n"
+            "  --cold                only run with the page cache cold\n",
+            name, BENCH_BYTES / 1048576, BENCH_MIN_REQUESTS, BENCH_MAX_REQUESTS, BENCH_DEFAULT_CHUNK);
+}
+
+// Parses a non-negative decimal number, returns false if arg is not one.
+static bool parse_size(const char* arg, size_t* out) {
+    char* end;
+    if (*arg < '0' || *arg > '9')
+        return false;
+    unsigned long long value = strtoull(arg, &end, 10);
+    if (*end != '\0')
+        return false;
+    *out = value;
+    return true;
+}
+
+// Parses a comma separated list of at most BENCH_MAX_SIZES sizes, returns their count, 0 if arg is malformed.
+static size_t parse_sizes(const char* arg, size_t* out) {
+    size_t count = 0;
+    for (;;) {
+        char* end;
+        if (*arg < '0' || *arg > '9' || count == BENCH_MAX_SIZES)
+            return 0;
+        out[count++] = strtoull(arg, &end, 10);
+        if (*end == '\0')
+            return count;
+        if (*end != ',')
+            return 0;
+        arg = end + 1;
+    }
+}
+
+static uint64_t bench_now(clockid_t clock) {
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static int bench_write(int sock, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t ret = write(sock, data, size);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return BENCH_ERR;
+        data += ret;
+        size -= ret;
+    }
+    return BENCH_OK;
+}
+
+///// Strategies /////
+// The server's: the body buffer is filled from the file and written.
+static int bench_chunked(bench_t* bench, int fd, size_t size) {
+    while (size > 0) {
+        size_t read_size;
+        size_t wanted = size < bench->chunk_size ? size : bench->chunk_size;
+        if (take_filecontent_chunk(fd, wanted, &bench->chunk, &read_size) != FILE_OK
+            || bench_write(bench->sock, bench->chunk, read_size) != BENCH_OK)
+            return BENCH_ERR;
+        size -= read_size;
+    }
+    return BENCH_OK;
+}
+
+static int bench_pread(bench_t* bench, int fd, size_t size) {
+    off_t offset = 0;
+    while (size > 0) {
+        size_t wanted = size < bench->chunk_size ? size : bench->chunk_size;
+        ssize_t ret = pread(fd, bench->chunk, wanted, offset);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0 || bench_write(bench->sock, bench->chunk, ret) != BENCH_OK)
+            return BENCH_ERR;
+        offset += ret;
+        size -= ret;
+    }
+    return BENCH_OK;
+}
+
+static int bench_mmap(bench_t* bench, int fd, size_t size) {
+    if (size == 0)
+        return BENCH_OK;
+    char* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+        return BENCH_ERR;
+    int ret = bench_write(bench->sock, data, size);
+    munmap(data, size);
+    return ret;
+}
+
+static int bench_sendfile(bench_t* bench, int fd, size_t size) {
+    off_t offset = 0;
+    while (size > 0) {
+        ssize_t ret = sendfile(bench->sock, fd, &offset, size);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return BENCH_ERR;
+        size -= ret;
+    }
+    return BENCH_OK;
+}
+
+// Through a pipe, as the proxy splices the bodies of the corelated servers.
+static int bench_splice(bench_t* bench, int fd, size_t size) {
+    loff_t offset = 0;
+    while (size > 0) {
+        ssize_t piped = splice(fd, &offset, bench->pipe[1], NULL, size < BENCH_PIPE_CHUNK ? size : BENCH_PIPE_CHUNK,
+                               SPLICE_F_MOVE);
+        if (piped == -1 && errno == EINTR)
+            continue;
+        if (piped <= 0)
+            return BENCH_ERR;
+        size -= piped;
+        while (piped > 0) {
+            ssize_t ret = splice(bench->pipe[0], NULL, bench->sock, NULL, piped, SPLICE_F_MOVE);
+            if (ret == -1 && errno == EINTR)
+                continue;
+            if (ret <= 0)
+                return BENCH_ERR;
+            piped -= ret;
+        }
+    }
+    return BENCH_OK;
+}
+
+static const bench_strategy_t bench_strategies[] = {
+    {"chunked",  bench_chunked},
+    {"pread",    bench_pread},
+    {"mmap",     bench_mmap},
+    {"sendfile", bench_sendfile},
+    {"splice",   bench_splice},
+};
+
+///// Runs /////
+static void* bench_drain(void* arg) {
+    bench_drain_t* drain = arg;
+    char* buffer = malloc(BENCH_DRAIN);
+    if (!buffer)
+        return NULL;
+    for (;;) {
+        ssize_t ret = read(drain->sock, buffer, BENCH_DRAIN);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+        drain->bytes += ret;
+    }
+    free(buffer);
+    return NULL;
+}
+
+// Connects a pair of sockets over the loopback.
+static int bench_connect(int listener, int* out_send, int* out_receive) {
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getsockname(listener, (struct sockaddr*)&addr, &addr_len) != 0)
+        return BENCH_ERR;
+
+    int receive = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (receive == -1)
+        return BENCH_ERR;
+    if (connect(receive, (struct sockaddr*)&addr, addr_len) != 0) {
+        close(receive);
+        return BENCH_ERR;
+    }
+    int send = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+    if (send == -1) {
+        close(receive);
+        return BENCH_ERR;
+    }
+    *out_send = send;
+    *out_receive = receive;
+    return BENCH_OK;
+}
+
+// Requests the file of size bytes requests times, its pages dropped before each if cold.
+static int bench_run(bench_t* bench, int listener, const bench_strategy_t* strategy,
+                     char* filename, int file, size_t size, size_t requests, bool cold) {
+    bench_drain_t drain = {0};
+    if (bench_connect(listener, &bench->sock, &drain.sock) != BENCH_OK)
+        return BENCH_ERR;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, bench_drain, &drain) != 0) {
+        close(bench->sock);
+        close(drain.sock);
+        return BENCH_ERR;
+    }
+
+    instrument_counts_t counts = {0};
+    uint64_t syscalls = 0;
+    int ret = BENCH_OK;
+    uint64_t started = bench_now(CLOCK_MONOTONIC);
+    uint64_t cpu_started = bench_now(CLOCK_THREAD_CPUTIME_ID);
+    for (size_t i = 0; i < requests && ret == BENCH_OK; ++i) {
+        if (cold)
+            posix_fadvise(file, 0, 0, POSIX_FADV_DONTNEED);
+
+        instrument_enter(&counts);
+        int fd;
+        size_t filesize;
+        ret = take_file(bench->dir, filename, &bench->arena, &fd) == FILE_OK ? BENCH_OK : BENCH_ERR;
+        if (ret == BENCH_OK) {
+            ret = take_filesize(fd, &filesize) == FILE_OK && filesize == size ? strategy->send(bench, fd, size) : BENCH_ERR;
+            close(fd);
+        }
+        instrument_leave();
+        arena_reset(&bench->arena);
+        syscalls += counts.syscalls;
+        counts.syscalls = 0;
+    }
+    uint64_t cpu_ns = bench_now(CLOCK_THREAD_CPUTIME_ID) - cpu_started;
+
+    // The run ends, once the receiver has everything.
+    shutdown(bench->sock, SHUT_WR);
+    pthread_join(thread, NULL);
+    uint64_t wall_ns = bench_now(CLOCK_MONOTONIC) - started;
+    close(bench->sock);
+    close(drain.sock);
+    if (ret != BENCH_OK || drain.bytes != (uint64_t)size * requests)
+        return BENCH_ERR;
+
+    double bytes = (double)size * requests;
+    printf("%-10zu %-9s %-5s %9zu %10.1f %10.3f %12.1f\n", size, strategy->name, cold ? "cold" : "hot", requests,
+           bytes / 1e6 / (wall_ns / 1e9), bytes > 0 ? cpu_ns / 1e9 / (bytes / 1e9) : 0.0, (double)syscalls / requests);
+    fflush(stdout);
+    return BENCH_OK;
+}
+
+// Creates the file of size bytes, written through to the disk, so that its pages can be dropped.
+static int bench_create(const char* path, size_t size, int* out_file) {
+    int file = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (file == -1)
+        return BENCH_ERR;
+
+    char block[4096];
+    for (size_t i = 0; i < sizeof(block); ++i)
+        block[i] = 'a' + i % 26;
+    for (size_t written = 0; written < size;) {
+        size_t wanted = size - written < sizeof(block) ? size - written : sizeof(block);
+        if (bench_write(file, block, wanted) != BENCH_OK) {
+            close(file);
+            return BENCH_ERR;
+        }
+        written += wanted;
+    }
+    if (fsync(file) != 0) {
+        close(file);
+        return BENCH_ERR;
+    }
+    *out_file = file;
+    return BENCH_OK;
+}
+
+int main(int argc, char* argv[]) {
+    size_t sizes[BENCH_MAX_SIZES] = {4096, 65536, 1048576, 16777216};
+    size_t size_count = 4;
+    size_t requests = 0;
+    size_t chunk_size = BENCH_DEFAULT_CHUNK;
+    int caches = BENCH_HOT | BENCH_COLD;
+
+    int option;
+    while ((option = getopt_long(argc, argv, "s:n:c:", long_options, NULL)) != -1) {
+        switch (option) {
+        case 's':
+            size_count = parse_sizes(optarg, sizes);
+            if (size_count == 0) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'n':
+            if (!parse_size(optarg, &requests) || requests == 0) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'c':
+            if (!parse_size(optarg, &chunk_size) || chunk_size == 0) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'H':
+            caches = BENCH_HOT;
+            break;
+        case 'C':
+            caches = BENCH_COLD;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    bench_t bench = {.dir = argv[optind], .chunk_size = chunk_size};
+    if (bufpool_init(4096, chunk_size, BUFPOOL_DEFAULT_MAX_SIZE, false) != BUFPOOL_OK || arena_init(&bench.arena) != ARENA_OK
+        || !(bench.chunk = bufpool_get(BUFPOOL_BODY)) || pipe2(bench.pipe, O_CLOEXEC) != 0) {
+        fprintf(stderr, "%s: cannot allocate the buffers\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    if (listener == -1 || bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, 1) != 0) {
+        fprintf(stderr, "%s: cannot listen on the loopback\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf("%-10s %-9s %-5s %9s %10s %10s %12s\n", "size", "strategy", "cache", "requests", "MB/s", "cpu s/GB", "syscalls/req");
+    int status = EXIT_SUCCESS;
+    for (size_t i = 0; i < size_count && status == EXIT_SUCCESS; ++i) {
+        size_t size = sizes[i];
+        char filename[64];
+        snprintf(filename, sizeof(filename), "/file_bench-%zu", size);
+        size_t path_size = strlen(bench.dir) + strlen(filename) + 1;
+        char* path = malloc(path_size);
+        if (path)
+            snprintf(path, path_size, "%s%s", bench.dir, filename);
+        int file;
+        if (!path || bench_create(path, size, &file) != BENCH_OK) {
+            fprintf(stderr, "%s: cannot create a file of %zu bytes in %s\n", argv[0], size, bench.dir);
+            free(path);
+            status = EXIT_FAILURE;
+            break;
+        }
+
+        size_t count = requests;
+        if (count == 0) {
+            count = size > 0 ? BENCH_BYTES / size : BENCH_MAX_REQUESTS;
+            count = count < BENCH_MIN_REQUESTS ? BENCH_MIN_REQUESTS : count > BENCH_MAX_REQUESTS ? BENCH_MAX_REQUESTS : count;
+        }
+        for (int cache = BENCH_HOT; cache <= BENCH_COLD && status == EXIT_SUCCESS; cache <<= 1) {
+            if (!(caches & cache))
+                continue;
+            for (size_t s = 0; s < sizeof(bench_strategies) / sizeof(bench_strategies[0]); ++s) {
+                if (bench_run(&bench, listener, &bench_strategies[s], filename, file, size, count, cache == BENCH_COLD) != BENCH_OK) {
+                    fprintf(stderr, "%s: %s of %zu bytes has failed\n", argv[0], bench_strategies[s].name, size);
+                    status = EXIT_FAILURE;
+                    break;
+                }
+            }
+        }
+        close(file);
+        unlink(path);
+        free(path);
+    }
+
+    close(listener);
+    close(bench.pipe[0]);
+    close(bench.pipe[1]);
+    bufpool_put(BUFPOOL_BODY, bench.chunk);
+    arena_destroy(&bench.arena);
+    return status;
+}
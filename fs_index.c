@@ -0,0 +1,666 @@
+#include "fs_index.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#define FS_NODE_DIR   0
+#define FS_NODE_REG   1
+#define FS_NODE_LINK  2   // Not followed, lookups through symlinks are left to stat.
+#define FS_NODE_OTHER 3
+
+#define FS_INITIAL_BUCKETS 1024
+#define FS_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE \
+                       | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+typedef struct fs_node {
+    struct fs_node* parent;
+    struct fs_node* children;
+    struct fs_node* next;       // Siblings
+    struct fs_node* prev;
+    struct fs_node* hash_next;
+    uint64_t hash;
+
+    uint8_t type;
+    bool complete;              // A directory which is watched and whose entries all are indexed.
+    bool seen;                  // Marks entries found during a scan of the parent.
+    int wd;                     // inotify watch of a directory, -1 if none.
+    off_t size;
+    struct timespec mtime;
+
+    size_t name_len;
+    char name[];
+} fs_node_t;
+
+// Everything below is guarded by fs_lock.
+// Only the walkers and the watching thread modify the index.
+static pthread_rwlock_t fs_lock = PTHREAD_RWLOCK_INITIALIZER;
+static char* fs_root_path = NULL;
+static fs_node_t* fs_root = NULL;
+
+// Nodes are hashed by their parent and name.
+static fs_node_t** fs_buckets = NULL;
+static size_t fs_bucket_count = 0;    // Power of 2.
+static size_t fs_node_count = 0;
+
+// Watched directories by their watch descriptors.
+static fs_node_t** fs_watches = NULL;
+static size_t fs_watch_capacity = 0;
+
+static int fs_inotify_fd = -1;
+static int fs_stop_pipe[2] = {-1, -1};
+static pthread_t fs_watcher;
+static bool fs_watcher_started = false;
+
+///// Nodes /////
+static uint64_t fs_hash(const fs_node_t* parent, const char* name, size_t name_len) {
+    // FNV-1a, seeded with the parent
+    uint64_t hash = 14695981039346656037ULL ^ ((uint64_t)(uintptr_t)parent * 0x9E3779B97F4A7C15ULL);
+    for (size_t i = 0; i < name_len; ++i) {
+        hash ^= (unsigned char)name[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static fs_node_t* fs_find(const fs_node_t* parent, const char* name, size_t name_len) {
+    uint64_t hash = fs_hash(parent, name, name_len);
+    fs_node_t* node = fs_buckets[hash & (fs_bucket_count - 1)];
+
+    while (node != NULL) {
+        if (node->hash == hash && node->parent == parent && node->name_len == name_len
+            && memcmp(node->name, name, name_len) == 0)
+            return node;
+        node = node->hash_next;
+    }
+    return NULL;
+}
+
+static int fs_grow() {
+    size_t bucket_count = 2 * fs_bucket_count;
+    fs_node_t** buckets = calloc(bucket_count, sizeof(fs_node_t*));
+    if (!buckets)
+        return FS_INDEX_INTERNAL_ERR;
+
+    for (size_t i = 0; i < fs_bucket_count; ++i) {
+        fs_node_t* node = fs_buckets[i];
+        while (node != NULL) {
+            fs_node_t* next = node->hash_next;
+            node->hash_next = buckets[node->hash & (bucket_count - 1)];
+            buckets[node->hash & (bucket_count - 1)] = node;
+            node = next;
+        }
+    }
+
+    free(fs_buckets);
+    fs_buckets = buckets;
+    fs_bucket_count = bucket_count;
+    return FS_INDEX_FOUND;
+}
+
+static fs_node_t* fs_insert(fs_node_t* parent, const char* name, size_t name_len) {
+    if (fs_node_count >= fs_bucket_count && fs_grow() != FS_INDEX_FOUND)
+        return NULL;
+
+    fs_node_t* node = malloc(sizeof(fs_node_t) + name_len + 1);
+    if (!node)
+        return NULL;
+
+    memset(node, 0, sizeof(fs_node_t));
+    node->wd = -1;
+    node->name_len = name_len;
+    memcpy(node->name, name, name_len);
+    node->name[name_len] = '\0';
+
+    node->parent = parent;
+    node->hash = fs_hash(parent, name, name_len);
+    node->hash_next = fs_buckets[node->hash & (fs_bucket_count - 1)];
+    fs_buckets[node->hash & (fs_bucket_count - 1)] = node;
+
+    if (parent) {
+        node->next = parent->children;
+        if (parent->children)
+            parent->children->prev = node;
+        parent->children = node;
+    }
+
+    ++fs_node_count;
+    return node;
+}
+
+static void fs_unwatch(fs_node_t* node) {
+    if (node->wd == -1)
+        return;
+
+    inotify_rm_watch(fs_inotify_fd, node->wd);
+    if ((size_t)node->wd < fs_watch_capacity && fs_watches[node->wd] == node)
+        fs_watches[node->wd] = NULL;
+    node->wd = -1;
+    node->complete = false;
+}
+
+static int fs_watch(fs_node_t* node, int wd) {
+    if ((size_t)wd >= fs_watch_capacity) {
+        size_t capacity = fs_watch_capacity ? fs_watch_capacity : 256;
+        while ((size_t)wd >= capacity)
+            capacity *= 2;
+
+        fs_node_t** watches = realloc(fs_watches, capacity * sizeof(fs_node_t*));
+        if (!watches)
+            return FS_INDEX_INTERNAL_ERR;
+        memset(watches + fs_watch_capacity, 0, (capacity - fs_watch_capacity) * sizeof(fs_node_t*));
+        fs_watches = watches;
+        fs_watch_capacity = capacity;
+    }
+
+    if (node->wd != -1 && node->wd != wd && fs_watches[node->wd] == node)
+        fs_watches[node->wd] = NULL;
+    fs_watches[wd] = node;
+    node->wd = wd;
+    return FS_INDEX_FOUND;
+}
+
+// Removes node with its whole subtree.
+static void fs_remove(fs_node_t* node) {
+    while (node->children)
+        fs_remove(node->children);
+    fs_unwatch(node);
+
+    fs_node_t** link = &fs_buckets[node->hash & (fs_bucket_count - 1)];
+    while (*link != node)
+        link = &(*link)->hash_next;
+    *link = node->hash_next;
+
+    if (node->prev)
+        node->prev->next = node->next;
+    else if (node->parent)
+        node->parent->children = node->next;
+    if (node->next)
+        node->next->prev = node->prev;
+
+    --fs_node_count;
+    free(node);
+}
+
+static void fs_node_set(fs_node_t* node, const struct stat* file_stat) {
+    uint8_t type;
+    if (S_ISDIR(file_stat->st_mode))
+        type = FS_NODE_DIR;
+    else if (S_ISREG(file_stat->st_mode))
+        type = FS_NODE_REG;
+    else if (S_ISLNK(file_stat->st_mode))
+        type = FS_NODE_LINK;
+    else
+        type = FS_NODE_OTHER;
+
+    if (node->type == FS_NODE_DIR && type != FS_NODE_DIR) {
+        while (node->children)
+            fs_remove(node->children);
+        fs_unwatch(node);
+    }
+    if (type != FS_NODE_DIR)
+        node->complete = false;
+
+    node->type = type;
+    node->size = file_stat->st_size;
+    node->mtime = file_stat->st_mtim;
+}
+
+// Returns the node of name in parent, created if needed, with metadata from file_stat.
+static fs_node_t* fs_upsert(fs_node_t* parent, const char* name, const struct stat* file_stat) {
+    size_t name_len = strlen(name);
+    fs_node_t* node = fs_find(parent, name, name_len);
+    if (!node) {
+        node = fs_insert(parent, name, name_len);
+        if (!node)
+            return NULL;
+        node->type = FS_NODE_OTHER;
+    }
+
+    fs_node_set(node, file_stat);
+    return node;
+}
+
+// Returns the path of node (or of its entry name, if not NULL) as a newly allocated string.
+static char* fs_path(const fs_node_t* node, const char* name) {
+    size_t root_len = strlen(fs_root_path);
+    size_t name_len = name ? strlen(name) + 1 : 0;
+    size_t path_len = root_len + name_len;
+    for (const fs_node_t* it = node; it->parent; it = it->parent)
+        path_len += it->name_len + 1;
+
+    char* path = malloc(path_len + 1);
+    if (!path)
+        return NULL;
+
+    char* end = path + path_len;
+    *end = '\0';
+    if (name) {
+        end -= name_len;
+        *end = '/';
+        memcpy(end + 1, name, name_len - 1);
+    }
+    for (const fs_node_t* it = node; it->parent; it = it->parent) {
+        end -= it->name_len + 1;
+        *end = '/';
+        memcpy(end + 1, it->name, it->name_len);
+    }
+    memcpy(path, fs_root_path, root_len);
+    return path;
+}
+
+///// Walking /////
+typedef struct fs_walk {
+    fs_node_t** queue;
+    size_t queued;
+    size_t capacity;
+    size_t busy;               // Walkers scanning a directory, which may queue more.
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} fs_walk_t;
+
+typedef struct fs_entry {
+    char* name;
+    struct stat file_stat;
+} fs_entry_t;
+
+static void fs_walk_push(fs_walk_t* walk, fs_node_t* dir) {
+    pthread_mutex_lock(&walk->mutex);
+    if (walk->queued == walk->capacity) {
+        size_t capacity = walk->capacity ? 2 * walk->capacity : 64;
+        fs_node_t** queue = realloc(walk->queue, capacity * sizeof(fs_node_t*));
+        if (!queue) {
+            // The directory stays incomplete, so lookups in it are left to stat.
+            pthread_mutex_unlock(&walk->mutex);
+            return;
+        }
+        walk->queue = queue;
+        walk->capacity = capacity;
+    }
+    walk->queue[walk->queued++] = dir;
+    pthread_cond_signal(&walk->cond);
+    pthread_mutex_unlock(&walk->mutex);
+}
+
+static void fs_free_entries(fs_entry_t* entries, size_t count) {
+    for (size_t i = 0; i < count; ++i)
+        free(entries[i].name);
+    free(entries);
+}
+
+// Reads the entries of dir, then replaces its children with them.
+// Subdirectories are queued in walk.
+static void fs_scan(fs_walk_t* walk, fs_node_t* dir) {
+    pthread_rwlock_rdlock(&fs_lock);
+    char* path = fs_path(dir, NULL);
+    pthread_rwlock_unlock(&fs_lock);
+    if (!path)
+        return;
+
+    // The watch is added before reading, so that no later change is missed.
+    int wd = inotify_add_watch(fs_inotify_fd, path, FS_WATCH_MASK);
+
+    fs_entry_t* entries = NULL;
+    size_t count = 0, capacity = 0;
+    bool read_all = false;
+
+    DIR* handle = opendir(path);
+    free(path);
+    if (handle) {
+        read_all = true;
+        struct dirent* dirent;
+        errno = 0;
+        while ((dirent = readdir(handle)) != NULL) {
+            if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0)
+                continue;
+
+            if (count == capacity) {
+                capacity = capacity ? 2 * capacity : 64;
+                fs_entry_t* grown = realloc(entries, capacity * sizeof(fs_entry_t));
+                if (!grown) {
+                    read_all = false;
+                    break;
+                }
+                entries = grown;
+            }
+
+            fs_entry_t* entry = &entries[count];
+            if (fstatat(dirfd(handle), dirent->d_name, &entry->file_stat, AT_SYMLINK_NOFOLLOW) != 0)
+                continue;  // Removed in the meantime.
+            entry->name = strdup(dirent->d_name);
+            if (!entry->name) {
+                read_all = false;
+                break;
+            }
+            ++count;
+        }
+        if (errno != 0)
+            read_all = false;
+        closedir(handle);
+    }
+
+    pthread_rwlock_wrlock(&fs_lock);
+    for (fs_node_t* child = dir->children; child; child = child->next)
+        child->seen = false;
+
+    for (size_t i = 0; i < count; ++i) {
+        fs_node_t* child = fs_upsert(dir, entries[i].name, &entries[i].file_stat);
+        if (!child) {
+            read_all = false;
+            continue;
+        }
+        child->seen = true;
+        if (child->type == FS_NODE_DIR)
+            fs_walk_push(walk, child);
+    }
+
+    if (read_all) {
+        fs_node_t* child = dir->children;
+        while (child) {
+            fs_node_t* next = child->next;
+            if (!child->seen)
+                fs_remove(child);
+            child = next;
+        }
+    }
+
+    if (wd != -1 && fs_watch(dir, wd) == FS_INDEX_FOUND)
+        dir->complete = read_all;
+    else
+        dir->complete = false;
+    pthread_rwlock_unlock(&fs_lock);
+
+    fs_free_entries(entries, count);
+}
+
+static void* fs_walker(void* arg) {
+    fs_walk_t* walk = arg;
+
+    pthread_mutex_lock(&walk->mutex);
+    for (;;) {
+        while (walk->queued == 0 && walk->busy > 0)
+            pthread_cond_wait(&walk->cond, &walk->mutex);
+        if (walk->queued == 0)
+            break;
+
+        fs_node_t* dir = walk->queue[--walk->queued];
+        ++walk->busy;
+        pthread_mutex_unlock(&walk->mutex);
+
+        fs_scan(walk, dir);
+
+        pthread_mutex_lock(&walk->mutex);
+        --walk->busy;
+    }
+    pthread_cond_broadcast(&walk->cond);
+    pthread_mutex_unlock(&walk->mutex);
+    return NULL;
+}
+
+// Rescans the subtree of dir with the given number of threads.
+static void fs_walk(fs_node_t* dir, int threads) {
+    fs_walk_t walk;
+    memset(&walk, 0, sizeof(walk));
+    pthread_mutex_init(&walk.mutex, NULL);
+    pthread_cond_init(&walk.cond, NULL);
+    fs_walk_push(&walk, dir);
+
+    pthread_t walkers[threads];
+    int started = 0;
+    for (int i = 1; i < threads; ++i)
+        if (pthread_create(&walkers[started], NULL, fs_walker, &walk) == 0)
+            ++started;
+
+    fs_walker(&walk);
+    for (int i = 0; i < started; ++i)
+        pthread_join(walkers[i], NULL);
+
+    free(walk.queue);
+    pthread_mutex_destroy(&walk.mutex);
+    pthread_cond_destroy(&walk.cond);
+}
+
+///// Watching /////
+// Updates the entry name of dir after an event.
+static void fs_refresh(fs_node_t* dir, const char* name) {
+    pthread_rwlock_rdlock(&fs_lock);
+    char* path = fs_path(dir, name);
+    pthread_rwlock_unlock(&fs_lock);
+    if (!path)
+        return;
+
+    struct stat file_stat;
+    int ret = lstat(path, &file_stat);
+    int err = errno;
+    free(path);
+
+    fs_node_t* rescan = NULL;
+    pthread_rwlock_wrlock(&fs_lock);
+    fs_node_t* child = fs_find(dir, name, strlen(name));
+    if (ret != 0) {
+        if (err == ENOENT || err == ENOTDIR) {
+            if (child)
+                fs_remove(child);
+        }
+        else {
+            // The entry cannot be checked now, so lookups in dir are left to stat.
+            dir->complete = false;
+        }
+    }
+    else {
+        child = fs_upsert(dir, name, &file_stat);
+        if (!child)
+            dir->complete = false;
+        else if (child->type == FS_NODE_DIR && !child->complete)
+            rescan = child;
+    }
+    pthread_rwlock_unlock(&fs_lock);
+
+    // A new directory is indexed by this thread alone, the only one changing the index.
+    if (rescan)
+        fs_walk(rescan, 1);
+}
+
+static void fs_handle_event(const struct inotify_event* event) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        // Events were lost, the whole tree has to be compared with the disk.
+        fs_walk(fs_root, FS_INDEX_WALKERS);
+        return;
+    }
+
+    if (event->wd < 0 || (size_t)event->wd >= fs_watch_capacity)
+        return;
+    fs_node_t* dir = fs_watches[event->wd];
+    if (!dir)
+        return;
+
+    if (event->mask & IN_IGNORED) {
+        pthread_rwlock_wrlock(&fs_lock);
+        fs_watches[event->wd] = NULL;
+        dir->wd = -1;
+        dir->complete = false;
+        pthread_rwlock_unlock(&fs_lock);
+        return;
+    }
+
+    if (event->len > 0)
+        fs_refresh(dir, event->name);
+}
+
+static void* fs_watch_loop(void* arg) {
+    (void)arg;
+
+    struct pollfd fds[2];
+    fds[0].fd = fs_stop_pipe[0];
+    fds[0].events = POLLIN;
+    fds[1].fd = fs_inotify_fd;
+    fds[1].events = POLLIN;
+
+    char events[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        if (poll(fds, 2, -1) == -1)
+            continue;
+        if (fds[0].revents & POLLIN)
+            break;
+
+        ssize_t events_size;
+        while ((events_size = read(fs_inotify_fd, events, sizeof(events))) > 0) {
+            for (char* ptr = events; ptr < events + events_size;) {
+                struct inotify_event* event = (struct inotify_event*)ptr;
+                fs_handle_event(event);
+                ptr += sizeof(struct inotify_event) + event->len;
+            }
+        }
+    }
+    return NULL;
+}
+
+///// Interface /////
+int fs_index_start(const char* root) {
+    struct stat root_stat;
+    if (stat(root, &root_stat) != 0 || !S_ISDIR(root_stat.st_mode))
+        return FS_INDEX_INTERNAL_ERR;
+
+    fs_root_path = strdup(root);
+    fs_bucket_count = FS_INITIAL_BUCKETS;
+    fs_buckets = calloc(fs_bucket_count, sizeof(fs_node_t*));
+    fs_inotify_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (!fs_root_path || !fs_buckets || fs_inotify_fd == -1 || pipe(fs_stop_pipe) != 0) {
+        fs_index_stop();
+        return FS_INDEX_INTERNAL_ERR;
+    }
+
+    // No lookups happen before the index is started, yet the walkers need the lock.
+    pthread_rwlock_wrlock(&fs_lock);
+    fs_node_t* root_node = fs_insert(NULL, "", 0);
+    if (root_node)
+        fs_node_set(root_node, &root_stat);
+    pthread_rwlock_unlock(&fs_lock);
+    if (!root_node) {
+        fs_index_stop();
+        return FS_INDEX_INTERNAL_ERR;
+    }
+
+    fs_walk(root_node, FS_INDEX_WALKERS);
+
+    if (pthread_create(&fs_watcher, NULL, fs_watch_loop, NULL) != 0) {
+        fs_index_stop();
+        return FS_INDEX_INTERNAL_ERR;
+    }
+    fs_watcher_started = true;
+
+    // Published last, lookups are answered only by a watched index.
+    pthread_rwlock_wrlock(&fs_lock);
+    fs_root = root_node;
+    pthread_rwlock_unlock(&fs_lock);
+    return FS_INDEX_FOUND;
+}
+
+int fs_index_lookup(const char* target, fs_meta_t* out_meta) {
+    int ret = FS_INDEX_FOUND;
+    pthread_rwlock_rdlock(&fs_lock);
+
+    fs_node_t* node = fs_root;
+    if (!node || *target != '/') {
+        ret = FS_INDEX_UNKNOWN;
+        goto out;
+    }
+
+    const char* component = target;
+    while (*component != '\0') {
+        ++component;  // Skip the '/'
+        const char* component_end = strchr(component, '/');
+        if (!component_end)
+            component_end = component + strlen(component);
+        size_t component_len = component_end - component;
+
+        // Anything following a file, even "." or "", is an error (ENOTDIR).
+        if (node->type == FS_NODE_LINK) {
+            ret = FS_INDEX_UNKNOWN;
+            goto out;
+        }
+        if (node->type != FS_NODE_DIR) {
+            ret = FS_INDEX_NOT_FOUND;
+            goto out;
+        }
+        if (!node->complete) {
+            ret = FS_INDEX_UNKNOWN;
+            goto out;
+        }
+
+        if (component_len == 0 || (component_len == 1 && component[0] == '.')) {
+            // Stays in the same directory.
+        }
+        else if (component_len == 2 && component[0] == '.' && component[1] == '.') {
+            if (node->parent)
+                node = node->parent;
+        }
+        else {
+            node = fs_find(node, component, component_len);
+            if (!node) {
+                ret = FS_INDEX_NOT_FOUND;
+                goto out;
+            }
+        }
+        component = component_end;
+    }
+
+    if (node->type == FS_NODE_LINK) {
+        ret = FS_INDEX_UNKNOWN;
+        goto out;
+    }
+    out_meta->regular = node->type == FS_NODE_REG;
+    out_meta->size = node->size;
+    out_meta->mtime = node->mtime;
+
+out:
+    pthread_rwlock_unlock(&fs_lock);
+    return ret;
+}
+
+void fs_index_stop() {
+    if (fs_watcher_started) {
+        if (write(fs_stop_pipe[1], "", 1) == 1)
+            pthread_join(fs_watcher, NULL);
+        fs_watcher_started = false;
+    }
+
+    pthread_rwlock_wrlock(&fs_lock);
+    fs_root = NULL;
+    if (fs_buckets) {
+        for (size_t i = 0; i < fs_bucket_count; ++i) {
+            fs_node_t* node = fs_buckets[i];
+            while (node) {
+                fs_node_t* next = node->hash_next;
+                free(node);
+                node = next;
+            }
+        }
+    }
+    free(fs_buckets);
+    fs_buckets = NULL;
+    fs_bucket_count = 0;
+    fs_node_count = 0;
+    free(fs_watches);
+    fs_watches = NULL;
+    fs_watch_capacity = 0;
+    free(fs_root_path);
+    fs_root_path = NULL;
+    pthread_rwlock_unlock(&fs_lock);
+
+    if (fs_inotify_fd != -1)
+        close(fs_inotify_fd);
+    fs_inotify_fd = -1;
+    for (int i = 0; i < 2; ++i) {
+        if (fs_stop_pipe[i] != -1)
+            close(fs_stop_pipe[i]);
+        fs_stop_pipe[i] = -1;
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef FS_INDEX_H
+#define FS_INDEX_H
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+// In-memory namespace tree of the server's root directory.
+// Built at startup by a parallel walk, then kept current by inotify watches,
+// so that looking up a file costs no system calls.
+
+// Return codes //
+#define FS_INDEX_INTERNAL_ERR -1
+#define FS_INDEX_FOUND         0
+#define FS_INDEX_NOT_FOUND     1
+#define FS_INDEX_UNKNOWN       2   // The index cannot answer, eg. the path goes through a symlink
+                                   // or an unwatched directory. The caller has to stat the file.
+
+#define FS_INDEX_WALKERS 4         // Threads walking the directories at startup and after an overflow.
+
+// Metadata of a file in the root directory.
+typedef struct fs_meta {
+    bool regular;
+    off_t size;
+    struct timespec mtime;
+} fs_meta_t;
+
+// Indexes the directory root and starts the thread watching it.
+// Has to be called at most once.
+int fs_index_start(const char* root);
+
+// Looks up target, a path relative to the indexed root starting with '/'.
+int fs_index_lookup(const char* target, fs_meta_t* out_meta);
+
+// Stops watching and frees the index. Lookups fall back to FS_INDEX_UNKNOWN.
+void fs_index_stop();
+
+#endif /* FS_INDEX_H */
@@ -0,0 +1,598 @@
+#define _GNU_SOURCE  // memmem
+
+#include "h2.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct h2_hpack_entry {
+    size_t name_len;
+    size_t value_len;
+    char data[];              // The name and the value, each NUL-terminated.
+};
+
+typedef struct h2_static_entry {
+    const char* name;
+    const char* value;
+} h2_static_entry_t;
+
+// RFC 7541, Appendix A.
+static const h2_static_entry_t h2_static_table[] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+#define H2_STATIC_ENTRIES (sizeof(h2_static_table) / sizeof(h2_static_table[0]))
+
+// RFC 7541, Appendix B. The code is canonical, so the lengths of the symbols' codes define it.
+static const uint8_t h2_huffman_lengths[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+#define H2_HUFFMAN_EOS     256
+#define H2_HUFFMAN_LONGEST 30
+
+// Canonical decoding tables, built once.
+static uint32_t h2_huffman_first[H2_HUFFMAN_LONGEST + 1];    // The lowest code of each length.
+static uint16_t h2_huffman_count[H2_HUFFMAN_LONGEST + 1];    // Codes of each length.
+static uint16_t h2_huffman_offset[H2_HUFFMAN_LONGEST + 1];   // Of the length's first symbol in h2_huffman_symbols.
+static uint16_t h2_huffman_symbols[257];                     // Ordered by their codes.
+static pthread_once_t h2_huffman_once = PTHREAD_ONCE_INIT;
+
+static void h2_huffman_build() {
+    size_t position = 0;
+    uint32_t code = 0;
+    for (int length = 1; length <= H2_HUFFMAN_LONGEST; ++length) {
+        h2_huffman_first[length] = code;
+        h2_huffman_offset[length] = position;
+        for (int symbol = 0; symbol < 257; ++symbol) {
+            if (h2_huffman_lengths[symbol] == length)
+                h2_huffman_symbols[position++] = symbol;
+        }
+        h2_huffman_count[length] = position - h2_huffman_offset[length];
+        code = (code + h2_huffman_count[length]) << 1;
+    }
+}
+
+///// Frames /////
+uint32_t h2_read_u32(const uint8_t* in) {
+    return (uint32_t)in[0] << 24 | (uint32_t)in[1] << 16 | (uint32_t)in[2] << 8 | in[3];
+}
+
+void h2_write_u32(uint8_t* out, uint32_t value) {
+    out[0] = value >> 24;
+    out[1] = value >> 16;
+    out[2] = value >> 8;
+    out[3] = value;
+}
+
+void h2_read_frame(const uint8_t* in, h2_frame_t* out) {
+    out->length = (uint32_t)in[0] << 16 | (uint32_t)in[1] << 8 | in[2];
+    out->type = in[3];
+    out->flags = in[4];
+    out->stream = h2_read_u32(in + 5) & 0x7fffffff;
+}
+
+void h2_write_frame(uint8_t* out, uint32_t length, uint8_t type, uint8_t flags, uint32_t stream) {
+    out[0] = length >> 16;
+    out[1] = length >> 8;
+    out[2] = length;
+    out[3] = type;
+    out[4] = flags;
+    h2_write_u32(out + 5, stream);
+}
+
+void h2_write_setting(uint8_t* out, uint16_t id, uint32_t value) {
+    out[0] = id >> 8;
+    out[1] = id;
+    h2_write_u32(out + 2, value);
+}
+
+///// Settings /////
+void h2_settings_init(h2_settings_t* settings) {
+    settings->header_table_size = H2_TABLE_SIZE;
+    settings->enable_push = 1;
+    settings->max_concurrent_streams = UINT32_MAX;
+    settings->initial_window = H2_DEFAULT_WINDOW;
+    settings->max_frame = H2_DEFAULT_FRAME;
+    settings->max_header_list = UINT32_MAX;
+}
+
+int h2_settings_apply(h2_settings_t* settings, const uint8_t* payload, size_t size, uint32_t* out_error) {
+    if (size % H2_SETTING_SIZE != 0) {
+        *out_error = H2_FRAME_SIZE_ERROR;
+        return H2_ERR;
+    }
+
+    for (size_t i = 0; i < size; i += H2_SETTING_SIZE) {
+        uint16_t id = (uint16_t)payload[i] << 8 | payload[i + 1];
+        uint32_t value = h2_read_u32(payload + i + 2);
+        switch (id) {
+        case H2_SETTINGS_HEADER_TABLE_SIZE:
+            settings->header_table_size = value;
+            break;
+        case H2_SETTINGS_ENABLE_PUSH:
+            if (value > 1) {
+                *out_error = H2_PROTOCOL_ERROR;
+                return H2_ERR;
+            }
+            settings->enable_push = value;
+            break;
+        case H2_SETTINGS_MAX_CONCURRENT_STREAMS:
+            settings->max_concurrent_streams = value;
+            break;
+        case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+            if (value > H2_MAX_WINDOW) {
+                *out_error = H2_FLOW_CONTROL_ERROR;
+                return H2_ERR;
+            }
+            settings->initial_window = value;
+            break;
+        case H2_SETTINGS_MAX_FRAME_SIZE:
+            if (value < H2_DEFAULT_FRAME || value > H2_MAX_FRAME) {
+                *out_error = H2_PROTOCOL_ERROR;
+                return H2_ERR;
+            }
+            settings->max_frame = value;
+            break;
+        case H2_SETTINGS_MAX_HEADER_LIST_SIZE:
+            settings->max_header_list = value;
+            break;
+        default:
+            // Unknown settings are ignored.
+            break;
+        }
+    }
+    return H2_OK;
+}
+
+static int h2_base64url_value(char c) {
+    if (c >= 'A' && c <= 'Z')
+        return c - 'A';
+    if (c >= 'a' && c <= 'z')
+        return c - 'a' + 26;
+    if (c >= '0' && c <= '9')
+        return c - '0' + 52;
+    if (c == '-')
+        return 62;
+    if (c == '_')
+        return 63;
+    return -1;
+}
+
+int h2_base64url_decode(const char* in, size_t in_size, uint8_t* out, size_t capacity, size_t* out_size) {
+    // Padding is not used by base64url, but some clients send it.
+    while (in_size > 0 && in[in_size - 1] == '=')
+        in_size--;
+    if (in_size % 4 == 1 || in_size / 4 * 3 + (in_size % 4 ? in_size % 4 - 1 : 0) > capacity)
+        return H2_ERR;
+
+    uint32_t bits = 0;
+    int bit_count = 0;
+    size_t size = 0;
+    for (size_t i = 0; i < in_size; ++i) {
+        int value = h2_base64url_value(in[i]);
+        if (value == -1)
+            return H2_ERR;
+        bits = bits << 6 | value;
+        bit_count += 6;
+        if (bit_count >= 8) {
+            bit_count -= 8;
+            out[size++] = bits >> bit_count;
+        }
+    }
+    *out_size = size;
+    return H2_OK;
+}
+
+///// Decoding /////
+void h2_hpack_init(h2_hpack_t* hpack) {
+    memset(hpack, 0, sizeof(h2_hpack_t));
+    hpack->max_size = H2_TABLE_SIZE;
+}
+
+static void h2_hpack_evict(h2_hpack_t* hpack, size_t max_size) {
+    while (hpack->size > max_size) {
+        // The oldest entry goes first.
+        size_t last = (hpack->first + hpack->count - 1) % H2_TABLE_ENTRIES;
+        h2_hpack_entry_t* entry = hpack->entries[last];
+        hpack->size -= entry->name_len + entry->value_len + 32;
+        hpack->count--;
+        free(entry);
+        hpack->entries[last] = NULL;
+    }
+}
+
+void h2_hpack_destroy(h2_hpack_t* hpack) {
+    h2_hpack_evict(hpack, 0);
+}
+
+static int h2_hpack_insert(h2_hpack_t* hpack, const char* name, size_t name_len, const char* value, size_t value_len) {
+    // The name can be an entry, which is evicted below, it is copied first.
+    h2_hpack_entry_t* entry = malloc(sizeof(h2_hpack_entry_t) + name_len + value_len + 2);
+    if (!entry)
+        return H2_ERR;
+    entry->name_len = name_len;
+    entry->value_len = value_len;
+    memcpy(entry->data, name, name_len);
+    entry->data[name_len] = '\0';
+    memcpy(entry->data + name_len + 1, value, value_len);
+    entry->data[name_len + 1 + value_len] = '\0';
+
+    size_t size = name_len + value_len + 32;
+    if (size > hpack->max_size) {
+        // Not an error, the table is only emptied.
+        free(entry);
+        h2_hpack_evict(hpack, 0);
+        return H2_OK;
+    }
+    h2_hpack_evict(hpack, hpack->max_size - size);
+
+    // Every entry takes at least 32 bytes, so the ring cannot overflow.
+    hpack->first = (hpack->first + H2_TABLE_ENTRIES - 1) % H2_TABLE_ENTRIES;
+    hpack->entries[hpack->first] = entry;
+    hpack->count++;
+    hpack->size += size;
+    return H2_OK;
+}
+
+// Looks up index of the static table followed by the dynamic one.
+static int h2_hpack_lookup(const h2_hpack_t* hpack, uint64_t index, const char** out_name, size_t* out_name_len,
+                           const char** out_value, size_t* out_value_len) {
+    if (index == 0)
+        return H2_ERR;
+    if (index <= H2_STATIC_ENTRIES) {
+        *out_name = h2_static_table[index - 1].name;
+        *out_name_len = strlen(*out_name);
+        *out_value = h2_static_table[index - 1].value;
+        *out_value_len = strlen(*out_value);
+        return H2_OK;
+    }
+
+    index -= H2_STATIC_ENTRIES + 1;
+    if (index >= hpack->count)
+        return H2_ERR;
+    const h2_hpack_entry_t* entry = hpack->entries[(hpack->first + index) % H2_TABLE_ENTRIES];
+    *out_name = entry->data;
+    *out_name_len = entry->name_len;
+    *out_value = entry->data + entry->name_len + 1;
+    *out_value_len = entry->value_len;
+    return H2_OK;
+}
+
+// Decodes an integer with a prefix of prefix_bits, RFC 7541 5.1.
+static int h2_decode_int(const uint8_t** pos, const uint8_t* end, int prefix_bits, uint64_t* out) {
+    uint64_t max = (1u << prefix_bits) - 1;
+    uint64_t value = **pos & max;
+    (*pos)++;
+    if (value == max) {
+        for (int shift = 0;; shift += 7) {
+            // Longer integers are not needed by any valid block.
+            if (*pos == end || shift > 28)
+                return H2_ERR;
+            uint8_t byte = *(*pos)++;
+            value += (uint64_t)(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                break;
+        }
+    }
+    *out = value;
+    return H2_OK;
+}
+
+static int h2_huffman_decode(const uint8_t* in, size_t size, char* out, size_t* out_len) {
+    pthread_once(&h2_huffman_once, h2_huffman_build);
+
+    size_t len = 0;
+    uint32_t code = 0;
+    int length = 0;
+    for (size_t i = 0; i < size; ++i) {
+        for (int bit = 7; bit >= 0; --bit) {
+            code = code << 1 | ((in[i] >> bit) & 1);
+            length++;
+            if (code - h2_huffman_first[length] < h2_huffman_count[length]) {
+                uint16_t symbol = h2_huffman_symbols[h2_huffman_offset[length] + code - h2_huffman_first[length]];
+                if (symbol == H2_HUFFMAN_EOS)
+                    return H2_ERR;
+                out[len++] = symbol;
+                code = 0;
+                length = 0;
+            }
+            else if (length == H2_HUFFMAN_LONGEST) {
+                return H2_ERR;
+            }
+        }
+    }
+
+    // The padding is shorter than a byte and made of the most significant bits of EOS, all ones.
+    if (length > 7 || code != (1u << length) - 1)
+        return H2_ERR;
+    *out_len = len;
+    return H2_OK;
+}
+
+// Decodes a string literal, RFC 7541 5.2, into a NUL-terminated copy in arena.
+static int h2_decode_string(const uint8_t** pos, const uint8_t* end, arena_t* arena, char** out, size_t* out_len) {
+    if (*pos == end)
+        return H2_ERR;
+    bool huffman = **pos & 0x80;
+    uint64_t size;
+    if (h2_decode_int(pos, end, 7, &size) != H2_OK || size > (uint64_t)(end - *pos))
+        return H2_ERR;
+
+    // The shortest code has 5 bits.
+    size_t capacity = huffman ? size * 8 / 5 + 1 : size + 1;
+    char* string = arena_alloc(arena, capacity);
+    if (!string)
+        return H2_ERR;
+    if (huffman) {
+        if (h2_huffman_decode(*pos, size, string, out_len) != H2_OK)
+            return H2_ERR;
+    }
+    else {
+        memcpy(string, *pos, size);
+        *out_len = size;
+    }
+    string[*out_len] = '\0';
+    *pos += size;
+    *out = string;
+    return H2_OK;
+}
+
+// Keeps a copy of the pseudo-headers, which are used.
+static int h2_decode_field(const char* name, const char* value, size_t value_len, arena_t* arena, h2_request_t* out) {
+    const char** field;
+    if (strcmp(name, ":method") == 0)
+        field = &out->method;
+    else if (strcmp(name, ":path") == 0)
+        field = &out->path;
+    else
+        return H2_OK;
+
+    char* copy = arena_alloc(arena, value_len + 1);
+    if (!copy)
+        return H2_ERR;
+    memcpy(copy, value, value_len + 1);
+    *field = copy;
+    return H2_OK;
+}
+
+int h2_decode_headers(h2_hpack_t* hpack, const uint8_t* block, size_t size, arena_t* arena, h2_request_t* out) {
+    const uint8_t* pos = block;
+    const uint8_t* end = block + size;
+    out->method = NULL;
+    out->path = NULL;
+
+    while (pos < end) {
+        uint8_t first = *pos;
+        uint64_t index;
+        const char* name;
+        const char* value;
+        size_t name_len;
+        size_t value_len;
+
+        if (first & 0x80) {
+            // Indexed header field
+            if (h2_decode_int(&pos, end, 7, &index) != H2_OK
+                || h2_hpack_lookup(hpack, index, &name, &name_len, &value, &value_len) != H2_OK
+                || h2_decode_field(name, value, value_len, arena, out) != H2_OK)
+                return H2_ERR;
+            continue;
+        }
+
+        if ((first & 0xe0) == 0x20) {
+            // Dynamic table size update, up to the size in the settings.
+            if (h2_decode_int(&pos, end, 5, &index) != H2_OK || index > H2_TABLE_SIZE)
+                return H2_ERR;
+            hpack->max_size = index;
+            h2_hpack_evict(hpack, hpack->max_size);
+            continue;
+        }
+
+        // Literal header field, with incremental indexing or not.
+        bool indexing = (first & 0xc0) == 0x40;
+        if (h2_decode_int(&pos, end, indexing ? 6 : 4, &index) != H2_OK)
+            return H2_ERR;
+        char* literal_name = NULL;
+        if (index == 0) {
+            if (h2_decode_string(&pos, end, arena, &literal_name, &name_len) != H2_OK)
+                return H2_ERR;
+            name = literal_name;
+        }
+        else if (h2_hpack_lookup(hpack, index, &name, &name_len, &value, &value_len) != H2_OK) {
+            return H2_ERR;
+        }
+        char* literal_value;
+        if (h2_decode_string(&pos, end, arena, &literal_value, &value_len) != H2_OK
+            || h2_decode_field(name, literal_value, value_len, arena, out) != H2_OK)
+            return H2_ERR;
+        if (indexing && h2_hpack_insert(hpack, name, name_len, literal_value, value_len) != H2_OK)
+            return H2_ERR;
+    }
+    return H2_OK;
+}
+
+///// Encoding /////
+// Encodes an integer with a prefix of prefix_bits, the pattern fills the bits above the prefix.
+static bool h2_encode_int(uint8_t** pos, const uint8_t* end, uint8_t pattern, int prefix_bits, uint64_t value) {
+    uint64_t max = (1u << prefix_bits) - 1;
+    if (*pos == end)
+        return false;
+    if (value < max) {
+        *(*pos)++ = pattern | value;
+        return true;
+    }
+    *(*pos)++ = pattern | max;
+    value -= max;
+    for (;;) {
+        if (*pos == end)
+            return false;
+        if (value < 0x80) {
+            *(*pos)++ = value;
+            return true;
+        }
+        *(*pos)++ = 0x80 | (value & 0x7f);
+        value >>= 7;
+    }
+}
+
+// Encodes a string literal without Huffman coding.
+static bool h2_encode_string(uint8_t** pos, const uint8_t* end, const char* string, size_t len) {
+    if (!h2_encode_int(pos, end, 0x00, 7, len) || (size_t)(end - *pos) < len)
+        return false;
+    memcpy(*pos, string, len);
+    *pos += len;
+    return true;
+}
+
+// Index of name in the static table, 0 if it is not there.
+static size_t h2_static_name(const char* name, size_t name_len) {
+    for (size_t i = 0; i < H2_STATIC_ENTRIES; ++i) {
+        if (strlen(h2_static_table[i].name) == name_len && memcmp(h2_static_table[i].name, name, name_len) == 0)
+            return i + 1;
+    }
+    return 0;
+}
+
+// Headers of the HTTP/1.1 connection, which are forbidden in HTTP/2.
+static bool h2_connection_header(const char* name, size_t name_len) {
+    static const char* names[] = {"connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade"};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+        if (strlen(names[i]) == name_len && memcmp(names[i], name, name_len) == 0)
+            return true;
+    }
+    return false;
+}
+
+int h2_encode_head(const char* head, size_t head_size, uint8_t* out, size_t capacity,
+                   size_t* out_size, size_t* out_consumed) {
+    const char* head_end = memmem(head, head_size, "\r\n\r\n", 4);
+    if (!head_end || head_size < 12 || memcmp(head, "HTTP/1.1 ", 9) != 0)
+        return H2_ERR;
+
+    uint8_t* pos = out;
+    const uint8_t* end = out + capacity;
+
+    // :status, indexed when the static table has it.
+    const char* status = head + 9;
+    size_t status_index = 0;
+    for (size_t i = 7; i < 14; ++i) {
+        if (memcmp(h2_static_table[i].value, status, 3) == 0)
+            status_index = i + 1;
+    }
+    if (status_index != 0) {
+        if (!h2_encode_int(&pos, end, 0x80, 7, status_index))
+            return H2_ERR;
+    }
+    else if (!h2_encode_int(&pos, end, 0x00, 4, 8) || !h2_encode_string(&pos, end, status, 3)) {
+        return H2_ERR;
+    }
+
+    const char* line = (const char*)memchr(head, '\n', head_end + 2 - head) + 1;
+    while (line < head_end + 2) {
+        const char* line_end = memchr(line, '\r', head_end + 2 - line);
+        const char* colon = memchr(line, ':', line_end - line);
+        if (!colon)
+            return H2_ERR;
+
+        // Names are lowercase in HTTP/2.
+        size_t name_len = colon - line;
+        char name[name_len + 1];
+        for (size_t i = 0; i < name_len; ++i)
+            name[i] = line[i] >= 'A' && line[i] <= 'Z' ? line[i] - 'A' + 'a' : line[i];
+        const char* value = colon + 1;
+        while (value < line_end && *value == ' ')
+            value++;
+        size_t value_len = line_end - value;
+        while (value_len > 0 && value[value_len - 1] == ' ')
+            value_len--;
+
+        if (!h2_connection_header(name, name_len)) {
+            // Literal header field never indexed, RFC 7541 6.2.3.
+            size_t index = h2_static_name(name, name_len);
+            if (!h2_encode_int(&pos, end, 0x10, 4, index)
+                || (index == 0 && !h2_encode_string(&pos, end, name, name_len))
+                || !h2_encode_string(&pos, end, value, value_len))
+                return H2_ERR;
+        }
+        line = line_end + 2;
+    }
+
+    *out_size = pos - out;
+    *out_consumed = head_end + 4 - head;
+    return H2_OK;
+}
@@ -0,0 +1,134 @@
+#ifndef H2_H
+#define H2_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "arena.h"
+
+// Wire format of HTTP/2 over cleartext TCP (h2c): frames, settings and HPACK header compression.
+// Connections and their streams are handled by server.c, responses are rendered by http.c
+// as for HTTP/1.1 and their heads are translated into header blocks here.
+//
+// Request headers are decoded with the dynamic table and Huffman coding.
+// Response headers are encoded as literals, which are never indexed, so the client's table stays empty.
+
+// Return codes //
+#define H2_ERR -1   // The peer has broken the protocol, the connection has to end.
+#define H2_OK   0
+
+#define H2_PREFACE      "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_SIZE 24
+#define H2_PREFACE_LINE 18   // "PRI * HTTP/2.0\r\n\r\n", which looks like a request to an HTTP/1.1 parser.
+
+#define H2_FRAME_HEADER 9
+#define H2_SETTING_SIZE 6
+
+// Frame types //
+#define H2_DATA          0x0
+#define H2_HEADERS       0x1
+#define H2_PRIORITY      0x2
+#define H2_RST_STREAM    0x3
+#define H2_SETTINGS      0x4
+#define H2_PUSH_PROMISE  0x5
+#define H2_PING          0x6
+#define H2_GOAWAY        0x7
+#define H2_WINDOW_UPDATE 0x8
+#define H2_CONTINUATION  0x9
+
+// Frame flags //
+#define H2_FLAG_END_STREAM  0x1
+#define H2_FLAG_ACK         0x1   // SETTINGS and PING
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED      0x8
+#define H2_FLAG_PRIORITY    0x20
+
+// Error codes //
+#define H2_NO_ERROR           0x0
+#define H2_PROTOCOL_ERROR     0x1
+#define H2_INTERNAL_ERROR     0x2
+#define H2_FLOW_CONTROL_ERROR 0x3
+#define H2_STREAM_CLOSED      0x5
+#define H2_FRAME_SIZE_ERROR   0x6
+#define H2_REFUSED_STREAM     0x7
+#define H2_CANCEL             0x8
+#define H2_COMPRESSION_ERROR  0x9
+#define H2_ENHANCE_YOUR_CALM  0xb
+
+// Settings //
+#define H2_SETTINGS_HEADER_TABLE_SIZE      0x1
+#define H2_SETTINGS_ENABLE_PUSH            0x2
+#define H2_SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE    0x4
+#define H2_SETTINGS_MAX_FRAME_SIZE         0x5
+#define H2_SETTINGS_MAX_HEADER_LIST_SIZE   0x6
+
+#define H2_DEFAULT_WINDOW 65535
+#define H2_MAX_WINDOW     0x7fffffff
+#define H2_DEFAULT_FRAME  16384        // Also the biggest frame accepted from the peer.
+#define H2_MAX_FRAME      0xffffff
+#define H2_TABLE_SIZE     4096         // Of the decoder's dynamic table, the default is not changed.
+#define H2_TABLE_ENTRIES  (H2_TABLE_SIZE / 32)
+
+typedef struct h2_frame {
+    uint32_t length;
+    uint8_t  type;
+    uint8_t  flags;
+    uint32_t stream;
+} h2_frame_t;
+
+typedef struct h2_settings {
+    uint32_t header_table_size;
+    uint32_t enable_push;
+    uint32_t max_concurrent_streams;
+    uint32_t initial_window;
+    uint32_t max_frame;
+    uint32_t max_header_list;
+} h2_settings_t;
+
+typedef struct h2_hpack_entry h2_hpack_entry_t;
+
+// Decoder of the header blocks of a connection.
+typedef struct h2_hpack {
+    h2_hpack_entry_t* entries[H2_TABLE_ENTRIES];   // Ring, the newest entry is at the lowest index.
+    size_t first;             // Position of the newest entry.
+    size_t count;
+    size_t size;              // As counted by HPACK, 32 bytes over the strings per entry.
+    size_t max_size;
+} h2_hpack_t;
+
+// Pseudo-headers of a request, the others are not used.
+typedef struct h2_request {
+    const char* method;       // NULL if missing.
+    const char* path;         // NULL if missing.
+} h2_request_t;
+
+void h2_read_frame(const uint8_t* in, h2_frame_t* out);
+void h2_write_frame(uint8_t* out, uint32_t length, uint8_t type, uint8_t flags, uint32_t stream);
+uint32_t h2_read_u32(const uint8_t* in);
+void h2_write_u32(uint8_t* out, uint32_t value);
+void h2_write_setting(uint8_t* out, uint16_t id, uint32_t value);
+
+// Sets the initial values of RFC 9113.
+void h2_settings_init(h2_settings_t* settings);
+
+// Applies the payload of a SETTINGS frame. On H2_ERR *out_error tells why.
+int h2_settings_apply(h2_settings_t* settings, const uint8_t* payload, size_t size, uint32_t* out_error);
+
+// Decodes the HTTP2-Settings header of an upgrading request, base64url without padding.
+int h2_base64url_decode(const char* in, size_t in_size, uint8_t* out, size_t capacity, size_t* out_size);
+
+void h2_hpack_init(h2_hpack_t* hpack);
+void h2_hpack_destroy(h2_hpack_t* hpack);
+
+// Decodes a complete header block into out, the strings are allocated in arena.
+// On H2_ERR the decoder cannot be used any more, a COMPRESSION_ERROR ends the connection.
+int h2_decode_headers(h2_hpack_t* hpack, const uint8_t* block, size_t size, arena_t* arena, h2_request_t* out);
+
+// Translates the head of an HTTP/1.1 response, its status line and header lines, into a header block
+// of at most capacity bytes. Headers of the HTTP/1.1 connection are left out.
+// *out_consumed is the size of the head, with the empty line ending it.
+int h2_encode_head(const char* head, size_t head_size, uint8_t* out, size_t capacity,
+                   size_t* out_size, size_t* out_consumed);
+
+#endif /* H2_H */
@@ -0,0 +1,232 @@
+#define _GNU_SOURCE  // memfd_create, SO_PEERCRED
+
+#include "handoff.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include "fcache.h"
+
+// Sent by the serving process, the descriptors come with it: the sockets, then the snapshot.
+typedef struct handoff_hello {
+    char magic[8];
+    uint32_t sock_count;
+    uint32_t snapshot;         // Whether the cache snapshot is sent.
+} handoff_hello_t;
+
+typedef union handoff_control {
+    struct cmsghdr header;     // Aligns the buffer.
+    char buffer[CMSG_SPACE((HANDOFF_MAX_SOCKS + 1) * sizeof(int))];
+} handoff_control_t;
+
+static int handoff_previous = -1;  // Connection to the process taken over from, until it is acknowledged.
+static int handoff_sock = -1;
+static int handoff_socks[HANDOFF_MAX_SOCKS];
+static unsigned handoff_sock_count = 0;
+static void (*handoff_retire)() = NULL;
+
+static int handoff_address(const char* path, struct sockaddr_un* out) {
+    if (strlen(path) >= sizeof(out->sun_path))
+        return HANDOFF_ERR;
+    memset(out, 0, sizeof(struct sockaddr_un));
+    out->sun_family = AF_UNIX;
+    strcpy(out->sun_path, path);
+    return HANDOFF_OK;
+}
+
+// Caches the files from the snapshot, a damaged one only makes the cache colder.
+static void handoff_import(int snapshot) {
+    struct stat st;
+    if (fstat(snapshot, &st) == 0 && st.st_size > 0) {
+        void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, snapshot, 0);
+        if (data != MAP_FAILED) {
+            if (fcache_import(data, st.st_size) != FCACHE_HIT)
+                fprintf(stderr, "The cache handed over is malformed\n");
+            munmap(data, st.st_size);
+        }
+    }
+    close(snapshot);
+}
+
+int handoff_receive(const char* path, int* out_socks, unsigned* out_count) {
+    struct sockaddr_un addr;
+    if (handoff_address(path, &addr) != HANDOFF_OK)
+        return HANDOFF_ERR;
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1)
+        return HANDOFF_ERR;
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        // Nobody serves, or the socket is left by a process, which has exited.
+        int ret = errno == ENOENT || errno == ECONNREFUSED ? HANDOFF_NONE : HANDOFF_ERR;
+        close(sock);
+        return ret;
+    }
+
+    handoff_hello_t hello;
+    handoff_control_t control;
+    struct iovec iov = {.iov_base = &hello, .iov_len = sizeof(hello)};
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buffer,
+        .msg_controllen = sizeof(control.buffer)
+    };
+    ssize_t ret;
+    do {
+        ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (ret == -1 && errno == EINTR);
+
+    int fds[HANDOFF_MAX_SOCKS + 1];
+    unsigned fd_count = 0;
+    for (struct cmsghdr* cmsg = ret > 0 ? CMSG_FIRSTHDR(&msg) : NULL; cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && fd_count == 0) {
+            fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), fd_count * sizeof(int));
+        }
+    }
+
+    bool valid = ret == sizeof(hello) && !(msg.msg_flags & MSG_CTRUNC)
+        && memcmp(hello.magic, HANDOFF_MAGIC, 8) == 0 && hello.sock_count <= HANDOFF_MAX_SOCKS
+        && fd_count == hello.sock_count + (hello.snapshot ? 1 : 0);
+    if (!valid) {
+        for (unsigned i = 0; i < fd_count; ++i)
+            close(fds[i]);
+        close(sock);
+        return HANDOFF_ERR;
+    }
+
+    if (hello.snapshot)
+        handoff_import(fds[hello.sock_count]);
+    memcpy(out_socks, fds, hello.sock_count * sizeof(int));
+    *out_count = hello.sock_count;
+    handoff_previous = sock;
+    return HANDOFF_OK;
+}
+
+// Whether the peer runs as the same user as this process, or as root.
+static bool handoff_trusted(int peer) {
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if (getsockopt(peer, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == -1)
+        return false;
+    return cred.uid == 0 || cred.uid == getuid();
+}
+
+// Sends the listening sockets and the snapshot of the cache to the new process.
+static int handoff_send(int peer) {
+    // Without a snapshot, the new process starts cold.
+    int snapshot = memfd_create("serwer-handoff", MFD_CLOEXEC);
+    if (snapshot != -1 && fcache_export(snapshot) != FCACHE_HIT) {
+        close(snapshot);
+        snapshot = -1;
+    }
+
+    handoff_hello_t hello;
+    memcpy(hello.magic, HANDOFF_MAGIC, 8);
+    hello.sock_count = handoff_sock_count;
+    hello.snapshot = snapshot != -1;
+
+    int fds[HANDOFF_MAX_SOCKS + 1];
+    unsigned fd_count = handoff_sock_count;
+    memcpy(fds, handoff_socks, handoff_sock_count * sizeof(int));
+    if (snapshot != -1)
+        fds[fd_count++] = snapshot;
+
+    handoff_control_t control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iov = {.iov_base = &hello, .iov_len = sizeof(hello)};
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buffer,
+        .msg_controllen = CMSG_SPACE(fd_count * sizeof(int))
+    };
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(fd_count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, fd_count * sizeof(int));
+
+    ssize_t ret;
+    do {
+        ret = sendmsg(peer, &msg, MSG_NOSIGNAL);
+    } while (ret == -1 && errno == EINTR);
+    if (snapshot != -1)
+        close(snapshot);
+    return ret == sizeof(hello) ? HANDOFF_OK : HANDOFF_ERR;
+}
+
+static void* handoff_loop(void* arg) {
+    struct timespec pause = {.tv_sec = 0, .tv_nsec = 100000000};
+
+    for (;;) {
+        int peer = accept4(handoff_sock, NULL, NULL, SOCK_CLOEXEC);
+        if (peer == -1) {
+            if (errno != EINTR && errno != ECONNABORTED)
+                nanosleep(&pause, NULL);
+            continue;
+        }
+        if (!handoff_trusted(peer) || handoff_send(peer) != HANDOFF_OK) {
+            close(peer);
+            continue;
+        }
+
+        // The new process acknowledges, once it is ready to serve. If it fails before, this one goes on.
+        char ack;
+        ssize_t ret;
+        do {
+            ret = read(peer, &ack, 1);
+        } while (ret == -1 && errno == EINTR);
+        close(peer);
+        if (ret != 1)
+            continue;
+
+        // The control socket's path belongs to the new process.
+        close(handoff_sock);
+        handoff_retire();
+        exit(EXIT_SUCCESS);
+    }
+    return NULL;
+}
+
+int handoff_start(const char* path, const int* socks, unsigned sock_count, void (*retire)()) {
+    struct sockaddr_un addr;
+    if (sock_count > HANDOFF_MAX_SOCKS || handoff_address(path, &addr) != HANDOFF_OK)
+        return HANDOFF_ERR;
+    memcpy(handoff_socks, socks, sock_count * sizeof(int));
+    handoff_sock_count = sock_count;
+    handoff_retire = retire;
+
+    // The previous process keeps serving its connections on the socket it has, the path is taken over.
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+    handoff_sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (handoff_sock == -1)
+        return HANDOFF_ERR;
+    if (bind(handoff_sock, (struct sockaddr*)&addr, sizeof(addr)) == -1 || chmod(path, 0600) == -1
+        || listen(handoff_sock, 1) == -1)
+        return HANDOFF_ERR;
+
+    if (handoff_previous != -1) {
+        write(handoff_previous, "1", 1);
+        close(handoff_previous);
+        handoff_previous = -1;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, handoff_loop, NULL) != 0)
+        return HANDOFF_ERR;
+    pthread_detach(thread);
+    return HANDOFF_OK;
+}
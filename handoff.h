@@ -0,0 +1,32 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+// Handoff of the listening sockets to a new process, so that a new build is deployed without
+// dropping connections and without starting with a cold cache.
+// The serving process waits on a Unix domain control socket. The new one connects to it and
+// receives the listening sockets with SCM_RIGHTS, along with a shared memory segment (memfd)
+// holding the cached files. Both accept connections, until the new one has started and
+// acknowledges. Then the old one stops accepting, lets its connections finish and exits.
+//
+// The root index is not handed over, its inotify watches belong to the process. The new one
+// indexes the root, while the old one still serves, before it connects.
+
+// Return codes //
+#define HANDOFF_ERR  -1
+#define HANDOFF_OK    0
+#define HANDOFF_NONE  1   // No process serves on the control socket.
+
+#define HANDOFF_MAX_SOCKS 16
+#define HANDOFF_MAGIC     "SRWHAND1"
+
+// Takes over from the process serving on the control socket path. On HANDOFF_OK its listening
+// sockets are in out_socks, their number in *out_count, and its cached files are imported.
+// The cache has to be initialized before.
+int handoff_receive(const char* path, int* out_socks, unsigned* out_count);
+
+// Acknowledges the takeover to the previous process, if any, and starts the thread waiting
+// for the next one on the control socket path. It is handed the sock_count sockets socks.
+// Then retire is called, to let the connections finish, and the process exits.
+int handoff_start(const char* path, const int* socks, unsigned sock_count, void (*retire)());
+
+#endif /* HANDOFF_H */
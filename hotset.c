@@ -0,0 +1,416 @@
+#define _GNU_SOURCE  // SO_PEERCRED
+
+#include "hotset.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include "arena.h"
+#include "fcache.h"
+#include "iopool.h"
+#include "scan.h"
+
+#define HOTSET_STRIPE_SLOTS (HOTSET_SLOTS / HOTSET_STRIPES)
+
+typedef struct hotset_slot {
+    uint64_t count;            // 0 if the slot is free.
+    uint64_t size;
+    char target[HOTSET_TARGET];
+} hotset_slot_t;
+
+typedef struct hotset_stripe {
+    pthread_mutex_t mutex;
+    hotset_slot_t slots[HOTSET_STRIPE_SLOTS];
+} hotset_stripe_t;
+
+static hotset_stripe_t hotset_table[HOTSET_STRIPES];
+static bool hotset_counting = false;
+static const char* hotset_filesystem = NULL;
+static char* hotset_manifest = NULL;
+static char* hotset_manifest_tmp = NULL;
+static hotset_slot_t* hotset_sorted = NULL;   // The slots copied out for writing.
+static pthread_mutex_t hotset_write_mutex = PTHREAD_MUTEX_INITIALIZER;
+static size_t hotset_warm_rate = 0;
+
+// Targets to warm, a ring.
+static char (*hotset_queue)[HOTSET_TARGET] = NULL;
+static size_t hotset_queue_head = 0;
+static size_t hotset_queue_length = 0;
+static pthread_mutex_t hotset_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hotset_queue_cond = PTHREAD_COND_INITIALIZER;
+
+static int hotset_sock = -1;
+
+static _Atomic uint64_t hotset_manifests = 0;
+static _Atomic uint64_t hotset_warmed = 0;
+static _Atomic uint64_t hotset_warmed_bytes = 0;
+static _Atomic uint64_t hotset_warm_failed = 0;
+static _Atomic uint64_t hotset_warm_rejected = 0;
+
+static uint64_t hotset_hash(const char* target, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= (uint8_t)target[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+///// Counting /////
+bool hotset_enabled() {
+    return hotset_counting;
+}
+
+void hotset_touch(const char* target, uint64_t size) {
+    size_t len = strlen(target);
+    if (len >= HOTSET_TARGET)
+        return;
+    uint64_t hash = hotset_hash(target, len);
+    hotset_stripe_t* stripe = &hotset_table[hash % HOTSET_STRIPES];
+    size_t start = (hash / HOTSET_STRIPES) % HOTSET_STRIPE_SLOTS;
+
+    pthread_mutex_lock(&stripe->mutex);
+    hotset_slot_t* coldest = NULL;
+    for (size_t probe = 0; probe < HOTSET_PROBES; ++probe) {
+        hotset_slot_t* slot = &stripe->slots[(start + probe) % HOTSET_STRIPE_SLOTS];
+        if (slot->count > 0 && strcmp(slot->target, target) == 0) {
+            slot->count++;
+            if (size > slot->size)
+                slot->size = size;
+            pthread_mutex_unlock(&stripe->mutex);
+            return;
+        }
+        if (!coldest || slot->count < coldest->count)
+            coldest = slot;
+    }
+    // A file taking the place of another starts above its count, or a burst of cold files
+    // would keep replacing each other without ever getting in (space saving).
+    coldest->count++;
+    coldest->size = size;
+    memcpy(coldest->target, target, len + 1);
+    pthread_mutex_unlock(&stripe->mutex);
+}
+
+static int hotset_compare(const void* a, const void* b) {
+    uint64_t count_a = ((const hotset_slot_t*)a)->count;
+    uint64_t count_b = ((const hotset_slot_t*)b)->count;
+    return count_a < count_b ? 1 : count_a > count_b ? -1 : 0;
+}
+
+int hotset_flush() {
+    if (!hotset_counting)
+        return HOTSET_OK;
+
+    pthread_mutex_lock(&hotset_write_mutex);
+    // The counts are halved as they are copied, the files, which are not requested any more, fade out.
+    size_t count = 0;
+    for (size_t s = 0; s < HOTSET_STRIPES; ++s) {
+        hotset_stripe_t* stripe = &hotset_table[s];
+        pthread_mutex_lock(&stripe->mutex);
+        for (size_t i = 0; i < HOTSET_STRIPE_SLOTS; ++i) {
+            if (stripe->slots[i].count == 0)
+                continue;
+            hotset_sorted[count++] = stripe->slots[i];
+            stripe->slots[i].count /= 2;
+        }
+        pthread_mutex_unlock(&stripe->mutex);
+    }
+    qsort(hotset_sorted, count, sizeof(hotset_slot_t), hotset_compare);
+
+    int ret = HOTSET_ERR;
+    FILE* out = fopen(hotset_manifest_tmp, "w");
+    if (out) {
+        for (size_t i = 0; i < count && i < HOTSET_MANIFEST; ++i)
+            fprintf(out, "%" PRIu64 " %" PRIu64 " %s\n", hotset_sorted[i].count, hotset_sorted[i].size, hotset_sorted[i].target);
+        if (fclose(out) == 0 && rename(hotset_manifest_tmp, hotset_manifest) == 0) {
+            atomic_fetch_add_explicit(&hotset_manifests, 1, memory_order_relaxed);
+            ret = HOTSET_OK;
+        }
+    }
+    pthread_mutex_unlock(&hotset_write_mutex);
+    return ret;
+}
+
+static void* hotset_write_loop(void* arg) {
+    struct timespec interval = {
+        .tv_sec = HOTSET_INTERVAL_MS / 1000,
+        .tv_nsec = (HOTSET_INTERVAL_MS % 1000) * 1000000
+    };
+
+    for (;;) {
+        nanosleep(&interval, NULL);
+        hotset_flush();
+    }
+    return NULL;
+}
+
+///// Warming /////
+// Queues the target, if it can be served. Returns false if it is rejected.
+static bool hotset_queue_push(const char* target, size_t len) {
+    bool valid = len > 0 && len < HOTSET_TARGET && target[0] == '/'
+        && scan_span(target, len, &scan_target) == len;
+    pthread_mutex_lock(&hotset_queue_mutex);
+    bool queued = valid && hotset_queue_length < HOTSET_QUEUE;
+    if (queued) {
+        char* slot = hotset_queue[(hotset_queue_head + hotset_queue_length++) % HOTSET_QUEUE];
+        memcpy(slot, target, len);
+        slot[len] = '\0';
+        pthread_cond_signal(&hotset_queue_cond);
+    }
+    pthread_mutex_unlock(&hotset_queue_mutex);
+    if (!queued)
+        atomic_fetch_add_explicit(&hotset_warm_rejected, 1, memory_order_relaxed);
+    return queued;
+}
+
+static void hotset_queue_pop(char* out_target) {
+    pthread_mutex_lock(&hotset_queue_mutex);
+    while (hotset_queue_length == 0)
+        pthread_cond_wait(&hotset_queue_cond, &hotset_queue_mutex);
+    memcpy(out_target, hotset_queue[hotset_queue_head], HOTSET_TARGET);
+    hotset_queue_head = (hotset_queue_head + 1) % HOTSET_QUEUE;
+    hotset_queue_length--;
+    pthread_mutex_unlock(&hotset_queue_mutex);
+}
+
+static void* hotset_warm_loop(void* arg) {
+    struct timespec pause = {.tv_sec = 0, .tv_nsec = HOTSET_PAUSE_MS * 1000000};
+    char target[HOTSET_TARGET];
+    arena_t arena;
+    if (arena_init(&arena) != ARENA_OK)
+        return NULL;
+
+    for (;;) {
+        hotset_queue_pop(target);
+
+        // The requests come first, the warming waits, while their file operations are queued.
+        for (;;) {
+            iopool_stats_t io;
+            iopool_stats(&io);
+            if (io.depth == 0)
+                break;
+            nanosleep(&pause, NULL);
+        }
+
+        uint64_t started = iopool_now();
+        size_t size;
+        int ret = fcache_warm(hotset_filesystem, target, &arena, &size);
+        arena_reset(&arena);
+        if (ret != FCACHE_HIT && ret != FCACHE_BYPASS) {
+            atomic_fetch_add_explicit(&hotset_warm_failed, 1, memory_order_relaxed);
+            continue;
+        }
+        atomic_fetch_add_explicit(&hotset_warmed, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&hotset_warmed_bytes, size, memory_order_relaxed);
+
+        // Keeps to the rate, sleeping for the time the bytes should have taken.
+        if (hotset_warm_rate > 0) {
+            uint64_t due = started + size * 1000000000 / hotset_warm_rate;
+            uint64_t now = iopool_now();
+            if (due > now) {
+                struct timespec rest = {.tv_sec = (due - now) / 1000000000, .tv_nsec = (due - now) % 1000000000};
+                nanosleep(&rest, NULL);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Queues the files of the manifest, in its order. A missing manifest is an empty one.
+static void hotset_load(const char* path) {
+    FILE* in = fopen(path, "r");
+    if (!in)
+        return;
+
+    char line[HOTSET_TARGET + 64];
+    while (fgets(line, sizeof(line), in)) {
+        // COUNT SIZE TARGET
+        char* target = strchr(line, ' ');
+        target = target ? strchr(target + 1, ' ') : NULL;
+        if (!target)
+            continue;
+        ++target;
+        size_t len = strcspn(target, "\n");
+        hotset_queue_push(target, len);
+    }
+    fclose(in);
+}
+
+int hotset_start(const char* filesystem, const char* manifest, size_t warm_rate) {
+    hotset_filesystem = filesystem;
+    hotset_warm_rate = warm_rate;
+    hotset_queue = malloc(HOTSET_QUEUE * sizeof(*hotset_queue));
+    if (!hotset_queue)
+        return HOTSET_ERR;
+
+    if (manifest) {
+        // Another process writes the manifest during a handoff, each one has a temporary file of its own.
+        size_t path_len = strlen(manifest) + 32;
+        hotset_manifest = strdup(manifest);
+        hotset_manifest_tmp = malloc(path_len);
+        hotset_sorted = malloc(HOTSET_SLOTS * sizeof(hotset_slot_t));
+        if (!hotset_manifest || !hotset_manifest_tmp || !hotset_sorted)
+            return HOTSET_ERR;
+        snprintf(hotset_manifest_tmp, path_len, "%s.%ld.tmp", manifest, (long)getpid());
+        for (size_t s = 0; s < HOTSET_STRIPES; ++s)
+            pthread_mutex_init(&hotset_table[s].mutex, NULL);
+        hotset_load(manifest);
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, hotset_warm_loop, NULL) != 0)
+        return HOTSET_ERR;
+    pthread_detach(thread);
+    if (manifest) {
+        if (pthread_create(&thread, NULL, hotset_write_loop, NULL) != 0)
+            return HOTSET_ERR;
+        pthread_detach(thread);
+        hotset_counting = true;
+    }
+    return HOTSET_OK;
+}
+
+///// Control socket /////
+// Whether the peer runs as the same user as this process, or as root.
+static bool hotset_trusted(int peer) {
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if (getsockopt(peer, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == -1)
+        return false;
+    return cred.uid == 0 || cred.uid == getuid();
+}
+
+// Queues the targets written by the peer, until it shuts down writing, and answers how many were queued.
+// A peer, which keeps the socket open longer than HOTSET_PEER_MS, is dropped without an answer,
+// so that it does not hold the socket from the others.
+static void hotset_serve(int peer) {
+    uint64_t deadline = iopool_now() + (uint64_t)HOTSET_PEER_MS * 1000000;
+    char buffer[HOTSET_TARGET * 4];
+    size_t size = 0;
+    unsigned queued = 0;
+    unsigned rejected = 0;
+    bool overlong = false;   // Skipping the rest of a line too long to be a target.
+
+    for (;;) {
+        uint64_t now = iopool_now();
+        struct pollfd fds = {.fd = peer, .events = POLLIN};
+        int ready = now < deadline ? poll(&fds, 1, (deadline - now + 999999) / 1000000) : 0;
+        if (ready == -1 && errno == EINTR)
+            continue;
+        if (ready == 0)
+            return;
+        ssize_t ret = read(peer, buffer + size, sizeof(buffer) - size);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+        size += ret;
+
+        char* line = buffer;
+        char* end;
+        while ((end = memchr(line, '\n', buffer + size - line)) != NULL) {
+            size_t len = end - line;
+            if (len > 0 && line[len - 1] == '\r')
+                --len;
+            if (overlong)
+                overlong = false;
+            else if (len > 0 && hotset_queue_push(line, len))
+                ++queued;
+            else if (len > 0)
+                ++rejected;
+            line = end + 1;
+        }
+        size -= line - buffer;
+        memmove(buffer, line, size);
+        if (size == sizeof(buffer)) {
+            if (!overlong) {
+                ++rejected;
+                atomic_fetch_add_explicit(&hotset_warm_rejected, 1, memory_order_relaxed);
+            }
+            overlong = true;
+            size = 0;
+        }
+    }
+    // The last line may come without its newline.
+    if (size > 0 && !overlong) {
+        if (hotset_queue_push(buffer, size))
+            ++queued;
+        else
+            ++rejected;
+    }
+
+    char answer[64];
+    int answer_size = snprintf(answer, sizeof(answer), "queued %u rejected %u\n", queued, rejected);
+    send(peer, answer, answer_size, MSG_NOSIGNAL);
+}
+
+static void* hotset_listen_loop(void* arg) {
+    struct timespec pause = {.tv_sec = 0, .tv_nsec = 100000000};
+
+    for (;;) {
+        int peer = accept4(hotset_sock, NULL, NULL, SOCK_CLOEXEC);
+        if (peer == -1) {
+            if (errno != EINTR && errno != ECONNABORTED)
+                nanosleep(&pause, NULL);
+            continue;
+        }
+        if (hotset_trusted(peer))
+            hotset_serve(peer);
+        close(peer);
+    }
+    return NULL;
+}
+
+int hotset_listen(const char* path) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return HOTSET_ERR;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    // A socket left by a previous run is replaced, any other file is not.
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+    hotset_sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (hotset_sock == -1)
+        return HOTSET_ERR;
+    if (bind(hotset_sock, (struct sockaddr*)&addr, sizeof(addr)) == -1 || chmod(path, 0600) == -1
+        || listen(hotset_sock, 4) == -1)
+        return HOTSET_ERR;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, hotset_listen_loop, NULL) != 0)
+        return HOTSET_ERR;
+    pthread_detach(thread);
+    return HOTSET_OK;
+}
+
+void hotset_stats(hotset_stats_t* out_stats) {
+    uint64_t files = 0;
+    if (hotset_counting) {
+        for (size_t s = 0; s < HOTSET_STRIPES; ++s) {
+            pthread_mutex_lock(&hotset_table[s].mutex);
+            for (size_t i = 0; i < HOTSET_STRIPE_SLOTS; ++i)
+                files += hotset_table[s].slots[i].count > 0;
+            pthread_mutex_unlock(&hotset_table[s].mutex);
+        }
+    }
+    out_stats->files = files;
+    out_stats->manifests = atomic_load_explicit(&hotset_manifests, memory_order_relaxed);
+    out_stats->warmed = atomic_load_explicit(&hotset_warmed, memory_order_relaxed);
+    out_stats->warmed_bytes = atomic_load_explicit(&hotset_warmed_bytes, memory_order_relaxed);
+    out_stats->warm_failed = atomic_load_explicit(&hotset_warm_failed, memory_order_relaxed);
+    out_stats->warm_rejected = atomic_load_explicit(&hotset_warm_rejected, memory_order_relaxed);
+}
@@ -0,0 +1,62 @@
+#ifndef HOTSET_H
+#define HOTSET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The hot set, the files requested most, kept across restarts so that a new process does not start cold.
+// Files answered with 200 are counted in a table of bounded size. Every HOTSET_INTERVAL_MS the
+// hottest HOTSET_MANIFEST of them are written to the manifest, with their counts and sizes,
+// and the counts are halved, so that the set follows the traffic.
+// On startup a thread warms the files of the manifest, hottest first: it caches them, or asks
+// the kernel to read ahead the ones too big for the cache. It keeps to a rate of bytes, and pauses
+// while the I/O pool has file operations of the requests queued.
+// Files can also be warmed on demand, their targets written one per line to a control socket.
+
+// Return codes //
+#define HOTSET_ERR -1
+#define HOTSET_OK   0
+
+#define HOTSET_SLOTS        4096   // Files counted at once.
+#define HOTSET_STRIPES      64     // Locks of the table, each over its part of the slots.
+#define HOTSET_PROBES       8      // Slots a file can take, the coldest of them is replaced.
+#define HOTSET_TARGET       256    // Longer targets are not counted.
+#define HOTSET_MANIFEST     1024   // Files written to the manifest.
+#define HOTSET_INTERVAL_MS  60000
+#define HOTSET_QUEUE        4096   // Files waiting to be warmed, more are rejected.
+#define HOTSET_PAUSE_MS     10     // Between the checks, whether the I/O pool is idle.
+#define HOTSET_PEER_MS      5000   // A peer of the warm socket, which has not shut down writing by then, is dropped.
+
+#define HOTSET_DEFAULT_WARM_RATE (16 * 1048576)   // Bytes per second.
+
+typedef struct hotset_stats {
+    uint64_t files;          // Counted now.
+    uint64_t manifests;      // Written.
+    uint64_t warmed;
+    uint64_t warmed_bytes;
+    uint64_t warm_failed;    // Not found, or not readable.
+    uint64_t warm_rejected;  // Not queued: the queue was full or the target malformed.
+} hotset_stats_t;
+
+// Starts warming the files of the root filesystem, at most warm_rate bytes per second, 0 means no limit.
+// If manifest is not NULL, the files it lists are queued and the requests are counted into it.
+// The cache has to be initialized before.
+int hotset_start(const char* filesystem, const char* manifest, size_t warm_rate);
+
+// Whether the requests are counted.
+bool hotset_enabled();
+
+// Counts a request answered with the file target of size bytes.
+void hotset_touch(const char* target, uint64_t size);
+
+// Writes the manifest now, eg. before the process exits.
+int hotset_flush();
+
+// Accepts targets to warm on the Unix domain control socket path. Each connection writes them
+// one per line and reads back how many were queued.
+int hotset_listen(const char* path);
+
+void hotset_stats(hotset_stats_t* out_stats);
+
+#endif /* HOTSET_H */
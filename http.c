@@ -1,28 +1,26 @@
 #include "http.h"
 
-///// Parsing /////
-static regex_t starting_line;
-static regex_t verify_target_file;
+#include <pthread.h>
+#include "scan.h"
 
-static regex_t header;
+///// Parsing /////
+// The request line, the target and the shape of a header are checked with the scan kernels,
+// the names of the headers looked for with the regexes.
 static regex_t connection;
 static regex_t connection_close;
 static regex_t content_type;
 static regex_t content_length;
 static regex_t server;
+static regex_t upgrade;
+static regex_t upgrade_h2c;
+static regex_t http2_settings;
+static regex_t via_serwer;
 
 // Returns 0 on a success
 static int compile_regexes() {
     int flags = REG_EXTENDED | REG_NOSUB;
     int flags_icase = flags | REG_ICASE;
 
-    if (regcomp(&starting_line, "^[^ \t\n\r\f\v]+ \\/[^ \t\n\r\f\v]* HTTP\\/1\\.1$", flags) == -1)
-        return -1;
-    if (regcomp(&verify_target_file, "^\\/[a-zA-Z0-9\\.\\/|-]*$", flags) == -1)
-        return -1;
-
-    if (regcomp(&header, "^[^ \t\n\r\f\v:]+:[ ]*.+[ ]*$", flags) == -1)
-        return -1;
     if (regcomp(&connection, "^Connection:", flags_icase) == -1)
         return -1;
     if (regcomp(&connection_close, "^[^ \t\n\r\f\v]+:[ ]*close[ ]*$", flags) == -1)
@@ -33,6 +31,15 @@ static int compile_regexes() {
         return -1;
     if (regcomp(&server, "^Server:", flags_icase) == -1)
         return -1;
+    if (regcomp(&upgrade, "^Upgrade:", flags_icase) == -1)
+        return -1;
+    if (regcomp(&upgrade_h2c, "^[^ \t\n\r\f\v]+:[ ]*h2c[ ]*$", flags) == -1)
+        return -1;
+    if (regcomp(&http2_settings, "^HTTP2-Settings:", flags_icase) == -1)
+        return -1;
+    // A member of the list, which may be spread over many Via headers.
+    if (regcomp(&via_serwer, "^Via:(.*,)?[ ]*1\\.1 serwer[ ]*(,.*)?$", flags_icase) == -1)
+        return -1;
     
     return 0;
 }
@@ -41,17 +48,22 @@ static int parse_starting_line(char* raw, starting_t* out);
 static int parse_headers(char* raw, headers_t* out);
 static int parse_header(char* raw, headers_t* out);
 
+static pthread_once_t regex_once = PTHREAD_ONCE_INIT;
+static bool regex_compiled = false;
+
+static void compile_regexes_once() {
+    regex_compiled = compile_regexes() == 0;
+}
+
 int parse_http_request(char* raw, request_t* out) {
-    static bool regex_compiled = false;
     int ret;
 
-    if (!regex_compiled) {
-        regex_compiled = true;
-        if (compile_regexes() != 0) return PARSE_INTERNAL_ERR;
-    }
+    // Requests are parsed by many threads at once.
+    pthread_once(&regex_once, compile_regexes_once);
+    if (!regex_compiled) return PARSE_INTERNAL_ERR;
 
     // Get the starting line
-    char* headers = strchr(raw, '\r');
+    char* headers = (char*)scan_find(raw, strlen(raw), '\r');
     if (!headers) {
         return PARSE_INTERNAL_ERR;  // At least one '\r' should exist.
                                     // A proper HTTP label ends with CRLF'\0' (before the body).
@@ -71,10 +83,14 @@ int parse_http_request(char* raw, request_t* out) {
 }
 
 static int parse_starting_line(char* raw, starting_t* out) {
-    int ret;
-
-    ret = regexec(&starting_line, raw, 0, NULL, 0);
-    if (ret == REG_NOMATCH)
+    // METHOD /TARGET HTTP/1.1, the method and the target without whitespace.
+    const char version[] = " HTTP/1.1";
+    size_t size = strlen(raw);
+    size_t method_size = scan_span(raw, size, &scan_word);
+    if (method_size == 0 || raw[method_size] != ' ' || raw[method_size + 1] != '/')
+        return PARSE_BAD_REQ;
+    size_t target_end = method_size + 1 + scan_span(raw + method_size + 1, size - method_size - 1, &scan_word);
+    if (size - target_end != sizeof(version) - 1 || memcmp(raw + target_end, version, sizeof(version) - 1) != 0)
         return PARSE_BAD_REQ;
 
     // Method
@@ -92,20 +108,13 @@ static int parse_starting_line(char* raw, starting_t* out) {
     }
 
     // Target file
-    char* target_file = strchr(raw, ' ');
-    if (!target_file)
-        return PARSE_INTERNAL_ERR;
-    ++target_file;
-    
-    char* target_file_end = strchr(target_file, ' ');
-    if (!target_file_end)
-        return PARSE_INTERNAL_ERR;
-    *target_file_end = '\0';
+    char* target_file = raw + method_size + 1;
+    size_t target_size = target_end - method_size - 1;
+    target_file[target_size] = '\0';
 
     out->target = target_file;
 
-    ret = regexec(&verify_target_file, target_file, 0, NULL, 0);
-    if (ret == REG_NOMATCH)
+    if (scan_span(target_file, target_size, &scan_target) != target_size)
         out->target_type = F_INCORRECT;
     else
         out->target_type = F_OK;
@@ -118,7 +127,12 @@ static int parse_headers(char* raw, headers_t* out) {
     out->checked_header[H_CONTENT_LENGTH] = false;
     out->checked_header[H_CONTENT_TYPE] = false;
     out->checked_header[H_SERVER] = false;
+    out->checked_header[H_UPGRADE] = false;
+    out->checked_header[H_HTTP2_SETTINGS] = false;
     out->con_close = false;
+    out->upgrade_h2c = false;
+    out->http2_settings = NULL;
+    out->via_serwer = false;
 
     while (*raw != '\0') {
         char* next_header = strchr(raw, '\r');
@@ -139,10 +153,12 @@ static int parse_headers(char* raw, headers_t* out) {
 }
 
 static int parse_header(char* raw, headers_t* out) {
-    int ret = regexec(&header, raw, 0, NULL, 0);
-    if (ret == REG_NOMATCH)
+    // NAME:VALUE, the name without whitespace, the value not empty.
+    size_t name_size = scan_span(raw, strlen(raw), &scan_name);
+    if (name_size == 0 || raw[name_size] != ':' || raw[name_size + 1] == '\0')
         return PARSE_BAD_REQ;
-    
+
+    int ret;    
     ret = regexec(&connection, raw, 0, NULL, 0);
     if (ret == 0) {
         if (out->checked_header[H_CONNECTION])
@@ -176,127 +192,75 @@ static int parse_header(char* raw, headers_t* out) {
         return PARSE_SUCCESS;
     }
 
+    ret = regexec(&upgrade, raw, 0, NULL, 0);
+    if (ret == 0) {
+        if (out->checked_header[H_UPGRADE])
+            return PARSE_BAD_REQ; // Double header
+        out->checked_header[H_UPGRADE] = true;
+
+        // Other protocols are not offered, the request is served as it is.
+        ret = regexec(&upgrade_h2c, raw, 0, NULL, 0);
+        out->upgrade_h2c = (ret == 0);
+        return PARSE_SUCCESS;
+    }
+
+    ret = regexec(&http2_settings, raw, 0, NULL, 0);
+    if (ret == 0) {
+        if (out->checked_header[H_HTTP2_SETTINGS])
+            return PARSE_BAD_REQ; // Double header
+        out->checked_header[H_HTTP2_SETTINGS] = true;
+
+        char* value = strchr(raw, ':') + 1;
+        while (*value == ' ')
+            value++;
+        out->http2_settings = value;
+        return PARSE_SUCCESS;
+    }
+
+    if (regexec(&via_serwer, raw, 0, NULL, 0) == 0) {
+        out->via_serwer = true;
+        return PARSE_SUCCESS;
+    }
+
     // Otherwise the header is ignored.
     return PARSE_SUCCESS;
 }
 
 void parse_http_clean() {
-    regfree(&starting_line);
-    regfree(&verify_target_file);
-
-    regfree(&header);
     regfree(&connection);
     regfree(&connection_close);
     regfree(&content_type);
     regfree(&content_length);
     regfree(&server);
+    regfree(&upgrade);
+    regfree(&upgrade_h2c);
+    regfree(&http2_settings);
+    regfree(&via_serwer);
 }
 
-///// Sending /////
-static int send_msg(int target, const char* message, size_t msg_size) {
-    if (write(target, message, msg_size) != msg_size)
-        return SEND_ERROR;
-    return SEND_OK;
-}
-
-int send_success(int target, request_t* response) {
-    static const char* base_msg = "HTTP/1.1 200 OK\r\n";
-    static size_t base_msg_size = 17;
-
-    /// Content-Type header ///
-    // strlen("Content-Type:") = 13, strlen("\r\n") = 2
-    size_t content_type_size = 13 + strlen(response->headers.content_type) + 2;
-    char* content_type = malloc(content_type_size + 1);
-    if (!content_type) {
-        return SEND_ERROR;
-    }
-
-    if (strcpy(content_type, "Content-Type:") == NULL) {
-        free(content_type);
-        return SEND_ERROR;
-    }
-    if (strcpy(content_type + 13, response->headers.content_type) == NULL) {
-        free(content_type);
-        return SEND_ERROR;
-    }
-    content_type[content_type_size - 2] = '\r';
-    content_type[content_type_size - 1] = '\n';
-
-    /// Content-Length header with additional CRLF ///
-    char* content_len = malloc(21);  // maximum size_t is less than 2*10^20
-    if (!content_len) {
-        free(content_type);
-        return SEND_ERROR;
-    }
-    int content_len_size = snprintf(content_len, 20, "%lu", response->headers.content_len);
-    if (content_len_size < 0) {
-        free(content_len);
-        free(content_type);
-        return SEND_ERROR;
-    }
-
-    // strlen("Content-Length:") = 15, strlen("\r\n\r\n") = 4
-    size_t content_lenh_size = 15 + content_len_size + 4;
-    char* content_lenh = malloc(content_lenh_size + 1);
-    if (!content_len) {
-        free(content_len);
-        free(content_type);
-        return SEND_ERROR;
-    }
-    if (strcpy(content_lenh, "Content-Length:") == NULL) {
-        free(content_lenh);
-        free(content_len);
-        free(content_type);
-        return SEND_ERROR;
-    }
-    if (strcpy(content_lenh + 15, content_len) == NULL) {
-        free(content_lenh);
-        free(content_len);
-        free(content_type);
-        return SEND_ERROR;
-    } free(content_len);
-    content_lenh[content_lenh_size - 4] = '\r';
-    content_lenh[content_lenh_size - 3] = '\n';
-    content_lenh[content_lenh_size - 2] = '\r';
-    content_lenh[content_lenh_size - 1] = '\n';
-
-    /// Concatenate all parts ///
-    size_t result_size = base_msg_size + content_type_size + content_lenh_size;
-    char* result = malloc(result_size + 1);
+///// Rendering /////
+int render_success(request_t* response, arena_t* arena, char** out_msg, size_t* out_msg_size) {
+    // strlen("HTTP/1.1 200 OK\r\n") = 17, strlen("Content-Type:") + strlen("\r\n") = 15,
+    // strlen("Content-Length:") + strlen("\r\n\r\n") = 19, maximum size_t is less than 2*10^20
+    size_t result_size = 17 + 15 + strlen(response->headers.content_type) + 19 + 20;
+    char* result = arena_alloc(arena, result_size + 1);
     if (!result) {
-        free(content_lenh);
-        free(content_type);
         return SEND_ERROR;
     }
-    if (strcpy(result, base_msg) == NULL) {
-        free(result);
-        free(content_lenh);
-        free(content_type);
+
+    int written = snprintf(result, result_size + 1,
+                           "HTTP/1.1 200 OK\r\nContent-Type:%s\r\nContent-Length:%zu\r\n\r\n",
+                           response->headers.content_type, response->headers.content_len);
+    if (written < 0 || (size_t)written > result_size) {
         return SEND_ERROR;
     }
-    if (strcpy(result + base_msg_size, content_type) == NULL) {
-        free(result);
-        free(content_lenh);
-        free(content_type);
-        return SEND_ERROR;
-    } free(content_type);
-    if (strcpy(result + base_msg_size + content_type_size, content_lenh) == NULL) {
-        free(result);
-        free(content_lenh);
-        free(content_type);
-        return SEND_ERROR;
-    } free(content_lenh);
 
-    int ret = send_msg(target, result, result_size);
-    free(result);
-    return ret;
-}
-
-int send_body_chunk(int target, const char* chunk, size_t chunk_size) {
-    return send_msg(target, chunk, chunk_size);
+    *out_msg = result;
+    *out_msg_size = written;
+    return SEND_OK;
 }
 
-int send_found(int target, const char* filename, const char* address) {
+int render_found(const char* filename, const char* address, char** out_msg, size_t* out_msg_size) {
     static const char* err_msg = "HTTP/1.1 302 Found\r\n";
     static size_t err_msg_size = 20;
 
@@ -313,53 +277,56 @@ int send_found(int target, const char* filename, const char* address) {
     if (!result) {
         return SEND_ERROR;
     }
-    result[result_size] = '\0';
-    if (strcpy(result, err_msg) == NULL) {
-        free(result);
-        return SEND_ERROR;
-    }
-    if (strcpy(result + err_msg_size, "Location: http://") == NULL) {
-        free(result);
-        return SEND_ERROR;
-    }
-    if (strcpy(result + err_msg_size + 17, address) == NULL) {
-        free(result);
-        return SEND_ERROR;
-    }
-    if (strcpy(result + err_msg_size + 17 + address_size, filename) == NULL) {
-        free(result);
-        return SEND_ERROR;
-    }
-    result[result_size - 4] = '\r';
-    result[result_size - 3] = '\n';
-    result[result_size - 2] = '\r';
-    result[result_size - 1] = '\n';
-
-    int ret = send_msg(target, result, result_size);
-    free(result);
-    return ret;
-}
 
-int send_bad_request(int target) {
-    static const char* err_msg = "HTTP/1.1 400 Bad Request\r\nConnection:close\r\n\r\n";
-    static size_t err_msg_size = 46;
-    return send_msg(target, err_msg, err_msg_size);
-}
+    memcpy(result, err_msg, err_msg_size);
+    memcpy(result + err_msg_size, "Location: http://", 17);
+    memcpy(result + err_msg_size + 17, address, address_size);
+    memcpy(result + err_msg_size + 17 + address_size, filename, filename_size);
+    memcpy(result + result_size - 4, "\r\n\r\n", 4);
+    result[result_size] = '\0';
 
-int send_not_found(int target) {
-    static const char* err_msg = "HTTP/1.1 404 Not Found\r\n\r\n";
-    static size_t err_msg_size = 26;
-    return send_msg(target, err_msg, err_msg_size);
+    *out_msg = result;
+    *out_msg_size = result_size;
+    return SEND_OK;
 }
 
-int send_internal_server_error(int target) {
-    static const char* err_msg = "HTTP/1.1 500 Internal Server Error\r\nConnection:close\r\n\r\n";
-    static size_t err_msg_size = 56;
-    return send_msg(target, err_msg, err_msg_size);
+void take_static_response(int code, const char** out_msg, size_t* out_msg_size) {
+    static const char bad_request[] = "HTTP/1.1 400 Bad Request\r\nConnection:close\r\n\r\n";
+    static const char not_found[] = "HTTP/1.1 404 Not Found\r\n\r\n";
+    static const char too_many[] = "HTTP/1.1 429 Too Many Requests\r\nRetry-After:1\r\n\r\n";
+    static const char internal_error[] = "HTTP/1.1 500 Internal Server Error\r\nConnection:close\r\n\r\n";
+    static const char not_implemented[] = "HTTP/1.1 501 Not Implemented\r\n\r\n";
+    static const char bad_gateway[] = "HTTP/1.1 502 Bad Gateway\r\nConnection:close\r\n\r\n";
+    static const char unavailable[] = "HTTP/1.1 503 Service Unavailable\r\nRetry-After:1\r\nConnection:close\r\n\r\n";
+
+    switch (code) {
+    case C_BAD_REQUEST:
+        *out_msg = bad_request;
+        *out_msg_size = sizeof(bad_request) - 1;
+        break;
+    case C_NOT_FOUND:
+        *out_msg = not_found;
+        *out_msg_size = sizeof(not_found) - 1;
+        break;
+    case C_TOO_MANY:
+        *out_msg = too_many;
+        *out_msg_size = sizeof(too_many) - 1;
+        break;
+    case C_NOT_IMPLEMENTED:
+        *out_msg = not_implemented;
+        *out_msg_size = sizeof(not_implemented) - 1;
+        break;
+    case C_BAD_GATEWAY:
+        *out_msg = bad_gateway;
+        *out_msg_size = sizeof(bad_gateway) - 1;
+        break;
+    case C_UNAVAILABLE:
+        *out_msg = unavailable;
+        *out_msg_size = sizeof(unavailable) - 1;
+        break;
+    default: /* C_INTERNAL_ERROR */
+        *out_msg = internal_error;
+        *out_msg_size = sizeof(internal_error) - 1;
+        break;
+    }
 }
-
-int send_not_implemented(int target) {
-    static const char* err_msg = "HTTP/1.1 501 Not Implemented\r\n\r\n";
-    static size_t err_msg_size = 32;
-    return send_msg(target, err_msg, err_msg_size);
-}
\ No newline at end of file
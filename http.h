@@ -8,6 +8,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include "arena.h"
 
 ///// Methods /////
 #define M_OTHER 0
@@ -19,6 +20,11 @@
 #define H_CONTENT_TYPE   1
 #define H_CONTENT_LENGTH 2
 #define H_SERVER         3
+#define H_UPGRADE        4
+#define H_HTTP2_SETTINGS 5
+
+// Put into the requests to the corelated servers, a request carrying it is not passed on again.
+#define HTTP_VIA "1.1 serwer"
 
 ///// Target files /////
 #define F_OK         0   // Filename falls under the regex [a-zA-Z0-9\.-/]*
@@ -39,8 +45,11 @@ typedef struct http_headers {
     char* content_type;
     size_t content_len;
     char* server;
+    bool upgrade_h2c;       // Upgrade: h2c, see h2.h.
+    char* http2_settings;   // Value of HTTP2-Settings, NULL if missing.
+    bool via_serwer;        // Via lists HTTP_VIA, a serwer has passed the request on.
 
-    bool checked_header[4]; // Marks header fields which had been read.
+    bool checked_header[6]; // Marks header fields which had been read.
                             // According to "Header fields".
 } headers_t;
 
@@ -70,31 +79,46 @@ int parse_http_request(char* raw, request_t* out);
 void parse_http_clean();
 
 ///// Response codes /////
+#define C_SWITCHING       101
 #define C_OK              200
 #define C_FOUND           302
 #define C_BAD_REQUEST     400
 #define C_NOT_FOUND       404
+#define C_TOO_MANY        429
 #define C_INTERNAL_ERROR  500
 #define C_NOT_IMPLEMENTED 501
+#define C_BAD_GATEWAY     502
+#define C_UNAVAILABLE     503
 
+#define STR_SWITCHING       "Switching Protocols"
 #define STR_OK              "OK"
 #define STR_FOUND           "Found"
 #define STR_BAD_REQUEST     ("Bad Request")
 #define STR_NOT_FOUND       ("Not Found")
+#define STR_TOO_MANY        ("Too Many Requests")
 #define STR_INTERNAL_ERROR  ("Internal Server Error")
 #define STR_NOT_IMPLEMENTED ("Not Implemented")
+#define STR_BAD_GATEWAY     ("Bad Gateway")
+#define STR_UNAVAILABLE     ("Service Unavailable")
 
 // Send returns
 #define SEND_ERROR -1
 #define SEND_OK     0
 
-// Sends only the heading.
-int send_success(int target, request_t* response);
-int send_body_chunk(int target, const char* chunk, size_t chunk_size);
-int send_found(int target, const char* filename, const char* address);
-int send_bad_request(int target);
-int send_not_found(int target);
-int send_internal_server_error(int target);
-int send_not_implemented(int target);
+// Responses are rendered into memory and written by the caller,
+// whose sockets do not block.
+
+// Builds only the heading, in arena.
+int render_success(request_t* response, arena_t* arena, char** out_msg, size_t* out_msg_size);
+
+// Gives the complete response with the status code, which does not depend on the request.
+// code is one of C_BAD_REQUEST, C_NOT_FOUND, C_TOO_MANY, C_INTERNAL_ERROR, C_NOT_IMPLEMENTED,
+// C_BAD_GATEWAY and C_UNAVAILABLE.
+void take_static_response(int code, const char** out_msg, size_t* out_msg_size);
+
+// Builds a complete 302 response redirecting to http://address + filename.
+// address is in the form "ip:port".
+// *out_msg is allocated with malloc and has to be freed by the caller.
+int render_found(const char* filename, const char* address, char** out_msg, size_t* out_msg_size);
 
 #endif /* HTTP_H */
@@ -0,0 +1,186 @@
+#define _GNU_SOURCE  // accept4, pipe2, splice
+
+#include "instrument.h"
+
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+typedef struct instrument_totals {
+    _Atomic uint64_t requests;
+    _Atomic uint64_t allocs;
+    _Atomic uint64_t frees;
+    _Atomic uint64_t syscalls;
+    _Atomic uint64_t max_allocs;
+    _Atomic uint64_t max_syscalls;
+} instrument_totals_t;
+
+static instrument_totals_t instrument_totals[INSTRUMENT_OUTCOMES];
+static __thread instrument_counts_t* instrument_current = NULL;
+
+void instrument_enter(instrument_counts_t* counts) {
+    instrument_current = counts;
+}
+
+void instrument_leave() {
+    instrument_current = NULL;
+}
+
+int instrument_outcome(int status, bool head) {
+    switch (status) {
+    case 200: return head ? INSTRUMENT_HEAD : INSTRUMENT_GET;
+    case 302: return INSTRUMENT_FOUND;
+    case 404: return INSTRUMENT_NOT_FOUND;
+    case 400: return INSTRUMENT_BAD_REQ;
+    case 501: return INSTRUMENT_NOT_IMPL;
+    default:  return INSTRUMENT_OTHER;
+    }
+}
+
+static void instrument_raise(_Atomic uint64_t* max, uint64_t value) {
+    uint64_t seen = atomic_load_explicit(max, memory_order_relaxed);
+    while (seen < value && !atomic_compare_exchange_weak_explicit(max, &seen, value, memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+void instrument_finish(instrument_counts_t* counts, int outcome) {
+    instrument_totals_t* totals = &instrument_totals[outcome];
+    atomic_fetch_add_explicit(&totals->requests, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&totals->allocs, counts->allocs, memory_order_relaxed);
+    atomic_fetch_add_explicit(&totals->frees, counts->frees, memory_order_relaxed);
+    atomic_fetch_add_explicit(&totals->syscalls, counts->syscalls, memory_order_relaxed);
+    instrument_raise(&totals->max_allocs, counts->allocs);
+    instrument_raise(&totals->max_syscalls, counts->syscalls);
+    counts->allocs = 0;
+    counts->frees = 0;
+    counts->syscalls = 0;
+}
+
+const char* instrument_outcome_name(int outcome) {
+    static const char* names[INSTRUMENT_OUTCOMES] = {"get", "head", "302", "404", "400", "501", "other"};
+    return names[outcome];
+}
+
+void instrument_stats(int outcome, instrument_stats_t* out_stats) {
+    instrument_totals_t* totals = &instrument_totals[outcome];
+    out_stats->requests = atomic_load_explicit(&totals->requests, memory_order_relaxed);
+    out_stats->allocs = atomic_load_explicit(&totals->allocs, memory_order_relaxed);
+    out_stats->frees = atomic_load_explicit(&totals->frees, memory_order_relaxed);
+    out_stats->syscalls = atomic_load_explicit(&totals->syscalls, memory_order_relaxed);
+    out_stats->max_allocs = atomic_load_explicit(&totals->max_allocs, memory_order_relaxed);
+    out_stats->max_syscalls = atomic_load_explicit(&totals->max_syscalls, memory_order_relaxed);
+}
+
+///// Wrappers /////
+// The counting comes first, free may release the connection holding the counts.
+#define COUNT(field) do { if (instrument_current) instrument_current->field++; } while (0)
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+int __real_posix_memalign(void** out_ptr, size_t alignment, size_t size);
+void* __real_aligned_alloc(size_t alignment, size_t size);
+char* __real_strdup(const char* str);
+char* __real_strndup(const char* str, size_t size);
+void __real_free(void* ptr);
+
+void* __wrap_malloc(size_t size) {
+    COUNT(allocs);
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+    COUNT(allocs);
+    return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+    COUNT(allocs);
+    return __real_realloc(ptr, size);
+}
+
+int __wrap_posix_memalign(void** out_ptr, size_t alignment, size_t size) {
+    COUNT(allocs);
+    return __real_posix_memalign(out_ptr, alignment, size);
+}
+
+void* __wrap_aligned_alloc(size_t alignment, size_t size) {
+    COUNT(allocs);
+    return __real_aligned_alloc(alignment, size);
+}
+
+char* __wrap_strdup(const char* str) {
+    COUNT(allocs);
+    return __real_strdup(str);
+}
+
+char* __wrap_strndup(const char* str, size_t size) {
+    COUNT(allocs);
+    return __real_strndup(str, size);
+}
+
+void __wrap_free(void* ptr) {
+    if (ptr)
+        COUNT(frees);
+    __real_free(ptr);
+}
+
+// System calls, with the arguments passed on as they are.
+#define SYSCALL(ret, name, params, args) \
+    ret __real_##name params; \
+    ret __wrap_##name params { COUNT(syscalls); return __real_##name args; }
+
+SYSCALL(ssize_t, read, (int fd, void* buf, size_t size), (fd, buf, size))
+SYSCALL(ssize_t, write, (int fd, const void* buf, size_t size), (fd, buf, size))
+SYSCALL(ssize_t, pread, (int fd, void* buf, size_t size, off_t offset), (fd, buf, size, offset))
+SYSCALL(ssize_t, readv, (int fd, const struct iovec* iov, int count), (fd, iov, count))
+SYSCALL(ssize_t, writev, (int fd, const struct iovec* iov, int count), (fd, iov, count))
+SYSCALL(ssize_t, sendfile, (int out_fd, int in_fd, off_t* offset, size_t size), (out_fd, in_fd, offset, size))
+SYSCALL(ssize_t, splice, (int in_fd, loff_t* in_off, int out_fd, loff_t* out_off, size_t size, unsigned flags),
+        (in_fd, in_off, out_fd, out_off, size, flags))
+SYSCALL(ssize_t, send, (int fd, const void* buf, size_t size, int flags), (fd, buf, size, flags))
+SYSCALL(ssize_t, recv, (int fd, void* buf, size_t size, int flags), (fd, buf, size, flags))
+SYSCALL(int, close, (int fd), (fd))
+SYSCALL(int, fstat, (int fd, struct stat* st), (fd, st))
+SYSCALL(int, stat, (const char* path, struct stat* st), (path, st))
+SYSCALL(int, lstat, (const char* path, struct stat* st), (path, st))
+SYSCALL(int, accept4, (int fd, struct sockaddr* addr, socklen_t* addr_len, int flags), (fd, addr, addr_len, flags))
+SYSCALL(int, socket, (int domain, int type, int protocol), (domain, type, protocol))
+SYSCALL(int, connect, (int fd, const struct sockaddr* addr, socklen_t addr_len), (fd, addr, addr_len))
+SYSCALL(int, setsockopt, (int fd, int level, int name, const void* value, socklen_t size), (fd, level, name, value, size))
+SYSCALL(int, shutdown, (int fd, int how), (fd, how))
+SYSCALL(int, pipe2, (int fds[2], int flags), (fds, flags))
+SYSCALL(int, epoll_ctl, (int epoll_fd, int op, int fd, struct epoll_event* event), (epoll_fd, op, fd, event))
+SYSCALL(int, epoll_wait, (int epoll_fd, struct epoll_event* events, int count, int timeout), (epoll_fd, events, count, timeout))
+SYSCALL(void*, mmap, (void* addr, size_t size, int prot, int flags, int fd, off_t offset), (addr, size, prot, flags, fd, offset))
+SYSCALL(int, munmap, (void* addr, size_t size), (addr, size))
+SYSCALL(int, madvise, (void* addr, size_t size, int advice), (addr, size, advice))
+
+// open and fcntl take a third argument only for some flags and commands, it is passed on anyway.
+int __real_open(const char* path, int flags, ...);
+int __wrap_open(const char* path, int flags, ...) {
+    va_list args;
+    va_start(args, flags);
+    mode_t mode = flags & (O_CREAT | O_TMPFILE) ? va_arg(args, mode_t) : 0;
+    va_end(args);
+    COUNT(syscalls);
+    return __real_open(path, flags, mode);
+}
+
+int __real_fcntl(int fd, int cmd, ...);
+int __wrap_fcntl(int fd, int cmd, ...) {
+    va_list args;
+    va_start(args, cmd);
+    long arg = va_arg(args, long);
+    va_end(args);
+    COUNT(syscalls);
+    return __real_fcntl(fd, cmd, arg);
+}
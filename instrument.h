@@ -0,0 +1,54 @@
+#ifndef INSTRUMENT_H
+#define INSTRUMENT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Counting of allocations and system calls per request, in the instrumentation build only
+// (cmake -DSERWER_INSTRUMENT=ON). malloc, free and the system calls the server makes are
+// wrapped by the linker (--wrap), each call is counted to the connection, which its event loop
+// drives at the moment. Once the response is finished, the counts go to its outcome.
+// Calls on other threads, eg. of the I/O pool, and between the turns are not counted.
+// file_bench is always linked with the wrappers, it counts the calls of each request it makes.
+
+// Outcomes //
+#define INSTRUMENT_GET        0   // 200 to a GET
+#define INSTRUMENT_HEAD       1   // 200 to a HEAD
+#define INSTRUMENT_FOUND      2   // 302
+#define INSTRUMENT_NOT_FOUND  3   // 404
+#define INSTRUMENT_BAD_REQ    4   // 400
+#define INSTRUMENT_NOT_IMPL   5   // 501
+#define INSTRUMENT_OTHER      6
+#define INSTRUMENT_OUTCOMES   7
+
+typedef struct instrument_counts {
+    uint32_t allocs;           // malloc, calloc, realloc and the like
+    uint32_t frees;
+    uint32_t syscalls;
+} instrument_counts_t;
+
+typedef struct instrument_stats {
+    uint64_t requests;
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t syscalls;
+    uint64_t max_allocs;       // Of a single request.
+    uint64_t max_syscalls;
+} instrument_stats_t;
+
+// Counts the calls of this thread to counts, until instrument_leave.
+void instrument_enter(instrument_counts_t* counts);
+void instrument_leave();
+
+// Returns the outcome of a response with the HTTP status, head tells whether it was to a HEAD.
+int instrument_outcome(int status, bool head);
+
+// Adds the counts of a finished response to its outcome, and resets them for the next one.
+void instrument_finish(instrument_counts_t* counts, int outcome);
+
+// Returns the name of the outcome, as used in the metrics.
+const char* instrument_outcome_name(int outcome);
+
+void instrument_stats(int outcome, instrument_stats_t* out_stats);
+
+#endif /* INSTRUMENT_H */
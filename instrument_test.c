@@ -0,0 +1,270 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "instrument.h"
+
+// Runs serwer of the instrumentation build, sends it requests of every outcome and checks the allocations
+// and system calls counted for them in its metrics. A GET of a cached file on a kept-alive connection
+// allocates nothing and makes TEST_CACHED_SYSCALLS calls: the read of the request, the write of the response
+// and the read, which finds the socket empty once the response is sent. The client pauses between
+// the requests, so that the server does find it empty. The other outcomes are held below their ceilings.
+//
+// Usage: instrument_test serwer
+
+#define TEST_GETS            16
+#define TEST_CACHED_SYSCALLS 3
+#define TEST_WAIT_MS         5000   // For serwer to start, and for the metrics to be written.
+#define TEST_POLL_MS         50
+#define TEST_PAUSE_MS        10     // Between the kept-alive requests.
+
+typedef struct test_case {
+    const char* request;
+    int outcome;
+    uint64_t max_allocs;       // Of the request.
+    uint64_t max_syscalls;
+} test_case_t;
+
+static const test_case_t test_cases[] = {
+    {"HEAD /a.txt HTTP/1.1\r\nConnection: close\r\n\r\n",     INSTRUMENT_HEAD,      0, 4},
+    {"GET /remote.txt HTTP/1.1\r\nConnection: close\r\n\r\n", INSTRUMENT_FOUND,     0, 4},
+    {"GET /nope HTTP/1.1\r\nConnection: close\r\n\r\n",       INSTRUMENT_NOT_FOUND, 0, 4},
+    {"GET nope HTTP/1.1\r\n\r\n",                             INSTRUMENT_BAD_REQ,   0, 4},
+    {"POST /a.txt HTTP/1.1\r\nConnection: close\r\n\r\n",     INSTRUMENT_NOT_IMPL,  0, 4},
+};
+
+static char test_dir[] = "/tmp/instrument_test.XXXXXX";
+static char test_metrics[sizeof(test_dir) + 16];
+static pid_t test_serwer = -1;
+static uint16_t test_port;
+static int test_failures = 0;
+
+static void sleep_ms(long ms) {
+    struct timespec interval = {.tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000};
+    nanosleep(&interval, NULL);
+}
+
+static void cleanup() {
+    if (test_serwer != -1) {
+        kill(test_serwer, SIGTERM);
+        waitpid(test_serwer, NULL, 0);
+    }
+    char path[sizeof(test_dir) + 32];
+    const char* files[] = {"root/a.txt", "root", "cos.txt", "metrics", "metrics.tmp"};
+    for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); ++i) {
+        snprintf(path, sizeof(path), "%s/%s", test_dir, files[i]);
+        remove(path);
+    }
+    rmdir(test_dir);
+}
+
+static void die(const char* what) {
+    fprintf(stderr, "%s: %s\n", what, errno ? strerror(errno) : "failed");
+    cleanup();
+    exit(EXIT_FAILURE);
+}
+
+static void write_file(const char* name, const char* content) {
+    char path[sizeof(test_dir) + 32];
+    snprintf(path, sizeof(path), "%s/%s", test_dir, name);
+    FILE* file = fopen(path, "w");
+    if (!file || fputs(content, file) == EOF || fclose(file) != 0)
+        die(path);
+}
+
+// Takes a port, which nothing listens on.
+static uint16_t free_port() {
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t addr_len = sizeof(addr);
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == -1 || bind(sock, (struct sockaddr*)&addr, addr_len) == -1
+        || getsockname(sock, (struct sockaddr*)&addr, &addr_len) == -1)
+        die("free_port");
+    close(sock);
+    return ntohs(addr.sin_port);
+}
+
+static int connect_serwer() {
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(test_port),
+                               .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == -1)
+        return -1;
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static void start_serwer(const char* serwer) {
+    char root[sizeof(test_dir) + 16], cos[sizeof(test_dir) + 16], port[8];
+    snprintf(root, sizeof(root), "%s/root", test_dir);
+    snprintf(cos, sizeof(cos), "%s/cos.txt", test_dir);
+    snprintf(port, sizeof(port), "%u", test_port);
+
+    test_serwer = fork();
+    if (test_serwer == -1)
+        die("fork");
+    if (test_serwer == 0) {
+        execl(serwer, serwer, "-w", "1", "--metrics", test_metrics, root, cos, port, (char*)NULL);
+        _exit(127);
+    }
+
+    for (int waited = 0; waited < TEST_WAIT_MS; waited += TEST_POLL_MS) {
+        int sock = connect_serwer();
+        if (sock != -1) {
+            close(sock);
+            return;
+        }
+        sleep_ms(TEST_POLL_MS);
+    }
+    die("serwer does not listen");
+}
+
+// Sends the request and reads its response: until the socket is closed, or its body is complete if keep_alive.
+static void exchange(int sock, const char* request, bool keep_alive) {
+    if (write(sock, request, strlen(request)) != (ssize_t)strlen(request))
+        die("write");
+
+    char response[4096];
+    size_t size = 0;
+    for (;;) {
+        if (keep_alive) {
+            response[size] = '\0';
+            const char* end = strstr(response, "\r\n\r\n");
+            const char* length = strstr(response, "Content-Length:");
+            if (end && length && size >= (size_t)(end + 4 - response) + strtoull(length + 15, NULL, 10))
+                return;
+        }
+        ssize_t ret = read(sock, response + size, sizeof(response) - 1 - size);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret == -1)
+            die("read");
+        if (ret == 0)
+            return;
+        size += ret;
+    }
+}
+
+static void request_once(const char* request) {
+    int sock = connect_serwer();
+    if (sock == -1)
+        die("connect");
+    exchange(sock, request, false);
+    close(sock);
+}
+
+// Reads the value of the metric for the outcome, false if it is not written yet.
+static bool read_metric(const char* name, int outcome, uint64_t* out_value) {
+    char buffer[16384];
+    FILE* file = fopen(test_metrics, "r");
+    if (!file)
+        return false;
+    size_t size = fread(buffer, 1, sizeof(buffer) - 1, file);
+    fclose(file);
+    buffer[size] = '\0';
+
+    char key[128];
+    snprintf(key, sizeof(key), "\n%s{outcome=\"%s\"} ", name, instrument_outcome_name(outcome));
+    const char* line = strstr(buffer, key);
+    if (!line)
+        return false;
+    *out_value = strtoull(line + strlen(key), NULL, 10);
+    return true;
+}
+
+// Waits until the metrics count the requests of the outcome.
+static void wait_requests(int outcome, uint64_t requests) {
+    for (int waited = 0; waited < TEST_WAIT_MS; waited += TEST_POLL_MS) {
+        uint64_t counted;
+        if (read_metric("serwer_instrumented_requests_total", outcome, &counted) && counted >= requests)
+            return;
+        sleep_ms(TEST_POLL_MS);
+    }
+    fprintf(stderr, "%s: the metrics do not count %" PRIu64 " requests\n", instrument_outcome_name(outcome), requests);
+    cleanup();
+    exit(EXIT_FAILURE);
+}
+
+static uint64_t metric(const char* name, int outcome) {
+    uint64_t value;
+    if (!read_metric(name, outcome, &value)) {
+        fprintf(stderr, "%s{outcome=\"%s\"} is not in the metrics\n", name, instrument_outcome_name(outcome));
+        cleanup();
+        exit(EXIT_FAILURE);
+    }
+    return value;
+}
+
+static void expect(const char* what, int outcome, uint64_t value, uint64_t limit, bool exact) {
+    bool ok = exact ? value == limit : value <= limit;
+    printf("%-5s %-9s %" PRIu64 " (%s %" PRIu64 ")\n", instrument_outcome_name(outcome), what, value,
+           exact ? "expected" : "at most", limit);
+    if (!ok)
+        test_failures++;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s serwer\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (!mkdtemp(test_dir))
+        die("mkdtemp");
+    snprintf(test_metrics, sizeof(test_metrics), "%s/metrics", test_dir);
+    char root[sizeof(test_dir) + 16];
+    snprintf(root, sizeof(root), "%s/root", test_dir);
+    if (mkdir(root, 0755) == -1)
+        die(root);
+    write_file("root/a.txt", "hello\n");
+    write_file("cos.txt", "/remote.txt\t127.0.0.1\t8080\n");
+    test_port = free_port();
+    start_serwer(argv[1]);
+
+    // The first GET reads the file into the cache, and starts the connection.
+    int sock = connect_serwer();
+    if (sock == -1)
+        die("connect");
+    exchange(sock, "GET /a.txt HTTP/1.1\r\n\r\n", true);
+    wait_requests(INSTRUMENT_GET, 1);
+    uint64_t allocs = metric("serwer_request_allocations_total", INSTRUMENT_GET);
+    uint64_t syscalls = metric("serwer_request_syscalls_total", INSTRUMENT_GET);
+
+    for (int i = 0; i < TEST_GETS; ++i) {
+        sleep_ms(TEST_PAUSE_MS);
+        exchange(sock, "GET /a.txt HTTP/1.1\r\n\r\n", true);
+    }
+    close(sock);
+    wait_requests(INSTRUMENT_GET, 1 + TEST_GETS);
+    expect("allocs", INSTRUMENT_GET, metric("serwer_request_allocations_total", INSTRUMENT_GET) - allocs, 0, true);
+    expect("syscalls", INSTRUMENT_GET, metric("serwer_request_syscalls_total", INSTRUMENT_GET) - syscalls,
+           TEST_CACHED_SYSCALLS * TEST_GETS, true);
+
+    for (size_t i = 0; i < sizeof(test_cases) / sizeof(test_cases[0]); ++i)
+        request_once(test_cases[i].request);
+    for (size_t i = 0; i < sizeof(test_cases) / sizeof(test_cases[0]); ++i) {
+        const test_case_t* test = &test_cases[i];
+        wait_requests(test->outcome, 1);
+        expect("allocs", test->outcome, metric("serwer_request_allocations_max", test->outcome), test->max_allocs, false);
+        expect("syscalls", test->outcome, metric("serwer_request_syscalls_max", test->outcome), test->max_syscalls, false);
+    }
+
+    cleanup();
+    if (test_failures > 0) {
+        fprintf(stderr, "%d counts over their limits\n", test_failures);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,166 @@
+#include "iopool.h"
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Queue of a pool thread, a ring buffer.
+// The owner takes the oldest task, thieves take the newest one.
+typedef struct iopool_queue {
+    pthread_mutex_t mutex;
+    iopool_task_t** tasks;
+    size_t head;             // Index of the oldest task.
+    size_t count;
+} iopool_queue_t;
+
+static iopool_queue_t* iopool_queues = NULL;
+static unsigned iopool_threads = 0;
+static size_t iopool_max_depth = 0;
+static uint64_t iopool_max_wait_ns = 0;
+
+// Counts queued tasks, every thread takes one before looking for a task.
+static sem_t iopool_pending;
+
+static _Atomic uint64_t iopool_depth = 0;
+static _Atomic uint64_t iopool_peak_depth = 0;
+static _Atomic uint64_t iopool_submitted = 0;
+static _Atomic uint64_t iopool_rejected = 0;
+static _Atomic uint64_t iopool_completed = 0;
+static _Atomic uint64_t iopool_expired = 0;
+static _Atomic uint64_t iopool_stolen = 0;
+static _Atomic uint64_t iopool_wait_ns = 0;
+static _Atomic uint64_t iopool_max_wait_seen = 0;
+static _Atomic uint64_t iopool_run_ns = 0;
+
+uint64_t iopool_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void iopool_raise(_Atomic uint64_t* max, uint64_t value) {
+    uint64_t seen = atomic_load_explicit(max, memory_order_relaxed);
+    while (value > seen
+           && !atomic_compare_exchange_weak_explicit(max, &seen, value,
+                                                     memory_order_relaxed, memory_order_relaxed));
+}
+
+static iopool_task_t* iopool_take(iopool_queue_t* queue, bool oldest) {
+    iopool_task_t* task = NULL;
+
+    pthread_mutex_lock(&queue->mutex);
+    if (queue->count > 0) {
+        if (oldest) {
+            task = queue->tasks[queue->head];
+            queue->head = (queue->head + 1) % iopool_max_depth;
+        }
+        else {
+            task = queue->tasks[(queue->head + queue->count - 1) % iopool_max_depth];
+        }
+        queue->count--;
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return task;
+}
+
+static void* iopool_loop(void* arg) {
+    unsigned self = (unsigned)(uintptr_t)arg;
+
+    for (;;) {
+        while (sem_wait(&iopool_pending) != 0);
+
+        // A task is queued somewhere, the own queue is checked first.
+        iopool_task_t* task = iopool_take(&iopool_queues[self], true);
+        for (unsigned i = 1; !task; ++i) {
+            task = iopool_take(&iopool_queues[(self + i) % iopool_threads], false);
+            if (task)
+                atomic_fetch_add_explicit(&iopool_stolen, 1, memory_order_relaxed);
+        }
+
+        uint64_t started = iopool_now();
+        uint64_t waited = started - task->submitted;
+        atomic_fetch_add_explicit(&iopool_wait_ns, waited, memory_order_relaxed);
+        iopool_raise(&iopool_max_wait_seen, waited);
+
+        task->expired = iopool_max_wait_ns > 0 && waited > iopool_max_wait_ns;
+        if (task->expired) {
+            atomic_fetch_add_explicit(&iopool_expired, 1, memory_order_relaxed);
+        }
+        else {
+            task->run(task);
+            atomic_fetch_add_explicit(&iopool_run_ns, iopool_now() - started, memory_order_relaxed);
+            atomic_fetch_add_explicit(&iopool_completed, 1, memory_order_relaxed);
+        }
+
+        atomic_fetch_sub_explicit(&iopool_depth, 1, memory_order_relaxed);
+        task->done(task);
+    }
+    return NULL;
+}
+
+int iopool_start(unsigned threads, size_t max_depth, uint64_t max_wait_ms) {
+    if (threads == 0 || max_depth == 0)
+        return IOPOOL_ERR;
+
+    iopool_queues = calloc(threads, sizeof(iopool_queue_t));
+    if (!iopool_queues)
+        return IOPOOL_ERR;
+    iopool_threads = threads;
+    iopool_max_depth = max_depth;
+    iopool_max_wait_ns = max_wait_ms * 1000000;
+
+    if (sem_init(&iopool_pending, 0, 0) != 0)
+        return IOPOOL_ERR;
+
+    // Every queue can hold all the tasks, so submitting never finds it full.
+    for (unsigned i = 0; i < threads; ++i) {
+        iopool_queues[i].tasks = malloc(max_depth * sizeof(iopool_task_t*));
+        if (!iopool_queues[i].tasks || pthread_mutex_init(&iopool_queues[i].mutex, NULL) != 0)
+            return IOPOOL_ERR;
+    }
+
+    for (unsigned i = 0; i < threads; ++i) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, iopool_loop, (void*)(uintptr_t)i) != 0)
+            return IOPOOL_ERR;
+        pthread_detach(thread);
+    }
+    return IOPOOL_OK;
+}
+
+int iopool_submit(iopool_task_t* task, unsigned queue) {
+    uint64_t depth = atomic_fetch_add_explicit(&iopool_depth, 1, memory_order_relaxed) + 1;
+    if (depth > iopool_max_depth) {
+        atomic_fetch_sub_explicit(&iopool_depth, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&iopool_rejected, 1, memory_order_relaxed);
+        return IOPOOL_FULL;
+    }
+    iopool_raise(&iopool_peak_depth, depth);
+    atomic_fetch_add_explicit(&iopool_submitted, 1, memory_order_relaxed);
+
+    task->submitted = iopool_now();
+    iopool_queue_t* target = &iopool_queues[queue % iopool_threads];
+    pthread_mutex_lock(&target->mutex);
+    target->tasks[(target->head + target->count) % iopool_max_depth] = task;
+    target->count++;
+    pthread_mutex_unlock(&target->mutex);
+
+    sem_post(&iopool_pending);
+    return IOPOOL_OK;
+}
+
+void iopool_stats(iopool_stats_t* out_stats) {
+    out_stats->threads = iopool_threads;
+    out_stats->depth = atomic_load(&iopool_depth);
+    out_stats->peak_depth = atomic_load(&iopool_peak_depth);
+    out_stats->submitted = atomic_load(&iopool_submitted);
+    out_stats->rejected = atomic_load(&iopool_rejected);
+    out_stats->completed = atomic_load(&iopool_completed);
+    out_stats->expired = atomic_load(&iopool_expired);
+    out_stats->stolen = atomic_load(&iopool_stolen);
+    out_stats->wait_ns = atomic_load(&iopool_wait_ns);
+    out_stats->max_wait_ns = atomic_load(&iopool_max_wait_seen);
+    out_stats->run_ns = atomic_load(&iopool_run_ns);
+}
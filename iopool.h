@@ -0,0 +1,57 @@
+#ifndef IOPOOL_H
+#define IOPOOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Pool of threads running blocking file operations (open, stat, read) for the event loops.
+// Every thread has a queue of its own, tasks are submitted to the queue picked by the caller
+// and idle threads steal from the others, so one slow disk read does not hold up
+// the tasks queued behind it.
+
+// Return codes //
+#define IOPOOL_ERR  -1
+#define IOPOOL_OK    0
+#define IOPOOL_FULL  1   // The queue depth limit is reached.
+
+#define IOPOOL_DEFAULT_THREADS 4
+#define IOPOOL_DEFAULT_DEPTH   1024
+
+typedef struct iopool_task {
+    // Runs the operation on a pool thread. Not called when the task has expired.
+    void (*run)(struct iopool_task* task);
+    // Called after run, or instead of it, on the same thread. Usually posts the task back to its owner.
+    void (*done)(struct iopool_task* task);
+
+    bool expired;           // The task has waited in the queue longer than allowed and was not run.
+    uint64_t submitted;     // Monotonic time in nanoseconds.
+} iopool_task_t;
+
+typedef struct iopool_stats {
+    uint64_t threads;
+    uint64_t depth;         // Tasks queued or running.
+    uint64_t peak_depth;
+    uint64_t submitted;
+    uint64_t rejected;      // Not queued, because the depth limit was reached.
+    uint64_t completed;
+    uint64_t expired;
+    uint64_t stolen;        // Taken from the queue of another thread.
+    uint64_t wait_ns;       // Total time spent by tasks in the queues.
+    uint64_t max_wait_ns;
+    uint64_t run_ns;        // Total time spent running tasks.
+} iopool_stats_t;
+
+// Starts threads threads. At most max_depth tasks can be queued or running at once.
+// Tasks waiting for longer than max_wait_ms are expired instead of run, 0 means no limit.
+int iopool_start(unsigned threads, size_t max_depth, uint64_t max_wait_ms);
+
+// Queues task on the queue of the thread number queue (modulo the number of threads).
+int iopool_submit(iopool_task_t* task, unsigned queue);
+
+void iopool_stats(iopool_stats_t* out_stats);
+
+// Monotonic time in nanoseconds.
+uint64_t iopool_now();
+
+#endif /* IOPOOL_H */
@@ -0,0 +1,175 @@
+#include "metrics.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "accesslog.h"
+#include "bufpool.h"
+#include "bundle.h"
+#include "fcache.h"
+#include "hotset.h"
+#include "instrument.h"
+#include "iopool.h"
+#include "prefetch.h"
+#include "ratelimit.h"
+#include "server.h"
+#include "upstream.h"
+
+static char* metrics_path = NULL;
+static char* metrics_tmp_path = NULL;
+
+static void metrics_write(FILE* out) {
+    server_stats_t server;
+    server_stats(&server);
+    fprintf(out, "serwer_loops %" PRIu64 "\n", server.loops);
+    fprintf(out, "serwer_connections %" PRIu64 "\n", server.connections);
+    fprintf(out, "serwer_accepted_total %" PRIu64 "\n", server.accepted);
+    fprintf(out, "serwer_accept_dropped_total %" PRIu64 "\n", server.dropped);
+    fprintf(out, "serwer_requests_total %" PRIu64 "\n", server.requests);
+    fprintf(out, "serwer_offloaded_total %" PRIu64 "\n", server.offloaded);
+    fprintf(out, "serwer_overloaded_total %" PRIu64 "\n", server.overloaded);
+    fprintf(out, "serwer_preempted_total %" PRIu64 "\n", server.preempted);
+    fprintf(out, "serwer_shed_total %" PRIu64 "\n", server.shed);
+    fprintf(out, "serwer_queue_delay_seconds_total %.6f\n", server.delay_ns / 1e9);
+    fprintf(out, "serwer_h2_connections_total %" PRIu64 "\n", server.h2);
+    fprintf(out, "serwer_h2_streams_total %" PRIu64 "\n", server.streams);
+    fprintf(out, "serwer_batches_total %" PRIu64 "\n", server.batches);
+    fprintf(out, "serwer_buffer_waits_total %" PRIu64 "\n", server.buffer_waits);
+
+    iopool_stats_t io;
+    iopool_stats(&io);
+    fprintf(out, "serwer_io_threads %" PRIu64 "\n", io.threads);
+    fprintf(out, "serwer_io_queue_depth %" PRIu64 "\n", io.depth);
+    fprintf(out, "serwer_io_queue_peak_depth %" PRIu64 "\n", io.peak_depth);
+    fprintf(out, "serwer_io_submitted_total %" PRIu64 "\n", io.submitted);
+    fprintf(out, "serwer_io_rejected_total %" PRIu64 "\n", io.rejected);
+    fprintf(out, "serwer_io_completed_total %" PRIu64 "\n", io.completed);
+    fprintf(out, "serwer_io_expired_total %" PRIu64 "\n", io.expired);
+    fprintf(out, "serwer_io_stolen_total %" PRIu64 "\n", io.stolen);
+    fprintf(out, "serwer_io_wait_seconds_total %.6f\n", io.wait_ns / 1e9);
+    fprintf(out, "serwer_io_wait_seconds_max %.6f\n", io.max_wait_ns / 1e9);
+    fprintf(out, "serwer_io_run_seconds_total %.6f\n", io.run_ns / 1e9);
+
+    fcache_stats_t cache;
+    fcache_stats(&cache);
+    fprintf(out, "serwer_cache_hits_total %" PRIu64 "\n", cache.hits);
+    fprintf(out, "serwer_cache_misses_total %" PRIu64 "\n", cache.misses);
+    fprintf(out, "serwer_cache_coalesced_total %" PRIu64 "\n", cache.coalesced);
+    fprintf(out, "serwer_cache_stale_total %" PRIu64 "\n", cache.stale);
+    fprintf(out, "serwer_cache_evictions_total %" PRIu64 "\n", cache.evictions);
+    fprintf(out, "serwer_cache_bypassed_total %" PRIu64 "\n", cache.bypassed);
+    fprintf(out, "serwer_cache_entries %" PRIu64 "\n", cache.entries);
+    fprintf(out, "serwer_cache_bytes %" PRIu64 "\n", cache.bytes);
+
+    ratelimit_stats_t limits;
+    ratelimit_stats(&limits);
+    fprintf(out, "serwer_ratelimit_clients %" PRIu64 "\n", limits.clients);
+    fprintf(out, "serwer_ratelimit_rejected_conns_total %" PRIu64 "\n", limits.rejected_conns);
+    fprintf(out, "serwer_ratelimit_limited_requests_total %" PRIu64 "\n", limits.limited_requests);
+    fprintf(out, "serwer_ratelimit_throttled_writes_total %" PRIu64 "\n", limits.throttled_writes);
+    fprintf(out, "serwer_ratelimit_untracked_total %" PRIu64 "\n", limits.untracked);
+
+    upstream_stats_t upstream;
+    upstream_stats(&upstream);
+    fprintf(out, "serwer_upstream_connects_total %" PRIu64 "\n", upstream.connects);
+    fprintf(out, "serwer_upstream_reuses_total %" PRIu64 "\n", upstream.reuses);
+    fprintf(out, "serwer_upstream_failures_total %" PRIu64 "\n", upstream.failures);
+
+    accesslog_stats_t log;
+    accesslog_stats(&log);
+    fprintf(out, "serwer_accesslog_written_total %" PRIu64 "\n", log.written);
+    fprintf(out, "serwer_accesslog_dropped_total %" PRIu64 "\n", log.dropped);
+    fprintf(out, "serwer_accesslog_rotations_total %" PRIu64 "\n", log.rotations);
+    fprintf(out, "serwer_accesslog_write_errors_total %" PRIu64 "\n", log.write_errors);
+
+    bundle_stats_t bundle;
+    bundle_stats(&bundle);
+    fprintf(out, "serwer_bundle_files %" PRIu64 "\n", bundle.files);
+    fprintf(out, "serwer_bundle_bytes %" PRIu64 "\n", bundle.bytes);
+    fprintf(out, "serwer_bundle_reloads_total %" PRIu64 "\n", bundle.reloads);
+    fprintf(out, "serwer_bundle_reload_errors_total %" PRIu64 "\n", bundle.reload_errors);
+
+    hotset_stats_t hot;
+    hotset_stats(&hot);
+    fprintf(out, "serwer_hotset_files %" PRIu64 "\n", hot.files);
+    fprintf(out, "serwer_hotset_manifests_total %" PRIu64 "\n", hot.manifests);
+    fprintf(out, "serwer_hotset_warmed_total %" PRIu64 "\n", hot.warmed);
+    fprintf(out, "serwer_hotset_warmed_bytes_total %" PRIu64 "\n", hot.warmed_bytes);
+    fprintf(out, "serwer_hotset_warm_failed_total %" PRIu64 "\n", hot.warm_failed);
+    fprintf(out, "serwer_hotset_warm_rejected_total %" PRIu64 "\n", hot.warm_rejected);
+
+    prefetch_stats_t prefetch;
+    prefetch_stats(&prefetch);
+    fprintf(out, "serwer_prefetch_pages_total %" PRIu64 "\n", prefetch.pages);
+    fprintf(out, "serwer_prefetch_dropped_total %" PRIu64 "\n", prefetch.dropped);
+    fprintf(out, "serwer_prefetch_prefetched_total %" PRIu64 "\n", prefetch.prefetched);
+    fprintf(out, "serwer_prefetch_hits_total %" PRIu64 "\n", prefetch.hits);
+    fprintf(out, "serwer_prefetch_misses_total %" PRIu64 "\n", prefetch.misses);
+    fprintf(out, "serwer_prefetch_wasted_total %" PRIu64 "\n", prefetch.wasted);
+    // Of the files requested after the pages, and of the files prefetched.
+    uint64_t requested = prefetch.hits + prefetch.misses;
+    uint64_t settled = prefetch.hits + prefetch.wasted;
+    fprintf(out, "serwer_prefetch_hit_ratio %.4f\n", requested > 0 ? (double)prefetch.hits / requested : 0.0);
+    fprintf(out, "serwer_prefetch_wasted_ratio %.4f\n", settled > 0 ? (double)prefetch.wasted / settled : 0.0);
+
+    static const char* classes[BUFPOOL_CLASSES] = {"header", "body"};
+    for (int class = 0; class < BUFPOOL_CLASSES; ++class) {
+        bufpool_stats_t pool;
+        bufpool_stats(class, &pool);
+        fprintf(out, "serwer_bufpool_buffers{class=\"%s\"} %" PRIu64 "\n", classes[class], pool.buffers);
+        fprintf(out, "serwer_bufpool_in_use{class=\"%s\"} %" PRIu64 "\n", classes[class], pool.in_use);
+        fprintf(out, "serwer_bufpool_peak_in_use{class=\"%s\"} %" PRIu64 "\n", classes[class], pool.peak_in_use);
+        fprintf(out, "serwer_bufpool_exhausted_total{class=\"%s\"} %" PRIu64 "\n", classes[class], pool.exhausted);
+    }
+
+#ifdef SERWER_INSTRUMENT
+    for (int outcome = 0; outcome < INSTRUMENT_OUTCOMES; ++outcome) {
+        instrument_stats_t counted;
+        instrument_stats(outcome, &counted);
+        const char* name = instrument_outcome_name(outcome);
+        fprintf(out, "serwer_instrumented_requests_total{outcome=\"%s\"} %" PRIu64 "\n", name, counted.requests);
+        fprintf(out, "serwer_request_allocations_total{outcome=\"%s\"} %" PRIu64 "\n", name, counted.allocs);
+        fprintf(out, "serwer_request_frees_total{outcome=\"%s\"} %" PRIu64 "\n", name, counted.frees);
+        fprintf(out, "serwer_request_syscalls_total{outcome=\"%s\"} %" PRIu64 "\n", name, counted.syscalls);
+        fprintf(out, "serwer_request_allocations_max{outcome=\"%s\"} %" PRIu64 "\n", name, counted.max_allocs);
+        fprintf(out, "serwer_request_syscalls_max{outcome=\"%s\"} %" PRIu64 "\n", name, counted.max_syscalls);
+    }
+#endif
+}
+
+static void* metrics_loop(void* arg) {
+    struct timespec interval = {
+        .tv_sec = METRICS_INTERVAL_MS / 1000,
+        .tv_nsec = (METRICS_INTERVAL_MS % 1000) * 1000000
+    };
+
+    for (;;) {
+        FILE* out = fopen(metrics_tmp_path, "w");
+        if (out) {
+            metrics_write(out);
+            if (fclose(out) == 0)
+                rename(metrics_tmp_path, metrics_path);
+        }
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+int metrics_start(const char* path) {
+    size_t path_len = strlen(path);
+    metrics_path = strdup(path);
+    metrics_tmp_path = malloc(path_len + 5);
+    if (!metrics_path || !metrics_tmp_path)
+        return METRICS_ERR;
+    memcpy(metrics_tmp_path, path, path_len);
+    memcpy(metrics_tmp_path + path_len, ".tmp", 5);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, metrics_loop, NULL) != 0)
+        return METRICS_ERR;
+    pthread_detach(thread);
+    return METRICS_OK;
+}
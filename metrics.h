@@ -0,0 +1,17 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+// Periodic export of the server's counters.
+// A thread writes them in the Prometheus text format to a file, which is replaced atomically,
+// so that a collector (eg. node_exporter's textfile collector) can pick it up.
+
+// Return codes //
+#define METRICS_ERR -1
+#define METRICS_OK   0
+
+#define METRICS_INTERVAL_MS 1000
+
+// Starts writing the counters to path every METRICS_INTERVAL_MS.
+int metrics_start(const char* path);
+
+#endif /* METRICS_H */
@@ -0,0 +1,348 @@
+#include "prefetch.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include "arena.h"
+#include "fcache.h"
+#include "iopool.h"
+#include "scan.h"
+
+#define PREFETCH_WINDOW_NS ((uint64_t)PREFETCH_WINDOW_MS * 1000000)
+
+typedef struct prefetch_slot {
+    uint64_t at;           // When the file was prefetched, 0 if the slot is free.
+    char target[PREFETCH_TARGET];
+} prefetch_slot_t;
+
+static bool prefetch_on = false;
+static const char* prefetch_filesystem = NULL;
+
+// Prefetched files, each in the slot of its hash.
+static prefetch_slot_t prefetch_slots[PREFETCH_SLOTS];
+static pthread_mutex_t prefetch_stripes[PREFETCH_STRIPES];
+
+// Pages to parse, a ring, and the hashes of the pages parsed recently.
+static char prefetch_queue[PREFETCH_QUEUE][PREFETCH_TARGET];
+static size_t prefetch_queue_head = 0;
+static size_t prefetch_queue_length = 0;
+static uint64_t prefetch_recent[PREFETCH_PAGES];
+static uint64_t prefetch_recent_at[PREFETCH_PAGES];
+static pthread_mutex_t prefetch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+
+static _Atomic uint64_t prefetch_pages = 0;
+static _Atomic uint64_t prefetch_dropped = 0;
+static _Atomic uint64_t prefetch_prefetched = 0;
+static _Atomic uint64_t prefetch_hits = 0;
+static _Atomic uint64_t prefetch_misses = 0;
+static _Atomic uint64_t prefetch_wasted = 0;
+
+static uint64_t prefetch_hash(const char* target, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= (uint8_t)target[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+bool prefetch_enabled() {
+    return prefetch_on;
+}
+
+static bool prefetch_is_page(const char* target, size_t len) {
+    return (len > 5 && strcasecmp(target + len - 5, ".html") == 0)
+        || (len > 4 && strcasecmp(target + len - 4, ".htm") == 0);
+}
+
+///// Tracking /////
+static void prefetch_count(_Atomic uint64_t* counter) {
+    atomic_fetch_add_explicit(counter, 1, memory_order_relaxed);
+}
+
+// Tracks the file as prefetched, the one it replaces unrequested is wasted.
+static void prefetch_track(const char* target, size_t len) {
+    uint64_t hash = prefetch_hash(target, len);
+    prefetch_slot_t* slot = &prefetch_slots[hash % PREFETCH_SLOTS];
+    pthread_mutex_t* stripe = &prefetch_stripes[hash % PREFETCH_STRIPES];
+
+    uint64_t now = iopool_now();
+    pthread_mutex_lock(stripe);
+    if (slot->at != 0 && (now - slot->at >= PREFETCH_WINDOW_NS || strcmp(slot->target, target) != 0))
+        prefetch_count(&prefetch_wasted);
+    slot->at = now;
+    memcpy(slot->target, target, len + 1);
+    pthread_mutex_unlock(stripe);
+}
+
+// Whether the file has been prefetched within the window.
+static bool prefetch_tracked(const char* target, size_t len) {
+    uint64_t hash = prefetch_hash(target, len);
+    prefetch_slot_t* slot = &prefetch_slots[hash % PREFETCH_SLOTS];
+    pthread_mutex_t* stripe = &prefetch_stripes[hash % PREFETCH_STRIPES];
+
+    pthread_mutex_lock(stripe);
+    bool tracked = slot->at != 0 && iopool_now() - slot->at < PREFETCH_WINDOW_NS && strcmp(slot->target, target) == 0;
+    pthread_mutex_unlock(stripe);
+    return tracked;
+}
+
+void prefetch_request(const char* target, uint64_t page_at) {
+    size_t len = strlen(target);
+    if (len >= PREFETCH_TARGET)
+        return;
+    uint64_t hash = prefetch_hash(target, len);
+    prefetch_slot_t* slot = &prefetch_slots[hash % PREFETCH_SLOTS];
+    pthread_mutex_t* stripe = &prefetch_stripes[hash % PREFETCH_STRIPES];
+    uint64_t now = iopool_now();
+
+    pthread_mutex_lock(stripe);
+    bool prefetched = slot->at != 0 && strcmp(slot->target, target) == 0;
+    bool hit = prefetched && now - slot->at < PREFETCH_WINDOW_NS;
+    if (prefetched)
+        slot->at = 0;
+    pthread_mutex_unlock(stripe);
+
+    if (hit)
+        prefetch_count(&prefetch_hits);
+    else if (prefetched)
+        prefetch_count(&prefetch_wasted);
+    // Going on to another page is not a miss, pages are not prefetched.
+    if (!hit && page_at != 0 && now - page_at < PREFETCH_WINDOW_NS && !prefetch_is_page(target, len))
+        prefetch_count(&prefetch_misses);
+}
+
+// Frees the slots of the files, which have not been requested within the window.
+static void prefetch_expire() {
+    uint64_t now = iopool_now();
+    for (size_t i = 0; i < PREFETCH_SLOTS; ++i) {
+        pthread_mutex_t* stripe = &prefetch_stripes[i % PREFETCH_STRIPES];
+        pthread_mutex_lock(stripe);
+        if (prefetch_slots[i].at != 0 && now - prefetch_slots[i].at >= PREFETCH_WINDOW_NS) {
+            prefetch_slots[i].at = 0;
+            prefetch_count(&prefetch_wasted);
+        }
+        pthread_mutex_unlock(stripe);
+    }
+}
+
+///// Pages /////
+bool prefetch_page(const char* target) {
+    size_t len = strlen(target);
+    if (!prefetch_is_page(target, len))
+        return false;
+    if (len >= PREFETCH_TARGET)
+        return true;
+
+    // A page requested over and over is parsed once in a window.
+    uint64_t hash = prefetch_hash(target, len);
+    uint64_t now = iopool_now();
+    size_t recent = hash % PREFETCH_PAGES;
+    pthread_mutex_lock(&prefetch_mutex);
+    if (prefetch_recent[recent] == hash && now - prefetch_recent_at[recent] < PREFETCH_WINDOW_NS) {
+        pthread_mutex_unlock(&prefetch_mutex);
+        return true;
+    }
+    if (prefetch_queue_length == PREFETCH_QUEUE) {
+        pthread_mutex_unlock(&prefetch_mutex);
+        prefetch_count(&prefetch_dropped);
+        return true;
+    }
+    prefetch_recent[recent] = hash;
+    prefetch_recent_at[recent] = now;
+    memcpy(prefetch_queue[(prefetch_queue_head + prefetch_queue_length++) % PREFETCH_QUEUE], target, len + 1);
+    pthread_cond_signal(&prefetch_cond);
+    pthread_mutex_unlock(&prefetch_mutex);
+    return true;
+}
+
+// Resolves the link of the page to a target of the root into out. Returns its length,
+// or 0 if it does not refer to a file of this server, eg. it has a scheme or leaves the root.
+static size_t prefetch_resolve(const char* page, const char* link, size_t link_len, char* out) {
+    // The query and the fragment do not change the file.
+    for (size_t i = 0; i < link_len; ++i) {
+        if (link[i] == '?' || link[i] == '#') {
+            link_len = i;
+            break;
+        }
+    }
+    if (link_len == 0 || (link_len > 1 && link[0] == '/' && link[1] == '/'))
+        return 0;
+
+    char path[PREFETCH_TARGET * 2];
+    size_t path_len = 0;
+    if (link[0] != '/') {
+        // Relative to the directory of the page.
+        const char* dir_end = strrchr(page, '/');
+        path_len = dir_end - page + 1;
+        memcpy(path, page, path_len);
+    }
+    if (path_len + link_len >= sizeof(path))
+        return 0;
+    memcpy(path + path_len, link, link_len);
+    path_len += link_len;
+
+    // Drops the "." segments and the empty ones, ".." takes the previous one away.
+    size_t out_len = 0;
+    size_t i = 0;
+    while (i < path_len) {
+        while (i < path_len && path[i] == '/')
+            ++i;
+        size_t start = i;
+        while (i < path_len && path[i] != '/')
+            ++i;
+        size_t segment = i - start;
+        if (segment == 0 || (segment == 1 && path[start] == '.'))
+            continue;
+        if (segment == 2 && path[start] == '.' && path[start + 1] == '.') {
+            if (out_len == 0)
+                return 0;
+            while (out[--out_len] != '/')
+                ;
+            continue;
+        }
+        if (out_len + 1 + segment >= PREFETCH_TARGET)
+            return 0;
+        out[out_len++] = '/';
+        memcpy(out + out_len, path + start, segment);
+        out_len += segment;
+    }
+    out[out_len] = '\0';
+
+    if (out_len == 0 || scan_span(out, out_len, &scan_target) != out_len)
+        return 0;
+    return out_len;
+}
+
+// Finds the values of the href and src attributes in the page, and prefetches their files.
+static void prefetch_links(const char* page, const char* data, size_t size, arena_t* arena) {
+    uint64_t seen[PREFETCH_LINKS];
+    unsigned count = 0;
+    const char* end = data + size;
+    const char* eq = data;
+
+    while (count < PREFETCH_LINKS && (eq = scan_find(eq, end - eq, '=')) != NULL) {
+        const char* value = eq + 1;
+        // The name of the attribute, before the '='.
+        const char* name_end = eq;
+        while (name_end > data && (name_end[-1] == ' ' || name_end[-1] == '\t'))
+            --name_end;
+        const char* name = name_end;
+        while (name > data && ((name[-1] >= 'a' && name[-1] <= 'z') || (name[-1] >= 'A' && name[-1] <= 'Z')))
+            --name;
+        eq = value;
+        size_t name_len = name_end - name;
+        bool link = (name_len == 4 && strncasecmp(name, "href", 4) == 0) || (name_len == 3 && strncasecmp(name, "src", 3) == 0);
+        if (!link || name == data || (name[-1] != ' ' && name[-1] != '\t' && name[-1] != '\n' && name[-1] != '\r'))
+            continue;
+
+        while (value < end && (*value == ' ' || *value == '\t'))
+            ++value;
+        const char* value_end;
+        if (value < end && (*value == '"' || *value == '\'')) {
+            value_end = scan_find(value + 1, end - value - 1, *value);
+            ++value;
+        }
+        else {
+            value_end = value;
+            while (value_end < end && *value_end != '>' && *value_end != ' ' && *value_end != '\t' && *value_end != '\n' && *value_end != '\r')
+                ++value_end;
+        }
+        if (!value_end || value_end - value >= PREFETCH_TARGET)
+            continue;
+
+        char target[PREFETCH_TARGET];
+        size_t len = prefetch_resolve(page, value, value_end - value, target);
+        if (len == 0)
+            continue;
+        uint64_t hash = prefetch_hash(target, len);
+        bool duplicate = false;
+        for (unsigned i = 0; i < count && !duplicate; ++i)
+            duplicate = seen[i] == hash;
+        if (duplicate)
+            continue;
+        seen[count++] = hash;
+
+        // A file prefetched for another page is still warm.
+        if (prefetch_tracked(target, len))
+            continue;
+        size_t file_size;
+        int ret = fcache_warm(prefetch_filesystem, target, arena, &file_size);
+        arena_reset(arena);
+        if (ret == FCACHE_HIT || ret == FCACHE_BYPASS) {
+            prefetch_track(target, len);
+            prefetch_count(&prefetch_prefetched);
+        }
+    }
+}
+
+static void prefetch_parse(char* page, arena_t* arena) {
+    fcache_entry_t* entry;
+    // Pages too big for the cache are not parsed.
+    if (fcache_get(prefetch_filesystem, page, arena, &entry) != FCACHE_HIT)
+        return;
+    prefetch_count(&prefetch_pages);
+    prefetch_links(page, fcache_data(entry), fcache_size(entry), arena);
+    fcache_release(entry);
+}
+
+static void* prefetch_loop(void* arg) {
+    char page[PREFETCH_TARGET];
+    arena_t arena;
+    if (arena_init(&arena) != ARENA_OK)
+        return NULL;
+    uint64_t expired_at = iopool_now();
+
+    for (;;) {
+        pthread_mutex_lock(&prefetch_mutex);
+        if (prefetch_queue_length == 0) {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_sec += PREFETCH_WINDOW_MS / 1000;
+            pthread_cond_timedwait(&prefetch_cond, &prefetch_mutex, &until);
+        }
+        bool queued = prefetch_queue_length > 0;
+        if (queued) {
+            memcpy(page, prefetch_queue[prefetch_queue_head], PREFETCH_TARGET);
+            prefetch_queue_head = (prefetch_queue_head + 1) % PREFETCH_QUEUE;
+            prefetch_queue_length--;
+        }
+        pthread_mutex_unlock(&prefetch_mutex);
+
+        if (queued) {
+            prefetch_parse(page, &arena);
+            arena_reset(&arena);
+        }
+        if (iopool_now() - expired_at >= PREFETCH_WINDOW_NS) {
+            prefetch_expire();
+            expired_at = iopool_now();
+        }
+    }
+    return NULL;
+}
+
+int prefetch_start(const char* filesystem) {
+    prefetch_filesystem = filesystem;
+    for (size_t i = 0; i < PREFETCH_STRIPES; ++i)
+        pthread_mutex_init(&prefetch_stripes[i], NULL);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, prefetch_loop, NULL) != 0)
+        return PREFETCH_ERR;
+    pthread_detach(thread);
+    prefetch_on = true;
+    return PREFETCH_OK;
+}
+
+void prefetch_stats(prefetch_stats_t* out_stats) {
+    out_stats->pages = atomic_load_explicit(&prefetch_pages, memory_order_relaxed);
+    out_stats->dropped = atomic_load_explicit(&prefetch_dropped, memory_order_relaxed);
+    out_stats->prefetched = atomic_load_explicit(&prefetch_prefetched, memory_order_relaxed);
+    out_stats->hits = atomic_load_explicit(&prefetch_hits, memory_order_relaxed);
+    out_stats->misses = atomic_load_explicit(&prefetch_misses, memory_order_relaxed);
+    out_stats->wasted = atomic_load_explicit(&prefetch_wasted, memory_order_relaxed);
+}
@@ -0,0 +1,51 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Prefetching of the resources of HTML pages.
+// A client, which has got a page, asks for the files its href and src attributes refer to next.
+// Once a page is served, a thread parses it and warms those files of the root, which are served
+// from the cache or read ahead into the page cache, before their requests come.
+// The prefetched files are tracked for PREFETCH_WINDOW_MS: one requested within it is a hit,
+// one which is not is wasted. A request following a page on its connection for a file, which
+// was not prefetched, is a miss.
+
+// Return codes //
+#define PREFETCH_ERR -1
+#define PREFETCH_OK   0
+
+#define PREFETCH_QUEUE      256     // Pages waiting to be parsed, more are dropped.
+#define PREFETCH_LINKS      32      // Files prefetched per page.
+#define PREFETCH_TARGET     256     // Longer targets are not prefetched.
+#define PREFETCH_SLOTS      4096    // Prefetched files tracked at once.
+#define PREFETCH_STRIPES    32      // Locks of the tracked files, each over its part of them.
+#define PREFETCH_PAGES      256     // Pages parsed recently, which are not parsed again within the window.
+#define PREFETCH_WINDOW_MS  10000
+
+typedef struct prefetch_stats {
+    uint64_t pages;        // Parsed.
+    uint64_t dropped;      // Pages not parsed, because the queue was full.
+    uint64_t prefetched;   // Files warmed.
+    uint64_t hits;         // Prefetched files requested.
+    uint64_t misses;       // Files requested after a page, which were not prefetched.
+    uint64_t wasted;       // Prefetched files not requested.
+} prefetch_stats_t;
+
+// Starts the thread prefetching the files of the root filesystem. The cache has to be initialized before.
+int prefetch_start(const char* filesystem);
+
+bool prefetch_enabled();
+
+// Accounts a request for the file target answered with 200. page_at is when its connection
+// was last answered with a page (iopool_now), 0 if it has not been.
+void prefetch_request(const char* target, uint64_t page_at);
+
+// Queues the resources of the file target to be prefetched, if it is an HTML page.
+// Returns whether it is one.
+bool prefetch_page(const char* target);
+
+void prefetch_stats(prefetch_stats_t* out_stats);
+
+#endif /* PREFETCH_H */
@@ -0,0 +1,196 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Runs two serwers proxying missing files, whose corelated servers are themselves or each other, and checks
+// that the requests are answered instead of passed round: a serwer does not proxy to its own port, and
+// redirects a request, which a serwer has passed on already.
+//
+// Usage: proxy_test serwer
+
+#define TEST_WAIT_MS  5000   // For serwer to start, and for a response.
+#define TEST_POLL_MS  50
+#define TEST_SERWERS  2
+
+typedef struct test_case {
+    int serwer;
+    const char* target;
+    const char* status;        // Beginning of the response.
+} test_case_t;
+
+// The first serwer names itself for /self.txt and the second one for /pair.txt, which the second one
+// names the first one for.
+static const test_case_t test_cases[] = {
+    {0, "/self.txt", "HTTP/1.1 404 "},
+    {0, "/pair.txt", "HTTP/1.1 302 "},
+    {1, "/pair.txt", "HTTP/1.1 302 "},
+};
+
+static char test_dir[] = "/tmp/proxy_test.XXXXXX";
+static pid_t test_serwers[TEST_SERWERS] = {-1, -1};
+static uint16_t test_ports[TEST_SERWERS];
+static int test_failures = 0;
+
+static void sleep_ms(long ms) {
+    struct timespec interval = {.tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000};
+    nanosleep(&interval, NULL);
+}
+
+static void cleanup() {
+    for (int i = 0; i < TEST_SERWERS; ++i) {
+        if (test_serwers[i] != -1) {
+            kill(test_serwers[i], SIGTERM);
+            waitpid(test_serwers[i], NULL, 0);
+        }
+    }
+    char path[sizeof(test_dir) + 32];
+    const char* files[] = {"root", "cos0.txt", "cos1.txt"};
+    for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); ++i) {
+        snprintf(path, sizeof(path), "%s/%s", test_dir, files[i]);
+        remove(path);
+    }
+    rmdir(test_dir);
+}
+
+static void die(const char* what) {
+    fprintf(stderr, "%s: %s\n", what, errno ? strerror(errno) : "failed");
+    cleanup();
+    exit(EXIT_FAILURE);
+}
+
+static void write_file(const char* name, const char* content) {
+    char path[sizeof(test_dir) + 32];
+    snprintf(path, sizeof(path), "%s/%s", test_dir, name);
+    FILE* file = fopen(path, "w");
+    if (!file || fputs(content, file) == EOF || fclose(file) != 0)
+        die(path);
+}
+
+// Takes a port, which nothing listens on.
+static uint16_t free_port() {
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t addr_len = sizeof(addr);
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == -1 || bind(sock, (struct sockaddr*)&addr, addr_len) == -1
+        || getsockname(sock, (struct sockaddr*)&addr, &addr_len) == -1)
+        die("free_port");
+    close(sock);
+    return ntohs(addr.sin_port);
+}
+
+static int connect_serwer(int serwer) {
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(test_ports[serwer]),
+                               .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == -1)
+        return -1;
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static void start_serwer(const char* serwer, int i) {
+    char root[sizeof(test_dir) + 16], cos[sizeof(test_dir) + 16], port[8];
+    snprintf(root, sizeof(root), "%s/root", test_dir);
+    snprintf(cos, sizeof(cos), "%s/cos%d.txt", test_dir, i);
+    snprintf(port, sizeof(port), "%u", test_ports[i]);
+
+    test_serwers[i] = fork();
+    if (test_serwers[i] == -1)
+        die("fork");
+    if (test_serwers[i] == 0) {
+        execl(serwer, serwer, "-w", "1", "--proxy", root, cos, port, (char*)NULL);
+        _exit(127);
+    }
+
+    for (int waited = 0; waited < TEST_WAIT_MS; waited += TEST_POLL_MS) {
+        int sock = connect_serwer(i);
+        if (sock != -1) {
+            close(sock);
+            return;
+        }
+        sleep_ms(TEST_POLL_MS);
+    }
+    die("serwer does not listen");
+}
+
+// Sends the request and reads the beginning of its response, until the socket is closed or TEST_WAIT_MS pass.
+static void request(const test_case_t* test) {
+    int sock = connect_serwer(test->serwer);
+    if (sock == -1)
+        die("connect");
+    struct timeval timeout = {.tv_sec = TEST_WAIT_MS / 1000, .tv_usec = (TEST_WAIT_MS % 1000) * 1000};
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1)
+        die("setsockopt");
+
+    char request[256];
+    int request_size = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nConnection: close\r\n\r\n", test->target);
+    if (write(sock, request, request_size) != request_size)
+        die("write");
+
+    char response[256];
+    size_t size = 0;
+    while (size < sizeof(response) - 1) {
+        ssize_t ret = read(sock, response + size, sizeof(response) - 1 - size);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+        size += ret;
+    }
+    response[size] = '\0';
+    close(sock);
+
+    bool ok = strncmp(response, test->status, strlen(test->status)) == 0;
+    printf("%d %-10s %.12s (expected %s)\n", test->serwer, test->target, size > 0 ? response : "no response",
+           test->status);
+    if (!ok)
+        test_failures++;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s serwer\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    if (!mkdtemp(test_dir))
+        die("mkdtemp");
+    char root[sizeof(test_dir) + 16];
+    snprintf(root, sizeof(root), "%s/root", test_dir);
+    if (mkdir(root, 0755) == -1)
+        die(root);
+
+    for (int i = 0; i < TEST_SERWERS; ++i)
+        test_ports[i] = free_port();
+    char cos[128];
+    snprintf(cos, sizeof(cos), "/self.txt\t127.0.0.1\t%u\n/pair.txt\t127.0.0.1\t%u\n", test_ports[0], test_ports[1]);
+    write_file("cos0.txt", cos);
+    snprintf(cos, sizeof(cos), "/pair.txt\t127.0.0.1\t%u\n", test_ports[0]);
+    write_file("cos1.txt", cos);
+    for (int i = 0; i < TEST_SERWERS; ++i)
+        start_serwer(argv[1], i);
+
+    for (size_t i = 0; i < sizeof(test_cases) / sizeof(test_cases[0]); ++i)
+        request(&test_cases[i]);
+
+    cleanup();
+    if (test_failures > 0) {
+        fprintf(stderr, "%d requests not answered as expected\n", test_failures);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,241 @@
+#include "ratelimit.h"
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+
+struct ratelimit_client {
+    uint8_t key[16];          // IPv6 address, IPv4 ones are mapped.
+    bool used;
+    uint16_t shard;
+    uint32_t conns;
+    uint32_t last_seen;       // Monotonic seconds.
+    uint64_t refilled;        // Monotonic nanoseconds of the last refill.
+    double request_tokens;
+    double byte_tokens;
+};
+
+typedef struct ratelimit_shard {
+    pthread_mutex_t mutex;
+    ratelimit_client_t slots[RATELIMIT_SLOTS];
+} ratelimit_shard_t;
+
+static ratelimit_shard_t ratelimit_shards[RATELIMIT_SHARDS];
+static unsigned ratelimit_max_conns = 0;
+static uint64_t ratelimit_requests_per_s = 0;
+static uint64_t ratelimit_bytes_per_s = 0;
+
+static _Atomic uint64_t ratelimit_clients = 0;
+static _Atomic uint64_t ratelimit_rejected_conns = 0;
+static _Atomic uint64_t ratelimit_limited_requests = 0;
+static _Atomic uint64_t ratelimit_throttled_writes = 0;
+static _Atomic uint64_t ratelimit_untracked = 0;
+
+static uint64_t ratelimit_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Returns false for other families than IP, eg. local sockets, whose peers have no address to tell them apart.
+static bool ratelimit_key(const struct sockaddr* addr, uint8_t* key) {
+    memset(key, 0, 16);
+    if (addr->sa_family == AF_INET6) {
+        memcpy(key, &((const struct sockaddr_in6*)addr)->sin6_addr, 16);
+        return true;
+    }
+    if (addr->sa_family == AF_INET) {
+        key[10] = key[11] = 0xff;
+        memcpy(key + 12, &((const struct sockaddr_in*)addr)->sin_addr, 4);
+        return true;
+    }
+    return false;
+}
+
+static uint64_t ratelimit_hash(const uint8_t* key) {
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < 16; ++i) {
+        hash ^= key[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Adds the tokens earned since the last refill. Called with the shard's mutex held.
+static void ratelimit_refill(ratelimit_client_t* client, uint64_t now) {
+    double elapsed = (now - client->refilled) / 1e9;
+    client->refilled = now;
+
+    client->request_tokens += elapsed * ratelimit_requests_per_s;
+    if (client->request_tokens > ratelimit_requests_per_s)
+        client->request_tokens = ratelimit_requests_per_s;
+    client->byte_tokens += elapsed * ratelimit_bytes_per_s;
+    if (client->byte_tokens > ratelimit_bytes_per_s)
+        client->byte_tokens = ratelimit_bytes_per_s;
+}
+
+void ratelimit_init(unsigned max_conns, uint64_t requests_per_s, uint64_t bytes_per_s) {
+    ratelimit_max_conns = max_conns;
+    ratelimit_requests_per_s = requests_per_s;
+    ratelimit_bytes_per_s = bytes_per_s;
+
+    for (int i = 0; i < RATELIMIT_SHARDS; ++i) {
+        pthread_mutex_init(&ratelimit_shards[i].mutex, NULL);
+        memset(ratelimit_shards[i].slots, 0, sizeof(ratelimit_shards[i].slots));
+    }
+}
+
+bool ratelimit_enabled() {
+    return ratelimit_max_conns > 0 || ratelimit_requests_per_s > 0 || ratelimit_bytes_per_s > 0;
+}
+
+int ratelimit_connect(const struct sockaddr* addr, ratelimit_client_t** out_client) {
+    uint8_t key[16];
+    if (!ratelimit_key(addr, key)) {
+        // Sharing one key, all of them would be limited as a single client.
+        *out_client = NULL;
+        return RATELIMIT_OK;
+    }
+    uint64_t hash = ratelimit_hash(key);
+    uint16_t shard_index = hash % RATELIMIT_SHARDS;
+    ratelimit_shard_t* shard = &ratelimit_shards[shard_index];
+    size_t home = (hash / RATELIMIT_SHARDS) % RATELIMIT_SLOTS;
+
+    uint64_t now = ratelimit_now();
+    uint32_t now_s = now / 1000000000;
+
+    pthread_mutex_lock(&shard->mutex);
+
+    // The client, or else the best slot to put it in: an empty one,
+    // or the one idle for the longest time.
+    ratelimit_client_t* client = NULL;
+    ratelimit_client_t* free_slot = NULL;
+    for (size_t i = 0; i <= RATELIMIT_PROBES; ++i) {
+        ratelimit_client_t* slot = &shard->slots[(home + i) % RATELIMIT_SLOTS];
+        if (slot->used && memcmp(slot->key, key, 16) == 0) {
+            client = slot;
+            break;
+        }
+        if (!slot->used) {
+            // Slots are never emptied, so the client cannot be further.
+            if (!free_slot || free_slot->used)
+                free_slot = slot;
+            break;
+        }
+        if (slot->conns == 0 && now_s - slot->last_seen >= RATELIMIT_IDLE_S) {
+            if (!free_slot || (free_slot->used && slot->last_seen < free_slot->last_seen))
+                free_slot = slot;
+        }
+    }
+
+    if (!client) {
+        if (!free_slot) {
+            // Every slot holds an active client, this one is let through untracked.
+            pthread_mutex_unlock(&shard->mutex);
+            atomic_fetch_add_explicit(&ratelimit_untracked, 1, memory_order_relaxed);
+            *out_client = NULL;
+            return RATELIMIT_OK;
+        }
+
+        if (!free_slot->used)
+            atomic_fetch_add_explicit(&ratelimit_clients, 1, memory_order_relaxed);
+        client = free_slot;
+        memcpy(client->key, key, 16);
+        client->used = true;
+        client->shard = shard_index;
+        client->conns = 0;
+        client->refilled = now;
+        client->request_tokens = ratelimit_requests_per_s;
+        client->byte_tokens = ratelimit_bytes_per_s;
+    }
+
+    client->last_seen = now_s;
+    if (ratelimit_max_conns > 0 && client->conns >= ratelimit_max_conns) {
+        pthread_mutex_unlock(&shard->mutex);
+        atomic_fetch_add_explicit(&ratelimit_rejected_conns, 1, memory_order_relaxed);
+        return RATELIMIT_OVER;
+    }
+    client->conns++;
+    pthread_mutex_unlock(&shard->mutex);
+
+    *out_client = client;
+    return RATELIMIT_OK;
+}
+
+void ratelimit_disconnect(ratelimit_client_t* client) {
+    if (!client)
+        return;
+
+    ratelimit_shard_t* shard = &ratelimit_shards[client->shard];
+    pthread_mutex_lock(&shard->mutex);
+    client->conns--;
+    client->last_seen = ratelimit_now() / 1000000000;
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+int ratelimit_request(ratelimit_client_t* client) {
+    if (!client || ratelimit_requests_per_s == 0)
+        return RATELIMIT_OK;
+
+    int ret = RATELIMIT_OK;
+    ratelimit_shard_t* shard = &ratelimit_shards[client->shard];
+    pthread_mutex_lock(&shard->mutex);
+    ratelimit_refill(client, ratelimit_now());
+    if (client->request_tokens >= 1)
+        client->request_tokens -= 1;
+    else
+        ret = RATELIMIT_OVER;
+    pthread_mutex_unlock(&shard->mutex);
+
+    if (ret == RATELIMIT_OVER)
+        atomic_fetch_add_explicit(&ratelimit_limited_requests, 1, memory_order_relaxed);
+    return ret;
+}
+
+size_t ratelimit_take_bytes(ratelimit_client_t* client, size_t wanted, uint64_t* out_wait_ns) {
+    if (!client || ratelimit_bytes_per_s == 0)
+        return wanted;
+
+    // Writes smaller than RATELIMIT_MIN_WRITE of a second worth of bytes are not worth their system calls.
+    double least = (double)ratelimit_bytes_per_s / RATELIMIT_MIN_WRITE;
+    if (least > wanted)
+        least = wanted;
+
+    size_t taken = 0;
+    ratelimit_shard_t* shard = &ratelimit_shards[client->shard];
+    pthread_mutex_lock(&shard->mutex);
+    ratelimit_refill(client, ratelimit_now());
+    if (client->byte_tokens >= least) {
+        taken = client->byte_tokens < wanted ? (size_t)client->byte_tokens : wanted;
+        client->byte_tokens -= taken;
+    }
+    else {
+        *out_wait_ns = (least - client->byte_tokens) * 1e9 / ratelimit_bytes_per_s + 1;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    if (taken == 0)
+        atomic_fetch_add_explicit(&ratelimit_throttled_writes, 1, memory_order_relaxed);
+    return taken;
+}
+
+void ratelimit_return_bytes(ratelimit_client_t* client, size_t unused) {
+    if (!client || ratelimit_bytes_per_s == 0 || unused == 0)
+        return;
+
+    ratelimit_shard_t* shard = &ratelimit_shards[client->shard];
+    pthread_mutex_lock(&shard->mutex);
+    client->byte_tokens += unused;
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+void ratelimit_stats(ratelimit_stats_t* out_stats) {
+    out_stats->clients = atomic_load(&ratelimit_clients);
+    out_stats->rejected_conns = atomic_load(&ratelimit_rejected_conns);
+    out_stats->limited_requests = atomic_load(&ratelimit_limited_requests);
+    out_stats->throttled_writes = atomic_load(&ratelimit_throttled_writes);
+    out_stats->untracked = atomic_load(&ratelimit_untracked);
+}
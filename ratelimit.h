@@ -0,0 +1,57 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+// Per client address limits: open connections, requests per second and bytes per second.
+// Rates are token buckets holding at most one second worth of tokens.
+// Clients are kept in a fixed-size table split into shards, each guarded by its own lock.
+// A client without connections, unseen for RATELIMIT_IDLE_S, can be replaced by another one.
+
+// Return codes //
+#define RATELIMIT_OK    0
+#define RATELIMIT_OVER  1   // The client is over the limit.
+
+#define RATELIMIT_SHARDS    64
+#define RATELIMIT_SLOTS     1024   // Per shard.
+#define RATELIMIT_PROBES    16     // Slots checked for a client, after its home slot.
+#define RATELIMIT_IDLE_S    60
+#define RATELIMIT_MIN_WRITE 50     // Throttled clients are sent at least 1/50 of their byte rate at once.
+
+typedef struct ratelimit_client ratelimit_client_t;
+
+typedef struct ratelimit_stats {
+    uint64_t clients;            // Tracked now.
+    uint64_t rejected_conns;     // Over the connection limit.
+    uint64_t limited_requests;   // Over the request rate.
+    uint64_t throttled_writes;   // Delayed, because of the byte rate.
+    uint64_t untracked;          // Let through, because the table had no room for the client.
+} ratelimit_stats_t;
+
+// A limit of 0 means no limit. When all are 0, the limiter is disabled.
+void ratelimit_init(unsigned max_conns, uint64_t requests_per_s, uint64_t bytes_per_s);
+
+bool ratelimit_enabled();
+
+// Counts a new connection of the client with the address addr.
+// On RATELIMIT_OK *out_client is to be passed to the other calls and released by ratelimit_disconnect.
+// It can be NULL, if the client is not tracked. Clients of local sockets are not, they are trusted.
+int ratelimit_connect(const struct sockaddr* addr, ratelimit_client_t** out_client);
+void ratelimit_disconnect(ratelimit_client_t* client);
+
+// Takes a token for a request.
+int ratelimit_request(ratelimit_client_t* client);
+
+// Takes up to wanted byte tokens, returns how many were taken.
+// When none are, *out_wait_ns tells how long to wait for some.
+size_t ratelimit_take_bytes(ratelimit_client_t* client, size_t wanted, uint64_t* out_wait_ns);
+
+// Gives back byte tokens, which were taken, but not used.
+void ratelimit_return_bytes(ratelimit_client_t* client, size_t unused);
+
+void ratelimit_stats(ratelimit_stats_t* out_stats);
+
+#endif /* RATELIMIT_H */
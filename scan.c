@@ -0,0 +1,247 @@
+#include "scan.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+typedef struct scan_impl {
+    int kernels;
+    const char* (*headers_end)(const char* data, size_t size);
+    const char* (*find)(const char* data, size_t size, char c);
+    size_t (*span)(const char* data, size_t size, const scan_class_t* class);
+} scan_impl_t;
+
+const scan_class_t scan_word = {
+    .ranges = 3,
+    .low  = {0x01, 0x0e, 0x21},
+    .high = {0x08, 0x1f, 0xff}
+};
+
+const scan_class_t scan_name = {
+    .ranges = 4,
+    .low  = {0x01, 0x0e, 0x21, ':' + 1},
+    .high = {0x08, 0x1f, ':' - 1, 0xff}
+};
+
+const scan_class_t scan_target = {
+    .ranges = 5,
+    .low  = {'-', 'A', '\\', 'a', '|'},   // "-./" and the digits are one range.
+    .high = {'9', 'Z', '\\', 'z', '|'}
+};
+
+///// Scalar /////
+static bool scan_in(const scan_class_t* class, uint8_t byte) {
+    for (unsigned i = 0; i < class->ranges; ++i) {
+        if (byte >= class->low[i] && byte <= class->high[i])
+            return true;
+    }
+    return false;
+}
+
+static const char* scalar_headers_end(const char* data, size_t size) {
+    for (size_t i = 0; i + 4 <= size; ++i) {
+        if (data[i] == '\r' && data[i + 1] == '\n' && data[i + 2] == '\r' && data[i + 3] == '\n')
+            return data + i;
+    }
+    return NULL;
+}
+
+static const char* scalar_find(const char* data, size_t size, char c) {
+    for (size_t i = 0; i < size; ++i) {
+        if (data[i] == c)
+            return data + i;
+    }
+    return NULL;
+}
+
+static size_t scalar_span(const char* data, size_t size, const scan_class_t* class) {
+    size_t i = 0;
+    while (i < size && scan_in(class, data[i]))
+        ++i;
+    return i;
+}
+
+static const scan_impl_t scan_scalar = {SCAN_SCALAR, scalar_headers_end, scalar_find, scalar_span};
+
+#ifdef SCAN_X86
+///// SSE2 /////
+// Each kernel takes whole vectors, the scalar one finishes the rest.
+
+__attribute__((target("sse2")))
+static const char* sse2_headers_end(const char* data, size_t size) {
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    size_t i = 0;
+    // The vectors at i + 1 .. i + 3 tell, whether the CRLFs follow.
+    for (; i + 16 + 3 <= size; i += 16) {
+        __m128i match = _mm_and_si128(
+            _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + i)), cr),
+                          _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + i + 1)), lf)),
+            _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + i + 2)), cr),
+                          _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + i + 3)), lf)));
+        int mask = _mm_movemask_epi8(match);
+        if (mask != 0)
+            return data + i + __builtin_ctz(mask);
+    }
+    return scalar_headers_end(data + i, size - i);
+}
+
+__attribute__((target("sse2")))
+static const char* sse2_find(const char* data, size_t size, char c) {
+    const __m128i byte = _mm_set1_epi8(c);
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + i)), byte));
+        if (mask != 0)
+            return data + i + __builtin_ctz(mask);
+    }
+    return scalar_find(data + i, size - i, c);
+}
+
+// A byte x is within [low, high], when x - low, wrapped around, is at most high - low.
+__attribute__((target("sse2")))
+static size_t sse2_span(const char* data, size_t size, const scan_class_t* class) {
+    __m128i low[SCAN_RANGES];
+    __m128i width[SCAN_RANGES];
+    for (unsigned r = 0; r < class->ranges; ++r) {
+        low[r] = _mm_set1_epi8(class->low[r]);
+        width[r] = _mm_set1_epi8(class->high[r] - class->low[r]);
+    }
+
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)(data + i));
+        __m128i in = _mm_setzero_si128();
+        for (unsigned r = 0; r < class->ranges; ++r) {
+            __m128i offset = _mm_sub_epi8(bytes, low[r]);
+            in = _mm_or_si128(in, _mm_cmpeq_epi8(_mm_min_epu8(offset, width[r]), offset));
+        }
+        int mask = ~_mm_movemask_epi8(in) & 0xffff;
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+    return i + scalar_span(data + i, size - i, class);
+}
+
+static const scan_impl_t scan_sse2 = {SCAN_SSE2, sse2_headers_end, sse2_find, sse2_span};
+
+///// AVX2 /////
+__attribute__((target("avx2")))
+static const char* avx2_headers_end(const char* data, size_t size) {
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 32 + 3 <= size; i += 32) {
+        __m256i match = _mm256_and_si256(
+            _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(data + i)), cr),
+                             _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(data + i + 1)), lf)),
+            _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(data + i + 2)), cr),
+                             _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(data + i + 3)), lf)));
+        unsigned mask = _mm256_movemask_epi8(match);
+        if (mask != 0)
+            return data + i + __builtin_ctz(mask);
+    }
+    return sse2_headers_end(data + i, size - i);
+}
+
+__attribute__((target("avx2")))
+static const char* avx2_find(const char* data, size_t size, char c) {
+    const __m256i byte = _mm256_set1_epi8(c);
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(data + i)), byte));
+        if (mask != 0)
+            return data + i + __builtin_ctz(mask);
+    }
+    return sse2_find(data + i, size - i, c);
+}
+
+__attribute__((target("avx2")))
+static size_t avx2_span(const char* data, size_t size, const scan_class_t* class) {
+    __m256i low[SCAN_RANGES];
+    __m256i width[SCAN_RANGES];
+    for (unsigned r = 0; r < class->ranges; ++r) {
+        low[r] = _mm256_set1_epi8(class->low[r]);
+        width[r] = _mm256_set1_epi8(class->high[r] - class->low[r]);
+    }
+
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i*)(data + i));
+        __m256i in = _mm256_setzero_si256();
+        for (unsigned r = 0; r < class->ranges; ++r) {
+            __m256i offset = _mm256_sub_epi8(bytes, low[r]);
+            in = _mm256_or_si256(in, _mm256_cmpeq_epi8(_mm256_min_epu8(offset, width[r]), offset));
+        }
+        unsigned mask = ~(unsigned)_mm256_movemask_epi8(in);
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+    return i + sse2_span(data + i, size - i, class);
+}
+
+static const scan_impl_t scan_avx2 = {SCAN_AVX2, avx2_headers_end, avx2_find, avx2_span};
+#endif
+
+///// Dispatch /////
+static const scan_impl_t* _Atomic scan_current = NULL;
+static pthread_once_t scan_once = PTHREAD_ONCE_INIT;
+
+static void scan_detect() {
+    const scan_impl_t* impl = &scan_scalar;
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        impl = &scan_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        impl = &scan_sse2;
+#endif
+    atomic_store(&scan_current, impl);
+}
+
+static const scan_impl_t* scan_impl() {
+    const scan_impl_t* impl = atomic_load_explicit(&scan_current, memory_order_acquire);
+    if (!impl) {
+        pthread_once(&scan_once, scan_detect);
+        impl = atomic_load_explicit(&scan_current, memory_order_acquire);
+    }
+    return impl;
+}
+
+int scan_kernels() {
+    return scan_impl()->kernels;
+}
+
+bool scan_use(int kernels) {
+    const scan_impl_t* impl = NULL;
+    if (kernels == SCAN_SCALAR)
+        impl = &scan_scalar;
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (kernels == SCAN_SSE2 && __builtin_cpu_supports("sse2"))
+        impl = &scan_sse2;
+    if (kernels == SCAN_AVX2 && __builtin_cpu_supports("avx2"))
+        impl = &scan_avx2;
+#endif
+    if (!impl)
+        return false;
+    pthread_once(&scan_once, scan_detect);
+    atomic_store(&scan_current, impl);
+    return true;
+}
+
+const char* scan_headers_end(const char* data, size_t size) {
+    return scan_impl()->headers_end(data, size);
+}
+
+const char* scan_find(const char* data, size_t size, char c) {
+    return scan_impl()->find(data, size, c);
+}
+
+size_t scan_span(const char* data, size_t size, const scan_class_t* class) {
+    return scan_impl()->span(data, size, class);
+}
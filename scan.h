@@ -0,0 +1,48 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Scanning of requests for delimiters and character classes, 32 or 16 bytes at a time.
+// The kernels are chosen once, by the features of the CPU: AVX2, SSE2, or portable C elsewhere.
+// The portable ones are the reference, the vector ones have to return the same.
+
+#define SCAN_RANGES 8
+
+// Kernels //
+#define SCAN_SCALAR 0
+#define SCAN_SSE2   1
+#define SCAN_AVX2   2
+
+// Set of bytes, as up to SCAN_RANGES inclusive ranges.
+typedef struct scan_class {
+    unsigned ranges;
+    uint8_t low[SCAN_RANGES];
+    uint8_t high[SCAN_RANGES];
+} scan_class_t;
+
+// Anything but NUL and the whitespace of isspace.
+extern const scan_class_t scan_word;
+// Bytes of a header name: a word without ':'.
+extern const scan_class_t scan_name;
+// Bytes of a target path served: [a-zA-Z0-9.\/|-]
+extern const scan_class_t scan_target;
+
+// Returns the kernels in use, SCAN_*.
+int scan_kernels();
+
+// Switches to the kernels, eg. to compare them. Returns false if the CPU lacks them.
+bool scan_use(int kernels);
+
+// Returns the first "\r\n\r\n" in data, NULL if there is none.
+const char* scan_headers_end(const char* data, size_t size);
+
+// Returns the first byte c in data, NULL if there is none.
+const char* scan_find(const char* data, size_t size, char c);
+
+// Returns the length of the longest prefix of data, whose bytes all belong to class.
+size_t scan_span(const char* data, size_t size, const scan_class_t* class);
+
+#endif /* SCAN_H */
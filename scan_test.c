@@ -0,0 +1,141 @@
+#include <regex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "scan.h"
+
+// Compares the vector kernels with the scalar ones at every length up to TEST_LENGTH and every start
+// offset up to TEST_OFFSET, so that the data begins and ends at every place of a vector, and the
+// character classes byte by byte with the regexes, which the parser used before them.
+
+#define TEST_LENGTH 100
+#define TEST_OFFSET 32
+#define TEST_ROUNDS 4    // Random fillings per length and offset.
+#define TEST_RUN    64   // Copies of a byte, so that the vectors are used for the classes.
+
+static char test_buffer[TEST_OFFSET + TEST_LENGTH + 64] __attribute__((aligned(64)));
+static unsigned test_failures = 0;
+
+static const char* kernel_names[] = {"scalar", "SSE2", "AVX2"};
+
+static void expect(bool ok, const char* what, int kernels, size_t offset, size_t length) {
+    if (ok)
+        return;
+    if (test_failures++ < 20)
+        fprintf(stderr, "%s: %s differs at offset %zu, length %zu\n", kernel_names[kernels], what, offset, length);
+}
+
+// Fills the data with bytes of alphabet, and what follows it with tail, which the kernels must not see.
+static void fill(char* data, size_t length, const char* alphabet, size_t alphabet_size, const char* tail) {
+    for (size_t i = 0; i < length; ++i)
+        data[i] = alphabet[rand() % alphabet_size];
+    for (size_t i = 0; i < 32; ++i)
+        data[length + i] = tail[i % strlen(tail)];
+}
+
+static size_t offset_of(const char* found, const char* data) {
+    return found ? (size_t)(found - data) : SIZE_MAX;
+}
+
+static void check_headers_end(int kernels, char* data, size_t offset, size_t length) {
+    scan_use(SCAN_SCALAR);
+    size_t expected = offset_of(scan_headers_end(data, length), data);
+    scan_use(kernels);
+    expect(offset_of(scan_headers_end(data, length), data) == expected, "scan_headers_end", kernels, offset, length);
+}
+
+static void check_find(int kernels, char* data, size_t offset, size_t length) {
+    scan_use(SCAN_SCALAR);
+    size_t expected = offset_of(scan_find(data, length, ','), data);
+    scan_use(kernels);
+    expect(offset_of(scan_find(data, length, ','), data) == expected, "scan_find", kernels, offset, length);
+}
+
+static void check_span(int kernels, char* data, size_t offset, size_t length) {
+    const scan_class_t* classes[] = {&scan_word, &scan_name, &scan_target};
+    for (size_t i = 0; i < sizeof(classes) / sizeof(classes[0]); ++i) {
+        scan_use(SCAN_SCALAR);
+        size_t expected = scan_span(data, length, classes[i]);
+        scan_use(kernels);
+        expect(scan_span(data, length, classes[i]) == expected, "scan_span", kernels, offset, length);
+    }
+}
+
+static void test_kernels(int kernels) {
+    const char crlf[] = "\r\n\r\r\n\na";
+    const char commas[] = "ab,\0";
+    const char requests[] = "aZ9/.-|\\: \t\r\n\x01\x7f\x80\xff";
+    for (size_t offset = 0; offset < TEST_OFFSET; ++offset) {
+        char* data = test_buffer + offset;
+        for (size_t length = 0; length <= TEST_LENGTH; ++length) {
+            for (int round = 0; round < TEST_ROUNDS; ++round) {
+                fill(data, length, crlf, sizeof(crlf) - 1, "\r\n");
+                check_headers_end(kernels, data, offset, length);
+                fill(data, length, commas, sizeof(commas) - 1, ",");
+                check_find(kernels, data, offset, length);
+                fill(data, length, requests, sizeof(requests) - 1, "a");
+                check_span(kernels, data, offset, length);
+            }
+
+            // The match at every place, eg. CRLFCRLF straddling the vectors.
+            for (size_t at = 0; at < length; ++at) {
+                fill(data, length, "a\r\n", 3, "\r\n");
+                if (at + 4 <= length) {
+                    memcpy(data + at, "\r\n\r\n", 4);
+                    check_headers_end(kernels, data, offset, length);
+                }
+                fill(data, length, "a", 1, ",");
+                data[at] = ',';
+                check_find(kernels, data, offset, length);
+                data[at] = requests[rand() % (sizeof(requests) - 1)];
+                check_span(kernels, data, offset, length);
+            }
+        }
+    }
+}
+
+// The span of a run of the byte, which is TEST_RUN if the byte is in the class, 0 if not.
+static size_t class_span(int kernels, const scan_class_t* class, unsigned char byte) {
+    char run[TEST_RUN];
+    memset(run, byte, sizeof(run));
+    scan_use(kernels);
+    return scan_span(run, sizeof(run), class);
+}
+
+static void test_class(int kernels, const scan_class_t* class, const char* name, const char* pattern) {
+    regex_t regex;
+    if (regcomp(&regex, pattern, REG_EXTENDED | REG_NOSUB) != 0) {
+        fprintf(stderr, "Cannot compile %s\n", pattern);
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned byte = 0; byte < 256; ++byte) {
+        char text[2] = {(char)byte, '\0'};
+        // The regexes saw the request as a string, never a NUL.
+        bool expected = byte != 0 && regexec(&regex, text, 0, NULL, 0) == 0;
+        if (class_span(kernels, class, byte) != (expected ? TEST_RUN : 0) && test_failures++ < 20)
+            fprintf(stderr, "%s: %s differs from %s at 0x%02x\n", kernel_names[kernels], name, pattern, byte);
+    }
+    regfree(&regex);
+}
+
+int main() {
+    srand(1);
+    for (int kernels = SCAN_SCALAR; kernels <= SCAN_AVX2; ++kernels) {
+        if (!scan_use(kernels)) {
+            printf("%s: not supported, skipped\n", kernel_names[kernels]);
+            continue;
+        }
+        if (kernels != SCAN_SCALAR)
+            test_kernels(kernels);
+        test_class(kernels, &scan_word, "scan_word", "^[^ \t\n\r\f\v]$");
+        test_class(kernels, &scan_name, "scan_name", "^[^ \t\n\r\f\v:]$");
+        test_class(kernels, &scan_target, "scan_target", "^[a-zA-Z0-9\\.\\/|-]$");
+        printf("%s: checked\n", kernel_names[kernels]);
+    }
+
+    if (test_failures > 0) {
+        fprintf(stderr, "%u differences\n", test_failures);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
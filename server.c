@@ -0,0 +1,2335 @@
+#define _GNU_SOURCE  // accept4, splice
+
+#include "server.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ifaddrs.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include "accesslog.h"
+#include "arena.h"
+#include "balance.h"
+#include "batch.h"
+#include "bufpool.h"
+#include "bundle.h"
+#include "co_servers.h"
+#include "codel.h"
+#include "fcache.h"
+#include "file.h"
+#include "h2.h"
+#include "hotset.h"
+#include "http.h"
+#include "instrument.h"
+#include "iopool.h"
+#include "prefetch.h"
+#include "ratelimit.h"
+#include "scan.h"
+#include "upstream.h"
+
+// Connection states //
+#define CONN_READ  0   // Waiting for a complete request.
+#define CONN_WAIT  1   // Waiting for the I/O pool or the file cache.
+#define CONN_WRITE 2   // Sending the response.
+#define CONN_CLOSE 3
+#define CONN_PROXY 4   // Exchanging the request with a corelated server.
+#define CONN_H2    5   // Exchanging HTTP/2 frames.
+
+// Phases of a proxied request //
+#define PROXY_SEND 0   // Sending the request upstream, connecting first if needed.
+#define PROXY_HEAD 1   // Reading the response head.
+#define PROXY_BODY 2   // Splicing the body to the client.
+
+// Operations run in the I/O pool //
+#define OP_CACHE 0     // Reads the file into the cache (also when woken by the cache).
+#define OP_OPEN  1     // Opens the file to be streamed.
+#define OP_META  2     // Takes the size of the file, for HEAD.
+#define OP_READ  3     // Reads the next chunk of the streamed file.
+#define OP_BATCH 4     // Reads the files of a batch.
+
+// Step returns
+#define STEP_AGAIN 0   // The socket is not ready.
+#define STEP_DONE  1
+#define STEP_YIELD 2   // The quantum of the connection is used up.
+#define STEP_LIMIT 3   // The client has to wait for its byte rate limit.
+
+// Run queues //
+#define RUN_SMALL 0
+#define RUN_BULK  1
+
+typedef struct loop loop_t;
+typedef struct session session_t;
+
+typedef struct conn {
+    loop_t* loop;
+    int fd;
+    int state;
+    struct conn* posted_next;  // In the loop's list of completed operations.
+    struct conn* loop_prev;    // In the loop's list of its connections, streams are not in it.
+    struct conn* loop_next;
+
+    bool queued;               // In a run queue of the loop.
+    bool bulk;                 // The response is not small, see SERVER_DEFAULT_SMALL_RESPONSE.
+    struct conn* run_next;
+    size_t deficit;            // Bytes the connection can still send in this turn.
+
+    struct sockaddr_storage addr;
+    ratelimit_client_t* client;
+    bool throttled;            // Waiting for its byte rate limit, until wake_at.
+    uint64_t wake_at;
+    struct conn* throttled_next;
+    struct conn* starved_next; // In the loop's list of connections waiting for a body buffer,
+    bool growing;              // to move an overlong head into, rather than to read a chunk of a file.
+
+    uint64_t arrived;          // When the request came, 0 once its response has started.
+    uint64_t page_at;          // When an HTML page was last served, its resources are prefetched, 0 if never.
+
+    // Logged, once the response is finished.
+    uint64_t started;          // When the request came, 0 if it has not been served.
+    bool parsed;
+    int status;                // 0 if no response is in progress.
+    uint64_t sent;             // Bytes of the response.
+
+    // The request buffer is kept NUL-terminated, one byte is reserved for that.
+    int buffer_class;
+    char* buffer;
+    size_t buffer_size;
+    size_t remaining_buffer_size;
+    char* read_loc;
+    char* request_end;
+    arena_t arena;
+    request_t request;
+
+    // The response is its head followed by its body, either may be empty.
+    const char* head;
+    size_t head_size;
+    const char* body;
+    size_t body_size;
+    size_t written;            // Of the head and the body together.
+    bool close_after;
+
+    fcache_entry_t* entry;     // Held while the body is sent from the cache.
+    bundle_t* bundle;          // Held while the body is sent from the bundle.
+    batch_t* batch;            // The body is a batch, its files are held while it is sent.
+    int file;                  // Streamed file, -1 if none.
+    size_t file_left;          // Bytes of the streamed file, which are not read yet.
+    char* chunk;               // Buffer of the streamed file, a body buffer, or a header buffer while they are all taken.
+    int chunk_class;
+
+    iopool_task_t task;
+    fcache_waiter_t waiter;
+    int op;
+    int op_ret;
+    size_t op_size;
+
+    // Proxied response, the head is sent like any other, the body is spliced through the pipe.
+    upstream_t* upstream;      // NULL if the response is not proxied.
+    int proxy_phase;
+    uint32_t proxy_ip;
+    uint16_t proxy_port;
+    uint64_t proxy_started;    // When the corelated server was asked.
+    char* proxy_buffer;        // The request, then the response head.
+    size_t proxy_size;         // Bytes of the request sent, or of the response read.
+    size_t proxy_request_size;
+    upstream_head_t proxy_head;
+    size_t proxy_left;         // Bytes of the body, which are not read from upstream.
+    size_t piped;              // Bytes in the pipe.
+    int pipe[2];               // -1 until the first body is spliced.
+
+    // HTTP/2. Each stream is a conn_t of its own, without a socket, served like an HTTP/1.1 request.
+    // Its connection frames the response.
+    session_t* h2;             // NULL if the connection speaks HTTP/1.1.
+    struct conn* session;      // Connection of the stream, NULL once the stream is cut off it.
+    uint32_t stream_id;        // 0 if the conn_t is not a stream.
+    int64_t window;            // Bytes the stream can send, by the client's flow control.
+    bool head_sent;
+
+#ifdef SERWER_INSTRUMENT
+    instrument_counts_t counts;  // Of the response in progress, the calls of a stream count to its connection.
+#endif
+} conn_t;
+
+// State of an HTTP/2 connection.
+struct session {
+    h2_hpack_t hpack;
+    h2_settings_t peer;
+    bool preface;              // The client's preface has come.
+    bool settings;             // Its first SETTINGS has come.
+    bool goaway;               // Sent or received, no more streams are opened.
+    bool closing;              // GOAWAY sent for an error, the connection ends once it is.
+    bool read_blocked;         // The socket had nothing more to read.
+    int64_t window;            // Bytes the connection can send, by the client's flow control.
+    uint32_t last_stream;      // The highest stream opened by the client.
+    uint32_t block_stream;     // Stream whose header block continues in CONTINUATION frames, 0 if none.
+    size_t block_size;
+
+    conn_t* streams[SERVER_H2_STREAMS];
+    unsigned stream_count;
+    unsigned turn;             // Rotates the order, in which the streams send.
+
+    size_t input_size;
+    size_t output_size;
+    size_t output_written;
+    uint8_t block[SERVER_H2_BLOCK];
+    uint8_t input[SERVER_H2_INPUT];
+    uint8_t output[SERVER_H2_OUTPUT];
+};
+
+struct loop {
+    unsigned index;
+    int epoll_fd;
+    int event_fd;              // Signalled when operations are posted.
+
+    pthread_mutex_t posted_mutex;
+    conn_t* posted;
+
+    // Connections ready to be driven, owned by the loop's thread.
+    conn_t* run_head[2];
+    conn_t* run_tail[2];
+    size_t run_length[2];
+    conn_t* throttled;
+    conn_t* starved_head;      // Waiting for a body buffer, in their order.
+    conn_t* starved_tail;
+    conn_t* conns;             // Every connection of the loop, woken when the server starts draining.
+    bool drain_seen;
+    codel_t codel;
+    upstream_pool_t upstreams;
+
+    _Atomic uint64_t connections;
+    _Atomic uint64_t accepted;
+    _Atomic uint64_t requests;
+    _Atomic uint64_t offloaded;
+    _Atomic uint64_t overloaded;
+    _Atomic uint64_t preempted;
+    _Atomic uint64_t shed;
+    _Atomic uint64_t delay_ns;
+    _Atomic uint64_t h2;
+    _Atomic uint64_t streams;
+    _Atomic uint64_t dropped;
+    _Atomic uint64_t batches;
+    _Atomic uint64_t buffer_waits;
+};
+
+// Set before the loops start.
+static const char* server_filesystem;
+static int server_socks[SERVER_MAX_LISTENERS];   // Their events point to their elements.
+static unsigned server_sock_count;
+static size_t server_quantum;
+static size_t server_small_response;
+static uint64_t server_codel_target;
+static uint64_t server_codel_interval;
+static bool server_proxy;
+static struct sockaddr_in server_self[SERVER_MAX_LISTENERS];  // TCP listening addresses, not proxied to.
+static unsigned server_self_count;
+static uint32_t server_local_ips[SERVER_MAX_LOCAL_IPS];       // Reach a socket listening on INADDR_ANY.
+static unsigned server_local_ip_count;
+static loop_t* server_loops = NULL;
+static unsigned server_loop_count = 0;
+
+static uint64_t server_drain_timeout;
+static atomic_bool server_draining = false;    // Connections are not accepted, nor kept alive.
+
+// Kept open, so that a connection can be accepted and refused when descriptors run out.
+static int server_reserve_fd = -1;
+static pthread_mutex_t server_reserve_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+///// BUFFER /////
+// Moves the beginning of the next request, which follows request_end, to the front of the buffer.
+static void adjust_buffer_state(char* buffer, size_t buffer_size, size_t* remaining_buffer_size, char** read_loc, char* request_end) {
+    char* new_request = request_end + 4;
+    size_t new_request_size = *read_loc - new_request;
+
+    memmove(buffer, new_request, new_request_size);
+    buffer[new_request_size] = '\0';
+
+    *remaining_buffer_size = buffer_size - new_request_size;
+    *read_loc = buffer + new_request_size;
+}
+
+///// CONNECTIONS /////
+static conn_t* conn_new(loop_t* loop, int fd) {
+    conn_t* conn = calloc(1, sizeof(conn_t));
+    if (!conn)
+        return NULL;
+
+    conn->buffer_class = BUFPOOL_HEADER;
+    conn->buffer = bufpool_get(conn->buffer_class);
+    if (!conn->buffer) {
+        free(conn);
+        return NULL;
+    }
+    if (arena_init(&conn->arena) != ARENA_OK) {
+        bufpool_put(conn->buffer_class, conn->buffer);
+        free(conn);
+        return NULL;
+    }
+
+    conn->loop = loop;
+    conn->fd = fd;
+    conn->state = CONN_READ;
+    conn->file = -1;
+    conn->pipe[0] = conn->pipe[1] = -1;
+    conn->buffer_size = bufpool_size(conn->buffer_class) - 1;
+    conn->remaining_buffer_size = conn->buffer_size;
+    conn->buffer[0] = '\0';
+    conn->read_loc = conn->buffer;
+    return conn;
+}
+
+// Drops everything the response holds.
+static void conn_release(conn_t* conn) {
+    if (conn->entry) {
+        fcache_release(conn->entry);
+        conn->entry = NULL;
+    }
+    if (conn->bundle) {
+        bundle_release(conn->bundle);
+        conn->bundle = NULL;
+    }
+    if (conn->batch) {
+        batch_release(conn->batch);
+        conn->batch = NULL;
+    }
+    if (conn->file != -1) {
+        close(conn->file);
+        conn->file = -1;
+    }
+    if (conn->chunk) {
+        bufpool_put(conn->chunk_class, conn->chunk);
+        conn->chunk = NULL;
+    }
+    if (conn->upstream) {
+        // Only a connection with its response read completely can serve another one.
+        bool complete = conn->proxy_phase == PROXY_BODY && conn->proxy_left == 0 && !conn->proxy_head.close;
+        if (complete && epoll_ctl(conn->loop->epoll_fd, EPOLL_CTL_DEL, conn->upstream->fd, NULL) == 0)
+            upstream_put(&conn->loop->upstreams, conn->upstream);
+        else
+            upstream_close(conn->upstream, false);
+        conn->upstream = NULL;
+    }
+}
+
+// Logs the response, which is finished or cut short.
+static void conn_log(conn_t* conn) {
+    if (conn->status == 0)
+        return;
+#ifdef SERWER_INSTRUMENT
+    if (conn->stream_id == 0)
+        instrument_finish(&conn->counts, instrument_outcome(conn->status, conn->parsed && conn->request.starting.method == M_HEAD));
+#endif
+    // Files of the root answered in full.
+    if (conn->status == C_OK && conn->parsed && !conn->upstream && !conn->batch) {
+        if (hotset_enabled())
+            hotset_touch(conn->request.starting.target, conn->request.headers.content_len);
+        if (prefetch_enabled()) {
+            // The streams of a connection are requested by one client, one after another.
+            conn_t* client = conn->session ? conn->session : conn;
+            prefetch_request(conn->request.starting.target, client->page_at);
+            if (conn->request.starting.method == M_GET && prefetch_page(conn->request.starting.target))
+                client->page_at = iopool_now();
+        }
+    }
+
+    if (accesslog_enabled()) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        accesslog_record_t record;
+        record.time_ns = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+        record.duration_ns = conn->started != 0 ? iopool_now() - conn->started : 0;
+        record.bytes = conn->sent;
+        record.status = conn->status;
+        accesslog_set_addr(&record, (struct sockaddr*)&conn->addr);
+        // The target of other methods is not parsed.
+        if (conn->parsed && conn->request.starting.method != M_OTHER) {
+            record.method = conn->request.starting.method;
+            strncpy(record.target, conn->request.starting.target, ACCESSLOG_TARGET - 1);
+            record.target[ACCESSLOG_TARGET - 1] = '\0';
+        }
+        else {
+            record.method = M_OTHER;
+            record.target[0] = '\0';
+        }
+        accesslog_push(conn->loop->index, &record);
+    }
+
+    conn->status = 0;
+    conn->sent = 0;
+    conn->started = 0;
+    conn->parsed = false;
+}
+
+static void conn_h2_close(conn_t* conn);
+
+static void conn_free(conn_t* conn) {
+    if (conn->h2)
+        conn_h2_close(conn);
+    conn_log(conn);
+    conn_release(conn);
+    if (conn->pipe[0] != -1) {
+        close(conn->pipe[0]);
+        close(conn->pipe[1]);
+    }
+    arena_destroy(&conn->arena);
+    bufpool_put(conn->buffer_class, conn->buffer);
+    // A stream shares the socket and the client of its connection.
+    if (conn->stream_id == 0) {
+        if (conn->loop_prev)
+            conn->loop_prev->loop_next = conn->loop_next;
+        else
+            conn->loop->conns = conn->loop_next;
+        if (conn->loop_next)
+            conn->loop_next->loop_prev = conn->loop_prev;
+        ratelimit_disconnect(conn->client);
+        close(conn->fd);
+        atomic_fetch_sub_explicit(&conn->loop->connections, 1, memory_order_relaxed);
+    }
+    free(conn);
+}
+
+static void conn_respond(conn_t* conn, const char* head, size_t head_size, const char* body, size_t body_size) {
+    conn->head = head;
+    conn->head_size = head_size;
+    conn->body = body;
+    conn->body_size = body_size;
+    conn->written = 0;
+    conn->state = CONN_WRITE;
+    conn->bulk = conn->bulk || head_size + body_size > server_small_response;
+}
+
+static void conn_respond_static(conn_t* conn, int code) {
+    const char* msg;
+    size_t msg_size;
+    take_static_response(code, &msg, &msg_size);
+    conn->status = code;
+
+    // These responses end the connection.
+    if (code == C_BAD_REQUEST || code == C_INTERNAL_ERROR || code == C_BAD_GATEWAY || code == C_UNAVAILABLE)
+        conn->close_after = true;
+    conn_respond(conn, msg, msg_size, NULL, 0);
+}
+
+// Sends the head of a 200 response for a file of size bytes.
+static void conn_respond_success(conn_t* conn, size_t size, const char* body, size_t body_size) {
+    char* head;
+    size_t head_size;
+
+    conn->request.headers.content_type = "application/octet-stream";
+    conn->request.headers.content_len = size;
+    if (render_success(&conn->request, &conn->arena, &head, &head_size) != SEND_OK) {
+        conn_respond_static(conn, C_INTERNAL_ERROR);
+        return;
+    }
+    conn_respond(conn, head, head_size, body, body_size);
+    conn->status = C_OK;
+    conn->bulk = conn->bulk || size > server_small_response;
+}
+
+// Tells whether ip:port reaches a listening socket of this process. ip is in the network byte order.
+static bool server_is_self(uint32_t ip, uint16_t port) {
+    for (unsigned i = 0; i < server_self_count; ++i) {
+        if (ntohs(server_self[i].sin_port) != port)
+            continue;
+        if (server_self[i].sin_addr.s_addr == ip)
+            return true;
+        if (server_self[i].sin_addr.s_addr != htonl(INADDR_ANY))
+            continue;
+        if ((ntohl(ip) >> 24) == IN_LOOPBACKNET)
+            return true;
+        for (unsigned j = 0; j < server_local_ip_count; ++j) {
+            if (server_local_ips[j] == ip)
+                return true;
+        }
+    }
+    return false;
+}
+
+static void conn_proxy(conn_t* conn, uint32_t ip, uint16_t port);
+
+// Answers for a file missing from the root, by the corelated servers.
+static void conn_respond_missing(conn_t* conn) {
+    const char* res;
+    size_t res_size;
+    // Streams are redirected, a proxied body is spliced into the client's socket.
+    // A request passed on by a serwer already is redirected too, so that the servers naming each other
+    // do not pass it round.
+    bool proxy = server_proxy && conn->stream_id == 0 && !conn->request.headers.via_serwer;
+
+    // The response belongs to the table, which is kept only until cos_read_end.
+    const cos_table_t* table = cos_read_begin();
+    if (!table) {
+        conn_respond_static(conn, C_INTERNAL_ERROR);
+        return;
+    }
+
+    if (balance_mode() != BALANCE_FIRST) {
+        const cos_replica_t* replicas;
+        uint32_t count;
+        int ret = cos_search_replicas(table, conn->request.starting.target, &replicas, &count);
+        if (ret != COS_FOUND) {
+            cos_read_end();
+            conn_respond_static(conn, ret == COS_NOT_FOUND ? C_NOT_FOUND : C_INTERNAL_ERROR);
+            return;
+        }
+
+        const cos_replica_t* replica = &replicas[balance_pick(replicas, count, (struct sockaddr*)&conn->addr)];
+        uint32_t ip = replica->ip;
+        uint16_t port = replica->port;
+        size_t copy_size = replica->response_size;
+        char* copy = proxy ? NULL : arena_alloc(&conn->arena, copy_size);
+        if (copy)
+            memcpy(copy, table->strings + replica->response_off, copy_size);
+        cos_read_end();
+
+        if (proxy && server_is_self(ip, port))
+            conn_respond_static(conn, C_NOT_FOUND);
+        else if (proxy)
+            conn_proxy(conn, ip, port);
+        else if (copy) {
+            conn_respond(conn, copy, copy_size, NULL, 0);
+            conn->status = C_FOUND;
+        }
+        else
+            conn_respond_static(conn, C_INTERNAL_ERROR);
+        return;
+    }
+
+    if (proxy) {
+        uint32_t ip;
+        uint16_t port;
+        int ret = cos_search_server(table, conn->request.starting.target, &ip, &port);
+        cos_read_end();
+        if (ret == COS_FOUND && !server_is_self(ip, port))
+            conn_proxy(conn, ip, port);
+        else
+            conn_respond_static(conn, C_NOT_FOUND);
+        return;
+    }
+
+    int ret = cos_search(table, conn->request.starting.target, &res, &res_size);
+    if (ret == COS_FOUND) {
+        char* copy = arena_alloc(&conn->arena, res_size);
+        if (copy)
+            memcpy(copy, res, res_size);
+        cos_read_end();
+
+        if (copy) {
+            conn_respond(conn, copy, res_size, NULL, 0);
+            conn->status = C_FOUND;
+        }
+        else
+            conn_respond_static(conn, C_INTERNAL_ERROR);
+    }
+    else if (ret == COS_NOT_FOUND) {
+        cos_read_end();
+        conn_respond_static(conn, C_NOT_FOUND);
+    }
+    else { /* if (ret == COS_INTERNAL_ERR) */
+        cos_read_end();
+        conn_respond_static(conn, C_INTERNAL_ERROR);
+    }
+}
+
+///// FILE OPERATIONS /////
+static void conn_post(conn_t* conn) {
+    loop_t* loop = conn->loop;
+
+    pthread_mutex_lock(&loop->posted_mutex);
+    conn->posted_next = loop->posted;
+    loop->posted = conn;
+    pthread_mutex_unlock(&loop->posted_mutex);
+
+    uint64_t one = 1;
+    write(loop->event_fd, &one, sizeof(one));
+}
+
+// Runs on a thread of the I/O pool.
+static void conn_run(iopool_task_t* task) {
+    conn_t* conn = (conn_t*)((char*)task - offsetof(conn_t, task));
+    char* target = conn->request.starting.target;
+    fs_meta_t meta;
+    int fd;
+
+    switch (conn->op) {
+    case OP_CACHE:
+        conn->op_ret = fcache_get(server_filesystem, target, &conn->arena, &conn->entry);
+        break;
+    case OP_OPEN:
+        conn->op_ret = take_file(server_filesystem, target, &conn->arena, &fd);
+        if (conn->op_ret != FILE_OK)
+            break;
+        conn->op_ret = take_filesize(fd, &conn->op_size);
+        if (conn->op_ret == FILE_OK)
+            conn->file = fd;
+        else
+            close(fd);
+        break;
+    case OP_META:
+        conn->op_ret = take_file_meta(server_filesystem, target, &conn->arena, &meta);
+        if (conn->op_ret == FILE_OK && !meta.regular)
+            conn->op_ret = FILE_NOT_FOUND;
+        if (conn->op_ret == FILE_OK)
+            conn->op_size = meta.size;
+        break;
+    case OP_BATCH:
+        batch_read(conn->batch, server_filesystem, &conn->arena);
+        break;
+    default: /* OP_READ */
+        conn->op_ret = take_filecontent_chunk(conn->file,
+                                              conn->file_left < bufpool_size(conn->chunk_class) ? conn->file_left : bufpool_size(conn->chunk_class),
+                                              &conn->chunk, &conn->op_size);
+        break;
+    }
+}
+
+static void conn_run_done(iopool_task_t* task) {
+    conn_post((conn_t*)((char*)task - offsetof(conn_t, task)));
+}
+
+// Called by the thread which has read the file into the cache.
+static void conn_wake(fcache_waiter_t* waiter) {
+    conn_t* conn = (conn_t*)((char*)waiter - offsetof(conn_t, waiter));
+    conn->task.expired = false;
+    conn->op_ret = waiter->result;
+    conn->entry = waiter->entry;
+    conn_post(conn);
+}
+
+static void conn_offload(conn_t* conn, int op) {
+    conn->op = op;
+    conn->task.run = conn_run;
+    conn->task.done = conn_run_done;
+    if (iopool_submit(&conn->task, conn->loop->index) != IOPOOL_OK) {
+        atomic_fetch_add_explicit(&conn->loop->overloaded, 1, memory_order_relaxed);
+        if (op == OP_READ)
+            conn->state = CONN_CLOSE;  // The head is sent already.
+        else
+            conn_respond_static(conn, C_UNAVAILABLE);
+        return;
+    }
+
+    atomic_fetch_add_explicit(&conn->loop->offloaded, 1, memory_order_relaxed);
+    conn->state = CONN_WAIT;
+}
+
+// Puts the connection aside, until a buffer is free. An exhausted pool holds the connections back,
+// it does not fail them.
+static void conn_starve(conn_t* conn, bool growing) {
+    loop_t* loop = conn->loop;
+    atomic_fetch_add_explicit(&loop->buffer_waits, 1, memory_order_relaxed);
+    conn->growing = growing;
+    conn->state = CONN_WAIT;
+    conn->starved_next = NULL;
+    if (loop->starved_tail)
+        loop->starved_tail->starved_next = conn;
+    else
+        loop->starved_head = conn;
+    loop->starved_tail = conn;
+}
+
+// Takes the buffer for the chunks of the streamed file. Smaller chunks keep it flowing, while the body buffers
+// are all taken, eg. by the heads, which have grown into them.
+static bool conn_take_chunk(conn_t* conn) {
+    conn->chunk_class = BUFPOOL_BODY;
+    conn->chunk = bufpool_get(BUFPOOL_BODY);
+    if (!conn->chunk) {
+        conn->chunk_class = BUFPOOL_HEADER;
+        conn->chunk = bufpool_get(BUFPOOL_HEADER);
+    }
+    return conn->chunk != NULL;
+}
+
+// Reads the next chunk of the streamed file, into the buffer taken for its first one.
+static void conn_read_chunk(conn_t* conn) {
+    if (!conn->chunk && !conn_take_chunk(conn)) {
+        conn_starve(conn, false);
+        return;
+    }
+    conn_offload(conn, OP_READ);
+}
+
+// Continues the request after a cache lookup.
+static void conn_cached(conn_t* conn, int ret) {
+    if (ret == FCACHE_HIT)
+        conn_respond_success(conn, fcache_size(conn->entry), fcache_data(conn->entry), fcache_size(conn->entry));
+    else if (ret == FCACHE_BYPASS)
+        conn_offload(conn, OP_OPEN);
+    else if (ret == FCACHE_WOULD_BLOCK)
+        conn_offload(conn, OP_CACHE);
+    else if (ret == FCACHE_PENDING)
+        conn->state = CONN_WAIT;
+    else if (ret == FCACHE_NOT_FOUND)
+        conn_respond_missing(conn);
+    else if (ret == FCACHE_REACHOUT)
+        conn_respond_static(conn, C_NOT_FOUND);
+    else
+        conn_respond_static(conn, C_INTERNAL_ERROR);
+}
+
+// Continues the request after taking the file's metadata.
+static void conn_meta_taken(conn_t* conn, int ret, size_t size) {
+    if (ret == FILE_OK)
+        conn_respond_success(conn, size, NULL, 0);
+    else if (ret == FILE_NOT_FOUND)
+        conn_respond_missing(conn);
+    else if (ret == FILE_REACHOUT)
+        conn_respond_static(conn, C_NOT_FOUND);
+    else
+        conn_respond_static(conn, C_INTERNAL_ERROR);
+}
+
+// Sends the batch, once its files are looked up.
+static void conn_batched(conn_t* conn) {
+    char* head;
+    size_t head_size;
+
+    batch_redirect(conn->batch, (struct sockaddr*)&conn->addr, &conn->arena);
+    if (batch_finish(conn->batch, &conn->arena) != BATCH_OK) {
+        conn_respond_static(conn, C_INTERNAL_ERROR);
+        return;
+    }
+    size_t size = batch_size(conn->batch);
+    conn->request.headers.content_type = BATCH_CONTENT_TYPE;
+    conn->request.headers.content_len = size;
+    if (render_success(&conn->request, &conn->arena, &head, &head_size) != SEND_OK) {
+        conn_respond_static(conn, C_INTERNAL_ERROR);
+        return;
+    }
+    // The body is gathered from the batch.
+    conn_respond(conn, head, head_size, NULL, conn->request.starting.method == M_GET ? size : 0);
+    conn->status = C_OK;
+    conn->bulk = conn->bulk || size > server_small_response;
+}
+
+// Continues the request after its operation has completed.
+static void conn_resume(conn_t* conn) {
+    if (conn->task.expired) {
+        // The request waited too long in the I/O pool.
+        atomic_fetch_add_explicit(&conn->loop->overloaded, 1, memory_order_relaxed);
+        if (conn->op == OP_READ)
+            conn->state = CONN_CLOSE;
+        else
+            conn_respond_static(conn, C_UNAVAILABLE);
+        return;
+    }
+
+    switch (conn->op) {
+    case OP_CACHE:
+        conn_cached(conn, conn->op_ret);
+        break;
+    case OP_OPEN:
+        if (conn->op_ret != FILE_OK) {
+            conn_meta_taken(conn, conn->op_ret, 0);
+            break;
+        }
+        conn->file_left = conn->op_size;
+        conn_respond_success(conn, conn->op_size, NULL, 0);
+        break;
+    case OP_META:
+        conn_meta_taken(conn, conn->op_ret, conn->op_size);
+        break;
+    case OP_BATCH:
+        conn_batched(conn);
+        break;
+    default: /* OP_READ */
+        if (conn->op_ret == FILE_INTERNAL_ERR || conn->op_size == 0) {
+            // The file has shrunk or cannot be read, the response cannot be completed.
+            conn->state = CONN_CLOSE;
+            break;
+        }
+        conn->file_left -= conn->op_size;
+        conn_respond(conn, NULL, 0, conn->chunk, conn->op_size);
+        break;
+    }
+}
+
+///// PROXY /////
+// Takes a connection to the corelated server and starts sending the request.
+static int conn_proxy_connect(conn_t* conn) {
+    if (upstream_get(&conn->loop->upstreams, conn->proxy_ip, conn->proxy_port, &conn->upstream) != UPSTREAM_OK) {
+        conn->upstream = NULL;
+        return SERVER_ERR;
+    }
+
+    // Both sockets wake the connection.
+    struct epoll_event event = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = conn};
+    if (epoll_ctl(conn->loop->epoll_fd, EPOLL_CTL_ADD, conn->upstream->fd, &event) == -1) {
+        upstream_close(conn->upstream, true);
+        conn->upstream = NULL;
+        return SERVER_ERR;
+    }
+
+    conn->proxy_phase = PROXY_SEND;
+    conn->proxy_size = 0;
+    conn->state = CONN_PROXY;
+    return SERVER_OK;
+}
+
+// Fetches the requested file from the corelated server ip:port, instead of redirecting the client there.
+static void conn_proxy(conn_t* conn, uint32_t ip, uint16_t port) {
+    char address[INET_ADDRSTRLEN];
+    struct in_addr in = {.s_addr = ip};
+    inet_ntop(AF_INET, &in, address, sizeof(address));
+
+    // The buffer holds the response head later.
+    const char* method = conn->request.starting.method == M_HEAD ? "HEAD" : "GET";
+    const char* target = conn->request.starting.target;
+    size_t size = strlen(method) + strlen(target) + strlen(address) + strlen(HTTP_VIA) + 40;
+    conn->proxy_buffer = arena_alloc(&conn->arena, size > SERVER_PROXY_HEAD ? size : SERVER_PROXY_HEAD);
+    if (!conn->proxy_buffer) {
+        conn_respond_static(conn, C_INTERNAL_ERROR);
+        return;
+    }
+    conn->proxy_request_size = snprintf(conn->proxy_buffer, size, "%s %s HTTP/1.1\r\nHost: %s:%u\r\nVia: %s\r\n\r\n",
+                                        method, target, address, port, HTTP_VIA);
+    conn->proxy_ip = ip;
+    conn->proxy_port = port;
+    conn->proxy_started = iopool_now();
+
+    if (conn_proxy_connect(conn) != SERVER_OK) {
+        balance_observe(ip, port, BALANCE_FAILURE_NS);
+        conn_respond_static(conn, C_BAD_GATEWAY);
+    }
+}
+
+// Gives up the upstream connection. A reused one may have been closed by the server while idle,
+// then the request is sent again, unless a part of the response has come.
+static void conn_proxy_fail(conn_t* conn) {
+    bool retry = conn->upstream->reused
+                 && (conn->proxy_phase == PROXY_SEND || (conn->proxy_phase == PROXY_HEAD && conn->proxy_size == 0));
+    upstream_close(conn->upstream, !retry);
+    conn->upstream = NULL;
+
+    if (retry && conn_proxy_connect(conn) == SERVER_OK)
+        return;
+    balance_observe(conn->proxy_ip, conn->proxy_port, BALANCE_FAILURE_NS);
+    if (conn->proxy_phase == PROXY_BODY)
+        conn->state = CONN_CLOSE;  // The head is sent already.
+    else
+        conn_respond_static(conn, C_BAD_GATEWAY);
+}
+
+// Moves the body from the upstream socket through the pipe to the client, within the connection's quantum.
+static int conn_proxy_splice(conn_t* conn) {
+    if (conn->pipe[0] == -1 && pipe2(conn->pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+        conn->pipe[0] = -1;
+        conn->state = CONN_CLOSE;
+        return STEP_DONE;
+    }
+
+    while (conn->piped > 0 || conn->proxy_left > 0) {
+        ssize_t ret;
+        if (conn->piped > 0) {
+            if (conn->deficit == 0)
+                return STEP_YIELD;
+            size_t wanted = conn->piped < conn->deficit ? conn->piped : conn->deficit;
+            uint64_t wait_ns;
+            size_t budget = ratelimit_take_bytes(conn->client, wanted, &wait_ns);
+            if (budget == 0) {
+                conn->wake_at = iopool_now() + wait_ns;
+                return STEP_LIMIT;
+            }
+
+            ret = splice(conn->pipe[0], NULL, conn->fd, NULL, budget, SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
+            ratelimit_return_bytes(conn->client, ret > 0 ? budget - ret : budget);
+            if (ret == -1 && errno == EINTR)
+                continue;
+            if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return STEP_AGAIN;
+            if (ret <= 0) {
+                conn->state = CONN_CLOSE;
+                return STEP_DONE;
+            }
+            conn->piped -= ret;
+            conn->sent += ret;
+            conn->deficit -= ret;
+        }
+        else {
+            size_t wanted = conn->proxy_left < SERVER_PIPE_CHUNK ? conn->proxy_left : SERVER_PIPE_CHUNK;
+            ret = splice(conn->upstream->fd, NULL, conn->pipe[1], NULL, wanted, SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
+            if (ret == -1 && errno == EINTR)
+                continue;
+            if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return STEP_AGAIN;
+            if (ret == 0 && conn->proxy_left == UPSTREAM_UNTIL_CLOSE) {
+                conn->proxy_left = 0;
+                break;
+            }
+            if (ret <= 0) {
+                conn_proxy_fail(conn);
+                return STEP_DONE;
+            }
+            conn->piped += ret;
+            if (conn->proxy_left != UPSTREAM_UNTIL_CLOSE)
+                conn->proxy_left -= ret;
+        }
+    }
+    return STEP_DONE;
+}
+
+// Exchanges the request with the corelated server. Once the response head has come,
+// it is sent to the client like any other response, the body follows by conn_sent.
+static int conn_proxy_step(conn_t* conn) {
+    ssize_t ret;
+    for (;;) {
+        switch (conn->proxy_phase) {
+        case PROXY_SEND:
+            ret = write(conn->upstream->fd, conn->proxy_buffer + conn->proxy_size,
+                        conn->proxy_request_size - conn->proxy_size);
+            if (ret == -1 && errno == EINTR)
+                continue;
+            // Also while connecting.
+            if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return STEP_AGAIN;
+            if (ret == -1) {
+                conn_proxy_fail(conn);
+                if (conn->state == CONN_PROXY)
+                    continue;
+                return STEP_DONE;
+            }
+            conn->proxy_size += ret;
+            if (conn->proxy_size == conn->proxy_request_size) {
+                conn->proxy_phase = PROXY_HEAD;
+                conn->proxy_size = 0;
+            }
+            break;
+        case PROXY_HEAD:
+            ret = read(conn->upstream->fd, conn->proxy_buffer + conn->proxy_size,
+                       SERVER_PROXY_HEAD - 1 - conn->proxy_size);
+            if (ret == -1 && errno == EINTR)
+                continue;
+            if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return STEP_AGAIN;
+            if (ret <= 0) {
+                conn_proxy_fail(conn);
+                if (conn->state == CONN_PROXY)
+                    continue;
+                return STEP_DONE;
+            }
+            conn->proxy_size += ret;
+            conn->proxy_buffer[conn->proxy_size] = '\0';
+
+            upstream_head_t* head = &conn->proxy_head;
+            int parsed = upstream_parse_head(conn->proxy_buffer, conn->proxy_size,
+                                             conn->request.starting.method == M_HEAD, head);
+            if (parsed == UPSTREAM_PARTIAL && conn->proxy_size < SERVER_PROXY_HEAD - 1)
+                continue;
+            // The bytes read after the head start the body.
+            size_t prefix = conn->proxy_size - head->head_size;
+            if (parsed != UPSTREAM_OK || (head->content_length != UPSTREAM_UNTIL_CLOSE && prefix > head->content_length)) {
+                conn_proxy_fail(conn);
+                return STEP_DONE;
+            }
+
+            balance_observe(conn->proxy_ip, conn->proxy_port, iopool_now() - conn->proxy_started);
+            conn->proxy_left = head->content_length == UPSTREAM_UNTIL_CLOSE ? UPSTREAM_UNTIL_CLOSE : head->content_length - prefix;
+            conn->piped = 0;
+            // A body ending with the upstream connection ends the client's one too.
+            if (head->content_length == UPSTREAM_UNTIL_CLOSE)
+                conn->close_after = true;
+            char* forwarded = arena_alloc(&conn->arena, head->head_size + sizeof(UPSTREAM_CLOSE_HEADER) + prefix);
+            if (!forwarded) {
+                conn_proxy_fail(conn);
+                return STEP_DONE;
+            }
+            size_t forwarded_size = upstream_forward_head(conn->proxy_buffer, head, conn->close_after, forwarded);
+            memcpy(forwarded + forwarded_size, conn->proxy_buffer + head->head_size, prefix);
+            conn->proxy_phase = PROXY_BODY;
+            conn_respond(conn, forwarded, forwarded_size + prefix, NULL, 0);
+            conn->status = head->status;
+            conn->bulk = conn->bulk || head->content_length > server_small_response;
+            return STEP_DONE;
+        default: /* PROXY_BODY */
+            return conn_proxy_splice(conn);
+        }
+    }
+}
+
+///// SERVING /////
+// Moves the head, which has filled its header buffer, to the body buffer buf.
+static void conn_grow(conn_t* conn, char* buf) {
+    memcpy(buf, conn->buffer, conn->buffer_size + 1);
+    bufpool_put(conn->buffer_class, conn->buffer);
+    conn->buffer_class = BUFPOOL_BODY;
+    conn->buffer = buf;
+    conn->read_loc = conn->buffer + conn->buffer_size;
+    conn->remaining_buffer_size = bufpool_size(conn->buffer_class) - 1 - conn->buffer_size;
+    conn->buffer_size = bufpool_size(conn->buffer_class) - 1;
+}
+
+// Reads until a complete request is in the buffer.
+static int conn_read(conn_t* conn) {
+    conn->request_end = (char*)scan_headers_end(conn->buffer, conn->read_loc - conn->buffer);
+    while (conn->request_end == NULL) {
+        if (conn->remaining_buffer_size == 0) {
+            // Headers longer than a header buffer move to a body buffer, there is no more room after that.
+            if (conn->buffer_class != BUFPOOL_HEADER) {
+                conn_respond_static(conn, C_INTERNAL_ERROR);
+                return STEP_DONE;
+            }
+            char* buf = bufpool_get(BUFPOOL_BODY);
+            if (!buf) {
+                conn_starve(conn, true);
+                return STEP_DONE;
+            }
+            conn_grow(conn, buf);
+        }
+
+        ssize_t ret = read(conn->fd, conn->read_loc, conn->remaining_buffer_size);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // An idle connection is not kept alive, while the server is draining.
+            if (conn->read_loc == conn->buffer && atomic_load_explicit(&server_draining, memory_order_relaxed)) {
+                conn->state = CONN_CLOSE;
+                return STEP_DONE;
+            }
+            return STEP_AGAIN;
+        }
+        if (ret <= 0) {
+            // The client has closed the connection, or it has failed.
+            conn->state = CONN_CLOSE;
+            return STEP_DONE;
+        }
+
+        // Searching for the end of headers -> CR LF CR LF, only the new bytes and the 3 before can start it.
+        char* from = conn->read_loc > conn->buffer + 3 ? conn->read_loc - 3 : conn->buffer;
+        conn->read_loc += ret;
+        *conn->read_loc = '\0';
+        conn->remaining_buffer_size -= ret;
+        conn->request_end = (char*)scan_headers_end(from, conn->read_loc - from);
+    }
+    if (conn->arrived == 0)
+        conn->arrived = iopool_now();
+    return STEP_DONE;
+}
+
+// Answers from the bundle, the body is sent straight from its mapping.
+static void conn_bundled(conn_t* conn) {
+    // Looked up as the root filesystem would resolve the target.
+    char* path;
+    int ret = take_normal_path(conn->request.starting.target, &conn->arena, &path);
+    if (ret != FILE_OK) {
+        conn_respond_static(conn, ret == FILE_REACHOUT ? C_NOT_FOUND : C_INTERNAL_ERROR);
+        return;
+    }
+
+    bundle_t* bundle = bundle_acquire();
+    const char* data;
+    fs_meta_t meta;
+    ret = bundle_lookup(bundle, path, &data, &meta);
+    if (ret == BUNDLE_FOUND && conn->request.starting.method == M_GET) {
+        conn->bundle = bundle;
+        conn_respond_success(conn, meta.size, data, meta.size);
+        return;
+    }
+
+    bundle_release(bundle);
+    if (ret == BUNDLE_FOUND)
+        conn_respond_success(conn, meta.size, NULL, 0);
+    else if (ret == BUNDLE_NOT_FOUND)
+        conn_respond_missing(conn);
+    else
+        conn_respond_static(conn, C_INTERNAL_ERROR);
+}
+
+// Parses the request ending at request_end. A malformed one is answered.
+static int conn_parse(conn_t* conn) {
+    // The parser takes the head as a string, a NUL would cut it short.
+    if (scan_find(conn->buffer, conn->request_end - conn->buffer, '\0')) {
+        conn_respond_static(conn, C_BAD_REQUEST);
+        return SERVER_ERR;
+    }
+    *(conn->request_end + 2) = '\0';
+    int ret = parse_http_request(conn->buffer, &conn->request);
+    if (ret == PARSE_BAD_REQ) {
+        conn_respond_static(conn, C_BAD_REQUEST);
+        return SERVER_ERR;
+    }
+    if (ret == PARSE_INTERNAL_ERR) {
+        conn_respond_static(conn, C_INTERNAL_ERROR);
+        return SERVER_ERR;
+    }
+    conn->parsed = true;
+    conn->close_after = conn->request.headers.con_close;
+    return SERVER_OK;
+}
+
+// Answers a batch fetch, see batch.h. The files of the root are read in the I/O pool.
+static void conn_batch(conn_t* conn) {
+    atomic_fetch_add_explicit(&conn->loop->batches, 1, memory_order_relaxed);
+    int ret = batch_parse(conn->request.starting.target, &conn->arena, &conn->batch);
+    if (ret != BATCH_OK) {
+        conn->batch = NULL;
+        conn_respond_static(conn, ret == BATCH_BAD_REQ ? C_BAD_REQUEST : C_INTERNAL_ERROR);
+        return;
+    }
+    if (bundle_enabled()) {
+        batch_read_bundle(conn->batch, &conn->arena);
+        conn_batched(conn);
+        return;
+    }
+    conn_offload(conn, OP_BATCH);
+}
+
+// Answers the parsed request.
+static void conn_answer(conn_t* conn) {
+    request_t* request = &conn->request;
+    int ret;
+
+    if (ratelimit_request(conn->client) == RATELIMIT_OVER) {
+        conn_respond_static(conn, C_TOO_MANY);
+        return;
+    }
+
+    if (request->starting.method == M_OTHER) {
+        conn_respond_static(conn, C_NOT_IMPLEMENTED);
+        return;
+    }
+    if (batch_requested(request->starting.target)) {
+        conn_batch(conn);
+        return;
+    }
+    if (request->starting.target_type == F_INCORRECT) {
+        conn_respond_static(conn, C_NOT_FOUND);
+        return;
+    }
+
+    // We know, that the method requested is either GET or HEAD.
+    if (bundle_enabled()) {
+        conn_bundled(conn);
+        return;
+    }
+
+    // Small files are sent from the cache, HEAD needs only the size.
+    // Whatever needs the disk is left to the I/O pool.
+    if (request->starting.method == M_GET) {
+        conn->waiter.wake = conn_wake;
+        conn->op = OP_CACHE;
+        conn_cached(conn, fcache_try_get(request->starting.target, &conn->waiter, &conn->entry));
+        return;
+    }
+
+    fs_meta_t meta;
+    ret = take_file_meta_indexed(request->starting.target, &meta);
+    if (ret == FILE_WOULD_BLOCK)
+        conn_offload(conn, OP_META);
+    else if (ret == FILE_OK && !meta.regular)
+        conn_meta_taken(conn, FILE_NOT_FOUND, 0);
+    else
+        conn_meta_taken(conn, ret, meta.size);
+}
+
+static void conn_h2_start(conn_t* conn);
+static void conn_h2_upgrade(conn_t* conn);
+
+// Starts answering the request ending at request_end.
+static void conn_serve(conn_t* conn) {
+    // A client, which knows that the server speaks HTTP/2, starts with its preface.
+    if (conn->stream_id == 0 && strncmp(conn->buffer, H2_PREFACE, H2_PREFACE_LINE) == 0) {
+        conn_h2_start(conn);
+        return;
+    }
+
+    request_t* request = &conn->request;
+    atomic_fetch_add_explicit(&conn->loop->requests, 1, memory_order_relaxed);
+    conn->started = conn->arrived;
+    conn->parsed = false;
+
+    // Shed before any work is spent on the request. Its delay is not observed.
+    if (codel_shed(&conn->loop->codel, iopool_now())) {
+        atomic_fetch_add_explicit(&conn->loop->shed, 1, memory_order_relaxed);
+        conn->arrived = 0;
+        conn_respond_static(conn, C_UNAVAILABLE);
+        return;
+    }
+
+    if (conn_parse(conn) != SERVER_OK)
+        return;
+    if (request->headers.upgrade_h2c && request->headers.http2_settings
+        && request->starting.method != M_OTHER && conn->stream_id == 0) {
+        conn_h2_upgrade(conn);
+        return;
+    }
+    conn_answer(conn);
+}
+
+// Observes the queueing delay of the request, once its response starts.
+static void conn_observe(conn_t* conn) {
+    if (conn->arrived == 0)
+        return;
+
+    uint64_t now = iopool_now();
+    uint64_t delay = now - conn->arrived;
+    conn->arrived = 0;
+    atomic_fetch_add_explicit(&conn->loop->delay_ns, delay, memory_order_relaxed);
+    codel_observe(&conn->loop->codel, delay, now);
+}
+
+// Writes as much of the response as the socket and the connection's quantum take.
+static int conn_write(conn_t* conn) {
+    conn_observe(conn);
+
+    while (conn->written < conn->head_size + conn->body_size) {
+        if (conn->deficit == 0)
+            return STEP_YIELD;
+
+        struct iovec iov[1 + BATCH_IOV];
+        int iov_count = 0;
+        if (conn->written < conn->head_size) {
+            iov[iov_count].iov_base = (char*)conn->head + conn->written;
+            iov[iov_count++].iov_len = conn->head_size - conn->written;
+        }
+        if (conn->body_size > 0) {
+            size_t body_written = conn->written > conn->head_size ? conn->written - conn->head_size : 0;
+            if (conn->batch)
+                iov_count += batch_gather(conn->batch, body_written, iov + iov_count, BATCH_IOV);
+            else {
+                iov[iov_count].iov_base = (char*)conn->body + body_written;
+                iov[iov_count++].iov_len = conn->body_size - body_written;
+            }
+        }
+        size_t wanted = conn->head_size + conn->body_size - conn->written;
+        if (wanted > conn->deficit)
+            wanted = conn->deficit;
+        uint64_t wait_ns;
+        size_t budget = ratelimit_take_bytes(conn->client, wanted, &wait_ns);
+        if (budget == 0) {
+            conn->wake_at = iopool_now() + wait_ns;
+            return STEP_LIMIT;
+        }
+        size_t taken = budget;
+        for (int i = 0; i < iov_count; ++i) {
+            if (iov[i].iov_len > budget)
+                iov[i].iov_len = budget;
+            budget -= iov[i].iov_len;
+        }
+
+        ssize_t ret = writev(conn->fd, iov, iov_count);
+        ratelimit_return_bytes(conn->client, ret > 0 ? taken - ret : taken);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return STEP_AGAIN;
+        if (ret == -1) {
+            conn->state = CONN_CLOSE;
+            return STEP_DONE;
+        }
+        conn->written += ret;
+        conn->sent += ret;
+        conn->deficit -= ret;
+    }
+    return STEP_DONE;
+}
+
+static void conn_h2_switch(conn_t* conn, const char* data, size_t size);
+
+// Continues after the response, or its part, has been sent.
+static void conn_sent(conn_t* conn) {
+    if (conn->file != -1 && conn->file_left > 0) {
+        conn_read_chunk(conn);
+        return;
+    }
+    if (conn->upstream && (conn->proxy_left > 0 || conn->piped > 0)) {
+        conn->state = CONN_PROXY;
+        return;
+    }
+
+    conn_log(conn);
+    conn_release(conn);
+    conn->bulk = false;
+    if (conn->h2) {
+        // The 101 is sent, the bytes after the upgrading request start the client's preface.
+        char* next = conn->request_end + 4;
+        conn_h2_switch(conn, next, conn->read_loc - next);
+        return;
+    }
+    if (conn->close_after || atomic_load_explicit(&server_draining, memory_order_relaxed)) {
+        conn->state = CONN_CLOSE;
+        return;
+    }
+
+    // Preparing buffer for another message
+    // Everything allocated for the previous response is dropped at once.
+    adjust_buffer_state(conn->buffer, conn->buffer_size, &conn->remaining_buffer_size, &conn->read_loc, conn->request_end);
+    arena_reset(&conn->arena);
+    conn->state = CONN_READ;
+}
+
+///// HTTP/2 /////
+static size_t session_room(const session_t* session) {
+    return SERVER_H2_OUTPUT - session->output_size;
+}
+
+// Queues a frame, whose payload follows the returned pointer. The caller has checked the room.
+static uint8_t* session_frame(session_t* session, uint32_t length, uint8_t type, uint8_t flags, uint32_t stream) {
+    uint8_t* frame = session->output + session->output_size;
+    h2_write_frame(frame, length, type, flags, stream);
+    session->output_size += H2_FRAME_HEADER + length;
+    return frame + H2_FRAME_HEADER;
+}
+
+static void session_reset(session_t* session, uint32_t stream, uint32_t error) {
+    h2_write_u32(session_frame(session, 4, H2_RST_STREAM, 0, stream), error);
+}
+
+// Ends the connection: at once for an error, once the frames queued before are sent,
+// or after the open streams for H2_NO_ERROR.
+static void session_goaway(session_t* session, uint32_t error) {
+    uint8_t* payload = session_frame(session, 8, H2_GOAWAY, 0, 0);
+    h2_write_u32(payload, session->last_stream);
+    h2_write_u32(payload + 4, error);
+    session->goaway = true;
+    session->closing = error != H2_NO_ERROR;
+}
+
+// Gives the connection a session and queues the server's SETTINGS, the first frame it sends.
+static int conn_h2_new(conn_t* conn) {
+    session_t* session = calloc(1, sizeof(session_t));
+    if (!session)
+        return SERVER_ERR;
+
+    h2_hpack_init(&session->hpack);
+    h2_settings_init(&session->peer);
+    session->window = H2_DEFAULT_WINDOW;
+    uint8_t* payload = session_frame(session, H2_SETTING_SIZE, H2_SETTINGS, 0, 0);
+    h2_write_setting(payload, H2_SETTINGS_MAX_CONCURRENT_STREAMS, SERVER_H2_STREAMS);
+
+    conn->h2 = session;
+    atomic_fetch_add_explicit(&conn->loop->h2, 1, memory_order_relaxed);
+    return SERVER_OK;
+}
+
+// Starts exchanging frames, data is what the client has sent so far.
+static void conn_h2_switch(conn_t* conn, const char* data, size_t size) {
+    session_t* session = conn->h2;
+    if (size > SERVER_H2_INPUT) {
+        conn->state = CONN_CLOSE;
+        return;
+    }
+    memcpy(session->input, data, size);
+    session->input_size = size;
+
+    // The arena keeps the decoded headers from now on.
+    arena_reset(&conn->arena);
+    conn->state = CONN_H2;
+}
+
+// Switches the connection, whose client has started with the preface.
+static void conn_h2_start(conn_t* conn) {
+    conn->arrived = 0;
+    if (conn_h2_new(conn) != SERVER_OK) {
+        conn->state = CONN_CLOSE;
+        return;
+    }
+    conn_h2_switch(conn, conn->buffer, conn->read_loc - conn->buffer);
+}
+
+static conn_t* conn_h2_find(conn_t* conn, uint32_t id) {
+    session_t* session = conn->h2;
+    for (unsigned i = 0; i < session->stream_count; ++i) {
+        if (session->streams[i]->stream_id == id)
+            return session->streams[i];
+    }
+    return NULL;
+}
+
+// Cuts the stream off its connection. It is freed, unless it waits for the I/O pool
+// or the file cache, then it is freed once it is posted back.
+static void conn_h2_detach(conn_t* stream) {
+    session_t* session = stream->session->h2;
+    for (unsigned i = 0; i < session->stream_count; ++i) {
+        if (session->streams[i] == stream) {
+            memmove(&session->streams[i], &session->streams[i + 1], (session->stream_count - i - 1) * sizeof(conn_t*));
+            session->stream_count--;
+            break;
+        }
+    }
+
+    stream->session = NULL;
+    if (stream->state != CONN_WAIT)
+        conn_free(stream);
+}
+
+static void conn_h2_close(conn_t* conn) {
+    session_t* session = conn->h2;
+    while (session->stream_count > 0)
+        conn_h2_detach(session->streams[session->stream_count - 1]);
+    h2_hpack_destroy(&session->hpack);
+    free(session);
+    conn->h2 = NULL;
+}
+
+// Opens the stream id for a request, which is rebuilt for the HTTP/1.1 parser, so that it is checked
+// and served as any other. Returns NULL if the stream is refused.
+static conn_t* conn_h2_open(conn_t* conn, uint32_t id, const char* method, const char* path) {
+    session_t* session = conn->h2;
+    conn_t* stream = session->stream_count < SERVER_H2_STREAMS ? conn_new(conn->loop, -1) : NULL;
+    if (!stream) {
+        session_reset(session, id, H2_REFUSED_STREAM);
+        return NULL;
+    }
+
+    stream->session = conn;
+    stream->stream_id = id;
+    stream->window = session->peer.initial_window;
+    stream->addr = conn->addr;
+    stream->client = conn->client;
+    stream->arrived = iopool_now();
+    session->streams[session->stream_count++] = stream;
+    atomic_fetch_add_explicit(&conn->loop->streams, 1, memory_order_relaxed);
+
+    // Spaces and control characters would change the meaning of the request line.
+    bool valid = true;
+    for (const char* c = method; valid && *c != '\0'; ++c)
+        valid = *c > ' ' && *c < 0x7f;
+    for (const char* c = path; valid && *c != '\0'; ++c)
+        valid = *c > ' ' && *c < 0x7f;
+    int size = snprintf(stream->buffer, stream->buffer_size + 1, "%s %s HTTP/1.1\r\n\r\n", method, path);
+    if (!valid || size < 0 || (size_t)size > stream->buffer_size) {
+        conn_respond_static(stream, C_BAD_REQUEST);
+        return stream;
+    }
+    stream->read_loc = stream->buffer + size;
+    stream->remaining_buffer_size = stream->buffer_size - size;
+    stream->request_end = stream->read_loc - 4;
+    return stream;
+}
+
+// Answers the request with 101 and switches to HTTP/2, the request goes on as the stream 1.
+static void conn_h2_upgrade(conn_t* conn) {
+    request_t* request = &conn->request;
+    const char* value = request->headers.http2_settings;
+    size_t value_len = strlen(value);
+    while (value_len > 0 && value[value_len - 1] == ' ')
+        value_len--;
+
+    // The client's settings come in the header, instead of a frame.
+    uint8_t payload[SERVER_H2_RESERVE];
+    size_t payload_size;
+    h2_settings_t settings;
+    uint32_t error;
+    h2_settings_init(&settings);
+    if (h2_base64url_decode(value, value_len, payload, sizeof(payload), &payload_size) != H2_OK
+        || h2_settings_apply(&settings, payload, payload_size, &error) != H2_OK) {
+        conn_respond_static(conn, C_BAD_REQUEST);
+        return;
+    }
+    if (conn_h2_new(conn) != SERVER_OK) {
+        conn_respond_static(conn, C_INTERNAL_ERROR);
+        return;
+    }
+    conn->h2->peer = settings;
+    conn->h2->last_stream = 1;
+
+    static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+    conn_respond(conn, switching, sizeof(switching) - 1, NULL, 0);
+    conn->status = C_SWITCHING;
+
+    // The request was counted and admitted already.
+    conn_t* stream = conn_h2_open(conn, 1, request->starting.method == M_HEAD ? "HEAD" : "GET", request->starting.target);
+    if (stream && stream->state == CONN_READ) {
+        stream->started = stream->arrived;
+        if (conn_parse(stream) == SERVER_OK)
+            conn_answer(stream);
+    }
+}
+
+// Collects a header block, which can continue in CONTINUATION frames, and opens its stream once complete.
+// Returns the error ending the connection, H2_NO_ERROR if none.
+static uint32_t conn_h2_block(conn_t* conn, uint32_t id, const uint8_t* fragment, size_t size, bool end) {
+    session_t* session = conn->h2;
+    if (size > SERVER_H2_BLOCK - session->block_size)
+        return H2_ENHANCE_YOUR_CALM;
+    memcpy(session->block + session->block_size, fragment, size);
+    session->block_size += size;
+    if (!end) {
+        session->block_stream = id;
+        return H2_NO_ERROR;
+    }
+    session->block_stream = 0;
+
+    // Every block is decoded, so that the table follows the client's one.
+    h2_request_t request;
+    int ret = h2_decode_headers(&session->hpack, session->block, session->block_size, &conn->arena, &request);
+    session->block_size = 0;
+    if (ret != H2_OK) {
+        arena_reset(&conn->arena);
+        return H2_COMPRESSION_ERROR;
+    }
+
+    uint32_t error = H2_NO_ERROR;
+    if (id <= session->last_stream) {
+        // Trailers of an open stream are not used, a closed stream cannot have any.
+        if (!conn_h2_find(conn, id))
+            error = H2_STREAM_CLOSED;
+    }
+    else {
+        session->last_stream = id;
+        if (session->goaway) {
+            // Not opened.
+        }
+        else if (!request.method || !request.path) {
+            session_reset(session, id, H2_PROTOCOL_ERROR);
+        }
+        else {
+            conn_t* stream = conn_h2_open(conn, id, request.method, request.path);
+            if (stream && stream->state == CONN_READ)
+                conn_serve(stream);
+        }
+    }
+    arena_reset(&conn->arena);
+    return error;
+}
+
+// Handles a frame of the client. Returns the error ending the connection, H2_NO_ERROR if none.
+static uint32_t conn_h2_frame(conn_t* conn, const h2_frame_t* frame, const uint8_t* payload) {
+    session_t* session = conn->h2;
+    conn_t* stream;
+
+    if (session->block_stream != 0 && (frame->type != H2_CONTINUATION || frame->stream != session->block_stream))
+        return H2_PROTOCOL_ERROR;
+    if (!session->settings && frame->type != H2_SETTINGS)
+        return H2_PROTOCOL_ERROR;
+
+    switch (frame->type) {
+    case H2_DATA:
+        if (frame->stream == 0)
+            return H2_PROTOCOL_ERROR;
+        // Request bodies are not used, the window is given back at once.
+        if (frame->length > 0)
+            h2_write_u32(session_frame(session, 4, H2_WINDOW_UPDATE, 0, 0), frame->length);
+        return H2_NO_ERROR;
+    case H2_HEADERS: {
+        if (frame->stream == 0 || frame->stream % 2 == 0)
+            return H2_PROTOCOL_ERROR;
+        size_t offset = 0;
+        size_t padding = 0;
+        if (frame->flags & H2_FLAG_PADDED) {
+            if (frame->length < 1)
+                return H2_PROTOCOL_ERROR;
+            padding = payload[0];
+            offset = 1;
+        }
+        if (frame->flags & H2_FLAG_PRIORITY)
+            offset += 5;
+        if (offset + padding > frame->length)
+            return H2_PROTOCOL_ERROR;
+        return conn_h2_block(conn, frame->stream, payload + offset, frame->length - offset - padding,
+                             frame->flags & H2_FLAG_END_HEADERS);
+    }
+    case H2_CONTINUATION:
+        if (session->block_stream == 0)
+            return H2_PROTOCOL_ERROR;
+        return conn_h2_block(conn, frame->stream, payload, frame->length, frame->flags & H2_FLAG_END_HEADERS);
+    case H2_PRIORITY:
+        // Streams take turns regardless of their priorities.
+        if (frame->stream == 0)
+            return H2_PROTOCOL_ERROR;
+        if (frame->length != 5)
+            session_reset(session, frame->stream, H2_FRAME_SIZE_ERROR);
+        return H2_NO_ERROR;
+    case H2_RST_STREAM:
+        if (frame->stream == 0 || frame->stream > session->last_stream)
+            return H2_PROTOCOL_ERROR;
+        if (frame->length != 4)
+            return H2_FRAME_SIZE_ERROR;
+        stream = conn_h2_find(conn, frame->stream);
+        if (stream)
+            conn_h2_detach(stream);
+        return H2_NO_ERROR;
+    case H2_SETTINGS: {
+        if (frame->stream != 0)
+            return H2_PROTOCOL_ERROR;
+        if (frame->flags & H2_FLAG_ACK)
+            return frame->length == 0 ? H2_NO_ERROR : H2_FRAME_SIZE_ERROR;
+
+        uint32_t before = session->peer.initial_window;
+        uint32_t error;
+        if (h2_settings_apply(&session->peer, payload, frame->length, &error) != H2_OK)
+            return error;
+        // Windows of the open streams follow the initial one.
+        int64_t delta = (int64_t)session->peer.initial_window - before;
+        for (unsigned i = 0; i < session->stream_count; ++i) {
+            session->streams[i]->window += delta;
+            if (session->streams[i]->window > H2_MAX_WINDOW)
+                return H2_FLOW_CONTROL_ERROR;
+        }
+        session->settings = true;
+        session_frame(session, 0, H2_SETTINGS, H2_FLAG_ACK, 0);
+        return H2_NO_ERROR;
+    }
+    case H2_PING:
+        if (frame->stream != 0)
+            return H2_PROTOCOL_ERROR;
+        if (frame->length != 8)
+            return H2_FRAME_SIZE_ERROR;
+        if (!(frame->flags & H2_FLAG_ACK))
+            memcpy(session_frame(session, 8, H2_PING, H2_FLAG_ACK, 0), payload, 8);
+        return H2_NO_ERROR;
+    case H2_GOAWAY:
+        if (frame->stream != 0)
+            return H2_PROTOCOL_ERROR;
+        if (frame->length < 8)
+            return H2_FRAME_SIZE_ERROR;
+        // The connection ends after the open streams.
+        session->goaway = true;
+        return H2_NO_ERROR;
+    case H2_WINDOW_UPDATE: {
+        if (frame->length != 4)
+            return H2_FRAME_SIZE_ERROR;
+        uint32_t increment = h2_read_u32(payload) & 0x7fffffff;
+        if (frame->stream == 0) {
+            if (increment == 0)
+                return H2_PROTOCOL_ERROR;
+            session->window += increment;
+            return session->window > H2_MAX_WINDOW ? H2_FLOW_CONTROL_ERROR : H2_NO_ERROR;
+        }
+
+        // Updates can come for streams, which have just ended.
+        stream = conn_h2_find(conn, frame->stream);
+        if (!stream)
+            return H2_NO_ERROR;
+        if (increment == 0 || stream->window + increment > H2_MAX_WINDOW) {
+            session_reset(session, frame->stream, increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+            conn_h2_detach(stream);
+            return H2_NO_ERROR;
+        }
+        stream->window += increment;
+        return H2_NO_ERROR;
+    }
+    case H2_PUSH_PROMISE:
+        // Only servers push.
+        return H2_PROTOCOL_ERROR;
+    default:
+        // Frames of unknown types are ignored.
+        return H2_NO_ERROR;
+    }
+}
+
+// Reads the client's frames and handles them, while the output has room for the frames answering them.
+// Returns SERVER_ERR if the client has closed the connection.
+static int conn_h2_input(conn_t* conn) {
+    session_t* session = conn->h2;
+    for (;;) {
+        size_t used = 0;
+        uint32_t error = H2_NO_ERROR;
+        bool full = false;
+        while (error == H2_NO_ERROR) {
+            const uint8_t* data = session->input + used;
+            size_t left = session->input_size - used;
+            if (!session->preface) {
+                if (left < H2_PREFACE_SIZE)
+                    break;
+                if (memcmp(data, H2_PREFACE, H2_PREFACE_SIZE) != 0)
+                    return SERVER_ERR;
+                session->preface = true;
+                used += H2_PREFACE_SIZE;
+                continue;
+            }
+
+            if (left < H2_FRAME_HEADER)
+                break;
+            h2_frame_t frame;
+            h2_read_frame(data, &frame);
+            if (frame.length > H2_DEFAULT_FRAME) {
+                error = H2_FRAME_SIZE_ERROR;
+                break;
+            }
+            if (left < H2_FRAME_HEADER + frame.length)
+                break;
+            if (session_room(session) < SERVER_H2_RESERVE) {
+                full = true;
+                break;
+            }
+            error = conn_h2_frame(conn, &frame, data + H2_FRAME_HEADER);
+            used += H2_FRAME_HEADER + frame.length;
+        }
+
+        memmove(session->input, session->input + used, session->input_size - used);
+        session->input_size -= used;
+        if (error != H2_NO_ERROR)
+            session_goaway(session, error);
+        if (error != H2_NO_ERROR || full) {
+            session->read_blocked = false;
+            return SERVER_OK;
+        }
+
+        ssize_t ret = read(conn->fd, session->input + session->input_size, SERVER_H2_INPUT - session->input_size);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            session->read_blocked = true;
+            return SERVER_OK;
+        }
+        if (ret <= 0)
+            return SERVER_ERR;
+        session->input_size += ret;
+    }
+}
+
+// Whether the stream has a frame to send now.
+static bool conn_h2_ready(const conn_t* stream) {
+    if (stream->state == CONN_CLOSE)
+        return true;
+    if (stream->state != CONN_WRITE)
+        return false;
+    return !stream->head_sent || (stream->window > 0 && stream->session->h2->window > 0);
+}
+
+// Continues after the stream's response, or its part, has been framed. Returns true if the stream has ended.
+static bool conn_h2_sent(conn_t* stream) {
+    if (stream->file != -1 && stream->file_left > 0) {
+        conn_read_chunk(stream);
+        return false;
+    }
+    conn_log(stream);
+    conn_h2_detach(stream);
+    return true;
+}
+
+// Queues the next frame of the stream's response. Returns false if there is none, which can be sent now.
+// *out_ended tells whether the stream has ended, it must not be touched then.
+static bool conn_h2_emit(conn_t* conn, conn_t* stream, bool* out_ended) {
+    session_t* session = conn->h2;
+    size_t room = session_room(session);
+    *out_ended = false;
+    if (!conn_h2_ready(stream) || room <= H2_FRAME_HEADER + 4)
+        return false;
+
+    if (stream->state == CONN_CLOSE) {
+        // The response cannot be completed.
+        session_reset(session, stream->stream_id, H2_INTERNAL_ERROR);
+        conn_h2_detach(stream);
+        *out_ended = true;
+        return true;
+    }
+
+    size_t capacity = room - H2_FRAME_HEADER;
+    if (capacity > session->peer.max_frame)
+        capacity = session->peer.max_frame;
+    size_t total = stream->head_size + stream->body_size;
+    bool last = stream->file == -1 || stream->file_left == 0;
+    uint8_t* payload = session->output + session->output_size + H2_FRAME_HEADER;
+
+    if (!stream->head_sent) {
+        conn_observe(stream);
+        size_t block_size;
+        size_t consumed;
+        if (h2_encode_head(stream->head, stream->head_size, payload, capacity, &block_size, &consumed) != H2_OK) {
+            // Not for the lack of room, if the output is empty.
+            if (session->output_size > 0)
+                return false;
+            session_reset(session, stream->stream_id, H2_INTERNAL_ERROR);
+            conn_h2_detach(stream);
+            *out_ended = true;
+            return true;
+        }
+        stream->head_sent = true;
+        stream->written = consumed;
+        bool end = consumed == total && last;
+        session_frame(session, block_size, H2_HEADERS, H2_FLAG_END_HEADERS | (end ? H2_FLAG_END_STREAM : 0),
+                      stream->stream_id);
+        if (consumed == total)
+            *out_ended = conn_h2_sent(stream);
+        return true;
+    }
+
+    // What follows the head, if the rendered response has a body, and the body.
+    size_t size = total - stream->written;
+    if (size > capacity)
+        size = capacity;
+    if ((int64_t)size > stream->window)
+        size = stream->window;
+    if ((int64_t)size > session->window)
+        size = session->window;
+
+    size_t copied = 0;
+    if (stream->written < stream->head_size) {
+        copied = stream->head_size - stream->written < size ? stream->head_size - stream->written : size;
+        memcpy(payload, stream->head + stream->written, copied);
+    }
+    if (copied < size && stream->batch)
+        batch_copy(stream->batch, stream->written + copied - stream->head_size, (char*)payload + copied, size - copied);
+    else if (copied < size)
+        memcpy(payload + copied, stream->body + (stream->written + copied - stream->head_size), size - copied);
+    stream->written += size;
+    stream->sent += size;
+    stream->window -= size;
+    session->window -= size;
+
+    bool end = stream->written == total && last;
+    session_frame(session, size, H2_DATA, end ? H2_FLAG_END_STREAM : 0, stream->stream_id);
+    if (stream->written == total)
+        *out_ended = conn_h2_sent(stream);
+    return true;
+}
+
+// Frames the streams' responses into the output. Small responses are framed whole first,
+// the bulk ones take turns by frames.
+static void conn_h2_produce(conn_t* conn) {
+    session_t* session = conn->h2;
+    session->turn++;
+
+    bool progress = true;
+    while (progress && !session->closing) {
+        progress = false;
+        // Ended streams are left out of the rest of the round.
+        conn_t* order[SERVER_H2_STREAMS];
+        unsigned count = session->stream_count;
+        for (unsigned i = 0; i < count; ++i)
+            order[i] = session->streams[(session->turn + i) % count];
+
+        for (int bulk = 0; bulk <= 1; ++bulk) {
+            for (unsigned i = 0; i < count; ++i) {
+                if (!order[i] || order[i]->bulk != bulk)
+                    continue;
+                bool emitted;
+                bool ended;
+                do {
+                    emitted = conn_h2_emit(conn, order[i], &ended);
+                    progress = progress || emitted;
+                } while (emitted && !ended && !bulk);
+                if (ended)
+                    order[i] = NULL;
+            }
+        }
+    }
+
+    // The connection is scheduled as a bulk transfer, while it has any.
+    conn->bulk = false;
+    for (unsigned i = 0; i < session->stream_count; ++i)
+        conn->bulk = conn->bulk || session->streams[i]->bulk;
+}
+
+// Writes the queued frames, as much as the socket and the connection's quantum take.
+static int conn_h2_flush(conn_t* conn) {
+    session_t* session = conn->h2;
+    while (session->output_written < session->output_size) {
+        if (conn->deficit == 0)
+            return STEP_YIELD;
+
+        size_t wanted = session->output_size - session->output_written;
+        if (wanted > conn->deficit)
+            wanted = conn->deficit;
+        uint64_t wait_ns;
+        size_t budget = ratelimit_take_bytes(conn->client, wanted, &wait_ns);
+        if (budget == 0) {
+            conn->wake_at = iopool_now() + wait_ns;
+            return STEP_LIMIT;
+        }
+
+        ssize_t ret = write(conn->fd, session->output + session->output_written, budget);
+        ratelimit_return_bytes(conn->client, ret > 0 ? budget - ret : budget);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return STEP_AGAIN;
+        if (ret == -1) {
+            conn->state = CONN_CLOSE;
+            return STEP_DONE;
+        }
+        session->output_written += ret;
+        conn->deficit -= ret;
+    }
+    session->output_size = 0;
+    session->output_written = 0;
+    return STEP_DONE;
+}
+
+// Exchanges frames with the client, until the socket blocks or the connection's quantum is used up.
+static int conn_h2_step(conn_t* conn) {
+    session_t* session = conn->h2;
+    for (;;) {
+        if (session->output_written > 0) {
+            memmove(session->output, session->output + session->output_written,
+                    session->output_size - session->output_written);
+            session->output_size -= session->output_written;
+            session->output_written = 0;
+        }
+
+        // New streams are refused, while the server is draining.
+        if (!session->goaway && session_room(session) >= SERVER_H2_RESERVE
+            && atomic_load_explicit(&server_draining, memory_order_relaxed))
+            session_goaway(session, H2_NO_ERROR);
+
+        if (!session->closing && conn_h2_input(conn) != SERVER_OK) {
+            conn->state = CONN_CLOSE;
+            return STEP_DONE;
+        }
+        // After an upgrade, the response of the stream 1 waits for the client's preface.
+        // Clients do not expect much data after the 101, before they have sent it.
+        if (session->settings)
+            conn_h2_produce(conn);
+        int ret = conn_h2_flush(conn);
+        if (ret != STEP_DONE || conn->state == CONN_CLOSE)
+            return ret;
+
+        // Everything queued is sent.
+        if (session->closing || (session->goaway && session->stream_count == 0)) {
+            conn->state = CONN_CLOSE;
+            return STEP_DONE;
+        }
+        bool ready = false;
+        for (unsigned i = 0; i < session->stream_count && !ready; ++i)
+            ready = conn_h2_ready(session->streams[i]);
+        if (session->read_blocked && (!ready || !session->settings))
+            return STEP_AGAIN;
+    }
+}
+
+static void loop_schedule(conn_t* conn);
+static void loop_throttle(conn_t* conn);
+
+// Advances the connection, until it has to wait or its quantum is used up.
+static void conn_drive(conn_t* conn) {
+    int ret;
+    int state;
+    for (;;) {
+        switch (conn->state) {
+        case CONN_READ:
+            if (conn_read(conn) == STEP_AGAIN) {
+                conn->deficit = 0;
+                return;
+            }
+            if (conn->state == CONN_READ)
+                conn_serve(conn);
+            break;
+        case CONN_WRITE:
+        case CONN_PROXY:
+        case CONN_H2:
+            state = conn->state;
+            if (state == CONN_WRITE)
+                ret = conn_write(conn);
+            else if (state == CONN_PROXY)
+                ret = conn_proxy_step(conn);
+            else
+                ret = conn_h2_step(conn);
+            if (ret == STEP_AGAIN) {
+                conn->deficit = 0;
+                return;
+            }
+            if (ret == STEP_LIMIT) {
+                conn->deficit = 0;
+                loop_throttle(conn);
+                return;
+            }
+            if (ret == STEP_YIELD) {
+                // Ready still, it continues in its next turn.
+                atomic_fetch_add_explicit(&conn->loop->preempted, 1, memory_order_relaxed);
+                loop_schedule(conn);
+                return;
+            }
+            // A proxied response goes on to be written, once its head has come.
+            if (conn->state == state)
+                conn_sent(conn);
+            break;
+        case CONN_WAIT:
+            conn->deficit = 0;
+            return;
+        default: /* CONN_CLOSE */
+            conn_free(conn);
+            return;
+        }
+    }
+}
+
+///// LOOPS /////
+// Queues a ready connection for its turn.
+static void loop_schedule(conn_t* conn) {
+    if (conn->queued || conn->throttled)
+        return;
+
+    loop_t* loop = conn->loop;
+    int queue = conn->bulk ? RUN_BULK : RUN_SMALL;
+    conn->queued = true;
+    conn->run_next = NULL;
+    if (loop->run_tail[queue])
+        loop->run_tail[queue]->run_next = conn;
+    else
+        loop->run_head[queue] = conn;
+    loop->run_tail[queue] = conn;
+    loop->run_length[queue]++;
+}
+
+// Puts the connection aside, until its client can send again.
+static void loop_throttle(conn_t* conn) {
+    conn->throttled = true;
+    conn->throttled_next = conn->loop->throttled;
+    conn->loop->throttled = conn;
+}
+
+// Schedules the throttled connections, which can send again.
+// Returns the milliseconds until the next one can, or -1 if none is throttled.
+static int loop_wake_throttled(loop_t* loop) {
+    uint64_t now = iopool_now();
+    uint64_t next = UINT64_MAX;
+
+    conn_t** link = &loop->throttled;
+    while (*link != NULL) {
+        conn_t* conn = *link;
+        if (conn->wake_at <= now) {
+            *link = conn->throttled_next;
+            conn->throttled = false;
+            loop_schedule(conn);
+        }
+        else {
+            if (conn->wake_at < next)
+                next = conn->wake_at;
+            link = &conn->throttled_next;
+        }
+    }
+
+    if (next == UINT64_MAX)
+        return -1;
+    return (next - now + 999999) / 1000000;
+}
+
+// Hands the buffers freed to the connections waiting for them, in their order.
+// Returns the milliseconds until the next try, or -1 if none waits.
+static int loop_feed_starved(loop_t* loop) {
+    while (loop->starved_head != NULL) {
+        conn_t* conn = loop->starved_head;
+        char* buf = NULL;
+        // A stream cut off its connection meanwhile needs none.
+        bool orphan = conn->stream_id != 0 && !conn->session;
+        if (!orphan && conn->growing && !(buf = bufpool_get(BUFPOOL_BODY)))
+            return SERVER_BUFFER_RETRY_MS;
+        if (!orphan && !conn->growing && !conn_take_chunk(conn))
+            return SERVER_BUFFER_RETRY_MS;
+
+        loop->starved_head = conn->starved_next;
+        if (!loop->starved_head)
+            loop->starved_tail = NULL;
+        if (orphan) {
+            conn_free(conn);
+            continue;
+        }
+        if (conn->growing) {
+            conn_grow(conn, buf);
+            conn->state = CONN_READ;
+        }
+        else
+            conn_offload(conn, OP_READ);
+        // The response of a stream is sent by its connection.
+        loop_schedule(conn->session ? conn->session : conn);
+    }
+    return -1;
+}
+
+static void loop_turn(loop_t* loop, int queue) {
+    conn_t* conn = loop->run_head[queue];
+    loop->run_head[queue] = conn->run_next;
+    if (!loop->run_head[queue])
+        loop->run_tail[queue] = NULL;
+    loop->run_length[queue]--;
+    conn->queued = false;
+
+    conn->deficit += server_quantum;
+#ifdef SERWER_INSTRUMENT
+    instrument_enter(&conn->counts);
+#endif
+    conn_drive(conn);
+#ifdef SERWER_INSTRUMENT
+    instrument_leave();
+#endif
+}
+
+// Gives a turn to every connection waiting for small responses, then to a few bulk ones.
+static void loop_serve_ready(loop_t* loop) {
+    for (size_t turns = loop->run_length[RUN_SMALL]; turns > 0; --turns)
+        loop_turn(loop, RUN_SMALL);
+    for (size_t turns = SERVER_BULK_TURNS; turns > 0 && loop->run_length[RUN_BULK] > 0; --turns)
+        loop_turn(loop, RUN_BULK);
+}
+
+// Refuses a connection waiting on sock, when there are no descriptors left to serve it.
+// Otherwise it would stay in the backlog and wake the loops over and over.
+static void loop_refuse(loop_t* loop, int sock) {
+    pthread_mutex_lock(&server_reserve_mutex);
+    if (server_reserve_fd != -1) {
+        close(server_reserve_fd);
+        int fd = accept4(sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd != -1) {
+            const char* msg;
+            size_t msg_size;
+            take_static_response(C_UNAVAILABLE, &msg, &msg_size);
+            write(fd, msg, msg_size);
+            close(fd);
+            atomic_fetch_add_explicit(&loop->dropped, 1, memory_order_relaxed);
+        }
+    }
+    // Taken again once a descriptor is free, if another thread has taken this one.
+    server_reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    pthread_mutex_unlock(&server_reserve_mutex);
+}
+
+static void loop_accept(loop_t* loop, int sock) {
+    for (int i = 0; i < SERVER_ACCEPT_BATCH; ++i) {
+        struct sockaddr_storage addr;
+        socklen_t addr_len = sizeof(addr);
+        int fd = accept4(sock, (struct sockaddr*)&addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EMFILE || errno == ENFILE)
+                loop_refuse(loop, sock);
+            // Other failures, eg. ENOBUFS, concern a single connection or pass. The rest waits for the next wake up.
+            return;
+        }
+
+        // Refused connections get a response, which is not waited for.
+        const char* msg;
+        size_t msg_size;
+        ratelimit_client_t* client = NULL;
+        if (ratelimit_enabled() && ratelimit_connect((struct sockaddr*)&addr, &client) == RATELIMIT_OVER) {
+            take_static_response(C_UNAVAILABLE, &msg, &msg_size);
+            write(fd, msg, msg_size);
+            close(fd);
+            continue;
+        }
+
+        conn_t* conn = conn_new(loop, fd);
+        if (!conn) {
+            ratelimit_disconnect(client);
+            take_static_response(C_INTERNAL_ERROR, &msg, &msg_size);
+            write(fd, msg, msg_size);
+            close(fd);
+            continue;
+        }
+        conn->addr = addr;
+        conn->client = client;
+        conn->arrived = iopool_now();
+        conn->loop_next = loop->conns;
+        if (loop->conns)
+            loop->conns->loop_prev = conn;
+        loop->conns = conn;
+        atomic_fetch_add_explicit(&loop->accepted, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&loop->connections, 1, memory_order_relaxed);
+
+        // Edge triggered, the connection is driven until its socket would block.
+        struct epoll_event event = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = conn};
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            conn_free(conn);
+            continue;
+        }
+        loop_schedule(conn);
+    }
+}
+
+// Wakes the connections waiting for their clients, once the server starts draining: the idle ones are closed
+// and the HTTP/2 sessions send GOAWAY.
+static void loop_drain(loop_t* loop) {
+    loop->drain_seen = true;
+    for (conn_t* conn = loop->conns; conn != NULL; conn = conn->loop_next) {
+        if (conn->state == CONN_READ || conn->state == CONN_H2)
+            loop_schedule(conn);
+    }
+}
+
+static void loop_posted(loop_t* loop) {
+    uint64_t count;
+    read(loop->event_fd, &count, sizeof(count));
+    if (!loop->drain_seen && atomic_load_explicit(&server_draining, memory_order_relaxed))
+        loop_drain(loop);
+
+    pthread_mutex_lock(&loop->posted_mutex);
+    conn_t* conn = loop->posted;
+    loop->posted = NULL;
+    pthread_mutex_unlock(&loop->posted_mutex);
+
+    while (conn != NULL) {
+        conn_t* next = conn->posted_next;
+        if (conn->stream_id != 0 && !conn->session) {
+            // The stream has been cut off its connection meanwhile.
+            conn_free(conn);
+        }
+        else {
+            conn_resume(conn);
+            // The response of a stream is sent by its connection.
+            loop_schedule(conn->session ? conn->session : conn);
+        }
+        conn = next;
+    }
+}
+
+static void* loop_run(void* arg) {
+    loop_t* loop = arg;
+    struct epoll_event events[SERVER_EVENTS];
+
+    for (;;) {
+        // Ready connections must not wait for new events.
+        int timeout = loop_wake_throttled(loop);
+        int starved = loop_feed_starved(loop);
+        if (starved != -1 && (timeout == -1 || starved < timeout))
+            timeout = starved;
+        if (loop->run_head[RUN_SMALL] || loop->run_head[RUN_BULK])
+            timeout = 0;
+        int count = epoll_wait(loop->epoll_fd, events, SERVER_EVENTS, timeout);
+        if (count == -1) {
+            if (errno == EINTR)
+                continue;
+            exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < count; ++i) {
+            void* ptr = events[i].data.ptr;
+            if (ptr >= (void*)server_socks && ptr < (void*)(server_socks + server_sock_count))
+                loop_accept(loop, *(int*)ptr);
+            else if (ptr == loop)
+                loop_posted(loop);
+            else if (((conn_t*)ptr)->state != CONN_WAIT)
+                loop_schedule(ptr);
+        }
+        loop_serve_ready(loop);
+    }
+    return NULL;
+}
+
+static int loop_init(loop_t* loop, unsigned index) {
+    loop->index = index;
+    loop->posted = NULL;
+    codel_init(&loop->codel, server_codel_target, server_codel_interval);
+    upstream_pool_init(&loop->upstreams);
+    if (pthread_mutex_init(&loop->posted_mutex, NULL) != 0)
+        return SERVER_ERR;
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd == -1)
+        return SERVER_ERR;
+    loop->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->event_fd == -1)
+        return SERVER_ERR;
+
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = loop};
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->event_fd, &event) == -1)
+        return SERVER_ERR;
+
+    // Only one of the loops is woken for a new connection.
+    for (unsigned i = 0; i < server_sock_count; ++i) {
+        event.events = EPOLLIN | EPOLLEXCLUSIVE;
+        event.data.ptr = &server_socks[i];
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, server_socks[i], &event) == -1)
+            return SERVER_ERR;
+    }
+    return SERVER_OK;
+}
+
+// Notes the addresses of the TCP listening sockets, and of the interfaces, which reach those on INADDR_ANY.
+static int server_find_self() {
+    server_self_count = 0;
+    for (unsigned i = 0; i < server_sock_count; ++i) {
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        if (getsockname(server_socks[i], (struct sockaddr*)&addr, &addr_len) == -1)
+            return SERVER_ERR;
+        if (addr.sin_family == AF_INET)
+            server_self[server_self_count++] = addr;
+    }
+
+    struct ifaddrs* ifaddrs;
+    if (getifaddrs(&ifaddrs) == -1)
+        return SERVER_ERR;
+    server_local_ip_count = 0;
+    for (struct ifaddrs* it = ifaddrs; it && server_local_ip_count < SERVER_MAX_LOCAL_IPS; it = it->ifa_next) {
+        if (it->ifa_addr && it->ifa_addr->sa_family == AF_INET)
+            server_local_ips[server_local_ip_count++] = ((struct sockaddr_in*)it->ifa_addr)->sin_addr.s_addr;
+    }
+    freeifaddrs(ifaddrs);
+    return SERVER_OK;
+}
+
+int server_run(const config_t* config, const int* socks, unsigned sock_count) {
+    unsigned loops = config->workers;
+    server_filesystem = config->filesystem;
+    server_quantum = config->quantum;
+    server_small_response = config->small_response;
+    server_codel_target = config->codel_target;
+    server_codel_interval = config->codel_interval;
+    server_proxy = config->proxy;
+    server_drain_timeout = config->drain_timeout;
+
+    if (sock_count == 0 || sock_count > SERVER_MAX_LISTENERS)
+        return SERVER_ERR;
+    for (unsigned i = 0; i < sock_count; ++i) {
+        int flags = fcntl(socks[i], F_GETFL);
+        if (flags == -1 || fcntl(socks[i], F_SETFL, flags | O_NONBLOCK) == -1)
+            return SERVER_ERR;
+        server_socks[i] = socks[i];
+    }
+    server_sock_count = sock_count;
+    if (server_find_self() != SERVER_OK)
+        return SERVER_ERR;
+    server_reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (server_reserve_fd == -1)
+        return SERVER_ERR;
+
+    server_loops = calloc(loops, sizeof(loop_t));
+    if (!server_loops)
+        return SERVER_ERR;
+    for (unsigned i = 0; i < loops; ++i) {
+        if (loop_init(&server_loops[i], i) != SERVER_OK)
+            return SERVER_ERR;
+    }
+    server_loop_count = loops;
+
+    // The calling thread runs the first loop.
+    for (unsigned i = 1; i < loops; ++i) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, loop_run, &server_loops[i]) != 0)
+            return SERVER_ERR;
+        pthread_detach(thread);
+    }
+    loop_run(&server_loops[0]);
+    return SERVER_ERR;
+}
+
+void server_drain() {
+    atomic_store(&server_draining, true);
+    for (unsigned i = 0; i < server_loop_count; ++i) {
+        for (unsigned j = 0; j < server_sock_count; ++j)
+            epoll_ctl(server_loops[i].epoll_fd, EPOLL_CTL_DEL, server_socks[j], NULL);
+        // The loop's thread wakes its connections.
+        uint64_t one = 1;
+        write(server_loops[i].event_fd, &one, sizeof(one));
+    }
+
+    struct timespec interval = {.tv_sec = 0, .tv_nsec = SERVER_DRAIN_POLL_MS * 1000000};
+    uint64_t deadline = iopool_now() + server_drain_timeout * 1000000;
+    server_stats_t stats;
+    do {
+        server_stats(&stats);
+        if (stats.connections == 0)
+            return;
+        nanosleep(&interval, NULL);
+    } while (iopool_now() < deadline);
+}
+
+void server_stats(server_stats_t* out_stats) {
+    memset(out_stats, 0, sizeof(server_stats_t));
+    out_stats->loops = server_loop_count;
+    for (unsigned i = 0; i < server_loop_count; ++i) {
+        loop_t* loop = &server_loops[i];
+        out_stats->connections += atomic_load(&loop->connections);
+        out_stats->accepted += atomic_load(&loop->accepted);
+        out_stats->requests += atomic_load(&loop->requests);
+        out_stats->offloaded += atomic_load(&loop->offloaded);
+        out_stats->overloaded += atomic_load(&loop->overloaded);
+        out_stats->preempted += atomic_load(&loop->preempted);
+        out_stats->shed += atomic_load(&loop->shed);
+        out_stats->delay_ns += atomic_load(&loop->delay_ns);
+        out_stats->h2 += atomic_load(&loop->h2);
+        out_stats->streams += atomic_load(&loop->streams);
+        out_stats->dropped += atomic_load(&loop->dropped);
+        out_stats->batches += atomic_load(&loop->batches);
+        out_stats->buffer_waits += atomic_load(&loop->buffer_waits);
+    }
+}
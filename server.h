@@ -0,0 +1,86 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdint.h>
+#include "config.h"
+
+// Event loops serving HTTP connections.
+// Every loop is a thread with its own epoll instance. It accepts connections from the listening
+// sockets, TCP or Unix domain ones alike, and serves them with non-blocking sockets. File operations, which can block,
+// run in the I/O pool and their completions are posted back to the loop owning the connection.
+//
+// Ready connections are scheduled by deficit round robin: each turn a connection may send
+// up to a quantum of bytes. Small responses have a queue of their own, served before
+// the bulk transfers and between every few of them, so large downloads do not delay them.
+//
+// Each loop measures the queueing delay of its requests, from their arrival (the accept, for
+// the first request of a connection) to the first byte of the response. While it stays too long,
+// new requests are shed with 503, see codel.h.
+//
+// In the proxy mode, files of the corelated servers are fetched from them over pooled
+// keep-alive connections, instead of redirecting the client. The body is spliced through a pipe.
+//
+// Draining, eg. when another process takes over the listening sockets, the loops stop accepting.
+// Responses in progress are finished, then their connections are closed instead of being kept alive.
+//
+// Connections can switch to HTTP/2 without TLS (h2c), by the client's preface or an Upgrade.
+// Each stream is served as an HTTP/1.1 request would be, and its response is framed, see h2.h.
+// Streams take turns by frames, small responses first, so a big file does not hold up the others.
+//
+// Many small files can be fetched with one request, their framed batch is one response, see batch.h.
+
+// Return codes //
+#define SERVER_ERR -1
+#define SERVER_OK   0
+
+#define SERVER_EVENTS       64   // Taken from epoll at once.
+#define SERVER_MAX_LISTENERS (1 + CONFIG_MAX_UNIX)
+#define SERVER_ACCEPT_BATCH 16   // Connections accepted at once, before serving the others.
+#define SERVER_BULK_TURNS    4   // Turns of bulk transfers between checks for other work.
+
+#define SERVER_DEFAULT_QUANTUM        (256 * 1024)
+#define SERVER_DEFAULT_SMALL_RESPONSE (64 * 1024)
+#define SERVER_DEFAULT_CODEL_INTERVAL 100   // Milliseconds
+#define SERVER_DEFAULT_DRAIN_TIMEOUT  30000 // Milliseconds
+#define SERVER_DRAIN_POLL_MS          50
+#define SERVER_BUFFER_RETRY_MS        10    // Connections waiting for a body buffer try again after that long.
+
+#define SERVER_PROXY_HEAD   4096          // Longest response head of a corelated server.
+#define SERVER_MAX_LOCAL_IPS 64           // Addresses of the interfaces, which are not proxied to.
+#define SERVER_PIPE_CHUNK   (64 * 1024)   // Spliced from a corelated server at once, the default pipe size.
+
+#define SERVER_H2_STREAMS 100             // Open at once on a connection.
+#define SERVER_H2_INPUT   (2 * 16393)     // Two frames of the default size, with their headers.
+#define SERVER_H2_OUTPUT  (64 * 1024)     // Frames queued for sending, a few, so that new streams are not delayed.
+#define SERVER_H2_BLOCK   (16 * 1024)     // Longest header block of a request.
+#define SERVER_H2_RESERVE 256             // Room in the output, below which the client's frames are not handled.
+
+typedef struct server_stats {
+    uint64_t loops;
+    uint64_t connections;      // Currently open.
+    uint64_t accepted;
+    uint64_t requests;
+    uint64_t offloaded;        // File operations run in the I/O pool.
+    uint64_t overloaded;       // Requests answered with 503, because the I/O pool was full or late.
+    uint64_t preempted;        // Turns ended, because the connection has used its quantum.
+    uint64_t shed;             // Requests answered with 503, because of the queueing delay.
+    uint64_t delay_ns;         // Queueing delay of the requests served, summed.
+    uint64_t h2;               // Connections switched to HTTP/2.
+    uint64_t streams;          // HTTP/2 streams opened.
+    uint64_t dropped;          // Connections refused with 503, because descriptors have run out.
+    uint64_t batches;          // Batch fetches, see batch.h.
+    uint64_t buffer_waits;     // Connections put aside, because the buffer pool was exhausted.
+} server_stats_t;
+
+// Serves files from the root in config to connections accepted on the sock_count listening sockets
+// socks, with config->workers event loops. The calling thread becomes one of them.
+// The I/O pool has to be started before. Returns only if starting fails.
+int server_run(const config_t* config, const int* socks, unsigned sock_count);
+
+// Stops accepting connections and waits until the open ones are closed, at most config->drain_timeout.
+// Called from a thread other than the loops'.
+void server_drain();
+
+void server_stats(server_stats_t* out_stats);
+
+#endif /* SERVER_H */
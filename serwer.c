@@ -1,335 +1,254 @@
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <dirent.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include "accesslog.h"
+#include "arena.h"
+#include "balance.h"
+#include "bufpool.h"
+#include "bundle.h"
 #include "co_servers.h"
+#include "config.h"
+#include "fcache.h"
 #include "file.h"
+#include "handoff.h"
+#include "hotset.h"
 #include "http.h"
+#include "iopool.h"
+#include "metrics.h"
+#include "prefetch.h"
+#include "ratelimit.h"
+#include "server.h"
 
 #define BODY_CHUNK_SIZE 1048576
-#define BUFFER_SIZE 256
-#define DEFAULT_HTTP_PORT 8080
+#define BUFFER_SIZE 4096
 
 
 /////  ERR  /////
 void syserr() {
     exit(EXIT_FAILURE);
 }
-///// BUFFER /////
-// 0 - success, -1 - internal server error
-int adjust_buffer_state(char** buffer, size_t* buffer_size, size_t* remaining_buffer_size, char** read_loc, char* request_end) {
-    char* new_request = request_end + 4;
-    size_t new_request_size = *buffer_size - *remaining_buffer_size;
 
-    size_t new_buffer_size = BUFFER_SIZE;
-    while (new_request_size >= new_buffer_size) {
-        new_buffer_size *= 2;
+/////  LISTENERS  /////
+// Takes the socket bound to addr out of the inherited ones, returns -1 if there is none.
+static int take_inherited(int* inherited, unsigned count, const struct sockaddr* addr, socklen_t addr_len) {
+    for (unsigned i = 0; i < count; ++i) {
+        struct sockaddr_storage bound;
+        socklen_t bound_len = sizeof(bound);
+        if (inherited[i] == -1 || getsockname(inherited[i], (struct sockaddr*)&bound, &bound_len) == -1)
+            continue;
+        if (bound_len == addr_len && memcmp(&bound, addr, addr_len) == 0) {
+            int sock = inherited[i];
+            inherited[i] = -1;
+            return sock;
+        }
     }
+    return -1;
+}
+
+// Returns a socket listening on the port, or -1. It is one of the inherited ones, if they have it.
+static int listen_tcp(const config_t* config, int* inherited, unsigned inherited_count) {
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = htonl(INADDR_ANY);
+    server.sin_port = htons(config->port);
+
+    int sock = take_inherited(inherited, inherited_count, (struct sockaddr *)&server, sizeof(server));
+    bool bound = sock != -1;
+    if (!bound)
+        sock = socket(PF_INET, SOCK_STREAM, 0);
+    if (sock == -1)
+        // Socket creation unsuccessful
+        return -1;
 
-    char* new_buffer = malloc(new_buffer_size + 1);
-    if (!new_buffer) {
+    // The connection is accepted once its request has come, the loops are not woken for idle ones.
+    int value = config->defer_accept;
+    if (value > 0 && setsockopt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, &value, sizeof(value)) == -1)
+        fprintf(stderr, "Cannot defer accepting connections\n");
+    // Clients, which have connected before, can send the request with the SYN.
+    value = config->fastopen;
+    if (value > 0 && setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN, &value, sizeof(value)) == -1)
+        fprintf(stderr, "Cannot enable TCP Fast Open\n");
+
+    // Listening again only changes the backlog of an inherited socket.
+    if ((!bound && bind(sock, (struct sockaddr *)&server, sizeof(server)) == -1) || listen(sock, config->backlog) == -1) {
+        // Socket binding or opening to listening unsuccessful
+        close(sock);
         return -1;
     }
-    if (strcpy(new_buffer, new_request) == NULL) {
-        free(new_buffer);
+    return sock;
+}
+
+// Returns a socket listening on the Unix domain socket path, or -1. It is one of the inherited ones, if they have it.
+// A socket left at path by a previous run is replaced, any other file is not.
+static int listen_unix(const char* path, int backlog, int* inherited, unsigned inherited_count) {
+    struct sockaddr_un server;
+    if (strlen(path) >= sizeof(server.sun_path))
+        return -1;
+    memset(&server, 0, sizeof(server));
+    server.sun_family = AF_UNIX;
+    strcpy(server.sun_path, path);
+
+    socklen_t server_len = offsetof(struct sockaddr_un, sun_path) + strlen(path) + 1;
+    int sock = take_inherited(inherited, inherited_count, (struct sockaddr *)&server, server_len);
+    if (sock != -1) {
+        if (listen(sock, backlog) == -1) {
+            close(sock);
+            return -1;
+        }
+        return sock;
+    }
+
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1)
+        return -1;
+    if (bind(sock, (struct sockaddr *)&server, sizeof(server)) == -1 || listen(sock, backlog) == -1) {
+        close(sock);
         return -1;
     }
-    
-    memset(new_buffer + new_request_size, 0, new_buffer_size - new_request_size + 1);
-    
-    free(*buffer);
-    *buffer = new_buffer;
-    *buffer_size = new_buffer_size;
-    *remaining_buffer_size = new_buffer_size - new_request_size;
-    *read_loc = *buffer + new_request_size;
-    return 0;
+    return sock;
 }
 
-int main (int argc, char *argv[]) {
-    const char headers_end[] = {13, 10, 13, 10, 0};
+/////  HANDOFF  /////
+// Lets the connections finish, once a new process has taken over.
+static void retire() {
+    server_drain();
+    accesslog_drain();
+    hotset_flush();
+}
 
-    if (argc < 3 || argc > 4) {
-        fprintf(stderr, "Usage: %s server's_filesystem_root corelated_servers [port_number]\n", argv[0]);
+int main (int argc, char *argv[]) {
+    config_t config;
+    if (parse_config(argc, argv, &config) != CONFIG_OK) {
+        print_usage(argv[0]);
         syserr();
     }
 
-    const char* filesystem = argv[1];
-    DIR* root = opendir(filesystem); // Only used to confirm the existence of the target directory.
-    if (!root) {
-        // Cannot open the directory
-        syserr();
+    const char* filesystem = config.filesystem;
+    if (config.bundle) {
+        if (bundle_start(filesystem) != BUNDLE_FOUND)
+            // Cannot map the bundle
+            syserr();
+    }
+    else {
+        DIR* root = opendir(filesystem); // Only used to confirm the existence of the target directory.
+        if (!root) {
+            // Cannot open the directory
+            syserr();
+        }
+        closedir(root);
     }
-    closedir(root);
 
-    const char* corelated_servers = argv[2];
+    const char* corelated_servers = config.corelated_servers;
     if (is_file(corelated_servers) == FILE_NOT_FOUND)
         // Cannot find the corelated servers file
         syserr();
 
-    short port;
-    if (argc == 4)
-        port = (short)atoi(argv[3]);
-    else
-        port = DEFAULT_HTTP_PORT;
-
-    int sock = socket(PF_INET, SOCK_STREAM, 0);
-    if (sock == -1)
-        // Socket creation unsuccessful
+    cos_table_t* corelated_table;
+    if (cos_load(corelated_servers, &corelated_table) != COS_FOUND)
+        // Cannot read the corelated servers file
         syserr();
-
-    struct sockaddr_in server;
-    server.sin_family = AF_INET;
-    server.sin_addr.s_addr = htonl(INADDR_ANY);
-    server.sin_port = htons(port);
-    
-    if (bind(sock, (struct sockaddr *)&server, sizeof(server)) == -1) {
-        // Socket binding unsuccessful
-        syserr();
-    }
-
-    if (listen(sock, 5) == -1)
-        // Socket opening to listening unsuccessful
+    if (cos_watch(corelated_servers, corelated_table) != COS_FOUND)
+        // Cannot start reloading the corelated servers file
         syserr();
 
-    for (;;) {
-        int rcv = accept(sock, (struct sockaddr *)NULL, NULL);
-        if (rcv == -1)
-            // Setting a connection failed
-            syserr();
-        
-        // Handling connection
-        size_t buffer_size = BUFFER_SIZE;
-        size_t remaining_buffer_size = buffer_size;
-        char* buffer = malloc(buffer_size + 1);
-        if (!buffer) syserr();
-        memset(buffer, 0, buffer_size + 1);
-        char* read_loc = buffer;
-        char* request_end;
+    if (!config.bundle && fs_index_start(filesystem) != FS_INDEX_FOUND)
+        // Files are still found, each one checked on the disk
+        fprintf(stderr, "Cannot index %s, files will be looked up on the disk\n", filesystem);
 
-        // Buffer starts with a fragment of the request, which already has been read (with length ≥ 0).  
-        for (;;) {
-            int ret;
-            
-            // Check if any full HTTP request isn't already in the buffer.
-            request_end = strstr(buffer, headers_end);
-            if (request_end == NULL) {
-                // We are trying to read the whole request (not counting the body, which shouldn't be here).
-                bool is_err = false;
-                while (true)
-                {
-                    ret = read(rcv, read_loc, remaining_buffer_size);
-                    if (ret == -1) {
-                        send_internal_server_error(rcv);
-                        is_err = true;
-                        break;
-                    }
+    // A client closing the connection early must not stop the server.
+    signal(SIGPIPE, SIG_IGN);
 
-                    // Searching for the end of headers -> CR LF CR LF
-                    request_end = strstr(buffer, headers_end);
-                    read_loc += ret;
-                    remaining_buffer_size -= ret;
-                    if (request_end != NULL)
-                        break;
-
-                    if (remaining_buffer_size == 0) {
-                        remaining_buffer_size = buffer_size;
-                        buffer_size *= 2;
-                        char* buf = malloc(buffer_size + 1);
-
-                        if (!buf) {
-                            send_internal_server_error(rcv);
-                            is_err = true;
-                            break;
-                        }
-
-                        strcpy(buf, buffer);
-                        memset(buf + remaining_buffer_size, 0, remaining_buffer_size + 1);
-                        read_loc = buf + remaining_buffer_size;
-                        free(buffer);
-                        buffer = buf;
-                    }
-                }
-                if (is_err) break;
-            }
-
-            // Parsing the request
-            request_t http_request;
-            *(request_end + 2) = '\0';
-            
-            ret = parse_http_request(buffer, &http_request);
-            if (ret == PARSE_BAD_REQ) {
-                send_bad_request(rcv);
-                break;
-            }
-            if (ret == PARSE_INTERNAL_ERR) {
-                send_internal_server_error(rcv);
-                break;
-            }
-
-            if (http_request.starting.method == M_OTHER) {
-                if (send_not_implemented(rcv) == SEND_ERROR) {
-                    send_internal_server_error(rcv);
-                    break;
-                }
-
-                if (http_request.headers.con_close) break;
-                if (adjust_buffer_state(&buffer, &buffer_size, &remaining_buffer_size, &read_loc, request_end) != 0) {
-                    send_internal_server_error(rcv);
-                    break;
-                }
-                continue;
-            }
-
-            if (http_request.starting.target_type == F_INCORRECT) {
-                if (send_not_found(rcv) == SEND_ERROR) {
-                    send_internal_server_error(rcv);
-                    break;
-                }
-
-                if (http_request.headers.con_close) break;
-                if (adjust_buffer_state(&buffer, &buffer_size, &remaining_buffer_size, &read_loc, request_end) != 0) {
-                    send_internal_server_error(rcv);
-                    break;
-                }
-                continue;
-            }
-
-            // We know, that the method requested is either GET or HEAD.
-            // Both need to verify file access.
-            FILE* fptr;
-            ret = take_file(filesystem, http_request.starting.target, &fptr);
-            
-            if (ret != FILE_OK) {
-                if (ret == FILE_REACHOUT) {
-                    if (send_not_found(rcv) == SEND_ERROR) {
-                        send_internal_server_error(rcv);
-                        break;
-                    }
-
-                    if (http_request.headers.con_close) break;
-                    if (adjust_buffer_state(&buffer, &buffer_size, &remaining_buffer_size, &read_loc, request_end) != 0) {
-                        send_internal_server_error(rcv);
-                        break;
-                    }
-                    continue;
-                }
-                else if (ret == FILE_NOT_FOUND) {
-                    char* res;
-                    
-                    ret = search_corelated_servers(corelated_servers, http_request.starting.target, &res);
-                    if (ret == COS_FOUND) {
-                        if (send_found(rcv, http_request.starting.target, res) == SEND_ERROR) {
-                            free(res);
-                            send_internal_server_error(rcv);
-                            break;
-                        }
-                        free(res);
-                    }
-                    else if (ret == COS_NOT_FOUND) {
-                        if (send_not_found(rcv) == SEND_ERROR) {
-                            send_internal_server_error(rcv);
-                            break;
-                        }
-                    }
-                    else { /* if (ret == COS_INTERNAL_ERR) */
-                        send_internal_server_error(rcv);
-                        break;
-                    }
-                    
-                    if (http_request.headers.con_close) break;
-
-                    if (adjust_buffer_state(&buffer, &buffer_size, &remaining_buffer_size, &read_loc, request_end) != 0) {
-                        send_internal_server_error(rcv);
-                        break;
-                    }
-                    continue;
-                }
-                else if (ret == FILE_INTERNAL_ERR) {
-                    send_internal_server_error(rcv);
-                    break;
-                }
-            }
-
-            ret = take_filesize(fptr, &http_request.headers.content_len);
-            if (ret == FILE_INTERNAL_ERR) {
-                fclose(fptr);
-                send_internal_server_error(rcv);
-                break;
-            }
-
-            http_request.headers.content_type = "application/octet-stream";
-            if (http_request.starting.method == M_GET) {
-                
-                char* body_chunk = NULL;
-                size_t body_chunk_size = 2 * BODY_CHUNK_SIZE;
-                while (body_chunk == NULL) {
-                    body_chunk_size /= 2;
-                    if (body_chunk_size == 0) {
-                        fclose(fptr);
-                        send_internal_server_error(rcv);
-                        break;
-                    }
-
-                    body_chunk = malloc(body_chunk_size);
-                }
-
-                if (send_success(rcv, &http_request) == SEND_ERROR) {
-                    free(body_chunk);
-                    fclose(fptr);
-                    send_internal_server_error(rcv);
-                    break;
-                }
-
-                ret = FILE_OK;
-                while (ret != FILE_EOF) {
-                    size_t has_read;
-                    ret = take_filecontent_chunk(fptr, body_chunk_size, &body_chunk, &has_read);
-                    if (ret == FILE_INTERNAL_ERR) {
-                        send_body_chunk(rcv, "\r\n\r\n", 4);
-                        free(body_chunk);
-                        fclose(fptr);
-                        send_internal_server_error(rcv);
-                        break;
-                    }
-
-                    if (send_body_chunk(rcv, body_chunk, has_read) == SEND_ERROR) {
-                        send_body_chunk(rcv, "\r\n\r\n", 4);
-                        free(body_chunk);
-                        fclose(fptr);
-                        send_internal_server_error(rcv);
-                        break;
-                    }
-                }
-
-                free(body_chunk);
-                fclose(fptr);
-            }
-            else { /* if (http_request.starting.method == M_HEAD) { */
-                fclose(fptr);
-                
-                if (send_success(rcv, &http_request) == SEND_ERROR) {
-                    send_internal_server_error(rcv);
-                    break;
-                }
-            }
-
-            if (http_request.headers.con_close) break;
+    if (bufpool_init(BUFFER_SIZE, BODY_CHUNK_SIZE, config.buffer_pool, config.hugepages) != BUFPOOL_OK)
+        syserr();
+    fcache_init(config.cache_size, config.cache_max_file);
+    balance_init(config.cos_balance);
+    ratelimit_init(config.max_conns_per_ip, config.requests_per_ip, config.bytes_per_ip);
+
+    // A process serving already hands over its listening sockets and its cache.
+    int inherited[HANDOFF_MAX_SOCKS];
+    unsigned inherited_count = 0;
+    if (config.handoff && handoff_receive(config.handoff, inherited, &inherited_count) == HANDOFF_ERR) {
+        fprintf(stderr, "Cannot take over from the process serving on %s\n", config.handoff);
+        syserr();
+    }
 
-            // Preparing buffer for another message
-            if (adjust_buffer_state(&buffer, &buffer_size, &remaining_buffer_size, &read_loc, request_end) != 0) {
-                send_internal_server_error(rcv);
-                break;
-            }
+    // Local clients can skip the TCP/IP stack, connecting to a Unix domain socket.
+    int socks[SERVER_MAX_LISTENERS];
+    unsigned sock_count = 0;
+    if (config.tcp) {
+        socks[sock_count] = listen_tcp(&config, inherited, inherited_count);
+        if (socks[sock_count++] == -1)
+            syserr();
+    }
+    for (unsigned i = 0; i < config.unix_count; ++i) {
+        socks[sock_count] = listen_unix(config.unix_paths[i], config.backlog, inherited, inherited_count);
+        if (socks[sock_count++] == -1) {
+            fprintf(stderr, "Cannot listen on %s\n", config.unix_paths[i]);
+            syserr();
         }
+    }
+    // Sockets, which are not listened on any more.
+    for (unsigned i = 0; i < inherited_count; ++i) {
+        if (inherited[i] != -1)
+            close(inherited[i]);
+    }
 
-        free(buffer);
-        close(rcv);
+    if (iopool_start(config.io_threads, config.io_queue, config.io_timeout) != IOPOOL_OK)
+        syserr();
+    if (config.metrics && metrics_start(config.metrics) != METRICS_OK)
+        syserr();
+    // The files of a bundle are in memory already.
+    if ((config.hotset || config.warm_socket) && !config.bundle) {
+        if (hotset_start(filesystem, config.hotset, config.warm_rate) != HOTSET_OK)
+            syserr();
+        if (config.warm_socket && hotset_listen(config.warm_socket) != HOTSET_OK) {
+            fprintf(stderr, "Cannot listen on %s\n", config.warm_socket);
+            syserr();
+        }
     }
+    if (config.prefetch && !config.bundle && prefetch_start(filesystem) != PREFETCH_OK)
+        syserr();
 
-    close(sock);
+    if (config.workers == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        config.workers = cpus > 0 && cpus <= CONFIG_MAX_WORKERS ? cpus : 1;
+    }
+    // Every event loop logs into a ring of its own.
+    if (config.access_log && accesslog_start(config.access_log, config.access_log_size, config.workers) != ACCESSLOG_OK)
+        syserr();
+    // The previous process stops accepting from here on.
+    if (config.handoff && handoff_start(config.handoff, socks, sock_count, retire) != HANDOFF_OK) {
+        fprintf(stderr, "Cannot serve the handoff on %s\n", config.handoff);
+        syserr();
+    }
+    // Returns only if the event loops cannot be started.
+    server_run(&config, socks, sock_count);
+
+    for (unsigned i = 0; i < sock_count; ++i)
+        close(socks[i]);
+    for (unsigned i = 0; i < config.unix_count; ++i)
+        unlink(config.unix_paths[i]);
+    if (config.warm_socket)
+        unlink(config.warm_socket);
+    cos_unwatch();
+    fs_index_stop();
+    fcache_destroy();
     parse_http_clean();
+    return EXIT_FAILURE;
 }
\ No newline at end of file
@@ -0,0 +1,191 @@
+#include "upstream.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+static _Atomic uint64_t upstream_connects = 0;
+static _Atomic uint64_t upstream_reuses = 0;
+static _Atomic uint64_t upstream_failures = 0;
+
+static uint64_t upstream_now_s() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+void upstream_pool_init(upstream_pool_t* pool) {
+    pool->idle = NULL;
+    pool->idle_count = 0;
+}
+
+int upstream_get(upstream_pool_t* pool, uint32_t ip, uint16_t port, upstream_t** out_upstream) {
+    uint64_t now = upstream_now_s();
+
+    upstream_t** link = &pool->idle;
+    while (*link != NULL) {
+        upstream_t* upstream = *link;
+        if (now - upstream->idle_since >= UPSTREAM_IDLE_S) {
+            // The server is likely to have closed it already.
+            *link = upstream->next;
+            pool->idle_count--;
+            upstream_close(upstream, false);
+            continue;
+        }
+        if (upstream->ip == ip && upstream->port == port) {
+            *link = upstream->next;
+            pool->idle_count--;
+            upstream->reused = true;
+            atomic_fetch_add_explicit(&upstream_reuses, 1, memory_order_relaxed);
+            *out_upstream = upstream;
+            return UPSTREAM_OK;
+        }
+        link = &upstream->next;
+    }
+
+    upstream_t* upstream = malloc(sizeof(upstream_t));
+    if (!upstream)
+        return UPSTREAM_ERR;
+    upstream->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (upstream->fd == -1) {
+        free(upstream);
+        return UPSTREAM_ERR;
+    }
+    int one = 1;
+    setsockopt(upstream->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = ip;
+    addr.sin_port = htons(port);
+    // The connection completes, when the socket becomes writable.
+    if (connect(upstream->fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 && errno != EINPROGRESS) {
+        upstream_close(upstream, true);
+        return UPSTREAM_ERR;
+    }
+
+    upstream->ip = ip;
+    upstream->port = port;
+    upstream->reused = false;
+    upstream->next = NULL;
+    atomic_fetch_add_explicit(&upstream_connects, 1, memory_order_relaxed);
+    *out_upstream = upstream;
+    return UPSTREAM_OK;
+}
+
+void upstream_put(upstream_pool_t* pool, upstream_t* upstream) {
+    if (pool->idle_count >= UPSTREAM_MAX_IDLE) {
+        upstream_close(upstream, false);
+        return;
+    }
+    upstream->idle_since = upstream_now_s();
+    upstream->next = pool->idle;
+    pool->idle = upstream;
+    pool->idle_count++;
+}
+
+void upstream_close(upstream_t* upstream, bool failed) {
+    if (failed)
+        atomic_fetch_add_explicit(&upstream_failures, 1, memory_order_relaxed);
+    close(upstream->fd);
+    free(upstream);
+}
+
+// Returns the value of the header field name in the head [start, end), or NULL if there is none.
+static const char* upstream_header(const char* start, const char* end, const char* name) {
+    size_t name_len = strlen(name);
+    for (const char* line = strstr(start, "\r\n"); line && line < end; line = strstr(line, "\r\n")) {
+        line += 2;
+        if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+            const char* value = line + name_len + 1;
+            while (*value == ' ' || *value == '\t')
+                ++value;
+            return value;
+        }
+    }
+    return NULL;
+}
+
+int upstream_parse_head(const char* buffer, size_t size, bool head_request, upstream_head_t* out_head) {
+    const char* end = strstr(buffer, "\r\n\r\n");
+    if (!end)
+        return strlen(buffer) < size ? UPSTREAM_ERR : UPSTREAM_PARTIAL;  // A NUL inside is malformed.
+    end += 2;
+    out_head->head_size = end + 2 - buffer;
+
+    // HTTP/1.x NNN
+    if (strncmp(buffer, "HTTP/1.", 7) != 0 || buffer[8] != ' '
+        || buffer[9] < '1' || buffer[9] > '5' || buffer[10] < '0' || buffer[10] > '9'
+        || buffer[11] < '0' || buffer[11] > '9')
+        return UPSTREAM_ERR;
+    out_head->status = (buffer[9] - '0') * 100 + (buffer[10] - '0') * 10 + (buffer[11] - '0');
+    out_head->close = buffer[7] == '0';
+
+    const char* connection = upstream_header(buffer, end, "Connection");
+    if (connection && strncasecmp(connection, "close", 5) == 0)
+        out_head->close = true;
+    else if (connection && strncasecmp(connection, "keep-alive", 10) == 0)
+        out_head->close = false;
+
+    // Chunked bodies are not relayed.
+    if (upstream_header(buffer, end, "Transfer-Encoding"))
+        return UPSTREAM_ERR;
+
+    const char* length = upstream_header(buffer, end, "Content-Length");
+    if (head_request || out_head->status == 204 || out_head->status == 304 || out_head->status < 200) {
+        out_head->content_length = 0;
+    }
+    else if (length) {
+        char* length_end;
+        if (*length < '0' || *length > '9')
+            return UPSTREAM_ERR;
+        out_head->content_length = strtoull(length, &length_end, 10);
+        if (*length_end != '\r' && *length_end != ' ')
+            return UPSTREAM_ERR;
+    }
+    else if (out_head->close) {
+        out_head->content_length = UPSTREAM_UNTIL_CLOSE;
+    }
+    else {
+        // Responses of this server without a length, like redirects, have no body.
+        out_head->content_length = 0;
+    }
+    return UPSTREAM_OK;
+}
+
+size_t upstream_forward_head(const char* buffer, const upstream_head_t* head, bool close, char* out) {
+    // The status line is kept as it is.
+    const char* end = buffer + head->head_size - 2;
+    const char* line = strstr(buffer, "\r\n") + 2;
+    size_t size = line - buffer;
+    memcpy(out, buffer, size);
+
+    while (line < end) {
+        const char* next = strstr(line, "\r\n") + 2;
+        if (!(strncasecmp(line, "Connection:", 11) == 0 || strncasecmp(line, "Keep-Alive:", 11) == 0)) {
+            memcpy(out + size, line, next - line);
+            size += next - line;
+        }
+        line = next;
+    }
+    if (close) {
+        memcpy(out + size, UPSTREAM_CLOSE_HEADER, sizeof(UPSTREAM_CLOSE_HEADER) - 1);
+        size += sizeof(UPSTREAM_CLOSE_HEADER) - 1;
+    }
+    memcpy(out + size, "\r\n", 2);
+    return size + 2;
+}
+
+void upstream_stats(upstream_stats_t* out_stats) {
+    out_stats->connects = atomic_load(&upstream_connects);
+    out_stats->reuses = atomic_load(&upstream_reuses);
+    out_stats->failures = atomic_load(&upstream_failures);
+}
@@ -0,0 +1,72 @@
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Connections to the corelated servers, for proxying requests to them.
+// Finished connections are kept alive in a pool, to be reused by later requests to the same server.
+// A pool belongs to one thread, it is not locked.
+
+// Return codes //
+#define UPSTREAM_ERR     -1
+#define UPSTREAM_OK       0
+#define UPSTREAM_PARTIAL  1   // The response head is not complete yet.
+
+#define UPSTREAM_MAX_IDLE  64   // Idle connections kept per pool.
+#define UPSTREAM_IDLE_S    30   // Idle connections are not reused after that long.
+#define UPSTREAM_UNTIL_CLOSE SIZE_MAX
+#define UPSTREAM_CLOSE_HEADER "Connection: close\r\n"
+
+typedef struct upstream {
+    int fd;
+    uint32_t ip;              // In network byte order.
+    uint16_t port;
+    bool reused;              // Taken from the pool, it may have been closed by the server meanwhile.
+    uint64_t idle_since;      // Monotonic seconds.
+    struct upstream* next;
+} upstream_t;
+
+typedef struct upstream_pool {
+    upstream_t* idle;         // Most recently used first.
+    size_t idle_count;
+} upstream_pool_t;
+
+// Parsed head of an upstream response.
+typedef struct upstream_head {
+    int status;
+    size_t head_size;         // Including the empty line.
+    size_t content_length;    // UPSTREAM_UNTIL_CLOSE, if the body ends with the connection.
+    bool close;               // The connection cannot be reused after this response.
+} upstream_head_t;
+
+typedef struct upstream_stats {
+    uint64_t connects;
+    uint64_t reuses;
+    uint64_t failures;        // Connections, which failed or sent a malformed response.
+} upstream_stats_t;
+
+void upstream_pool_init(upstream_pool_t* pool);
+
+// Takes an idle connection to ip:port, or starts connecting a new, non-blocking one.
+int upstream_get(upstream_pool_t* pool, uint32_t ip, uint16_t port, upstream_t** out_upstream);
+
+// Gives back a connection, whose response has been read completely.
+void upstream_put(upstream_pool_t* pool, upstream_t* upstream);
+
+// Closes a connection, which cannot be reused. failed counts it as a failure.
+void upstream_close(upstream_t* upstream, bool failed);
+
+// Parses the response head at the beginning of buffer, which holds size bytes and is NUL-terminated.
+// head_request tells that the response has no body, whatever its headers say.
+int upstream_parse_head(const char* buffer, size_t size, bool head_request, upstream_head_t* out_head);
+
+// Writes the head parsed from buffer to out, for the client: without the hop-by-hop Connection and
+// Keep-Alive headers of the corelated server, with UPSTREAM_CLOSE_HEADER instead if close.
+// out has to hold head_size + sizeof(UPSTREAM_CLOSE_HEADER) bytes. Returns the bytes written.
+size_t upstream_forward_head(const char* buffer, const upstream_head_t* head, bool close, char* out);
+
+void upstream_stats(upstream_stats_t* out_stats);
+
+#endif /* UPSTREAM_H */